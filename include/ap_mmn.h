@@ -733,6 +733,14 @@
  * 20211221.25 (2.5.1-dev) AP_SLASHES and AP_IS_SLASH
  * 20211221.26 (2.5.1-dev) Add is_host_matchable to proxy_worker_shared
  * 20211221.27 (2.5.1-dev) Add sock_proto to proxy_worker_shared, and AP_LISTEN_MPTCP
+ * 20211221.28 (2.5.1-dev) Add proxy_worker_slot and ap_proxy_worker_slot_get()
+ *                         to proxy_util.h
+ * 20211221.29 (2.5.1-dev) Add ap_set_config_snapshot() to http_core.h
+ * 20211221.30 (2.5.1-dev) Add ap_cache_vary_value() to mod_cache.h
+ * 20211221.31 (2.5.1-dev) Add optional function ap_proxy_suspended_done()
+ *                         to mod_proxy.h
+ * 20211221.32 (2.5.1-dev) Add optional function hc_get_latency() to
+ *                         mod_proxy.h
  */
 
 #define MODULE_MAGIC_COOKIE 0x41503235UL /* "AP25" */
@@ -740,7 +748,7 @@
 #ifndef MODULE_MAGIC_NUMBER_MAJOR
 #define MODULE_MAGIC_NUMBER_MAJOR 20211221
 #endif
-#define MODULE_MAGIC_NUMBER_MINOR 27             /* 0...n */
+#define MODULE_MAGIC_NUMBER_MINOR 32             /* 0...n */
 
 /**
  * Determine if the server's current MODULE_MAGIC_NUMBER is at least a
@@ -782,6 +782,10 @@ void ap_add_output_filters_by_type(request_rec *r);
 /* for http_config.c */
 void ap_core_reorder_directories(apr_pool_t *, server_rec *);
 
+/* for core.c */
+const char *ap_set_config_snapshot(cmd_parms *cmd, void *dummy,
+                                   const char *arg);
+
 /* for mod_perl */
 AP_CORE_DECLARE(void) ap_add_per_dir_conf(server_rec *s, void *dir_config);
 AP_CORE_DECLARE(void) ap_add_per_url_conf(server_rec *s, void *url_config);
@@ -307,8 +307,14 @@ static void ap_authn_cache_store(request_rec *r, const char *module,
         return;
     }
 
-    /* OK, we're on.  Grab mutex to do our business */
-    rv = apr_global_mutex_trylock(authn_cache_mutex);
+    /* OK, we're on.  Grab mutex to do our business, unless the provider
+     * does its own locking */
+    if (!(socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE)) {
+        rv = APR_SUCCESS;
+    }
+    else {
+        rv = apr_global_mutex_trylock(authn_cache_mutex);
+    }
     if (APR_STATUS_IS_EBUSY(rv)) {
         /* don't wait around; just abandon it */
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(01679)
@@ -343,9 +349,11 @@ static void ap_authn_cache_store(request_rec *r, const char *module,
     }
 
     /* We're done with the mutex */
-    rv = apr_global_mutex_unlock(authn_cache_mutex);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01683) "Failed to release mutex!");
+    if (socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        rv = apr_global_mutex_unlock(authn_cache_mutex);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01683) "Failed to release mutex!");
+        }
     }
 }
 
@@ -32,6 +32,13 @@
 #define CACHE_HEADER_SUFFIX ".header"
 #define CACHE_DATA_SUFFIX   ".data"
 #define CACHE_VDIR_SUFFIX   ".vary"
+#define CACHE_SEGMENT_SUFFIX ".seg"
+
+/* The journal of mod_cache_disk, in the cache root, and the name it is
+ * renamed to by htcacheclean to rotate it.
+ */
+#define CACHE_JOURNAL_FILE  "cache.journal"
+#define CACHE_JOURNAL_OLD   "cache.journal.old"
 
 #define AP_TEMPFILE_PREFIX "/"
 #define AP_TEMPFILE_BASE   "aptmp"
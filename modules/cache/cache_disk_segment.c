@@ -0,0 +1,2008 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apr_lib.h"
+#include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_core.h"
+#include "http_protocol.h"
+#include "ap_provider.h"
+#include "util_mutex.h"
+
+#include "mod_cache.h"
+#include "mod_cache_disk.h"
+#include "mod_status.h"
+
+/*
+ * Segment storage for mod_cache_disk.
+ *
+ * Rather than a .header and a .data file per entity in hashed directories,
+ * the entities are appended as records to a fixed number of large segment
+ * files directly in the CacheRoot:
+ *
+ *   segment-<generation>.seg
+ *     cache_segment_file_t
+ *     records, each 8 bytes aligned:
+ *       cache_segment_record_t
+ *       key
+ *       data: either a Vary entry or the entity headers, laid out like in
+ *             mod_cache_socache (see below)
+ *       body
+ *
+ * The index of the records lives in shared memory, protected by a global
+ * mutex, and is rebuilt at startup by scanning the segments in generation
+ * order: later records replace earlier ones of the same key, tombstone
+ * records remove them. Scanning a segment stops at the first damaged
+ * record. Bodies are served from their offset in the segment with a file
+ * bucket, so sendfile is used where available.
+ *
+ * Records are only ever appended; space is reclaimed by compaction. When
+ * the active segment is full and all the segments are in use, the one
+ * holding the fewest live bytes is compacted: its records still indexed
+ * and fresh are copied to a new generation of the segment, up to half of
+ * its size, the others are evicted, and the new generation becomes the
+ * active segment. The old file is then unlinked, requests still reading
+ * it keep their descriptor. The copy is done without holding the mutex,
+ * stores needing space meanwhile are simply not cached, nor are the
+ * records appended to the segment being compacted.
+ *
+ * The body of an entity being stored is spooled to a temporary file in
+ * the CacheRoot, and copied after the headers when the record is appended.
+ *
+ * Vary entry:
+ *   apr_uint32_t format;
+ *   apr_time_t expire;
+ *   apr_array_t vary_headers (delimited by CRLF)
+ *
+ * Entity:
+ *   cache_segment_info_t (first sizeof(apr_uint32_t) bytes is the format)
+ *   entity name (sobj->name) [length is in cache_segment_info_t->name_len]
+ *   r->headers_out (delimited by CRLF)
+ *   CRLF
+ *   r->headers_in (delimited by CRLF)
+ *   CRLF
+ */
+
+APLOG_USE_MODULE(cache_disk);
+
+#define CACHE_SEGMENT_MAGIC     0x47535041 /* "APSG" */
+#define CACHE_SEGMENT_RECORD    0x52535041 /* "APSR" */
+#define CACHE_SEGMENT_TOMBSTONE 0x01
+
+#define CACHE_SEGMENT_VARY_FORMAT_VERSION 1
+#define CACHE_SEGMENT_DISK_FORMAT_VERSION 2
+
+#define CACHE_SEGMENT_PREFIX    "segment-"
+#define CACHE_SEGMENT_NIL       APR_UINT32_MAX
+/* Average record size assumed to size the index */
+#define CACHE_SEGMENT_AVG_RECORD 8192
+#define CACHE_SEGMENT_MIN_INDEX 1024
+/* Largest key and headers of a record */
+#define CACHE_SEGMENT_MAX_HEADERS (64 * 1024)
+
+#define DEFAULT_MAXTIME 86400
+#define DEFAULT_MINTIME 600
+
+typedef struct {
+    apr_uint32_t magic;
+    apr_uint32_t generation;
+    apr_uint64_t reserved;
+} cache_segment_file_t;
+
+typedef struct {
+    apr_uint32_t magic;
+    apr_uint32_t flags;
+    apr_uint32_t key_len;
+    apr_uint32_t data_len;
+    apr_uint64_t body_len;
+    apr_time_t expire;
+} cache_segment_record_t;
+
+#define SEGMENT_RECORD_LEN(rec) \
+    APR_ALIGN(sizeof(cache_segment_record_t) + (apr_uint64_t)(rec)->key_len \
+              + (rec)->data_len + (rec)->body_len, 8)
+
+typedef struct {
+    /* Indicates the format of the header struct stored on disk. */
+    apr_uint32_t format;
+    /* The HTTP status code returned for this response.  */
+    int status;
+    /* The size of the entity name that follows. */
+    apr_size_t name_len;
+    /* Miscellaneous time values. */
+    apr_time_t date;
+    apr_time_t expire;
+    apr_time_t request_time;
+    apr_time_t response_time;
+    /* Does this cached request have a body? */
+    unsigned int header_only:1;
+    /* The parsed cache control header */
+    cache_control_t control;
+} cache_segment_info_t;
+
+/*
+ * Shared memory layout:
+ *   cache_segment_header_t
+ *   cache_segment_slot_t slots[nslots]
+ *   apr_uint32_t buckets[nbuckets]    (hash index, chained via entries)
+ *   cache_segment_entry_t entries[nentries]
+ */
+typedef struct {
+    apr_uint64_t size;          /* of a segment */
+    apr_uint32_t nslots;
+    apr_uint32_t nbuckets;
+    apr_uint32_t nentries;
+    apr_uint32_t used;          /* indexed entries */
+    apr_uint32_t free;          /* free entries list */
+    apr_uint32_t active;        /* slot appended to */
+    apr_uint32_t next_generation;
+    apr_uint32_t compacting;
+    apr_uint64_t hits;
+    apr_uint64_t misses;
+    apr_uint64_t stores;
+    apr_uint64_t compactions;
+    apr_uint64_t compacted;     /* bytes copied by compactions */
+    apr_uint64_t evictions;
+    apr_uint64_t nospace;
+} cache_segment_header_t;
+
+typedef struct {
+    apr_uint32_t generation;    /* of the file, 0 if the slot is unused */
+    apr_uint32_t compacting;
+    apr_uint32_t nentries;      /* indexed records */
+    apr_uint64_t tail;          /* bytes appended or reserved */
+    apr_uint64_t live;          /* bytes of the indexed records */
+} cache_segment_slot_t;
+
+typedef struct {
+    apr_uint32_t next;          /* hash chain, or free entries list */
+    apr_uint32_t hash;
+    apr_uint32_t slot;
+    apr_uint32_t generation;
+    apr_uint64_t offset;        /* of the record in the segment */
+    apr_uint64_t length;        /* of the record, aligned */
+    apr_time_t expire;
+} cache_segment_entry_t;
+
+/*
+ * cache_segment_object_t
+ * Pointed to by cache_object_t::vobj
+ */
+typedef struct cache_segment_object_t
+{
+    apr_pool_t *pool; /* pool */
+    unsigned char *buffer; /* the record being stored, but the body */
+    apr_size_t buffer_len; /* size of the buffer */
+    apr_file_t *tempfd; /* the body being stored */
+    const char *tempfile; /* its name */
+    apr_bucket_brigade *body; /* brigade containing the body, if any */
+    apr_table_t *headers_in; /* Input headers to save */
+    apr_table_t *headers_out; /* Output headers to save */
+    cache_segment_info_t seg_info; /* Header information. */
+    apr_size_t data_offset; /* offset to the headers in the buffer */
+    apr_size_t body_offset; /* offset to the start of the body */
+    apr_off_t body_length; /* length of the cached entity body */
+    apr_off_t length; /* expected length of the body */
+    apr_time_t expire; /* when to expire the entry */
+
+    const char *name; /* Requested URI without vary bits - suitable for mortals. */
+    const char *key; /* Cache key; URI with Vary bits (if present) */
+    unsigned int newbody :1; /* whether a new body is present */
+    unsigned int done :1; /* Is the attempt to cache complete? */
+} cache_segment_object_t;
+
+/* The shared index and its mutex */
+static const char * const cache_segment_id = "cache-segment";
+static apr_shm_t *segment_shm = NULL;
+static cache_segment_header_t *segment_header = NULL;
+static cache_segment_slot_t *segment_slots = NULL;
+static apr_uint32_t *segment_buckets = NULL;
+static cache_segment_entry_t *segment_entries = NULL;
+static apr_global_mutex_t *segment_mutex = NULL;
+static const char *segment_root = NULL;
+
+/*
+ * Index management, all the seg_*() functions but seg_hash() and
+ * seg_file() require the mutex to be held.
+ */
+
+static apr_uint32_t seg_hash(const char *key, apr_size_t klen)
+{
+    apr_ssize_t len = klen;
+
+    return apr_hashfunc_default(key, &len);
+}
+
+static const char *seg_file(apr_pool_t *p, apr_uint32_t generation)
+{
+    return apr_psprintf(p, "%s/" CACHE_SEGMENT_PREFIX "%08x"
+                        CACHE_SEGMENT_SUFFIX, segment_root, generation);
+}
+
+static APR_INLINE apr_uint32_t *seg_chain(apr_uint32_t hash)
+{
+    return &segment_buckets[hash % segment_header->nbuckets];
+}
+
+static apr_uint32_t seg_lookup(apr_uint32_t hash)
+{
+    apr_uint32_t i = *seg_chain(hash);
+
+    while (i != CACHE_SEGMENT_NIL && segment_entries[i].hash != hash) {
+        i = segment_entries[i].next;
+    }
+    return i;
+}
+
+static void seg_drop(apr_uint32_t i)
+{
+    cache_segment_entry_t *e = &segment_entries[i];
+    cache_segment_slot_t *slot = &segment_slots[e->slot];
+    apr_uint32_t *prev = seg_chain(e->hash);
+
+    while (*prev != i) {
+        prev = &segment_entries[*prev].next;
+    }
+    *prev = e->next;
+
+    slot->live -= e->length;
+    slot->nentries--;
+    segment_header->used--;
+
+    e->next = segment_header->free;
+    segment_header->free = i;
+}
+
+static apr_status_t seg_insert(apr_uint32_t hash, apr_uint32_t slot,
+                               apr_uint64_t offset, apr_uint64_t length,
+                               apr_time_t expire)
+{
+    cache_segment_entry_t *e;
+    apr_uint32_t i, *chain;
+
+    /* a colliding key is replaced too, it's only a cache */
+    i = seg_lookup(hash);
+    if (i != CACHE_SEGMENT_NIL) {
+        seg_drop(i);
+    }
+
+    i = segment_header->free;
+    if (i == CACHE_SEGMENT_NIL) {
+        return APR_ENOSPC;
+    }
+    e = &segment_entries[i];
+    segment_header->free = e->next;
+
+    e->hash = hash;
+    e->slot = slot;
+    e->generation = segment_slots[slot].generation;
+    e->offset = offset;
+    e->length = length;
+    e->expire = expire;
+
+    chain = seg_chain(hash);
+    e->next = *chain;
+    *chain = i;
+
+    segment_slots[slot].live += length;
+    segment_slots[slot].nentries++;
+    segment_header->used++;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Create the file of a new segment generation. Children of a previous
+ * generation of the server may still be running with their own index, so
+ * the file must not exist already; the next generation is tried if so.
+ */
+static apr_status_t seg_create_file(apr_pool_t *p, apr_uint32_t *generation)
+{
+    cache_segment_file_t hdr;
+    apr_file_t *fd;
+    apr_status_t rv;
+    int tries = 16;
+
+    do {
+        *generation = segment_header->next_generation++;
+        rv = apr_file_open(&fd, seg_file(p, *generation),
+                           APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                           | APR_FOPEN_EXCL | APR_FOPEN_BINARY,
+                           APR_FPROT_UREAD | APR_FPROT_UWRITE, p);
+    } while (APR_STATUS_IS_EEXIST(rv) && --tries);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CACHE_SEGMENT_MAGIC;
+    hdr.generation = *generation;
+    rv = apr_file_write_full(fd, &hdr, sizeof(hdr), NULL);
+    apr_file_close(fd);
+
+    return rv;
+}
+
+/*
+ * Reserve room for a record in the active segment, starting a new segment
+ * if it's full. Returns APR_EAGAIN with the slot to compact when there is
+ * no unused segment left.
+ */
+static apr_status_t seg_reserve(apr_pool_t *p, apr_uint64_t len,
+                                apr_uint32_t *slot, apr_uint32_t *generation,
+                                apr_uint64_t *offset)
+{
+    cache_segment_slot_t *s = &segment_slots[segment_header->active];
+    apr_uint32_t i, victim = CACHE_SEGMENT_NIL;
+    apr_status_t rv;
+
+    if (!s->generation || s->compacting
+            || s->tail + len > segment_header->size) {
+
+        for (i = 0; i < segment_header->nslots; i++) {
+            if (!segment_slots[i].generation) {
+                break;
+            }
+        }
+        if (i < segment_header->nslots) {
+            apr_uint32_t gen;
+
+            rv = seg_create_file(p, &gen);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            s = &segment_slots[i];
+            memset(s, 0, sizeof(*s));
+            s->generation = gen;
+            s->tail = sizeof(cache_segment_file_t);
+            segment_header->active = i;
+        }
+        else {
+            if (segment_header->compacting) {
+                return APR_ENOSPC;
+            }
+            for (i = 0; i < segment_header->nslots; i++) {
+                if (i != segment_header->active
+                        && (victim == CACHE_SEGMENT_NIL
+                            || segment_slots[i].live
+                               < segment_slots[victim].live)) {
+                    victim = i;
+                }
+            }
+            if (victim == CACHE_SEGMENT_NIL) {
+                return APR_ENOSPC;
+            }
+            *slot = victim;
+            return APR_EAGAIN;
+        }
+    }
+
+    *slot = segment_header->active;
+    *generation = s->generation;
+    *offset = s->tail;
+    s->tail += len;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Locked accessors, for the request processing
+ */
+
+typedef struct {
+    apr_uint32_t index;
+    apr_uint64_t offset;
+    apr_uint64_t length;
+    apr_uint64_t moved;         /* new offset, 0 if evicted */
+} cache_segment_kept_t;
+
+static int kept_sort(const void *a, const void *b)
+{
+    const cache_segment_kept_t *ka = a, *kb = b;
+
+    return ka->offset < kb->offset ? -1 : ka->offset > kb->offset;
+}
+
+static apr_status_t cache_segment_copy(apr_file_t *from, apr_file_t *to,
+                                       apr_uint64_t offset, apr_uint64_t len,
+                                       char *buf, apr_size_t buf_len)
+{
+    apr_off_t off = offset;
+    apr_status_t rv;
+
+    rv = apr_file_seek(from, APR_SET, &off);
+    while (rv == APR_SUCCESS && len) {
+        apr_size_t n = len > buf_len ? buf_len : (apr_size_t)len;
+
+        rv = apr_file_read_full(from, buf, n, NULL);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_write_full(to, buf, n, NULL);
+        }
+        len -= n;
+    }
+
+    return rv;
+}
+
+static apr_status_t cache_segment_compact(request_rec *r, apr_uint32_t v)
+{
+    cache_segment_slot_t *slot = &segment_slots[v];
+    apr_array_header_t *kept;
+    cache_segment_kept_t *k;
+    apr_uint32_t old_gen, new_gen, b, i, nentries = 0;
+    apr_uint64_t tail = sizeof(cache_segment_file_t), live = 0;
+    apr_file_t *from = NULL, *to = NULL;
+    apr_pool_t *pool;
+    const char *old_file;
+    char *buf;
+    apr_status_t rv;
+    int n;
+
+    rv = apr_global_mutex_lock(segment_mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10563)
+                "could not acquire lock, segment not compacted");
+        return rv;
+    }
+    if (segment_header->compacting || slot->compacting
+            || v == segment_header->active) {
+        apr_global_mutex_unlock(segment_mutex);
+        return APR_ENOSPC;
+    }
+    segment_header->compacting = 1;
+    slot->compacting = 1;
+    old_gen = slot->generation;
+
+    apr_pool_create(&pool, r->pool);
+    apr_pool_tag(pool, "mod_cache_disk (compaction)");
+
+    rv = seg_create_file(pool, &new_gen);
+    if (rv != APR_SUCCESS) {
+        slot->compacting = 0;
+        segment_header->compacting = 0;
+        apr_global_mutex_unlock(segment_mutex);
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10603)
+                "could not create a cache segment in %s", segment_root);
+        apr_pool_destroy(pool);
+        return rv;
+    }
+
+    /* the records to keep, the expired ones go right away */
+    kept = apr_array_make(pool, slot->nentries + 1,
+                          sizeof(cache_segment_kept_t));
+    for (b = 0; b < segment_header->nbuckets; b++) {
+        i = segment_buckets[b];
+        while (i != CACHE_SEGMENT_NIL) {
+            cache_segment_entry_t *e = &segment_entries[i];
+            apr_uint32_t next = e->next;
+            if (e->slot == v) {
+                if (e->expire < r->request_time) {
+                    seg_drop(i);
+                    segment_header->evictions++;
+                }
+                else {
+                    k = apr_array_push(kept);
+                    k->index = i;
+                    k->offset = e->offset;
+                    k->length = e->length;
+                    k->moved = 0;
+                }
+            }
+            i = next;
+        }
+    }
+    apr_global_mutex_unlock(segment_mutex);
+
+    /* copy them, in order, without holding the mutex */
+    qsort(kept->elts, kept->nelts, sizeof(cache_segment_kept_t), kept_sort);
+    old_file = seg_file(pool, old_gen);
+    rv = apr_file_open(&to, seg_file(pool, new_gen),
+                       APR_FOPEN_WRITE | APR_FOPEN_APPEND
+                       | APR_FOPEN_BUFFERED | APR_FOPEN_BINARY,
+                       APR_OS_DEFAULT, pool);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_open(&from, old_file,
+                           APR_FOPEN_READ | APR_FOPEN_BINARY,
+                           APR_OS_DEFAULT, pool);
+    }
+    buf = apr_palloc(pool, AP_IOBUFSIZE);
+    k = (cache_segment_kept_t *)kept->elts;
+    for (n = 0; rv == APR_SUCCESS && n < kept->nelts; n++) {
+        if (tail + k[n].length > segment_header->size / 2) {
+            continue;
+        }
+        rv = cache_segment_copy(from, to, k[n].offset, k[n].length,
+                                buf, AP_IOBUFSIZE);
+        if (rv == APR_SUCCESS) {
+            k[n].moved = tail;
+            tail += k[n].length;
+        }
+    }
+    if (to) {
+        apr_status_t rc = apr_file_close(to);
+        if (rv == APR_SUCCESS) {
+            rv = rc;
+        }
+    }
+    if (from) {
+        apr_file_close(from);
+    }
+
+    apr_global_mutex_lock(segment_mutex);
+    if (rv != APR_SUCCESS) {
+        /* leave the segment as it was */
+        slot->compacting = 0;
+        segment_header->compacting = 0;
+        apr_global_mutex_unlock(segment_mutex);
+        apr_file_remove(seg_file(pool, new_gen), pool);
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10564)
+                "compaction of segment %s failed", old_file);
+        apr_pool_destroy(pool);
+        return rv;
+    }
+    for (n = 0; n < kept->nelts; n++) {
+        cache_segment_entry_t *e = &segment_entries[k[n].index];
+
+        /* skip what was removed or replaced meanwhile */
+        if (e->slot != v || e->generation != old_gen
+                || e->offset != k[n].offset) {
+            continue;
+        }
+        if (k[n].moved) {
+            e->generation = new_gen;
+            e->offset = k[n].moved;
+            live += e->length;
+            nentries++;
+        }
+        else {
+            seg_drop(k[n].index);
+            segment_header->evictions++;
+        }
+    }
+    slot->generation = new_gen;
+    slot->tail = tail;
+    slot->live = live;
+    slot->nentries = nentries;
+    slot->compacting = 0;
+    segment_header->active = v;
+    segment_header->compacting = 0;
+    segment_header->compactions++;
+    segment_header->compacted += tail - sizeof(cache_segment_file_t);
+    apr_global_mutex_unlock(segment_mutex);
+
+    apr_file_remove(old_file, pool);
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10565)
+            "compacted segment %s, %u records kept in %" APR_UINT64_T_FMT
+            " bytes", old_file, nentries, tail);
+
+    apr_pool_destroy(pool);
+    return APR_SUCCESS;
+}
+
+/*
+ * Append a record, and index it unless it's a tombstone. The record is
+ * buf, followed by the body_len bytes of the body file if any, padded.
+ */
+static apr_status_t cache_segment_append(request_rec *r, const char *key,
+                                         const void *buf, apr_size_t buf_len,
+                                         apr_file_t *body, apr_off_t body_len,
+                                         apr_time_t expire, int tombstone)
+{
+    static const char padding[8] = { 0 };
+    apr_uint32_t hash = seg_hash(key, strlen(key)), slot, gen;
+    apr_uint64_t offset, len = APR_ALIGN(buf_len + body_len, 8);
+    apr_off_t off;
+    apr_file_t *fd;
+    apr_status_t rv;
+    int retried = 0;
+
+    for (;;) {
+        rv = apr_global_mutex_lock(segment_mutex);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10566)
+                    "could not acquire lock, ignoring: %s", key);
+            return rv;
+        }
+        rv = seg_reserve(r->pool, len, &slot, &gen, &offset);
+        if (rv != APR_SUCCESS && rv != APR_EAGAIN) {
+            segment_header->nospace++;
+        }
+        apr_global_mutex_unlock(segment_mutex);
+
+        if (rv != APR_EAGAIN) {
+            break;
+        }
+        if (retried++ || cache_segment_compact(r, slot) != APR_SUCCESS) {
+            apr_global_mutex_lock(segment_mutex);
+            segment_header->nospace++;
+            apr_global_mutex_unlock(segment_mutex);
+            return APR_ENOSPC;
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = apr_file_open(&fd, seg_file(r->pool, gen),
+                       APR_FOPEN_WRITE | APR_FOPEN_BINARY, APR_OS_DEFAULT,
+                       r->pool);
+    if (rv == APR_SUCCESS) {
+        off = offset;
+        rv = apr_file_seek(fd, APR_SET, &off);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_write_full(fd, buf, buf_len, NULL);
+        }
+        if (rv == APR_SUCCESS && body_len) {
+            rv = cache_segment_copy(body, fd, 0, body_len,
+                                    apr_palloc(r->pool, AP_IOBUFSIZE),
+                                    AP_IOBUFSIZE);
+        }
+        if (rv == APR_SUCCESS && len > buf_len + body_len) {
+            rv = apr_file_write_full(fd, padding,
+                                     len - (buf_len + body_len), NULL);
+        }
+        apr_file_close(fd);
+    }
+    if (rv != APR_SUCCESS) {
+        /* the reserved room is left as a hole, dead space */
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(10567)
+                "could not write to segment %s, ignoring: %s",
+                seg_file(r->pool, gen), key);
+        return rv;
+    }
+
+    rv = apr_global_mutex_lock(segment_mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10568)
+                "could not acquire lock, ignoring: %s", key);
+        return rv;
+    }
+    if (tombstone) {
+        apr_uint32_t i = seg_lookup(hash);
+        if (i != CACHE_SEGMENT_NIL) {
+            seg_drop(i);
+        }
+    }
+    else if (segment_slots[slot].generation != gen
+             || segment_slots[slot].compacting) {
+        /* compacted meanwhile, or being compacted: the entries of the
+         * slot to keep are known already, and the file goes away
+         */
+        rv = APR_EGENERAL;
+    }
+    else {
+        rv = seg_insert(hash, slot, offset, len, expire);
+        if (rv == APR_SUCCESS) {
+            segment_header->stores++;
+        }
+        else {
+            segment_header->nospace++;
+        }
+    }
+    apr_global_mutex_unlock(segment_mutex);
+
+    return rv;
+}
+
+/* Find the record of a key, the caller must check the key it contains */
+static apr_status_t cache_segment_find(request_rec *r, const char *key,
+                                       apr_uint32_t *generation,
+                                       apr_uint64_t *offset,
+                                       apr_uint64_t *length)
+{
+    apr_uint32_t hash = seg_hash(key, strlen(key)), i;
+    apr_status_t rv;
+
+    rv = apr_global_mutex_lock(segment_mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10569)
+                "could not acquire lock, ignoring: %s", key);
+        return rv;
+    }
+    i = seg_lookup(hash);
+    if (i != CACHE_SEGMENT_NIL
+            && segment_entries[i].expire < r->request_time) {
+        seg_drop(i);
+        i = CACHE_SEGMENT_NIL;
+    }
+    if (i == CACHE_SEGMENT_NIL) {
+        segment_header->misses++;
+        rv = APR_NOTFOUND;
+    }
+    else {
+        segment_header->hits++;
+        *generation = segment_entries[i].generation;
+        *offset = segment_entries[i].offset;
+        *length = segment_entries[i].length;
+    }
+    apr_global_mutex_unlock(segment_mutex);
+
+    return rv;
+}
+
+static void cache_segment_remove(request_rec *r, const char *key)
+{
+    cache_segment_record_t *rec;
+    apr_size_t klen = strlen(key), len;
+
+    /* drop it from the index, and append a tombstone to make it stick
+     * across restarts
+     */
+    len = APR_ALIGN(sizeof(*rec) + klen, 8);
+    rec = apr_pcalloc(r->pool, len);
+    rec->magic = CACHE_SEGMENT_RECORD;
+    rec->flags = CACHE_SEGMENT_TOMBSTONE;
+    rec->key_len = klen;
+    memcpy(rec + 1, key, klen);
+
+    cache_segment_append(r, key, rec, len, NULL, 0, 0, 1);
+}
+
+/*
+ * Read the record of a key, returns its data, the body's offset and length,
+ * and the open segment.
+ */
+static apr_status_t cache_segment_read(request_rec *r, const char *key,
+                                       apr_file_t **fd,
+                                       unsigned char **data,
+                                       apr_size_t *data_len,
+                                       apr_off_t *body_offset,
+                                       apr_off_t *body_len)
+{
+    cache_segment_record_t rec;
+    apr_uint32_t generation;
+    apr_uint64_t offset, length;
+    apr_size_t klen = strlen(key);
+    apr_off_t off;
+    char *rkey;
+    apr_status_t rv;
+
+    rv = cache_segment_find(r, key, &generation, &offset, &length);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = apr_file_open(fd, seg_file(r->pool, generation),
+                       APR_FOPEN_READ | APR_FOPEN_BINARY
+                       | APR_FOPEN_SENDFILE_ENABLED, APR_OS_DEFAULT, r->pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    off = offset;
+    rv = apr_file_seek(*fd, APR_SET, &off);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_read_full(*fd, &rec, sizeof(rec), NULL);
+    }
+    if (rv != APR_SUCCESS) {
+        apr_file_close(*fd);
+        return rv;
+    }
+    if (rec.magic != CACHE_SEGMENT_RECORD
+            || (rec.flags & CACHE_SEGMENT_TOMBSTONE)
+            || SEGMENT_RECORD_LEN(&rec) != length
+            || rec.key_len + rec.data_len > CACHE_SEGMENT_MAX_HEADERS) {
+        apr_file_close(*fd);
+        return APR_EGENERAL;
+    }
+    if (rec.key_len != klen) {
+        /* another key with the same hash */
+        apr_file_close(*fd);
+        return APR_NOTFOUND;
+    }
+
+    rkey = apr_palloc(r->pool, rec.key_len + rec.data_len);
+    rv = apr_file_read_full(*fd, rkey, rec.key_len + rec.data_len, NULL);
+    if (rv != APR_SUCCESS) {
+        apr_file_close(*fd);
+        return rv;
+    }
+    if (memcmp(rkey, key, klen)) {
+        apr_file_close(*fd);
+        return APR_NOTFOUND;
+    }
+
+    *data = (unsigned char *)rkey + rec.key_len;
+    *data_len = rec.data_len;
+    *body_offset = offset + sizeof(rec) + rec.key_len + rec.data_len;
+    *body_len = rec.body_len;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Local static functions
+ */
+
+static apr_status_t read_array(request_rec *r, apr_array_header_t *arr,
+        const unsigned char *buffer, apr_size_t buffer_len, apr_size_t *slider)
+{
+    apr_size_t val = *slider;
+
+    while (*slider < buffer_len) {
+        if (buffer[*slider] == '\r') {
+            if (val == *slider) {
+                (*slider)++;
+                return APR_SUCCESS;
+            }
+            *((const char **) apr_array_push(arr)) = apr_pstrndup(r->pool,
+                    (const char *) buffer + val, *slider - val);
+            (*slider)++;
+            if (*slider < buffer_len && buffer[*slider] == '\n') {
+                (*slider)++;
+            }
+            val = *slider;
+        }
+        else if (buffer[*slider] == '\0') {
+            (*slider)++;
+            return APR_SUCCESS;
+        }
+        else {
+            (*slider)++;
+        }
+    }
+
+    return APR_EOF;
+}
+
+static apr_status_t store_array(apr_array_header_t *arr, unsigned char *buffer,
+        apr_size_t buffer_len, apr_size_t *slider)
+{
+    int i, len;
+    const char **elts;
+
+    elts = (const char **) arr->elts;
+
+    for (i = 0; i < arr->nelts; i++) {
+        apr_size_t e_len = strlen(elts[i]);
+        if (e_len + 3 >= buffer_len - *slider) {
+            return APR_EOF;
+        }
+        len = apr_snprintf(buffer ? (char *) buffer + *slider : NULL,
+                buffer ? buffer_len - *slider : 0, "%s" CRLF, elts[i]);
+        *slider += len;
+    }
+    if (buffer) {
+        memcpy(buffer + *slider, CRLF, sizeof(CRLF) - 1);
+    }
+    *slider += sizeof(CRLF) - 1;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t read_table(request_rec *r, apr_table_t *table,
+        const unsigned char *buffer, apr_size_t buffer_len,
+        apr_size_t *slider)
+{
+    apr_size_t key = *slider, colon = 0, len = 0;
+
+    while (*slider < buffer_len) {
+        if (buffer[*slider] == ':') {
+            if (!colon) {
+                colon = *slider;
+            }
+            (*slider)++;
+        }
+        else if (buffer[*slider] == '\r') {
+            len = colon;
+            if (key == *slider) {
+                (*slider)++;
+                if (*slider < buffer_len && buffer[*slider] == '\n') {
+                    (*slider)++;
+                }
+                return APR_SUCCESS;
+            }
+            if (!colon || buffer[colon++] != ':') {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10570)
+                        "Premature end of cache headers.");
+                return APR_EGENERAL;
+            }
+            /* Do not go past the \r from above as apr_isspace('\r') is true */
+            while (apr_isspace(buffer[colon]) && (colon < *slider)) {
+                colon++;
+            }
+            apr_table_addn(table, apr_pstrmemdup(r->pool, (const char *) buffer
+                    + key, len - key), apr_pstrmemdup(r->pool,
+                    (const char *) buffer + colon, *slider - colon));
+            (*slider)++;
+            if (*slider < buffer_len && buffer[*slider] == '\n') {
+                (*slider)++;
+            }
+            key = *slider;
+            colon = 0;
+        }
+        else if (buffer[*slider] == '\0') {
+            (*slider)++;
+            return APR_SUCCESS;
+        }
+        else {
+            (*slider)++;
+        }
+    }
+
+    return APR_EOF;
+}
+
+static apr_status_t store_table(apr_table_t *table, unsigned char *buffer,
+        apr_size_t buffer_len, apr_size_t *slider)
+{
+    int i, len;
+    apr_table_entry_t *elts;
+
+    elts = (apr_table_entry_t *) apr_table_elts(table)->elts;
+    for (i = 0; i < apr_table_elts(table)->nelts; ++i) {
+        if (elts[i].key != NULL) {
+            apr_size_t key_len = strlen(elts[i].key);
+            apr_size_t val_len = strlen(elts[i].val);
+            if (key_len + val_len + 5 >= buffer_len - *slider) {
+                return APR_EOF;
+            }
+            len = apr_snprintf(buffer ? (char *) buffer + *slider : NULL,
+                    buffer ? buffer_len - *slider : 0, "%s: %s" CRLF,
+                    elts[i].key, elts[i].val);
+            *slider += len;
+        }
+    }
+    if (3 >= buffer_len - *slider) {
+        return APR_EOF;
+    }
+    if (buffer) {
+        memcpy(buffer + *slider, CRLF, sizeof(CRLF) - 1);
+    }
+    *slider += sizeof(CRLF) - 1;
+
+    return APR_SUCCESS;
+}
+
+static const char* regen_key(request_rec *r, apr_table_t *headers,
+                             apr_array_header_t *varray, const char *oldkey)
+{
+    struct iovec *iov;
+    int i, k;
+    int nvec;
+    const char *header;
+    const char **elts;
+
+    nvec = (varray->nelts * 2) + 1;
+    iov = apr_palloc(r->pool, sizeof(struct iovec) * nvec);
+    elts = (const char **) varray->elts;
+
+    for (i = 0, k = 0; i < varray->nelts; i++) {
+        header = ap_cache_vary_value(r, elts[i],
+                                     apr_table_get(headers, elts[i]));
+        if (!header) {
+            header = "";
+        }
+        iov[k].iov_base = (char*) elts[i];
+        iov[k].iov_len = strlen(elts[i]);
+        k++;
+        iov[k].iov_base = (char*) header;
+        iov[k].iov_len = strlen(header);
+        k++;
+    }
+    iov[k].iov_base = (char*) oldkey;
+    iov[k].iov_len = strlen(oldkey);
+    k++;
+
+    return apr_pstrcatv(r->pool, iov, k, NULL);
+}
+
+static int array_alphasort(const void *fn1, const void *fn2)
+{
+    return strcmp(*(char**) fn1, *(char**) fn2);
+}
+
+static void tokens_to_array(apr_pool_t *p, const char *data,
+        apr_array_header_t *arr)
+{
+    char *token;
+
+    while ((token = ap_get_list_item(p, &data)) != NULL) {
+        *((const char **) apr_array_push(arr)) = token;
+    }
+
+    /* Sort it so that "Vary: A, B" and "Vary: B, A" are stored the same. */
+    qsort((void *) arr->elts, arr->nelts, sizeof(char *), array_alphasort);
+}
+
+/* Fill in the record header of a buffer, and return its aligned length */
+static apr_size_t make_record(unsigned char *buffer, const char *key,
+                              apr_size_t data_len, apr_off_t body_len,
+                              apr_time_t expire)
+{
+    cache_segment_record_t *rec = (cache_segment_record_t *)buffer;
+
+    rec->magic = CACHE_SEGMENT_RECORD;
+    rec->flags = 0;
+    rec->key_len = strlen(key);
+    rec->data_len = data_len;
+    rec->body_len = body_len;
+    rec->expire = expire;
+
+    return (apr_size_t)SEGMENT_RECORD_LEN(rec);
+}
+
+/*
+ * Hook and mod_cache callback functions
+ */
+static int create_entity(cache_handle_t *h, request_rec *r, const char *key,
+        apr_off_t len, apr_bucket_brigade *bb)
+{
+    disk_cache_dir_conf *dconf = ap_get_module_config(r->per_dir_config,
+                                                      &cache_disk_module);
+    cache_object_t *obj;
+    cache_segment_object_t *sobj;
+
+    if (!segment_header) {
+        return DECLINED;
+    }
+
+    /* we don't support caching of range requests (yet) */
+    if (r->status == HTTP_PARTIAL_CONTENT) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10571)
+                "URL %s partial content response not cached",
+                key);
+        return DECLINED;
+    }
+
+    /* The record is written in one go, so its size must be known */
+    if (len < 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10572)
+                "URL '%s' had no explicit size, ignoring", key);
+        return DECLINED;
+    }
+    if (len > dconf->maxfs || len < dconf->minfs
+            || (apr_uint64_t)len > segment_header->size / 4) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10573)
+                "URL %s failed the size check (%" APR_OFF_T_FMT ")",
+                key, len);
+        return DECLINED;
+    }
+
+    /* Allocate and initialize cache_object_t and cache_segment_object_t */
+    h->cache_obj = obj = apr_pcalloc(r->pool, sizeof(*obj));
+    obj->vobj = sobj = apr_pcalloc(r->pool, sizeof(*sobj));
+
+    obj->key = apr_pstrdup(r->pool, key);
+    sobj->key = obj->key;
+    sobj->name = obj->key;
+    sobj->length = len;
+
+    return OK;
+}
+
+static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
+{
+    unsigned char *data = NULL;
+    apr_size_t dlen = 0, slider;
+    apr_off_t body_offset, body_len;
+    apr_uint32_t format;
+    const char *nkey = NULL;
+    apr_file_t *fd;
+    apr_status_t rc;
+    cache_object_t *obj;
+    cache_info *info;
+    cache_segment_object_t *sobj;
+
+    h->cache_obj = NULL;
+
+    if (!segment_header) {
+        return DECLINED;
+    }
+
+    /* Create and init the cache object */
+    obj = apr_pcalloc(r->pool, sizeof(cache_object_t));
+    sobj = apr_pcalloc(r->pool, sizeof(cache_segment_object_t));
+
+    info = &(obj->info);
+
+    /* attempt to retrieve the cached entry */
+    rc = cache_segment_read(r, key, &fd, &data, &dlen, &body_offset,
+                            &body_len);
+    if (rc != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(10574)
+                "Key not found in cache: %s", key);
+        return DECLINED;
+    }
+    if (dlen < sizeof(format)) {
+        goto fail;
+    }
+
+    /* read the format from the cache entry */
+    memcpy(&format, data, sizeof(format));
+    slider = sizeof(format);
+
+    if (format == CACHE_SEGMENT_VARY_FORMAT_VERSION) {
+        apr_array_header_t* varray;
+
+        slider += sizeof(apr_time_t);
+
+        varray = apr_array_make(r->pool, 5, sizeof(char*));
+        rc = read_array(r, varray, data, dlen, &slider);
+        apr_file_close(fd);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(10575)
+                    "Cannot parse vary entry for key: %s", key);
+            cache_segment_remove(r, key);
+            return DECLINED;
+        }
+
+        nkey = regen_key(r, r->headers_in, varray, key);
+
+        /* attempt to retrieve the cached entry */
+        rc = cache_segment_read(r, nkey, &fd, &data, &dlen, &body_offset,
+                                &body_len);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(10576)
+                    "Key not found in cache: %s", key);
+            return DECLINED;
+        }
+        if (dlen < sizeof(format)) {
+            goto fail;
+        }
+        memcpy(&format, data, sizeof(format));
+    }
+    else {
+        nkey = key;
+    }
+
+    if (format != CACHE_SEGMENT_DISK_FORMAT_VERSION) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10577)
+                "Key '%s' found in cache has version %d, expected %d, ignoring",
+                nkey, format, CACHE_SEGMENT_DISK_FORMAT_VERSION);
+        goto fail;
+    }
+
+    obj->key = nkey;
+    sobj->key = nkey;
+    sobj->name = key;
+
+    if (dlen < sizeof(cache_segment_info_t)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10578)
+                "Cache entry for key '%s' too short, removing", nkey);
+        goto fail;
+    }
+    memcpy(&sobj->seg_info, data, sizeof(cache_segment_info_t));
+    slider = sizeof(cache_segment_info_t);
+
+    /* Store it away so we can get it later. */
+    info->status = sobj->seg_info.status;
+    info->date = sobj->seg_info.date;
+    info->expire = sobj->seg_info.expire;
+    info->request_time = sobj->seg_info.request_time;
+    info->response_time = sobj->seg_info.response_time;
+
+    memcpy(&info->control, &sobj->seg_info.control, sizeof(cache_control_t));
+
+    if (sobj->seg_info.name_len > dlen - slider
+            || strncmp((const char *) data + slider, sobj->name,
+                       sobj->seg_info.name_len)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10579)
+                "Cache entry for key '%s' URL mismatch, ignoring", nkey);
+        apr_file_close(fd);
+        return DECLINED;
+    }
+    slider += sobj->seg_info.name_len;
+
+    /* Is this a cached HEAD request? */
+    if (sobj->seg_info.header_only && !r->header_only) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, APLOGNO(10580)
+                "HEAD request cached, non-HEAD requested, ignoring: %s",
+                sobj->key);
+        apr_file_close(fd);
+        return DECLINED;
+    }
+
+    h->req_hdrs = apr_table_make(r->pool, 20);
+    h->resp_hdrs = apr_table_make(r->pool, 20);
+
+    /* Call routine to read the header lines/status line */
+    if (APR_SUCCESS != read_table(r, h->resp_hdrs, data, dlen, &slider)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10581)
+                "Cache entry for key '%s' response headers unreadable, removing", nkey);
+        goto fail;
+    }
+    if (APR_SUCCESS != read_table(r, h->req_hdrs, data, dlen, &slider)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10582)
+                "Cache entry for key '%s' request headers unreadable, removing", nkey);
+        goto fail;
+    }
+
+    /* Serve the body, if any, from its place in the segment */
+    sobj->body = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    if (body_len > 0) {
+        apr_brigade_insert_file(sobj->body, fd, body_offset, body_len,
+                                r->pool);
+    }
+    else {
+        apr_file_close(fd);
+    }
+
+    /* make the configuration stick */
+    h->cache_obj = obj;
+    obj->vobj = sobj;
+
+    return OK;
+
+fail:
+    apr_file_close(fd);
+    cache_segment_remove(r, nkey ? nkey : key);
+    return DECLINED;
+}
+
+static int remove_entity(cache_handle_t *h)
+{
+    /* Null out the cache object pointer so next time we start from scratch  */
+    h->cache_obj = NULL;
+    return OK;
+}
+
+static int remove_url(cache_handle_t *h, request_rec *r)
+{
+    cache_segment_object_t *sobj;
+
+    sobj = (cache_segment_object_t *) h->cache_obj->vobj;
+    if (!sobj) {
+        return DECLINED;
+    }
+
+    /* Remove the key from the cache */
+    cache_segment_remove(r, sobj->key);
+
+    return OK;
+}
+
+static apr_status_t recall_headers(cache_handle_t *h, request_rec *r)
+{
+    /* we recalled the headers during open_entity, so do nothing */
+    return APR_SUCCESS;
+}
+
+static apr_status_t recall_body(cache_handle_t *h, apr_pool_t *p,
+        apr_bucket_brigade *bb)
+{
+    cache_segment_object_t *sobj = (cache_segment_object_t*) h->cache_obj->vobj;
+
+    if (sobj->body) {
+        APR_BRIGADE_CONCAT(bb, sobj->body);
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t store_headers(cache_handle_t *h, request_rec *r,
+        cache_info *info)
+{
+    apr_size_t slider;
+    apr_status_t rv;
+    cache_object_t *obj = h->cache_obj;
+    cache_segment_object_t *sobj = (cache_segment_object_t*) obj->vobj;
+    cache_segment_info_t *seg_info;
+
+    memcpy(&h->cache_obj->info, info, sizeof(cache_info));
+
+    if (r->headers_out) {
+        sobj->headers_out = ap_cache_cacheable_headers_out(r);
+    }
+
+    if (r->headers_in) {
+        sobj->headers_in = ap_cache_cacheable_headers_in(r);
+    }
+
+    sobj->expire
+            = obj->info.expire > r->request_time + apr_time_from_sec(DEFAULT_MAXTIME)
+                    ? r->request_time + apr_time_from_sec(DEFAULT_MAXTIME)
+                    : obj->info.expire + apr_time_from_sec(DEFAULT_MINTIME);
+
+    apr_pool_create(&sobj->pool, r->pool);
+    apr_pool_tag(sobj->pool, "mod_cache_disk (store_headers)");
+
+    /* room for the record header, key and headers, the key being counted
+     * in the headers limit
+     */
+    sobj->buffer_len = sizeof(cache_segment_record_t)
+                       + CACHE_SEGMENT_MAX_HEADERS + 8;
+    sobj->buffer = apr_pcalloc(sobj->pool, sobj->buffer_len);
+
+    if (sobj->headers_out) {
+        const char *vary;
+
+        vary = apr_table_get(sobj->headers_out, "Vary");
+
+        if (vary) {
+            apr_array_header_t* varray;
+            apr_uint32_t format = CACHE_SEGMENT_VARY_FORMAT_VERSION;
+            apr_size_t start, len;
+
+            start = sizeof(cache_segment_record_t) + strlen(obj->key);
+            if (start >= CACHE_SEGMENT_MAX_HEADERS) {
+                apr_pool_destroy(sobj->pool);
+                sobj->pool = NULL;
+                return APR_EGENERAL;
+            }
+            memcpy(sobj->buffer + sizeof(cache_segment_record_t), obj->key,
+                   start - sizeof(cache_segment_record_t));
+            slider = start;
+
+            memcpy(sobj->buffer + slider, &format, sizeof(format));
+            slider += sizeof(format);
+
+            memcpy(sobj->buffer + slider, &obj->info.expire,
+                    sizeof(obj->info.expire));
+            slider += sizeof(obj->info.expire);
+
+            varray = apr_array_make(r->pool, 6, sizeof(char*));
+            tokens_to_array(r->pool, vary, varray);
+
+            if (APR_SUCCESS != (rv = store_array(varray, sobj->buffer,
+                    CACHE_SEGMENT_MAX_HEADERS, &slider))) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10583)
+                        "buffer too small for Vary array, caching aborted: %s",
+                        obj->key);
+                apr_pool_destroy(sobj->pool);
+                sobj->pool = NULL;
+                return rv;
+            }
+            len = make_record(sobj->buffer, obj->key, slider - start, 0,
+                              sobj->expire);
+            rv = cache_segment_append(r, obj->key, sobj->buffer, len, NULL,
+                                      0, sobj->expire, 0);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(10584)
+                        "Vary not written to cache, ignoring: %s", obj->key);
+                apr_pool_destroy(sobj->pool);
+                sobj->pool = NULL;
+                return rv;
+            }
+            memset(sobj->buffer, 0, APR_ALIGN(slider, 8));
+
+            obj->key = sobj->key = regen_key(r, sobj->headers_in, varray,
+                                             sobj->name);
+        }
+    }
+
+    /* the record header is filled in at commit time */
+    slider = sizeof(cache_segment_record_t) + strlen(sobj->key);
+    if (slider + sizeof(cache_segment_info_t) >= CACHE_SEGMENT_MAX_HEADERS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10585)
+                "cache key too long: %s", sobj->key);
+        apr_pool_destroy(sobj->pool);
+        sobj->pool = NULL;
+        return APR_EGENERAL;
+    }
+    memcpy(sobj->buffer + sizeof(cache_segment_record_t), sobj->key,
+           slider - sizeof(cache_segment_record_t));
+    sobj->data_offset = slider;
+
+    seg_info = (cache_segment_info_t *) (sobj->buffer + slider);
+    memset(seg_info, 0, sizeof(*seg_info));
+    seg_info->format = CACHE_SEGMENT_DISK_FORMAT_VERSION;
+    seg_info->date = obj->info.date;
+    seg_info->expire = obj->info.expire;
+    seg_info->request_time = obj->info.request_time;
+    seg_info->response_time = obj->info.response_time;
+    seg_info->status = obj->info.status;
+
+    if (r->header_only && r->status != HTTP_NOT_MODIFIED) {
+        seg_info->header_only = 1;
+    }
+    else {
+        seg_info->header_only = sobj->seg_info.header_only;
+    }
+
+    seg_info->name_len = strlen(sobj->name);
+
+    memcpy(&seg_info->control, &obj->info.control, sizeof(cache_control_t));
+    slider += sizeof(cache_segment_info_t);
+
+    if (slider + seg_info->name_len >= CACHE_SEGMENT_MAX_HEADERS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10586)
+                "cache buffer too small for name: %s",
+                sobj->name);
+        apr_pool_destroy(sobj->pool);
+        sobj->pool = NULL;
+        return APR_EGENERAL;
+    }
+    memcpy(sobj->buffer + slider, sobj->name, seg_info->name_len);
+    slider += seg_info->name_len;
+
+    if (sobj->headers_out) {
+        if (APR_SUCCESS != store_table(sobj->headers_out, sobj->buffer,
+                CACHE_SEGMENT_MAX_HEADERS, &slider)) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10587)
+                    "out-headers didn't fit in buffer: %s", sobj->name);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+    }
+
+    if (sobj->headers_in) {
+        if (APR_SUCCESS != store_table(sobj->headers_in, sobj->buffer,
+                CACHE_SEGMENT_MAX_HEADERS, &slider)) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10588)
+                    "in-headers didn't fit in buffer %s",
+                    sobj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+    }
+
+    sobj->body_offset = slider;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t store_body(cache_handle_t *h, request_rec *r,
+        apr_bucket_brigade *in, apr_bucket_brigade *out)
+{
+    apr_bucket *e;
+    apr_status_t rv = APR_SUCCESS;
+    cache_segment_object_t *sobj =
+            (cache_segment_object_t *) h->cache_obj->vobj;
+    int seen_eos = 0;
+
+    if (!sobj->newbody) {
+        sobj->body_length = 0;
+        sobj->newbody = 1;
+    }
+
+    while (APR_SUCCESS == rv && !APR_BRIGADE_EMPTY(in)) {
+        const char *str;
+        apr_size_t length;
+
+        e = APR_BRIGADE_FIRST(in);
+
+        /* are we done completely? if so, pass any trailing buckets right through */
+        if (sobj->done || !sobj->pool) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            continue;
+        }
+
+        /* have we seen eos yet? */
+        if (APR_BUCKET_IS_EOS(e)) {
+            seen_eos = 1;
+            sobj->done = 1;
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            break;
+        }
+
+        /* honour flush buckets, we'll get called again */
+        if (APR_BUCKET_IS_FLUSH(e)) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            break;
+        }
+
+        /* metadata buckets are preserved as is */
+        if (APR_BUCKET_IS_METADATA(e)) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            continue;
+        }
+
+        /* read the bucket, write to the cache */
+        rv = apr_bucket_read(e, &str, &length, APR_BLOCK_READ);
+        APR_BUCKET_REMOVE(e);
+        APR_BRIGADE_INSERT_TAIL(out, e);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10589)
+                    "Error when reading bucket for URL %s",
+                    h->cache_obj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return rv;
+        }
+
+        /* don't write empty buckets to the cache */
+        if (!length) {
+            continue;
+        }
+
+        sobj->body_length += length;
+        if (sobj->body_length > sobj->length) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10590)
+                    "URL %s body longer than announced "
+                    "(%" APR_OFF_T_FMT ">%" APR_OFF_T_FMT ")",
+                    h->cache_obj->key, sobj->body_length, sobj->length);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+
+        /* spool the body, removed with the pool */
+        if (!sobj->tempfd) {
+            sobj->tempfile = apr_pstrcat(sobj->pool, segment_root,
+                                         AP_TEMPFILE, NULL);
+            rv = apr_file_mktemp(&sobj->tempfd, sobj->tempfile,
+                                 APR_FOPEN_CREATE | APR_FOPEN_READ
+                                 | APR_FOPEN_WRITE | APR_FOPEN_BINARY
+                                 | APR_FOPEN_BUFFERED | APR_FOPEN_EXCL
+                                 | APR_FOPEN_DELONCLOSE, sobj->pool);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(10676)
+                        "could not create temp file %s, not caching: %s",
+                        sobj->tempfile, h->cache_obj->key);
+                apr_pool_destroy(sobj->pool);
+                sobj->pool = NULL;
+                return rv;
+            }
+        }
+        rv = apr_file_write_full(sobj->tempfd, str, length, NULL);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(10677)
+                    "could not write to temp file %s, not caching: %s",
+                    sobj->tempfile, h->cache_obj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return rv;
+        }
+    }
+
+    /* Was this the final bucket? If yes, perform sanity checks.
+     */
+    if (seen_eos) {
+        const char *cl_header;
+        apr_off_t cl;
+
+        if (r->connection->aborted || r->no_cache) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(10591)
+                    "Discarding body for URL %s "
+                    "because connection has been aborted.",
+                    h->cache_obj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+
+        cl_header = apr_table_get(r->headers_out, "Content-Length");
+        if (cl_header && (!ap_parse_strict_length(&cl, cl_header)
+                          || cl != sobj->body_length)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10592)
+                    "URL %s didn't receive complete response, not caching",
+                    h->cache_obj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+
+        /* All checks were fine, we're good to go when the commit comes */
+
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_object_t *obj = h->cache_obj;
+    cache_segment_object_t *sobj = (cache_segment_object_t *) obj->vobj;
+    apr_status_t rv;
+
+    if (!sobj->pool) {
+        return APR_EGENERAL;
+    }
+
+    make_record(sobj->buffer, sobj->key, sobj->body_offset - sobj->data_offset,
+                sobj->body_length, sobj->expire);
+    if (sobj->tempfd) {
+        rv = apr_file_flush(sobj->tempfd);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(10678)
+                    "could not write to temp file %s, not caching: %s",
+                    sobj->tempfile, sobj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return rv;
+        }
+    }
+    rv = cache_segment_append(r, sobj->key, sobj->buffer, sobj->body_offset,
+                              sobj->tempfd, sobj->body_length, sobj->expire,
+                              0);
+    if (rv != APR_SUCCESS) {
+        /* For safety, remove any existing entry on failure, just in case it
+         * could not be revalidated successfully.
+         */
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(10593)
+                "could not write to cache, ignoring: %s", sobj->key);
+        cache_segment_remove(r, sobj->key);
+    }
+    else {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10594)
+                "commit_entity: Headers and body for URL %s cached for maximum of %d seconds.",
+                sobj->name, (apr_uint32_t)apr_time_sec(sobj->expire - r->request_time));
+    }
+
+    apr_pool_destroy(sobj->pool);
+    sobj->pool = NULL;
+
+    return rv;
+}
+
+static apr_status_t invalidate_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_segment_object_t *sobj = (cache_segment_object_t *) h->cache_obj->vobj;
+
+    /* Records are never rewritten, so rather than being marked invalidated
+     * the entity is removed, to be fetched again on the next request.
+     */
+    h->cache_obj->info.control.invalidated = 1;
+    cache_segment_remove(r, sobj->key);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t cache_segment_cleanup(void *data)
+{
+    if (segment_shm) {
+        apr_shm_destroy(segment_shm);
+        segment_shm = NULL;
+    }
+    segment_header = NULL;
+    segment_slots = NULL;
+    segment_buckets = NULL;
+    segment_entries = NULL;
+    segment_mutex = NULL;
+    return APR_SUCCESS;
+}
+
+static int cache_segment_status_hook(request_rec *r, int flags)
+{
+    cache_segment_header_t h;
+    apr_uint64_t live = 0, tail = 0;
+    apr_uint32_t i, used = 0;
+    apr_status_t rv;
+
+    if (!segment_header) {
+        return DECLINED;
+    }
+
+    rv = apr_global_mutex_lock(segment_mutex);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10595)
+                "could not acquire lock for cache status");
+        return DECLINED;
+    }
+    memcpy(&h, segment_header, sizeof(h));
+    for (i = 0; i < h.nslots; i++) {
+        if (segment_slots[i].generation) {
+            used++;
+            live += segment_slots[i].live;
+            tail += segment_slots[i].tail;
+        }
+    }
+    apr_global_mutex_unlock(segment_mutex);
+
+    if (!(flags & AP_STATUS_SHORT)) {
+        ap_rputs("<hr>\n"
+                 "<table cellspacing=0 cellpadding=0>\n"
+                 "<tr><td bgcolor=\"#000000\">\n"
+                 "<b><font color=\"#ffffff\" face=\"Arial,Helvetica\">"
+                 "mod_cache_disk Segments Status:</font></b>\n"
+                 "</td></tr>\n"
+                 "<tr><td bgcolor=\"#ffffff\">\n", r);
+        ap_rprintf(r, "segments: <b>%u</b> of <b>%u</b> of <b>%"
+                   APR_UINT64_T_FMT "</b> bytes in use, <b>%" APR_UINT64_T_FMT
+                   "</b> bytes written, of which live: <b>%" APR_UINT64_T_FMT
+                   "</b><br>", used, h.nslots, h.size, tail, live);
+        ap_rprintf(r, "entries: <b>%u</b> of <b>%u</b><br>",
+                   h.used, h.nentries);
+        ap_rprintf(r, "hits: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "misses: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "stores: <b>%" APR_UINT64_T_FMT "</b><br>",
+                   h.hits, h.misses, h.stores);
+        ap_rprintf(r, "compactions: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "bytes compacted: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "evictions: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "stores without space: <b>%" APR_UINT64_T_FMT "</b><br>",
+                   h.compactions, h.compacted, h.evictions, h.nospace);
+        ap_rputs("</td></tr>\n</table>\n", r);
+    }
+    else {
+        ap_rputs("ModCacheDiskSegmentStatus\n", r);
+        ap_rprintf(r, "CacheSegmentsUsed: %u\n", used);
+        ap_rprintf(r, "CacheSegmentBytes: %" APR_UINT64_T_FMT "\n", tail);
+        ap_rprintf(r, "CacheSegmentLiveBytes: %" APR_UINT64_T_FMT "\n", live);
+        ap_rprintf(r, "CacheSegmentEntries: %u\n", h.used);
+        ap_rprintf(r, "CacheSegmentHits: %" APR_UINT64_T_FMT "\n", h.hits);
+        ap_rprintf(r, "CacheSegmentMisses: %" APR_UINT64_T_FMT "\n", h.misses);
+        ap_rprintf(r, "CacheSegmentStores: %" APR_UINT64_T_FMT "\n", h.stores);
+        ap_rprintf(r, "CacheSegmentCompactions: %" APR_UINT64_T_FMT "\n",
+                   h.compactions);
+        ap_rprintf(r, "CacheSegmentEvictions: %" APR_UINT64_T_FMT "\n",
+                   h.evictions);
+        ap_rprintf(r, "CacheSegmentNoSpace: %" APR_UINT64_T_FMT "\n",
+                   h.nospace);
+    }
+
+    return OK;
+}
+
+/*
+ * Rebuild the index from a segment, returns the offset following the last
+ * valid record.
+ */
+static apr_uint64_t cache_segment_scan(apr_pool_t *p, server_rec *s,
+                                       const char *file, apr_uint32_t slot,
+                                       apr_time_t now)
+{
+    cache_segment_file_t hdr;
+    cache_segment_record_t rec;
+    apr_uint64_t offset = sizeof(hdr);
+    apr_file_t *fd;
+    apr_finfo_t finfo;
+    char *key;
+    apr_off_t off;
+    apr_status_t rv;
+
+    rv = apr_file_open(&fd, file, APR_FOPEN_READ | APR_FOPEN_BUFFERED
+                       | APR_FOPEN_BINARY, APR_OS_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10596)
+                "could not open cache segment %s", file);
+        return offset;
+    }
+    if (apr_file_info_get(&finfo, APR_FINFO_SIZE, fd) != APR_SUCCESS
+            || apr_file_read_full(fd, &hdr, sizeof(hdr), NULL) != APR_SUCCESS
+            || hdr.magic != CACHE_SEGMENT_MAGIC
+            || hdr.generation != segment_slots[slot].generation) {
+        apr_file_close(fd);
+        return offset;
+    }
+
+    key = apr_palloc(p, CACHE_SEGMENT_MAX_HEADERS);
+    while (offset + sizeof(rec) <= (apr_uint64_t)finfo.size) {
+        apr_uint64_t len;
+        apr_uint32_t hash, i;
+
+        off = offset;
+        if (apr_file_seek(fd, APR_SET, &off) != APR_SUCCESS
+                || apr_file_read_full(fd, &rec, sizeof(rec), NULL)
+                   != APR_SUCCESS
+                || rec.magic != CACHE_SEGMENT_RECORD
+                || rec.key_len + rec.data_len > CACHE_SEGMENT_MAX_HEADERS
+                || offset + SEGMENT_RECORD_LEN(&rec) > segment_header->size
+                || apr_file_read_full(fd, key, rec.key_len, NULL)
+                   != APR_SUCCESS) {
+            break;
+        }
+        len = SEGMENT_RECORD_LEN(&rec);
+        if (offset + len > (apr_uint64_t)finfo.size) {
+            break;
+        }
+
+        hash = seg_hash(key, rec.key_len);
+        if (!(rec.flags & CACHE_SEGMENT_TOMBSTONE) && rec.expire >= now) {
+            seg_insert(hash, slot, offset, len, rec.expire);
+        }
+        else if ((i = seg_lookup(hash)) != CACHE_SEGMENT_NIL) {
+            seg_drop(i);
+        }
+        offset += len;
+    }
+    apr_file_close(fd);
+
+    return offset;
+}
+
+static int generation_sort(const void *a, const void *b)
+{
+    apr_uint32_t ga = *(const apr_uint32_t *)a, gb = *(const apr_uint32_t *)b;
+
+    return ga < gb ? -1 : ga > gb;
+}
+
+static void cache_segment_load(apr_pool_t *p, server_rec *s)
+{
+    apr_array_header_t *gens;
+    apr_dir_t *dir;
+    apr_finfo_t finfo;
+    apr_uint32_t *g, i, n;
+    apr_time_t now = apr_time_now();
+    apr_size_t plen = strlen(CACHE_SEGMENT_PREFIX);
+
+    gens = apr_array_make(p, segment_header->nslots, sizeof(apr_uint32_t));
+    if (apr_dir_open(&dir, segment_root, p) == APR_SUCCESS) {
+        while (apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE, dir)
+               == APR_SUCCESS) {
+            const char *ext;
+            char *end;
+            apr_int64_t gen;
+
+            if (finfo.filetype != APR_REG
+                    || strncmp(finfo.name, CACHE_SEGMENT_PREFIX, plen)
+                    || !(ext = strchr(finfo.name, '.'))
+                    || strcmp(ext, CACHE_SEGMENT_SUFFIX)) {
+                continue;
+            }
+            gen = apr_strtoi64(finfo.name + plen, &end, 16);
+            if (end != ext || gen <= 0 || gen >= APR_UINT32_MAX) {
+                continue;
+            }
+            *(apr_uint32_t *)apr_array_push(gens) = (apr_uint32_t)gen;
+        }
+        apr_dir_close(dir);
+    }
+    qsort(gens->elts, gens->nelts, sizeof(apr_uint32_t), generation_sort);
+
+    /* keep the most recent segments, if there are now fewer of them */
+    g = (apr_uint32_t *)gens->elts;
+    n = gens->nelts;
+    i = 0;
+    while (n - i > segment_header->nslots) {
+        apr_file_remove(seg_file(p, g[i++]), p);
+    }
+    for (n = 0; i < (apr_uint32_t)gens->nelts; i++, n++) {
+        cache_segment_slot_t *slot = &segment_slots[n];
+
+        slot->generation = g[i];
+        slot->tail = cache_segment_scan(p, s, seg_file(p, g[i]), n, now);
+        segment_header->active = n;
+        segment_header->next_generation = g[i] + 1;
+    }
+
+    /* The last segment may still be appended to by the children of the
+     * previous generation of the server, start with a new one.
+     */
+    if (n) {
+        segment_slots[segment_header->active].tail = segment_header->size;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10597)
+            "%s: %u segments of %" APR_UINT64_T_FMT " bytes loaded from %s, "
+            "%u entries", cache_segment_id, n, segment_header->size,
+            segment_root, segment_header->used);
+}
+
+static int cache_segment_precfg(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptmp)
+{
+    apr_status_t rv = ap_mutex_register(pconf, cache_segment_id, NULL,
+            APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(10598)
+                "failed to register %s mutex", cache_segment_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+
+    /* Register to handle mod_status status page generation */
+    APR_OPTIONAL_HOOK(ap, status_hook, cache_segment_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
+
+    return OK;
+}
+
+static int cache_segment_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptmp, server_rec *s)
+{
+    disk_cache_conf *conf = ap_get_module_config(s->module_config,
+                                                 &cache_disk_module);
+    apr_uint64_t nentries;
+    apr_size_t size, slots_offset, buckets_offset, entries_offset;
+    apr_uint32_t i, nbuckets;
+    char *base;
+    apr_status_t rv;
+
+    if (!conf->segments) {
+        return OK;
+    }
+    if (!conf->cache_root) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, APLOGNO(10599)
+                "CacheSegments requires CacheRoot in the main server");
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    segment_root = conf->cache_root;
+
+    /* Compute the layout */
+    nentries = (apr_uint64_t)conf->segments * conf->segment_size
+               / CACHE_SEGMENT_AVG_RECORD;
+    if (nentries < CACHE_SEGMENT_MIN_INDEX) {
+        nentries = CACHE_SEGMENT_MIN_INDEX;
+    }
+    if (nentries > APR_UINT32_MAX / 2) {
+        nentries = APR_UINT32_MAX / 2;
+    }
+    nbuckets = (apr_uint32_t)nentries;
+    slots_offset = APR_ALIGN_DEFAULT(sizeof(cache_segment_header_t));
+    buckets_offset = slots_offset
+            + APR_ALIGN_DEFAULT(conf->segments * sizeof(cache_segment_slot_t));
+    entries_offset = buckets_offset
+            + APR_ALIGN_DEFAULT(nbuckets * sizeof(apr_uint32_t));
+    size = entries_offset + nentries * sizeof(cache_segment_entry_t);
+
+    /* Use anonymous shm, the children inherit it */
+    rv = apr_shm_create(&segment_shm, size, NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10600)
+                "could not allocate %" APR_SIZE_T_FMT " bytes of shared "
+                "memory for %s", size, cache_segment_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    apr_pool_cleanup_register(pconf, NULL, cache_segment_cleanup,
+            apr_pool_cleanup_null);
+
+    base = apr_shm_baseaddr_get(segment_shm);
+    segment_header = (cache_segment_header_t *)base;
+    segment_slots = (cache_segment_slot_t *)(base + slots_offset);
+    segment_buckets = (apr_uint32_t *)(base + buckets_offset);
+    segment_entries = (cache_segment_entry_t *)(base + entries_offset);
+
+    memset(base, 0, entries_offset);
+    memset(segment_buckets, 0xff, nbuckets * sizeof(apr_uint32_t));
+    segment_header->size = conf->segment_size;
+    segment_header->nslots = conf->segments;
+    segment_header->nbuckets = nbuckets;
+    segment_header->nentries = (apr_uint32_t)nentries;
+    segment_header->next_generation = 1;
+    for (i = 0; i < segment_header->nentries; i++) {
+        segment_entries[i].next = i + 1 < segment_header->nentries
+                                  ? i + 1 : CACHE_SEGMENT_NIL;
+    }
+    segment_header->free = 0;
+
+    rv = ap_global_mutex_create(&segment_mutex, NULL, cache_segment_id, NULL,
+                                s, pconf, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10601)
+                "failed to create %s mutex", cache_segment_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+
+    cache_segment_load(ptmp, s);
+
+    return OK;
+}
+
+static void cache_segment_child_init(apr_pool_t *p, server_rec *s)
+{
+    const char *lock;
+    apr_status_t rv;
+
+    if (!segment_header) {
+        return; /* don't waste the overhead of creating mutex */
+    }
+    lock = apr_global_mutex_lockfile(segment_mutex);
+    rv = apr_global_mutex_child_init(&segment_mutex, lock, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10602)
+                "failed to initialise mutex in child_init");
+    }
+}
+
+static const cache_provider cache_segment_provider =
+{
+    &remove_entity, &store_headers, &store_body, &recall_headers, &recall_body,
+    &create_entity, &open_entity, &remove_url, &commit_entity,
+    &invalidate_entity
+};
+
+void cache_disk_segment_register_hook(apr_pool_t *p)
+{
+    ap_register_provider(p, CACHE_PROVIDER_GROUP, "segment", "0",
+            &cache_segment_provider);
+    ap_hook_pre_config(cache_segment_precfg, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(cache_segment_post_config, NULL, NULL,
+                        APR_HOOK_MIDDLE);
+    ap_hook_child_init(cache_segment_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+}
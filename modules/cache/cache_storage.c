@@ -58,6 +58,106 @@ int cache_remove_url(cache_request_rec *cache, request_rec *r)
 }
 
 
+/*
+ * The index of a provider in the list, i.e. its tier
+ */
+static int cache_tier_of(cache_request_rec *cache, cache_provider_list *list)
+{
+    cache_provider_list *l;
+    int tier = 0;
+
+    for (l = cache->providers; l && l != list; l = l->next) {
+        tier++;
+    }
+    return tier;
+}
+
+/*
+ * Copy an entity found in a lower tier to the first tier.
+ *
+ * The entity is opened again from the lower tier, so that the body of the
+ * handle being served is left untouched.
+ */
+static void cache_tier_promote(cache_request_rec *cache, request_rec *r,
+                               cache_handle_t *h, cache_provider_list *from)
+{
+    const cache_provider *to = cache->providers->provider;
+    cache_handle_t *src, *dst;
+    apr_bucket_brigade *bb, *out;
+    const char *cl;
+    apr_off_t len = -1;
+    apr_status_t rv;
+
+    if (r->header_only) {
+        return;
+    }
+
+    /* Let the first tier decline early, e.g. if the entity is too large */
+    cl = apr_table_get(h->resp_hdrs, "Content-Length");
+    if (cl && !ap_parse_strict_length(&len, cl)) {
+        len = -1;
+    }
+    dst = apr_pcalloc(r->pool, sizeof(cache_handle_t));
+    if (to->create_entity(dst, r, cache->key, len, NULL) != OK) {
+        return;
+    }
+
+    src = apr_pcalloc(r->pool, sizeof(cache_handle_t));
+    if (from->provider->open_entity(src, r, cache->key) != OK) {
+        to->remove_entity(dst);
+        return;
+    }
+    if (from->provider->recall_headers(src, r) != APR_SUCCESS) {
+        from->provider->remove_entity(src);
+        to->remove_entity(dst);
+        return;
+    }
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+
+    rv = to->store_headers(dst, r, &src->cache_obj->info);
+    if (rv == APR_SUCCESS) {
+        from->provider->recall_body(src, r->pool, bb);
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+        while (rv == APR_SUCCESS && !APR_BRIGADE_EMPTY(bb)) {
+            rv = to->store_body(dst, r, bb, out);
+            apr_brigade_cleanup(out);
+        }
+        apr_brigade_cleanup(bb);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = to->commit_entity(dst, r);
+    }
+    from->provider->remove_entity(src);
+
+    if (rv == APR_SUCCESS) {
+        cache_tier_count(-1);
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10561)
+                "cache: promoted %s from %s to %s (estimated frequency %u)",
+                cache->key, from->provider_name,
+                cache->providers->provider_name, cache->tier_freq);
+    }
+    else {
+        to->remove_entity(dst);
+    }
+}
+
+/*
+ * Remove the stale entity of the first tier, replaced by one in a lower
+ * tier, otherwise the first tier would keep hiding it.
+ */
+static void cache_tier_remove_stale(cache_request_rec *cache, request_rec *r)
+{
+    const cache_provider *first = cache->providers->provider;
+    cache_handle_t *h = apr_pcalloc(r->pool, sizeof(cache_handle_t));
+
+    if (first->open_entity(h, r, cache->key) == OK) {
+        first->remove_url(h, r);
+        first->remove_entity(h);
+    }
+}
+
 /*
  * create a new URL entity in the cache
  *
@@ -74,6 +174,7 @@ int cache_create_entity(cache_request_rec *cache, request_rec *r,
 {
     cache_provider_list *list;
     cache_handle_t *h = apr_pcalloc(r->pool, sizeof(cache_handle_t));
+    cache_server_conf *conf;
     apr_status_t rv;
 
     if (!cache) {
@@ -91,11 +192,28 @@ int cache_create_entity(cache_request_rec *cache, request_rec *r,
         }
     }
 
+    conf = ap_get_module_config(r->server->module_config, &cache_module);
+
     list = cache->providers;
+
+    /* In tiered mode, new entities go to the lower tiers, they get to the
+     * first tier by being promoted once requested often enough. Unless
+     * they are frequent already, or replace an entity of the first tier.
+     */
+    if (conf->tiered && list->next
+            && cache->tier_freq < conf->tier_admission
+            && cache->stale_provider != list->provider) {
+        list = list->next;
+    }
+
     /* for each specified cache type, delete the URL */
     while (list) {
         switch (rv = list->provider->create_entity(h, r, cache->key, size, in)) {
         case OK: {
+            if (conf->tiered && list != cache->providers
+                    && cache->stale_provider == cache->providers->provider) {
+                cache_tier_remove_stale(cache, r);
+            }
             cache->handle = h;
             cache->provider = list->provider;
             cache->provider_name = list->provider_name;
@@ -214,6 +332,7 @@ void cache_accept_headers(cache_handle_t *h, request_rec *r, apr_table_t *top,
 int cache_select(cache_request_rec *cache, request_rec *r)
 {
     cache_provider_list *list;
+    cache_server_conf *conf;
     apr_status_t rv;
     cache_handle_t *h;
 
@@ -239,6 +358,11 @@ int cache_select(cache_request_rec *cache, request_rec *r)
         }
     }
 
+    conf = ap_get_module_config(r->server->module_config, &cache_module);
+    if (conf->tiered && !cache->tier_freq) {
+        cache->tier_freq = cache_tier_touch(cache->key);
+    }
+
     /* go through the cache types till we get a match */
     h = apr_palloc(r->pool, sizeof(cache_handle_t));
 
@@ -287,8 +411,10 @@ int cache_select(cache_request_rec *cache, request_rec *r)
                  * is this header in the request and the header in the cached
                  * request identical? If not, we give up and do a straight get
                  */
-                h1 = cache_table_getm(r->pool, r->headers_in, vary);
-                h2 = cache_table_getm(r->pool, h->req_hdrs, vary);
+                h1 = ap_cache_vary_value(r, vary,
+                        cache_table_getm(r->pool, r->headers_in, vary));
+                h2 = ap_cache_vary_value(r, vary,
+                        cache_table_getm(r->pool, h->req_hdrs, vary));
                 if (h1 == h2) {
                     /* both headers NULL, so a match - do nothing */
                 }
@@ -311,6 +437,17 @@ int cache_select(cache_request_rec *cache, request_rec *r)
                 continue;
             }
 
+            /* purged by one of its tags (CacheTagHeader), remove it lazily */
+            if (cache_tag_purged(conf, r, h->resp_hdrs,
+                                 h->cache_obj->info.request_time)) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                        APLOGNO(10617) "cache_select(): entity of %s purged "
+                        "by tag, removing", cache->key);
+                list->provider->remove_url(h, r);
+                list = list->next;
+                continue;
+            }
+
             cache->provider = list->provider;
             cache->provider_name = list->provider_name;
 
@@ -350,6 +487,7 @@ int cache_select(cache_request_rec *cache, request_rec *r)
                 cache->stale_headers = apr_table_copy(r->pool,
                         r->headers_in);
                 cache->stale_handle = h;
+                cache->stale_provider = list->provider;
 
                 /* if no existing conditionals, use conditionals of our own */
                 if (!mismatch) {
@@ -400,6 +538,15 @@ int cache_select(cache_request_rec *cache, request_rec *r)
             /* Okay, this response looks okay.  Merge in our stuff and go. */
             cache_accept_headers(h, r, h->resp_hdrs, r->headers_out, 0);
 
+            if (conf->tiered) {
+                int tier = cache_tier_of(cache, list);
+
+                cache_tier_count(tier);
+                if (tier > 0 && cache->tier_freq >= conf->tier_admission) {
+                    cache_tier_promote(cache, r, h, list);
+                }
+            }
+
             cache->handle = h;
             return OK;
         }
@@ -19,6 +19,14 @@
 #include "cache_util.h"
 #include <ap_provider.h>
 
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_mutex.h"
+
+#include "mod_status.h"
+
 #include "test_char.h"
 
 APLOG_USE_MODULE(cache);
@@ -377,6 +385,175 @@ apr_status_t cache_try_lock(cache_server_conf *conf, cache_request_rec *cache,
 
 }
 
+/*
+ * The requests waiting for a cache lock, woken up when a lock of their
+ * process is removed. The lock of another process is only noticed when
+ * polled.
+ */
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *lock_wait_mutex = NULL;
+static apr_thread_cond_t *lock_wait_cond = NULL;
+static apr_uint32_t lock_wait_removed = 0;
+
+static apr_status_t cache_lock_wait_cleanup(void *dummy)
+{
+    lock_wait_mutex = NULL;
+    lock_wait_cond = NULL;
+    return APR_SUCCESS;
+}
+#endif
+
+apr_status_t cache_lock_wait_init(apr_pool_t *p)
+{
+#if APR_HAS_THREADS
+    apr_status_t rv;
+
+    /* not to be used once the pool is gone, e.g. on restart */
+    apr_pool_cleanup_register(p, NULL, cache_lock_wait_cleanup,
+                              apr_pool_cleanup_null);
+    rv = apr_thread_mutex_create(&lock_wait_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                 p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&lock_wait_cond, p);
+    }
+    if (rv != APR_SUCCESS) {
+        lock_wait_cond = NULL;
+    }
+    return rv;
+#else
+    return APR_SUCCESS;
+#endif
+}
+
+/* Sleep for the interval, or until a lock is removed by this process
+ * since *removed was seen */
+static void cache_lock_sleep(apr_interval_time_t interval,
+                             apr_uint32_t *removed)
+{
+#if APR_HAS_THREADS
+    if (lock_wait_cond) {
+        apr_thread_mutex_lock(lock_wait_mutex);
+        if (lock_wait_removed == *removed) {
+            apr_thread_cond_timedwait(lock_wait_cond, lock_wait_mutex,
+                                      interval);
+        }
+        *removed = lock_wait_removed;
+        apr_thread_mutex_unlock(lock_wait_mutex);
+        return;
+    }
+#endif
+    apr_sleep(interval);
+}
+
+static apr_uint32_t cache_lock_removed(void)
+{
+    apr_uint32_t removed = 0;
+
+#if APR_HAS_THREADS
+    if (lock_wait_cond) {
+        apr_thread_mutex_lock(lock_wait_mutex);
+        removed = lock_wait_removed;
+        apr_thread_mutex_unlock(lock_wait_mutex);
+    }
+#endif
+    return removed;
+}
+
+static void cache_lock_wakeup(void)
+{
+#if APR_HAS_THREADS
+    if (lock_wait_cond) {
+        apr_thread_mutex_lock(lock_wait_mutex);
+        lock_wait_removed++;
+        apr_thread_cond_broadcast(lock_wait_cond);
+        apr_thread_mutex_unlock(lock_wait_mutex);
+    }
+#endif
+}
+
+/**
+ * Wait for the cache lock held by another request.
+ *
+ * The lock is a file, possibly held by another process, so we poll for
+ * its removal, starting with a short interval since most responses are
+ * cached quickly, and backing off from there. The removal of a lock by
+ * this process wakes us up at once.
+ */
+int cache_wait_lock(cache_server_conf *conf, cache_request_rec *cache,
+        request_rec *r)
+{
+    apr_status_t status;
+    apr_interval_time_t interval = CACHE_LOCKWAIT_POLL_MIN;
+    apr_time_t now, deadline;
+    apr_finfo_t finfo;
+    apr_uint32_t removed;
+    void *dummy;
+
+    if (!conf || !conf->lock || !conf->lockpath || conf->lockwait <= 0) {
+        /* no locks or no waiting configured, leave */
+        return 0;
+    }
+
+    /* a stale entity is served while the lock is held, and no-cache is
+     * not for us to delay
+     */
+    if (cache->stale_handle
+            || (cache->control_in.no_cache && !conf->ignorecachecontrol)) {
+        return 0;
+    }
+
+    removed = cache_lock_removed();
+    status = cache_try_lock(conf, cache, r);
+    if (!APR_STATUS_IS_EEXIST(status)) {
+        /* either we obtained the lock and go to the backend ourselves, or
+         * something went wrong and we go to the backend regardless
+         */
+        return 0;
+    }
+
+    apr_pool_userdata_get(&dummy, CACHE_LOCKNAME_KEY, r->pool);
+    if (!dummy) {
+        return 0;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10673)
+            "Cache locked for url, waiting up to %" APR_TIME_T_FMT
+            "ms for the response to be cached: %s",
+            apr_time_as_msec(conf->lockwait), r->uri);
+
+    now = apr_time_now();
+    deadline = now + conf->lockwait;
+    while (now < deadline) {
+        if (interval > deadline - now) {
+            interval = deadline - now;
+        }
+        cache_lock_sleep(interval, &removed);
+
+        status = apr_stat(&finfo, (const char *)dummy, APR_FINFO_MTIME,
+                r->pool);
+        if (APR_STATUS_IS_ENOENT(status)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10674)
+                    "Cache lock released, looking up the cache again: %s",
+                    r->uri);
+            return 1;
+        }
+        else if (APR_SUCCESS != status) {
+            return 0;
+        }
+
+        interval *= 2;
+        if (interval > CACHE_LOCKWAIT_POLL_MAX) {
+            interval = CACHE_LOCKWAIT_POLL_MAX;
+        }
+        now = apr_time_now();
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10520)
+            "Cache still locked after waiting, not caching "
+            "response: %s", r->uri);
+    return 0;
+}
+
 /**
  * Remove the cache lock, if present.
  *
@@ -394,6 +571,7 @@ apr_status_t cache_remove_lock(cache_server_conf *conf,
 {
     void *dummy;
     const char *lockname;
+    apr_status_t rv;
 
     if (!conf || !conf->lock || !conf->lockpath) {
         /* no locks configured, leave */
@@ -420,7 +598,9 @@ apr_status_t cache_remove_lock(cache_server_conf *conf,
     }
     apr_pool_userdata_get(&dummy, CACHE_LOCKFILE_KEY, r->pool);
     if (dummy) {
-        return apr_file_close((apr_file_t *)dummy);
+        rv = apr_file_close((apr_file_t *)dummy);
+        cache_lock_wakeup();
+        return rv;
     }
     apr_pool_userdata_get(&dummy, CACHE_LOCKNAME_KEY, r->pool);
     lockname = (const char *)dummy;
@@ -446,12 +626,352 @@ apr_status_t cache_remove_lock(cache_server_conf *conf,
 
         lockname = apr_pstrcat(r->pool, conf->lockpath, dir, "/", lockname, NULL);
     }
-    return apr_file_remove(lockname, r->pool);
+    rv = apr_file_remove(lockname, r->pool);
+    cache_lock_wakeup();
+    return rv;
 }
 
-int ap_cache_check_no_cache(cache_request_rec *cache, request_rec *r)
+/*
+ * Tiered caching.
+ *
+ * The sketch lives in anonymous shared memory inherited by the children,
+ * and is only updated with atomic operations. Increments racing with the
+ * halving of the counters may be lost, which is fine for an estimate.
+ */
+typedef struct {
+    apr_uint32_t updates;               /* since the last halving */
+    apr_uint32_t lookups;
+    apr_uint32_t promotions;
+    apr_uint32_t hits[CACHE_TIER_MAX];
+    apr_uint32_t counters[CACHE_TIER_SKETCH_DEPTH][CACHE_TIER_SKETCH_WIDTH];
+} cache_tier_sketch_t;
+
+static apr_shm_t *tier_shm = NULL;
+static cache_tier_sketch_t *tier_sketch = NULL;
+
+static apr_status_t cache_tier_cleanup(void *dummy)
+{
+    if (tier_shm) {
+        apr_shm_destroy(tier_shm);
+        tier_shm = NULL;
+    }
+    tier_sketch = NULL;
+    return APR_SUCCESS;
+}
+
+apr_status_t cache_tier_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+
+    rv = apr_shm_create(&tier_shm, sizeof(cache_tier_sketch_t), NULL, p);
+    if (rv != APR_SUCCESS) {
+        tier_shm = NULL;
+        return rv;
+    }
+    apr_pool_cleanup_register(p, NULL, cache_tier_cleanup,
+                              apr_pool_cleanup_null);
+
+    tier_sketch = apr_shm_baseaddr_get(tier_shm);
+    memset(tier_sketch, 0, sizeof(*tier_sketch));
+
+    return APR_SUCCESS;
+}
+
+apr_uint32_t cache_tier_touch(const char *key)
 {
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    const unsigned char *c;
+    apr_uint32_t h1, h2, i, j, n, min = APR_UINT32_MAX;
+
+    if (!tier_sketch) {
+        return 0;
+    }
+
+    /* Double hashing, with FNV-1a (made odd) as the second hash */
+    h1 = apr_hashfunc_default(key, &len);
+    h2 = 2166136261U;
+    for (c = (const unsigned char *)key; *c; c++) {
+        h2 ^= *c;
+        h2 *= 16777619U;
+    }
+    h2 |= 1;
+
+    for (i = 0; i < CACHE_TIER_SKETCH_DEPTH; i++) {
+        n = apr_atomic_inc32(&tier_sketch->counters[i]
+                             [(h1 + i * h2) % CACHE_TIER_SKETCH_WIDTH]) + 1;
+        if (n < min) {
+            min = n;
+        }
+    }
+    apr_atomic_inc32(&tier_sketch->lookups);
+
+    /* Age the sketch */
+    if ((apr_atomic_inc32(&tier_sketch->updates) + 1)
+            % CACHE_TIER_SKETCH_SAMPLE == 0) {
+        for (i = 0; i < CACHE_TIER_SKETCH_DEPTH; i++) {
+            for (j = 0; j < CACHE_TIER_SKETCH_WIDTH; j++) {
+                apr_uint32_t *counter = &tier_sketch->counters[i][j];
+                apr_atomic_set32(counter, apr_atomic_read32(counter) >> 1);
+            }
+        }
+    }
+
+    return min;
+}
+
+void cache_tier_count(int tier)
+{
+    if (!tier_sketch) {
+        return;
+    }
+    if (tier < 0) {
+        apr_atomic_inc32(&tier_sketch->promotions);
+    }
+    else if (tier < CACHE_TIER_MAX) {
+        apr_atomic_inc32(&tier_sketch->hits[tier]);
+    }
+}
 
+int cache_tier_status(request_rec *r, int flags)
+{
+    apr_uint32_t lookups;
+    int i;
+
+    if (!tier_sketch) {
+        return DECLINED;
+    }
+
+    lookups = apr_atomic_read32(&tier_sketch->lookups);
+    if (!(flags & AP_STATUS_SHORT)) {
+        ap_rputs("<hr>\n<h2>mod_cache tiers</h2>\n<dl>", r);
+        ap_rprintf(r, "<dt>Lookups: %u, promotions to tier 1: %u</dt>\n",
+                   lookups, apr_atomic_read32(&tier_sketch->promotions));
+        for (i = 0; i < CACHE_TIER_MAX; i++) {
+            apr_uint32_t hits = apr_atomic_read32(&tier_sketch->hits[i]);
+            ap_rprintf(r, "<dt>Tier %d hits: %u (%.1f%%)</dt>\n", i + 1, hits,
+                       lookups ? 100.0 * hits / lookups : 0.0);
+        }
+        ap_rputs("</dl>\n", r);
+    }
+    else {
+        ap_rprintf(r, "CacheTierLookups: %u\n", lookups);
+        ap_rprintf(r, "CacheTierPromotions: %u\n",
+                   apr_atomic_read32(&tier_sketch->promotions));
+        for (i = 0; i < CACHE_TIER_MAX; i++) {
+            ap_rprintf(r, "CacheTier%dHits: %u\n", i + 1,
+                       apr_atomic_read32(&tier_sketch->hits[i]));
+        }
+    }
+
+    return OK;
+}
+
+/*
+ * Tag purges (CacheTagHeader)
+ *
+ * The time (in seconds) of the last purge of the tags hashing to each
+ * slot, in anonymous shared memory inherited by the children, updated
+ * with atomic operations. The segment is kept in the process pool across
+ * restarts, and the times are saved to a file when the server stops, for
+ * the entities cached on disk not to come back.
+ */
+#define CACHE_TAG_SLOTS 65536
+
+typedef struct {
+    apr_uint32_t purges;
+    apr_uint32_t invalidations;
+    apr_uint32_t purged[CACHE_TAG_SLOTS];
+} cache_tag_table_t;
+
+static cache_tag_table_t *tag_table = NULL;
+
+static void cache_tag_load(const char *fname, apr_pool_t *p)
+{
+    apr_file_t *f;
+    apr_size_t len = sizeof(tag_table->purged);
+
+    if (apr_file_open(&f, fname, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                      APR_OS_DEFAULT, p) != APR_SUCCESS) {
+        return;
+    }
+    if (apr_file_read_full(f, tag_table->purged, len, &len) != APR_SUCCESS) {
+        /* truncated or from elsewhere, forget about it */
+        memset(tag_table->purged, 0, sizeof(tag_table->purged));
+    }
+    apr_file_close(f);
+}
+
+static apr_status_t cache_tag_save(void *data)
+{
+    const char *fname = data;
+    const char *tmp;
+    apr_file_t *f;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if (!tag_table || apr_pool_create(&p, NULL) != APR_SUCCESS) {
+        return APR_SUCCESS;
+    }
+    tmp = apr_pstrcat(p, fname, ".tmp", NULL);
+    rv = apr_file_open(&f, tmp, APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                       | APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+                       APR_FPROT_UREAD | APR_FPROT_UWRITE, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(f, tag_table->purged,
+                                 sizeof(tag_table->purged), NULL);
+        apr_file_close(f);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_rename(tmp, fname, p);
+        }
+        if (rv != APR_SUCCESS) {
+            apr_file_remove(tmp, p);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, NULL, APLOGNO(10660)
+                     "cache: could not save the purges of CacheTagHeader "
+                     "to %s", fname);
+    }
+    apr_pool_destroy(p);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t cache_tag_init(apr_pool_t *p, server_rec *s)
+{
+    apr_shm_t *shm = NULL;
+    const char *fname;
+    apr_status_t rv;
+
+    /* a DSO is reloaded on restart, the segment is found in the pool */
+    apr_pool_userdata_get((void **)&shm, CACHE_TAG_SHM_KEY, p);
+    if (shm) {
+        tag_table = apr_shm_baseaddr_get(shm);
+        return APR_SUCCESS;
+    }
+
+    rv = apr_shm_create(&shm, sizeof(cache_tag_table_t), NULL, p);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    apr_pool_userdata_set(shm, CACHE_TAG_SHM_KEY, apr_pool_cleanup_null, p);
+
+    tag_table = apr_shm_baseaddr_get(shm);
+    memset(tag_table, 0, sizeof(*tag_table));
+
+    fname = ap_runtime_dir_relative(p, DEFAULT_CACHE_TAGPATH);
+    if (fname) {
+        cache_tag_load(fname, p);
+        apr_pool_cleanup_register(p, fname, cache_tag_save,
+                                  apr_pool_cleanup_null);
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_uint32_t *cache_tag_slot(const char *tag)
+{
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+
+    return &tag_table->purged[apr_hashfunc_default(tag, &len)
+                              % CACHE_TAG_SLOTS];
+}
+
+/* Call fn on each tag of the CacheTagHeader headers of the table, until
+ * it returns non-zero; returns the number of calls */
+static int cache_tag_do(cache_server_conf *conf, request_rec *r,
+                        apr_table_t *hdrs,
+                        int (*fn)(const char *tag, void *baton), void *baton)
+{
+    int i, n = 0;
+
+    for (i = 0; i < conf->tag_headers->nelts; i++) {
+        const char *name = APR_ARRAY_IDX(conf->tag_headers, i, const char *);
+        const char *value = cache_table_getm(r->pool, hdrs, name);
+        char *tags, *tag, *last;
+
+        if (!value) {
+            continue;
+        }
+        tags = apr_pstrdup(r->pool, value);
+        for (tag = apr_strtok(tags, " ,\t", &last); tag;
+             tag = apr_strtok(NULL, " ,\t", &last)) {
+            n++;
+            if (fn(tag, baton)) {
+                return n;
+            }
+        }
+    }
+
+    return n;
+}
+
+struct cache_tag_check_t {
+    apr_uint32_t since;
+    int purged;
+};
+
+static int cache_tag_check(const char *tag, void *baton)
+{
+    struct cache_tag_check_t *check = baton;
+    apr_uint32_t purged = apr_atomic_read32(cache_tag_slot(tag));
+
+    check->purged = (purged && purged >= check->since);
+    return check->purged;
+}
+
+int cache_tag_purged(cache_server_conf *conf, request_rec *r,
+                     apr_table_t *hdrs, apr_time_t request_time)
+{
+    struct cache_tag_check_t check;
+
+    if (!tag_table || !conf->tag_headers || !conf->tag_headers->nelts) {
+        return 0;
+    }
+
+    check.since = (apr_uint32_t)apr_time_sec(request_time);
+    check.purged = 0;
+    cache_tag_do(conf, r, hdrs, cache_tag_check, &check);
+    if (check.purged) {
+        apr_atomic_inc32(&tag_table->invalidations);
+    }
+
+    return check.purged;
+}
+
+static int cache_tag_set(const char *tag, void *baton)
+{
+    apr_uint32_t *slot = cache_tag_slot(tag);
+    apr_uint32_t now = *(apr_uint32_t *)baton, purged;
+
+    /* never go back in time */
+    do {
+        purged = apr_atomic_read32(slot);
+        if (purged >= now) {
+            break;
+        }
+    } while (apr_atomic_cas32(slot, now, purged) != purged);
+
+    return 0;
+}
+
+int cache_tag_purge(cache_server_conf *conf, request_rec *r)
+{
+    apr_uint32_t now = (apr_uint32_t)apr_time_sec(apr_time_now());
+    int n;
+
+    if (!tag_table || !conf->tag_headers) {
+        return 0;
+    }
+
+    n = cache_tag_do(conf, r, r->headers_in, cache_tag_set, &now);
+    apr_atomic_add32(&tag_table->purges, n);
+
+    return n;
+}
+
+int ap_cache_check_no_cache(cache_request_rec *cache, request_rec *r)
+{
     cache_server_conf *conf =
       (cache_server_conf *)ap_get_module_config(r->server->module_config,
                                                 &cache_module);
@@ -532,12 +1052,54 @@ int ap_cache_check_no_store(cache_request_rec *cache, request_rec *r)
     return 1;
 }
 
+/*
+ * RFC5861 stale-while-revalidate of the cached response, or -1. This is not
+ * part of the (stored) cache_control_t, so it is parsed from the headers.
+ */
+static apr_int64_t cache_stale_while_revalidate(cache_handle_t *h,
+        request_rec *r)
+{
+    const char *cc_header;
+    char *header, *token, *arg, *last, *endp;
+    apr_status_t rv;
+    apr_off_t offt;
+
+    cc_header = cache_table_getm(r->pool, h->resp_hdrs, "Cache-Control");
+    if (!cc_header) {
+        return -1;
+    }
+
+    header = apr_pstrdup(r->pool, cc_header);
+    for (rv = cache_strqtok(header, &token, &arg, &last);
+         rv == APR_SUCCESS;
+         rv = cache_strqtok(NULL, &token, &arg, &last)) {
+        if (arg && !ap_cstr_casecmp(token, "stale-while-revalidate")) {
+            if (!apr_strtoff(&offt, arg, &endp, 10)
+                    && endp > arg && !*endp) {
+                return offt;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Whether this is the subrequest revalidating an entity in the background,
+ * which must go to the backend whatever the freshness of the entity.
+ */
+static int cache_is_revalidation(request_rec *r)
+{
+    return r->main
+            && apr_table_get(r->main->notes, CACHE_REVALIDATE_NOTE) != NULL;
+}
+
 int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
         request_rec *r)
 {
     apr_status_t status;
     apr_int64_t age, maxage_req, maxage_cresp, maxage, smaxage, maxstale;
-    apr_int64_t minfresh;
+    apr_int64_t minfresh, lifetime, swr;
     const char *cc_req;
     const char *pragma;
     const char *agestr = NULL;
@@ -547,6 +1109,10 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
     cache_server_conf *conf =
       (cache_server_conf *)ap_get_module_config(r->server->module_config,
                                                 &cache_module);
+    cache_dir_conf *dconf =
+      (cache_dir_conf *)ap_get_module_config(r->per_dir_config,
+                                             &cache_module);
+    int revalidation = cache_is_revalidation(r);
 
     /*
      * We now want to check if our cached data is still fresh. This depends
@@ -694,11 +1260,23 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
         maxstale = 0;
     }
 
-    /* handle expiration */
-    if (((maxage != -1) && (age < (maxage + maxstale - minfresh))) ||
-        ((smaxage == -1) && (maxage == -1) &&
-         (info->expire != APR_DATE_BAD) &&
-         (age < (apr_time_sec(info->expire - info->date) + maxstale - minfresh)))) {
+    /* the freshness lifetime, with the precedence of the check below */
+    if (maxage != -1) {
+        lifetime = maxage;
+    }
+    else if (smaxage == -1 && info->expire != APR_DATE_BAD) {
+        lifetime = apr_time_sec(info->expire - info->date);
+    }
+    else {
+        lifetime = -1;
+    }
+
+    /* handle expiration, unless we are the revalidation itself */
+    if (!revalidation &&
+        (((maxage != -1) && (age < (maxage + maxstale - minfresh))) ||
+         ((smaxage == -1) && (maxage == -1) &&
+          (info->expire != APR_DATE_BAD) &&
+          (age < (apr_time_sec(info->expire - info->date) + maxstale - minfresh))))) {
 
         warn_head = apr_table_get(h->resp_hdrs, "Warning");
 
@@ -737,9 +1315,64 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
                                  "113 Heuristic expiration");
             }
         }
+
+        /*
+         * A hit on an entity close to expiry refreshes it in the background,
+         * so that hot entities never go stale. The lock ensures that only
+         * one request does it.
+         */
+        if (dconf->refresh_ahead && conf->lock && !r->main && lifetime > 0
+                && age * 100 >= lifetime * dconf->refresh_ahead
+                && cache_try_lock(conf, cache, r) == APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10521)
+                    "Cached URL close to expiry (age %" APR_INT64_T_FMT
+                    " of %" APR_INT64_T_FMT "s), refreshing it in the "
+                    "background: %s", age, lifetime, r->unparsed_uri);
+            cache->revalidate = 1;
+        }
+
         return 1;    /* Cache object is fresh (enough) */
     }
 
+    /*
+     * RFC5861 stale-while-revalidate: within the given time after it went
+     * stale, the entity is served stale, and the request which obtains the
+     * lock revalidates it in the background once it has responded. Without
+     * the lock every request would revalidate, so the entity then takes
+     * the usual stale path.
+     */
+    if (dconf->stale_while_revalidate && conf->lock && !r->main
+            && lifetime >= 0
+            && !h->cache_obj->info.control.must_revalidate
+            && !h->cache_obj->info.control.proxy_revalidate
+            && (swr = cache_stale_while_revalidate(h, r)) > 0
+            && age < lifetime + swr) {
+
+        status = cache_try_lock(conf, cache, r);
+        if (APR_SUCCESS == status || APR_STATUS_IS_EEXIST(status)) {
+            if (APR_SUCCESS == status) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10522)
+                        "Stale cached URL within stale-while-revalidate, "
+                        "serving it and revalidating in the background: %s",
+                        r->unparsed_uri);
+                cache->revalidate = 1;
+            }
+
+            apr_table_set(h->resp_hdrs, "Age",
+                          apr_psprintf(r->pool, "%lu", (unsigned long)age));
+
+            /* make sure we don't stomp on a previous warning */
+            warn_head = apr_table_get(h->resp_hdrs, "Warning");
+            if ((warn_head == NULL) ||
+                    (ap_strstr_c(warn_head, "110") == NULL)) {
+                apr_table_mergen(h->resp_hdrs, "Warning",
+                                 "110 Response is stale");
+            }
+
+            return 1;
+        }
+    }
+
     /*
      * At this point we are stale, but: if we are under load, we may let
      * a significant number of stale requests through before the first
@@ -835,6 +1468,76 @@ CACHE_DECLARE(const char *)ap_cache_tokstr(apr_pool_t *p, const char *list,
         return NULL;
 }
 
+/* Whether a list with quality values, like Accept-Encoding, accepts the
+ * token, explicitly or with a wildcard */
+static int cache_vary_accepts(apr_pool_t *p, const char *value,
+                              const char *token)
+{
+    const char *item;
+    int star = 0;
+
+    while ((item = ap_get_list_item(p, &value)) != NULL) {
+        const char *params = ap_strchr_c(item, ';');
+        apr_size_t len = params ? params - item : strlen(item);
+        int accepted = 1;
+
+        while (len && apr_isspace(item[len - 1])) {
+            len--;
+        }
+        for (; params; params = ap_strchr_c(params + 1, ';')) {
+            const char *q = params + 1;
+
+            while (apr_isspace(*q)) {
+                q++;
+            }
+            if ((*q == 'q' || *q == 'Q') && q[1] == '=') {
+                accepted = (atof(q + 2) > 0);
+                break;
+            }
+        }
+
+        if (len == 1 && *item == '*') {
+            star = accepted;
+        }
+        else if (len == strlen(token) && !ap_cstr_casecmpn(item, token, len)) {
+            return accepted;
+        }
+    }
+
+    return star;
+}
+
+CACHE_DECLARE(const char *)ap_cache_vary_value(request_rec *r,
+                                               const char *header,
+                                               const char *value)
+{
+    cache_server_conf *conf;
+    cache_vary_buckets_t *buckets;
+    int i, j;
+
+    if (!value) {
+        return NULL;
+    }
+
+    conf = ap_get_module_config(r->server->module_config, &cache_module);
+    for (i = 0; i < conf->vary_buckets->nelts; i++) {
+        buckets = &APR_ARRAY_IDX(conf->vary_buckets, i, cache_vary_buckets_t);
+        if (ap_cstr_casecmp(buckets->header, header)) {
+            continue;
+        }
+        for (j = 0; j < buckets->tokens->nelts; j++) {
+            const char *token = APR_ARRAY_IDX(buckets->tokens, j,
+                                              const char *);
+            if (cache_vary_accepts(r->pool, value, token)) {
+                return token;
+            }
+        }
+        break;
+    }
+
+    return value;
+}
+
 /*
  * Converts apr_time_t expressed as hex digits to
  * a true apr_time_t.
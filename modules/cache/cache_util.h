@@ -98,7 +98,19 @@ extern "C" {
 #define DEFAULT_CACHE_LOCKPATH "mod_cache-lock"
 #define CACHE_LOCKNAME_KEY "mod_cache-lockname"
 #define CACHE_LOCKFILE_KEY "mod_cache-lockfile"
+#define DEFAULT_CACHE_TAGPATH "mod_cache-tags"
+#define CACHE_TAG_SHM_KEY "mod_cache-tag-shm"
+/* Polling of a held lock by CacheLockWait, doubling from min to max */
+#define CACHE_LOCKWAIT_POLL_MIN apr_time_from_msec(5)
+#define CACHE_LOCKWAIT_POLL_MAX apr_time_from_msec(100)
 #define CACHE_CTX_KEY "mod_cache-ctx"
+#define CACHE_REVALIDATE_NOTE "mod_cache-revalidate"
+/* Tiered caching: request frequencies sketch (count-min) and counters */
+#define CACHE_TIER_MAX 4
+#define CACHE_TIER_SKETCH_DEPTH 4
+#define CACHE_TIER_SKETCH_WIDTH 16384
+#define CACHE_TIER_SKETCH_SAMPLE (10 * CACHE_TIER_SKETCH_WIDTH)
+#define DEFAULT_CACHE_TIER_ADMISSION 2
 
 /**
  * cache_util.c
@@ -123,8 +135,16 @@ typedef struct {
     apr_array_header_t *ignore_headers;
     /** store the identifiers that should not be used for key calculation */
     apr_array_header_t *ignore_session_id;
+    /** the response headers tagging the entities for purges */
+    apr_array_header_t *tag_headers;
+    /** the buckets of the values of the varying request headers */
+    apr_array_header_t *vary_buckets;
     const char *lockpath;
     apr_time_t lockmaxage;
+    /* how long a miss waits for the request holding the lock */
+    apr_interval_time_t lockwait;
+    /* estimated request frequency to get into the first tier */
+    apr_uint32_t tier_admission;
     apr_uri_t *base_uri;
     /** ignore client's requests for uncached responses */
     unsigned int ignorecachecontrol:1;
@@ -136,6 +156,8 @@ typedef struct {
     unsigned int lock:1;
     unsigned int x_cache:1;
     unsigned int x_cache_detail:1;
+    /* first provider as a memory tier in front of the next ones */
+    unsigned int tiered:1;
     /* flag if CacheIgnoreHeader has been set */
     #define CACHE_IGNORE_HEADERS_SET   1
     #define CACHE_IGNORE_HEADERS_UNSET 0
@@ -151,10 +173,21 @@ typedef struct {
     unsigned int lock_set:1;
     unsigned int lockpath_set:1;
     unsigned int lockmaxage_set:1;
+    unsigned int lockwait_set:1;
     unsigned int x_cache_set:1;
     unsigned int x_cache_detail_set:1;
+    unsigned int tiered_set:1;
+    unsigned int tier_admission_set:1;
+    unsigned int tag_headers_set:1;
+    unsigned int vary_buckets_set:1;
 } cache_server_conf;
 
+/* The buckets of the values of a varying request header (CacheVaryBuckets) */
+typedef struct {
+    const char *header;
+    apr_array_header_t *tokens;
+} cache_vary_buckets_t;
+
 typedef struct {
     /* Minimum time to keep cached files in msecs */
     apr_time_t minex;
@@ -164,6 +197,8 @@ typedef struct {
     apr_time_t defex;
     /* factor for estimating expires date */
     double factor;
+    /* percentage of the lifetime after which a hit refreshes the entity */
+    int refresh_ahead;
     /* cache enabled for this location */
     apr_array_header_t *cacheenable;
     /* cache disabled for this location */
@@ -173,6 +208,8 @@ typedef struct {
     unsigned int x_cache_detail:1;
     /* serve stale on error */
     unsigned int stale_on_error:1;
+    /* serve stale while revalidating in the background */
+    unsigned int stale_while_revalidate:1;
     /** ignore the last-modified header when deciding to cache this request */
     unsigned int no_last_mod_ignore:1;
     /** ignore expiration date from server */
@@ -188,6 +225,8 @@ typedef struct {
     unsigned int x_cache_set:1;
     unsigned int x_cache_detail_set:1;
     unsigned int stale_on_error_set:1;
+    unsigned int stale_while_revalidate_set:1;
+    unsigned int refresh_ahead_set:1;
     unsigned int no_last_mod_ignore_set:1;
     unsigned int store_expired_set:1;
     unsigned int store_private_set:1;
@@ -229,6 +268,9 @@ typedef struct {
     apr_off_t size;                     /* the content length from the headers, or -1 */
     apr_bucket_brigade *out;            /* brigade to reuse for upstream responses */
     cache_control_t control_in;         /* cache control incoming */
+    int revalidate;                     /* revalidate once served */
+    apr_uint32_t tier_freq;             /* estimated request frequency */
+    const cache_provider *stale_provider; /* provider of stale_handle */
 } cache_request_rec;
 
 /**
@@ -283,6 +325,83 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
 apr_status_t cache_try_lock(cache_server_conf *conf, cache_request_rec *cache,
         request_rec *r);
 
+/**
+ * Wait for the cache lock held by another request, if CacheLockWait is set.
+ *
+ * This is used when nothing (not even a stale entity) is cached for the
+ * request, so that the concurrent misses of a same URL do not all go to the
+ * backend: the first one obtains the lock (and keeps it, see
+ * cache_try_lock()), the next ones poll the lock until it is removed, i.e.
+ * when the first request has cached (or failed to cache) the response, or
+ * until CacheLockWait is elapsed.
+ *
+ * If we return 1, the lock was released while we waited and the cache
+ * should be looked up again. If we return 0, proceed as without waiting.
+ */
+int cache_wait_lock(cache_server_conf *conf, cache_request_rec *cache,
+        request_rec *r);
+
+/**
+ * Create what wakes up the requests waiting for a cache lock when it is
+ * removed by their process.
+ */
+apr_status_t cache_lock_wait_init(apr_pool_t *p);
+
+/**
+ * Create the shared memory used by tiered caching (CacheTiered).
+ */
+apr_status_t cache_tier_init(apr_pool_t *p, server_rec *s);
+
+/**
+ * Account for a lookup of the given key, and estimate how often it
+ * has been requested recently.
+ *
+ * The estimate is given by a count-min sketch shared by all the children,
+ * whose counters are halved every CACHE_TIER_SKETCH_SAMPLE lookups so that
+ * it follows the recent popularity (as in TinyLFU).
+ * @return the estimated frequency, or 0 if tiered caching is not enabled
+ */
+apr_uint32_t cache_tier_touch(const char *key);
+
+/**
+ * Account for a hit in the given tier (provider index), or for the
+ * promotion of an entity to the first tier if tier is negative.
+ */
+void cache_tier_count(int tier);
+
+/**
+ * mod_status hook showing the hit ratios of the tiers.
+ */
+int cache_tier_status(request_rec *r, int flags);
+
+/**
+ * Create the shared memory keeping the time of the purges of the tags
+ * (CacheTagHeader). It is allocated from the given pool once, so that
+ * it survives restarts, and saved to DEFAULT_CACHE_TAGPATH in the runtime
+ * directory when the pool is destroyed, to be loaded on the next start.
+ */
+apr_status_t cache_tag_init(apr_pool_t *p, server_rec *s);
+
+/**
+ * Whether an entity was purged by one of its tags, i.e. whether one of
+ * the tags found in the CacheTagHeader headers of the response was purged
+ * after the entity was requested.
+ *
+ * Purges are lazy: the tags hash into a table of the last time they were
+ * purged, shared by all the children, and the entities are only removed
+ * when they are looked up. Colliding tags share their purges, which can
+ * only cause spurious misses.
+ * @return 1 if the entity was purged, 0 otherwise
+ */
+int cache_tag_purged(cache_server_conf *conf, request_rec *r,
+                     apr_table_t *hdrs, apr_time_t request_time);
+
+/**
+ * Purge the tags found in the CacheTagHeader headers of the request.
+ * @return the number of tags purged
+ */
+int cache_tag_purge(cache_server_conf *conf, request_rec *r);
+
 /**
  * Remove the cache lock, if present.
  *
@@ -19,6 +19,8 @@
 #include "cache_storage.h"
 #include "cache_util.h"
 
+#include "mod_status.h"
+
 module AP_MODULE_DECLARE_DATA cache_module;
 APR_OPTIONAL_FN_TYPE(ap_cache_generate_key) *cache_generate_key;
 
@@ -35,6 +37,7 @@ static ap_filter_rec_t *cache_out_filter_handle;
 static ap_filter_rec_t *cache_out_subreq_filter_handle;
 static ap_filter_rec_t *cache_remove_url_filter_handle;
 static ap_filter_rec_t *cache_invalidate_filter_handle;
+static ap_filter_rec_t *cache_discard_filter_handle;
 
 /**
  * Entity headers' names
@@ -52,6 +55,65 @@ static const char *MOD_CACHE_ENTITY_HEADERS[] = {
     NULL
 };
 
+/*
+ * Revalidate the entity just served by the request in the background, once
+ * the client has its response, with a subrequest going through the cache
+ * as any other miss would (hence updating it), but whose response is
+ * discarded.
+ */
+static void cache_revalidate(request_rec *r, cache_request_rec *cache,
+        cache_server_conf *conf)
+{
+    static const char *const conditionals[] = {
+        "Range", "If-Range", "If-Match", "If-None-Match",
+        "If-Modified-Since", "If-Unmodified-Since", NULL
+    };
+    apr_bucket_brigade *bb;
+    apr_table_t *headers_in;
+    ap_filter_t *discard;
+    request_rec *rr;
+    int i, rv;
+
+    /* the subrequest obtains the lock in turn */
+    cache_remove_lock(conf, cache, r, NULL);
+
+    if (r->unparsed_uri[0] != '/') {
+        /* not something we can make a subrequest for (forward proxy) */
+        return;
+    }
+
+    /* let the client have its response first */
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    ap_fflush(r->connection->output_filters, bb);
+    apr_brigade_destroy(bb);
+
+    discard = ap_add_output_filter_handle(cache_discard_filter_handle, NULL,
+            r, r->connection);
+
+    /* the client's conditionals are not ours, those of the entity will be
+     * added by the cache
+     */
+    headers_in = r->headers_in;
+    r->headers_in = apr_table_copy(r->pool, headers_in);
+    for (i = 0; conditionals[i]; ++i) {
+        apr_table_unset(r->headers_in, conditionals[i]);
+    }
+    apr_table_setn(r->notes, CACHE_REVALIDATE_NOTE, "1");
+
+    rr = ap_sub_req_lookup_uri(r->unparsed_uri, r, discard);
+    r->headers_in = headers_in;
+    if (rr->status == HTTP_OK) {
+        rv = ap_run_sub_req(rr);
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10523)
+                "cache: background revalidation of %s returned %d (%d)",
+                r->unparsed_uri, rv, rr->status);
+    }
+    ap_destroy_sub_req(rr);
+
+    apr_table_unset(r->notes, CACHE_REVALIDATE_NOTE);
+    ap_remove_output_filter(discard);
+}
+
 /*
  * CACHE handler
  * -------------
@@ -177,6 +239,10 @@ static int cache_quick_handler(request_rec *r, int lookup)
      *   return OK
      */
     rv = cache_select(cache, r);
+    if (rv == DECLINED && !lookup && cache_wait_lock(conf, cache, r)) {
+        /* someone else just fetched the response, it may be cached now */
+        rv = cache_select(cache, r);
+    }
     if (rv != OK) {
         if (rv == DECLINED) {
             if (!lookup) {
@@ -333,9 +399,14 @@ static int cache_quick_handler(request_rec *r, int lookup)
     e = apr_bucket_eos_create(out->bucket_alloc);
     APR_BRIGADE_INSERT_TAIL(out, e);
 
-    return ap_pass_brigade_fchk(r, out,
-                                "cache_quick_handler(%s): ap_pass_brigade returned",
-                                cache->provider_name);
+    rv = ap_pass_brigade_fchk(r, out,
+                              "cache_quick_handler(%s): ap_pass_brigade returned",
+                              cache->provider_name);
+    if (rv == OK && cache->revalidate) {
+        cache_revalidate(r, cache, conf);
+    }
+
+    return rv;
 }
 
 /**
@@ -477,6 +548,10 @@ static int cache_handler(request_rec *r)
      *   return OK
      */
     rv = cache_select(cache, r);
+    if (rv == DECLINED && cache_wait_lock(conf, cache, r)) {
+        /* someone else just fetched the response, it may be cached now */
+        rv = cache_select(cache, r);
+    }
     if (rv != OK) {
         if (rv == DECLINED) {
 
@@ -628,8 +703,13 @@ static int cache_handler(request_rec *r)
     out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
     e = apr_bucket_eos_create(out->bucket_alloc);
     APR_BRIGADE_INSERT_TAIL(out, e);
-    return ap_pass_brigade_fchk(r, out, "cache(%s): ap_pass_brigade returned",
-                                cache->provider_name);
+    rv = ap_pass_brigade_fchk(r, out, "cache(%s): ap_pass_brigade returned",
+                              cache->provider_name);
+    if (rv == OK && cache->revalidate) {
+        cache_revalidate(r, cache, conf);
+    }
+
+    return rv;
 }
 
 /*
@@ -1715,6 +1795,19 @@ static apr_status_t cache_invalidate_filter(ap_filter_t *f,
     return ap_pass_brigade(f->next, in);
 }
 
+/*
+ * CACHE_DISCARD filter
+ * --------------------
+ *
+ * Swallow the response of the background revalidation.
+ */
+static apr_status_t cache_discard_filter(ap_filter_t *f,
+        apr_bucket_brigade *in)
+{
+    apr_brigade_cleanup(in);
+    return APR_SUCCESS;
+}
+
 /*
  * CACHE filter
  * ------------
@@ -1996,6 +2089,15 @@ static void *merge_dir_config(apr_pool_t *p, void *basev, void *addv) {
     new->stale_on_error_set = add->stale_on_error_set
             || base->stale_on_error_set;
 
+    new->stale_while_revalidate = (add->stale_while_revalidate_set == 0)
+            ? base->stale_while_revalidate : add->stale_while_revalidate;
+    new->stale_while_revalidate_set = add->stale_while_revalidate_set
+            || base->stale_while_revalidate_set;
+    new->refresh_ahead = (add->refresh_ahead_set == 0) ? base->refresh_ahead
+            : add->refresh_ahead;
+    new->refresh_ahead_set = add->refresh_ahead_set
+            || base->refresh_ahead_set;
+
     new->cacheenable = add->enable_set ? apr_array_append(p, base->cacheenable,
             add->cacheenable) : base->cacheenable;
     new->enable_set = add->enable_set || base->enable_set;
@@ -2027,10 +2129,16 @@ static void * create_cache_config(apr_pool_t *p, server_rec *s)
     /* array of identifiers that should not be used for key calculation */
     ps->ignore_session_id = apr_array_make(p, 10, sizeof(char *));
     ps->ignore_session_id_set = CACHE_IGNORE_SESSION_ID_UNSET;
+    /* array of headers tagging the entities, none by default */
+    ps->tag_headers = apr_array_make(p, 2, sizeof(char *));
+    /* buckets of the varying request headers, none by default */
+    ps->vary_buckets = apr_array_make(p, 2, sizeof(cache_vary_buckets_t));
     ps->lock = 0; /* thundering herd lock defaults to off */
     ps->lock_set = 0;
     ps->lockpath = ap_runtime_dir_relative(p, DEFAULT_CACHE_LOCKPATH);
     ps->lockmaxage = apr_time_from_sec(DEFAULT_CACHE_MAXAGE);
+    ps->lockwait = 0; /* don't wait for the lock by default */
+    ps->tier_admission = DEFAULT_CACHE_TIER_ADMISSION;
     ps->x_cache = DEFAULT_X_CACHE;
     ps->x_cache_detail = DEFAULT_X_CACHE_DETAIL;
     return ps;
@@ -2079,6 +2187,26 @@ static void * merge_cache_config(apr_pool_t *p, void *basev, void *overridesv)
         (overrides->lockmaxage_set == 0)
         ? base->lockmaxage
         : overrides->lockmaxage;
+    ps->lockwait =
+        (overrides->lockwait_set == 0)
+        ? base->lockwait
+        : overrides->lockwait;
+    ps->tiered =
+        (overrides->tiered_set == 0)
+        ? base->tiered
+        : overrides->tiered;
+    ps->tier_admission =
+        (overrides->tier_admission_set == 0)
+        ? base->tier_admission
+        : overrides->tier_admission;
+    ps->tag_headers =
+        (overrides->tag_headers_set == 0)
+        ? base->tag_headers
+        : overrides->tag_headers;
+    ps->vary_buckets =
+        (overrides->vary_buckets_set == 0)
+        ? base->vary_buckets
+        : overrides->vary_buckets;
     ps->quick =
         (overrides->quick_set == 0)
         ? base->quick
@@ -2222,6 +2350,49 @@ static const char *add_ignore_session_id(cmd_parms *parms, void *dummy,
     return NULL;
 }
 
+static const char *add_tag_header(cmd_parms *parms, void *dummy,
+                                  const char *header)
+{
+    cache_server_conf *conf;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    if (!strcasecmp(header, "None")) {
+        /* if header None is listed clear array */
+        conf->tag_headers->nelts = 0;
+    }
+    else {
+        APR_ARRAY_PUSH(conf->tag_headers, const char *) = header;
+    }
+    conf->tag_headers_set = 1;
+    return NULL;
+}
+
+static const char *add_vary_buckets(cmd_parms *parms, void *dummy,
+                                    int argc, char *const argv[])
+{
+    cache_server_conf *conf;
+    cache_vary_buckets_t *buckets;
+    int i;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    if (argc < 2) {
+        return "CacheVaryBuckets needs a header name and at least one value";
+    }
+
+    buckets = apr_array_push(conf->vary_buckets);
+    buckets->header = argv[0];
+    buckets->tokens = apr_array_make(parms->pool, argc - 1, sizeof(char *));
+    for (i = 1; i < argc; i++) {
+        APR_ARRAY_PUSH(buckets->tokens, const char *) = argv[i];
+    }
+    conf->vary_buckets_set = 1;
+    return NULL;
+}
+
 static const char *add_cache_enable(cmd_parms *parms, void *dummy,
                                     const char *type,
                                     const char *url)
@@ -2430,6 +2601,55 @@ static const char *set_cache_lock_maxage(cmd_parms *parms, void *dummy,
     return NULL;
 }
 
+static const char *set_cache_lock_wait(cmd_parms *parms, void *dummy,
+                                       const char *arg)
+{
+    cache_server_conf *conf;
+    apr_interval_time_t wait;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    if (ap_timeout_parameter_parse(arg, &wait, "s") != APR_SUCCESS
+            || wait < 0) {
+        return "CacheLockWait must be a positive duration (with an optional "
+               "unit, 's' by default)";
+    }
+    conf->lockwait = wait;
+    conf->lockwait_set = 1;
+    return NULL;
+}
+
+static const char *set_cache_tiered(cmd_parms *parms, void *dummy, int flag)
+{
+    cache_server_conf *conf;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    conf->tiered = flag;
+    conf->tiered_set = 1;
+    return NULL;
+}
+
+static const char *set_cache_tier_admission(cmd_parms *parms, void *dummy,
+                                            const char *arg)
+{
+    cache_server_conf *conf;
+    int admission;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    admission = atoi(arg);
+    if (admission < 1) {
+        return "CacheTieredAdmission must be a number of requests, at least 1";
+    }
+    conf->tier_admission = admission;
+    conf->tier_admission_set = 1;
+    return NULL;
+}
+
 static const char *set_cache_x_cache(cmd_parms *parms, void *dummy, int flag)
 {
 
@@ -2508,9 +2728,45 @@ static const char *set_cache_stale_on_error(cmd_parms *parms, void *dummy,
     return NULL;
 }
 
+static const char *set_cache_stale_while_revalidate(cmd_parms *parms,
+        void *dummy, int flag)
+{
+    cache_dir_conf *dconf = (cache_dir_conf *)dummy;
+
+    dconf->stale_while_revalidate = flag;
+    dconf->stale_while_revalidate_set = 1;
+    return NULL;
+}
+
+static const char *set_cache_refresh_ahead(cmd_parms *parms, void *dummy,
+        const char *arg)
+{
+    cache_dir_conf *dconf = (cache_dir_conf *)dummy;
+    int percent;
+
+    percent = atoi(arg);
+    if (percent < 0 || percent >= 100) {
+        return "CacheRefreshAhead must be a percentage between 0 and 99";
+    }
+    dconf->refresh_ahead = percent;
+    dconf->refresh_ahead_set = 1;
+    return NULL;
+}
+
+static int cache_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                            apr_pool_t *ptemp)
+{
+    /* Register to handle mod_status status page generation */
+    APR_OPTIONAL_HOOK(ap, status_hook, cache_tier_status, NULL, NULL,
+                      APR_HOOK_MIDDLE);
+    return OK;
+}
+
 static int cache_post_config(apr_pool_t *p, apr_pool_t *plog,
                              apr_pool_t *ptemp, server_rec *s)
 {
+    server_rec *sr;
+
     /* This is the means by which unusual (non-unix) os's may find alternate
      * means to run a given command (e.g. shebang/registry parsing on Win32)
      */
@@ -2518,6 +2774,88 @@ static int cache_post_config(apr_pool_t *p, apr_pool_t *plog,
     if (!cache_generate_key) {
         cache_generate_key = cache_generate_key_default;
     }
+
+    for (sr = s; sr; sr = sr->next) {
+        cache_server_conf *conf = ap_get_module_config(sr->module_config,
+                                                       &cache_module);
+        if (conf->lock && conf->lockwait > 0) {
+            apr_status_t rv = cache_lock_wait_init(p);
+            if (rv != APR_SUCCESS) {
+                /* the waiting requests only poll */
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10685)
+                             "cache: could not create the condition of "
+                             "CacheLockWait");
+            }
+            break;
+        }
+    }
+
+    for (sr = s; sr; sr = sr->next) {
+        cache_server_conf *conf = ap_get_module_config(sr->module_config,
+                                                       &cache_module);
+        if (conf->tiered) {
+            apr_status_t rv = cache_tier_init(p, s);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10562)
+                             "cache: could not create the shared memory "
+                             "of CacheTiered");
+                return 500; /* An HTTP status would be a misnomer! */
+            }
+            break;
+        }
+    }
+
+    for (sr = s; sr; sr = sr->next) {
+        cache_server_conf *conf = ap_get_module_config(sr->module_config,
+                                                       &cache_module);
+        if (conf->tag_headers->nelts) {
+            /* from the process pool, to keep the purges across restarts */
+            apr_status_t rv = cache_tag_init(s->process->pool, s);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10614)
+                             "cache: could not create the shared memory "
+                             "of CacheTagHeader");
+                return 500; /* An HTTP status would be a misnomer! */
+            }
+            break;
+        }
+    }
+
+    return OK;
+}
+
+/*
+ * The cache-tag-purge handler: purge the tags given in the CacheTagHeader
+ * headers of a POST or PURGE request.
+ */
+static int cache_tag_handler(request_rec *r)
+{
+    cache_server_conf *conf;
+    int n;
+
+    if (!r->handler || strcmp(r->handler, "cache-tag-purge")) {
+        return DECLINED;
+    }
+
+    r->allowed = (AP_METHOD_BIT << M_POST);
+    if (r->method_number != M_POST && strcmp(r->method, "PURGE")) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+
+    conf = ap_get_module_config(r->server->module_config, &cache_module);
+    if (!conf->tag_headers->nelts) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10615)
+                      "cache: cache-tag-purge used without CacheTagHeader");
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    n = cache_tag_purge(conf, r);
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(10616)
+                  "cache: %d tag(s) purged", n);
+
+    ap_set_content_type(r, "text/plain");
+    ap_rprintf(r, "%d tags purged\n", n);
+
     return OK;
 }
 
@@ -2585,6 +2923,25 @@ static const command_rec cache_cmds[] =
                   "DefaultRuntimeDir setting."),
     AP_INIT_TAKE1("CacheLockMaxAge", set_cache_lock_maxage, NULL, RSRC_CONF,
                   "Maximum age of any thundering herd lock."),
+    AP_INIT_TAKE1("CacheLockWait", set_cache_lock_wait, NULL, RSRC_CONF,
+                  "Maximum time a cache miss waits for the request holding "
+                  "the thundering herd lock to cache the response."),
+    AP_INIT_FLAG("CacheTiered", set_cache_tiered, NULL, RSRC_CONF,
+                 "Use the first cache type of CacheEnable as a tier in front "
+                 "of the next ones, default off"),
+    AP_INIT_TAKE1("CacheTieredAdmission", set_cache_tier_admission, NULL,
+                  RSRC_CONF,
+                  "Estimated number of recent requests for an entity to be "
+                  "admitted in the first tier, default "
+                  APR_STRINGIFY(DEFAULT_CACHE_TIER_ADMISSION)),
+    AP_INIT_ITERATE("CacheTagHeader", add_tag_header, NULL, RSRC_CONF,
+                    "A space separated list of headers of the responses "
+                    "listing the tags of the cached entities, and of the "
+                    "requests listing the tags to purge"),
+    AP_INIT_TAKE_ARGV("CacheVaryBuckets", add_vary_buckets, NULL, RSRC_CONF,
+                      "A request header and the values it is reduced to, "
+                      "in order of preference, when a response varies on "
+                      "it"),
     AP_INIT_FLAG("CacheHeader", set_cache_x_cache, NULL, RSRC_CONF | ACCESS_CONF,
                  "Add a X-Cache header to responses. Default is off."),
     AP_INIT_FLAG("CacheDetailHeader", set_cache_x_cache_detail, NULL,
@@ -2595,6 +2952,16 @@ static const command_rec cache_cmds[] =
     AP_INIT_FLAG("CacheStaleOnError", set_cache_stale_on_error,
                  NULL, RSRC_CONF|ACCESS_CONF,
                  "Serve stale content on 5xx errors if present. Defaults to on."),
+    AP_INIT_FLAG("CacheStaleWhileRevalidate", set_cache_stale_while_revalidate,
+                 NULL, RSRC_CONF|ACCESS_CONF,
+                 "Serve stale content within the stale-while-revalidate time "
+                 "of the response, and revalidate it in the background. "
+                 "Defaults to off."),
+    AP_INIT_TAKE1("CacheRefreshAhead", set_cache_refresh_ahead,
+                  NULL, RSRC_CONF|ACCESS_CONF,
+                  "Percentage of the freshness lifetime after which a hit "
+                  "refreshes the entity in the background. Defaults to 0 "
+                  "(disabled)."),
     {NULL}
 };
 
@@ -2605,6 +2972,8 @@ static void register_hooks(apr_pool_t *p)
     ap_hook_quick_handler(cache_quick_handler, NULL, NULL, APR_HOOK_FIRST);
     /* cache handler */
     ap_hook_handler(cache_handler, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    /* cache tag purges */
+    ap_hook_handler(cache_tag_handler, NULL, NULL, APR_HOOK_MIDDLE);
     /* cache status */
     cache_hook_cache_status(cache_status, NULL, NULL, APR_HOOK_MIDDLE);
     /* cache error handler */
@@ -2688,6 +3057,15 @@ static void register_hooks(apr_pool_t *p)
                                   cache_invalidate_filter,
                                   NULL,
                                   AP_FTYPE_PROTOCOL);
+    /* CACHE_DISCARD swallows the response of background revalidations,
+     * it has to be after the subrequest's CACHE_SAVE_SUBREQ.
+     */
+    cache_discard_filter_handle =
+        ap_register_output_filter("CACHE_DISCARD",
+                                  cache_discard_filter,
+                                  NULL,
+                                  AP_FTYPE_CONTENT_SET+1);
+    ap_hook_pre_config(cache_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(cache_post_config, NULL, NULL, APR_HOOK_REALLY_FIRST);
 }
 
@@ -138,6 +138,15 @@ CACHE_DECLARE(char *) ap_cache_generate_name(apr_pool_t *p, int dirlevels,
                                              const char *name);
 CACHE_DECLARE(const char *)ap_cache_tokstr(apr_pool_t *p, const char *list, const char **str);
 
+/* Canonical value of a request header listed in the Vary header of a
+ * response, to compute and compare the keys of the variants: with
+ * CacheVaryBuckets, the first bucket the value accepts (if any), else
+ * the value itself.
+ */
+CACHE_DECLARE(const char *)ap_cache_vary_value(request_rec *r,
+                                               const char *header,
+                                               const char *value);
+
 /* Create a new table consisting of those elements from an
  * headers table that are allowed to be stored in a cache.
  */
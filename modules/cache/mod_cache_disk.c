@@ -17,6 +17,8 @@
 #include "apr_lib.h"
 #include "apr_file_io.h"
 #include "apr_strings.h"
+#include "apr_hash.h"
+#include "apr_thread_mutex.h"
 #include "mod_cache.h"
 #include "mod_cache_disk.h"
 #include "http_config.h"
@@ -41,6 +43,9 @@
  *      re-read in <hash>.header (must be format #2)
  *   read in <hash>.data
  *
+ * With CacheVaryIndex, each child remembers the Vary headers of format #1
+ * files for a while, and opens the regenerated <hash>.header directly.
+ *
  * Format #1:
  *   apr_uint32_t format;
  *   apr_time_t expire;
@@ -211,6 +216,134 @@ static apr_status_t file_cache_create(disk_cache_conf *conf, disk_cache_file_t *
     return APR_SUCCESS;
 }
 
+/*
+ * The journal consumed by htcacheclean -j: a record for each entity
+ * stored (S), accessed (A) or removed (R), with the time, size and expiry
+ * of its files. A child buffers its records and appends them at once,
+ * when the buffer is full or has been for JOURNAL_FLUSH_TIME, and when the
+ * child exits. The journal is opened for each append, so that htcacheclean
+ * can rotate it at any time, and written in a single append so that the
+ * records of concurrent writers don't interleave. Should htcacheclean not
+ * keep up, the journal is removed past JOURNAL_MAX_SIZE, and htcacheclean
+ * rescans the cache when it notices.
+ */
+struct disk_cache_journal {
+    const char *file;
+    char *buf;
+    apr_size_t len;
+    apr_time_t since;            /* when the first buffered record came */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+static apr_status_t journal_append(struct disk_cache_journal *jbuf,
+                                   apr_pool_t *p)
+{
+    apr_finfo_t finfo;
+    apr_file_t *fd;
+    apr_size_t len = jbuf->len;
+    apr_status_t rv;
+
+    jbuf->len = 0;
+    if (!len) {
+        return APR_SUCCESS;
+    }
+
+    rv = apr_file_open(&fd, jbuf->file, APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                       | APR_FOPEN_APPEND | APR_FOPEN_BINARY, APR_OS_DEFAULT,
+                       p);
+    if (rv == APR_SUCCESS
+            && apr_file_info_get(&finfo, APR_FINFO_SIZE, fd) == APR_SUCCESS
+            && finfo.size >= JOURNAL_MAX_SIZE) {
+        apr_file_close(fd);
+        apr_file_remove(jbuf->file, p);
+        rv = apr_file_open(&fd, jbuf->file, APR_FOPEN_WRITE
+                           | APR_FOPEN_CREATE | APR_FOPEN_APPEND
+                           | APR_FOPEN_BINARY, APR_OS_DEFAULT, p);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(fd, jbuf->buf, len, NULL);
+        apr_file_close(fd);
+    }
+
+    return rv;
+}
+
+static void journal_record(request_rec *r, disk_cache_conf *conf, char op,
+                           const char *hdrs_file, apr_off_t size,
+                           apr_time_t expire)
+{
+    struct disk_cache_journal *jbuf = conf->jbuf;
+    apr_size_t slen = sizeof(CACHE_HEADER_SUFFIX) - 1, len;
+    apr_time_t now;
+    const char *name;
+    char *record;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (!conf->journal || !jbuf || !hdrs_file) {
+        return;
+    }
+
+    /* the name of the file set, relative to the cache root */
+    len = strlen(hdrs_file);
+    if (len <= conf->cache_root_len + 1 + slen
+            || strncmp(hdrs_file, conf->cache_root, conf->cache_root_len)) {
+        return;
+    }
+    name = hdrs_file + conf->cache_root_len + 1;
+    len -= conf->cache_root_len + 1 + slen;
+
+    record = apr_psprintf(r->pool, "%c %" APR_TIME_T_FMT " %" APR_OFF_T_FMT
+                          " %" APR_TIME_T_FMT " %.*s\n", op,
+                          apr_time_sec(r->request_time), size,
+                          expire > 0 ? apr_time_sec(expire) : 0,
+                          (int)len, name);
+    len = strlen(record);
+    if (len > JOURNAL_BUFFER_SIZE) {
+        return;
+    }
+    now = apr_time_now();
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(jbuf->mutex);
+#endif
+    if (jbuf->len + len > JOURNAL_BUFFER_SIZE) {
+        rv = journal_append(jbuf, r->pool);
+    }
+    if (!jbuf->len) {
+        jbuf->since = now;
+    }
+    memcpy(jbuf->buf + jbuf->len, record, len);
+    jbuf->len += len;
+    if (rv == APR_SUCCESS && now - jbuf->since >= JOURNAL_FLUSH_TIME) {
+        rv = journal_append(jbuf, r->pool);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(jbuf->mutex);
+#endif
+
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(10604)
+                "could not append to the cache journal in %s",
+                conf->cache_root);
+    }
+}
+
+static apr_status_t journal_cleanup(void *data)
+{
+    struct disk_cache_journal *jbuf = data;
+    apr_pool_t *p;
+
+    /* the child pool is being cleared, append from a pool of our own */
+    if (jbuf->len && apr_pool_create(&p, NULL) == APR_SUCCESS) {
+        journal_append(jbuf, p);
+        apr_pool_destroy(p);
+    }
+
+    return APR_SUCCESS;
+}
+
 /* These two functions get and put state information into the data
  * file for an ap_cache_el, this state information will be read
  * and written transparent to clients of this module
@@ -257,7 +390,130 @@ static int file_cache_recall_mydata(apr_file_t *fd, cache_info *info,
     return APR_SUCCESS;
 }
 
-static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
+/*
+ * The vary index: the Vary headers of the recently used URLs, in each
+ * child, so that the hits on variants don't have to read the format #1
+ * file before the variant. Since the other children may replace the file
+ * meanwhile, an entry is only used for CacheVaryIndex at most, and as long
+ * as the file has the inode and modification time it had when read, which
+ * costs a stat() rather than an open() and a read().
+ */
+typedef struct {
+    apr_array_header_t *varray;
+    apr_time_t expire;
+    apr_time_t mtime;            /* of the format #1 file */
+    apr_ino_t inode;
+} vary_index_entry_t;
+
+static apr_pool_t *vary_index_pool = NULL;
+static apr_hash_t *vary_index = NULL;
+static int vary_index_stores = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *vary_index_mutex = NULL;
+#endif
+
+static void vary_index_lock(void)
+{
+#if APR_HAS_THREADS
+    if (vary_index_mutex) {
+        apr_thread_mutex_lock(vary_index_mutex);
+    }
+#endif
+}
+
+static void vary_index_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (vary_index_mutex) {
+        apr_thread_mutex_unlock(vary_index_mutex);
+    }
+#endif
+}
+
+static apr_array_header_t *vary_index_copy(apr_pool_t *p,
+                                           const apr_array_header_t *varray)
+{
+    apr_array_header_t *copy = apr_array_make(p, varray->nelts,
+                                              sizeof(char *));
+    int i;
+
+    for (i = 0; i < varray->nelts; i++) {
+        APR_ARRAY_PUSH(copy, const char *) =
+            apr_pstrdup(p, APR_ARRAY_IDX(varray, i, const char *));
+    }
+
+    return copy;
+}
+
+static apr_array_header_t *vary_index_get(request_rec *r, const char *key,
+                                          const char *file)
+{
+    vary_index_entry_t *entry;
+    apr_array_header_t *varray = NULL;
+    apr_time_t mtime = 0;
+    apr_ino_t inode = 0;
+    apr_finfo_t finfo;
+
+    if (!vary_index) {
+        return NULL;
+    }
+
+    vary_index_lock();
+    entry = apr_hash_get(vary_index, key, APR_HASH_KEY_STRING);
+    if (entry && entry->expire > r->request_time) {
+        varray = vary_index_copy(r->pool, entry->varray);
+        mtime = entry->mtime;
+        inode = entry->inode;
+    }
+    vary_index_unlock();
+
+    /* the file must not have been replaced since */
+    if (varray && (apr_stat(&finfo, file, APR_FINFO_MTIME | APR_FINFO_INODE,
+                            r->pool) != APR_SUCCESS
+                   || finfo.mtime != mtime || finfo.inode != inode)) {
+        return NULL;
+    }
+
+    return varray;
+}
+
+static void vary_index_set(disk_cache_conf *conf, const char *key,
+                           apr_array_header_t *varray, apr_file_t *fd)
+{
+    vary_index_entry_t *entry;
+    apr_finfo_t finfo;
+
+    if (!vary_index || !conf->vary_index) {
+        return;
+    }
+    if (varray && apr_file_info_get(&finfo, APR_FINFO_MTIME
+                                    | APR_FINFO_INODE, fd) != APR_SUCCESS) {
+        varray = NULL;
+    }
+
+    vary_index_lock();
+    /* entries are never freed one by one, start over once in a while */
+    if (++vary_index_stores > VARY_INDEX_MAX) {
+        apr_pool_clear(vary_index_pool);
+        vary_index = apr_hash_make(vary_index_pool);
+        vary_index_stores = 1;
+    }
+    if (varray) {
+        entry = apr_palloc(vary_index_pool, sizeof(*entry));
+        entry->varray = vary_index_copy(vary_index_pool, varray);
+        entry->expire = apr_time_now() + conf->vary_index;
+        entry->mtime = finfo.mtime;
+        entry->inode = finfo.inode;
+        apr_hash_set(vary_index, apr_pstrdup(vary_index_pool, key),
+                     APR_HASH_KEY_STRING, entry);
+    }
+    else {
+        apr_hash_set(vary_index, key, APR_HASH_KEY_STRING, NULL);
+    }
+    vary_index_unlock();
+}
+
+static const char* regen_key(request_rec *r, apr_table_t *headers,
                              apr_array_header_t *varray, const char *oldkey)
 {
     struct iovec *iov;
@@ -267,7 +523,7 @@ static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
     const char **elts;
 
     nvec = (varray->nelts * 2) + 1;
-    iov = apr_palloc(p, sizeof(struct iovec) * nvec);
+    iov = apr_palloc(r->pool, sizeof(struct iovec) * nvec);
     elts = (const char **) varray->elts;
 
     /* TODO:
@@ -295,7 +551,8 @@ static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
      */
 
     for (i=0, k=0; i < varray->nelts; i++) {
-        header = apr_table_get(headers, elts[i]);
+        header = ap_cache_vary_value(r, elts[i],
+                                     apr_table_get(headers, elts[i]));
         if (!header) {
             header = "";
         }
@@ -310,7 +567,7 @@ static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
     iov[k].iov_len = strlen(oldkey);
     k++;
 
-    return apr_pstrcatv(p, iov, k, NULL);
+    return apr_pstrcatv(r->pool, iov, k, NULL);
 }
 
 static int array_alphasort(const void *fn1, const void *fn2)
@@ -447,6 +704,32 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
 
     dobj->vary.file = header_file(r->pool, conf, dobj, key);
     flags = APR_READ|APR_BINARY|APR_BUFFERED;
+
+    /* Known variants, skip the format #1 file */
+    if (conf->vary_index) {
+        apr_array_header_t *varray = vary_index_get(r, key,
+                                                    dobj->vary.file);
+
+        if (varray) {
+            nkey = regen_key(r, r->headers_in, varray, key);
+
+            dobj->hashfile = NULL;
+            dobj->prefix = dobj->vary.file;
+            dobj->hdrs.file = header_file(r->pool, conf, dobj, nkey);
+
+            rc = apr_file_open(&dobj->hdrs.fd, dobj->hdrs.file, flags, 0,
+                               r->pool);
+            if (rc == APR_SUCCESS) {
+                goto variant;
+            }
+
+            /* possibly gone with the Vary headers, look the URL up again */
+            vary_index_set(conf, key, NULL, NULL);
+            dobj->hashfile = NULL;
+            dobj->prefix = NULL;
+        }
+    }
+
     rc = apr_file_open(&dobj->vary.fd, dobj->vary.file, flags, 0, r->pool);
     if (rc != APR_SUCCESS) {
         return DECLINED;
@@ -472,9 +755,10 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
             apr_file_close(dobj->vary.fd);
             return DECLINED;
         }
+        vary_index_set(conf, key, varray, dobj->vary.fd);
         apr_file_close(dobj->vary.fd);
 
-        nkey = regen_key(r->pool, r->headers_in, varray, key);
+        nkey = regen_key(r, r->headers_in, varray, key);
 
         dobj->hashfile = NULL;
         dobj->prefix = dobj->vary.file;
@@ -508,6 +792,7 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
         nkey = key;
     }
 
+variant:
     obj->key = nkey;
     dobj->key = nkey;
     dobj->name = key;
@@ -576,6 +861,8 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
             h->cache_obj = obj;
             obj->vobj = dobj;
 
+            journal_record(r, conf, 'A', dobj->hdrs.file, 0, 0);
+
             return OK;
         }
 
@@ -586,6 +873,8 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
         h->cache_obj = obj;
         obj->vobj = dobj;
 
+        journal_record(r, conf, 'A', dobj->hdrs.file, 0, 0);
+
         return OK;
     }
 
@@ -625,6 +914,8 @@ static int remove_entity(cache_handle_t *h)
 
 static int remove_url(cache_handle_t *h, request_rec *r)
 {
+    disk_cache_conf *conf = ap_get_module_config(r->server->module_config,
+                                                 &cache_disk_module);
     apr_status_t rc;
     disk_cache_object_t *dobj;
 
@@ -634,6 +925,8 @@ static int remove_url(cache_handle_t *h, request_rec *r)
         return DECLINED;
     }
 
+    journal_record(r, conf, 'R', dobj->hdrs.file, 0, 0);
+
     /* Delete headers file */
     if (dobj->hdrs.file) {
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00711)
@@ -1051,12 +1344,17 @@ static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
                 return rv;
             }
 
-            tmp = regen_key(r->pool, dobj->headers_in, varray, dobj->name);
+            /* indexed when next read, once the file is in place */
+            vary_index_set(conf, dobj->name, NULL, NULL);
+            tmp = regen_key(r, dobj->headers_in, varray, dobj->name);
             dobj->prefix = dobj->hdrs.file;
             dobj->hashfile = NULL;
             dobj->data.file = data_file(r->pool, conf, dobj, tmp);
             dobj->hdrs.file = header_file(r->pool, conf, dobj, tmp);
         }
+        else {
+            vary_index_set(conf, dobj->name, NULL, NULL);
+        }
     }
 
 
@@ -1368,6 +1666,23 @@ static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00737)
                 "commit_entity: Headers and body for URL %s cached.",
                 dobj->name);
+
+        if (conf->journal) {
+            apr_finfo_t finfo;
+            apr_off_t size = 0;
+
+            if (apr_stat(&finfo, dobj->hdrs.file, APR_FINFO_SIZE,
+                         r->pool) == APR_SUCCESS) {
+                size += finfo.size;
+            }
+            if (!dobj->disk_info.header_only
+                    && apr_stat(&finfo, dobj->data.file, APR_FINFO_SIZE,
+                                r->pool) == APR_SUCCESS) {
+                size += finfo.size;
+            }
+            journal_record(r, conf, 'S', dobj->hdrs.file, size,
+                           dobj->disk_info.expire);
+        }
     }
 
     apr_pool_destroy(dobj->data.pool);
@@ -1427,6 +1742,7 @@ static void *create_config(apr_pool_t *p, server_rec *s)
     /* XXX: Set default values */
     conf->dirlevels = DEFAULT_DIRLEVELS;
     conf->dirlength = DEFAULT_DIRLENGTH;
+    conf->segment_size = DEFAULT_SEGMENT_SIZE;
 
     conf->cache_root = NULL;
     conf->cache_root_len = 0;
@@ -1541,6 +1857,70 @@ static const char
     return NULL;
 }
 
+static const char
+*set_cache_journal(cmd_parms *parms, void *in_struct_ptr, int flag)
+{
+    disk_cache_conf *conf = ap_get_module_config(parms->server->module_config,
+                                                 &cache_disk_module);
+
+    conf->journal = flag;
+    return NULL;
+}
+
+static const char
+*set_cache_vary_index(cmd_parms *parms, void *in_struct_ptr, const char *arg)
+{
+    disk_cache_conf *conf = ap_get_module_config(parms->server->module_config,
+                                                 &cache_disk_module);
+    apr_interval_time_t timeout;
+
+    if (ap_timeout_parameter_parse(arg, &timeout, "s") != APR_SUCCESS
+            || timeout < 0) {
+        return "CacheVaryIndex argument must be a positive timeout, "
+               "in seconds by default";
+    }
+    conf->vary_index = timeout;
+    return NULL;
+}
+
+static const char
+*set_cache_segments(cmd_parms *parms, void *in_struct_ptr, const char *arg)
+{
+    disk_cache_conf *conf = ap_get_module_config(parms->server->module_config,
+                                                 &cache_disk_module);
+    const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+    int val;
+
+    if (err) {
+        return err;
+    }
+    val = atoi(arg);
+    if (val < 2 || val > 65536) {
+        return "CacheSegments argument must be the number of segment files, "
+               "between 2 and 65536";
+    }
+    conf->segments = val;
+    return NULL;
+}
+
+static const char
+*set_cache_segment_size(cmd_parms *parms, void *in_struct_ptr, const char *arg)
+{
+    disk_cache_conf *conf = ap_get_module_config(parms->server->module_config,
+                                                 &cache_disk_module);
+    const char *err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+
+    if (err) {
+        return err;
+    }
+    if (apr_strtoff(&conf->segment_size, arg, NULL, 10) != APR_SUCCESS
+            || conf->segment_size < 1024 * 1024) {
+        return "CacheSegmentSize argument must be the size in bytes of a "
+               "segment file, at least 1048576";
+    }
+    return NULL;
+}
+
 static const command_rec disk_cache_cmds[] =
 {
     AP_INIT_TAKE1("CacheRoot", set_cache_root, NULL, RSRC_CONF,
@@ -1557,6 +1937,15 @@ static const command_rec disk_cache_cmds[] =
                   "The maximum quantity of data to attempt to read and cache in one go"),
     AP_INIT_TAKE1("CacheReadTime", set_cache_readtime, NULL, RSRC_CONF | ACCESS_CONF,
                   "The maximum time taken to attempt to read and cache in go"),
+    AP_INIT_FLAG("CacheJournal", set_cache_journal, NULL, RSRC_CONF,
+                 "Keep a journal of the stores and accesses for htcacheclean"),
+    AP_INIT_TAKE1("CacheVaryIndex", set_cache_vary_index, NULL, RSRC_CONF,
+                  "How long each child remembers the Vary headers of a URL, "
+                  "default 0 (disabled)"),
+    AP_INIT_TAKE1("CacheSegments", set_cache_segments, NULL, RSRC_CONF,
+                  "The number of segment files of the segment storage"),
+    AP_INIT_TAKE1("CacheSegmentSize", set_cache_segment_size, NULL, RSRC_CONF,
+                  "The size in bytes of a segment file"),
     {NULL}
 };
 
@@ -1574,11 +1963,49 @@ static const cache_provider cache_disk_provider =
     &invalidate_entity
 };
 
+static void disk_cache_child_init(apr_pool_t *p, server_rec *s)
+{
+    server_rec *sr;
+
+    for (sr = s; sr; sr = sr->next) {
+        disk_cache_conf *conf = ap_get_module_config(sr->module_config,
+                                                     &cache_disk_module);
+        if (conf->journal && conf->cache_root) {
+            conf->jbuf = apr_pcalloc(p, sizeof(*conf->jbuf));
+            conf->jbuf->file = apr_pstrcat(p, conf->cache_root, "/",
+                                           CACHE_JOURNAL_FILE, NULL);
+            conf->jbuf->buf = apr_palloc(p, JOURNAL_BUFFER_SIZE);
+#if APR_HAS_THREADS
+            apr_thread_mutex_create(&conf->jbuf->mutex,
+                                    APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+            apr_pool_pre_cleanup_register(p, conf->jbuf, journal_cleanup);
+        }
+    }
+
+    for (sr = s; sr; sr = sr->next) {
+        disk_cache_conf *conf = ap_get_module_config(sr->module_config,
+                                                     &cache_disk_module);
+        if (conf->vary_index) {
+            apr_pool_create(&vary_index_pool, p);
+            apr_pool_tag(vary_index_pool, "mod_cache_disk (vary index)");
+            vary_index = apr_hash_make(vary_index_pool);
+#if APR_HAS_THREADS
+            apr_thread_mutex_create(&vary_index_mutex,
+                                    APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+            break;
+        }
+    }
+}
+
 static void disk_cache_register_hook(apr_pool_t *p)
 {
     /* cache initializer */
     ap_register_provider(p, CACHE_PROVIDER_GROUP, "disk", "0",
                          &cache_disk_provider);
+    ap_hook_child_init(disk_cache_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    cache_disk_segment_register_hook(p);
 }
 
 AP_DECLARE_MODULE(cache_disk) = {
@@ -68,12 +68,24 @@ typedef struct disk_cache_object {
 #define DEFAULT_MAX_FILE_SIZE 1000000
 #define DEFAULT_READSIZE 0
 #define DEFAULT_READTIME 0
+#define DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define VARY_INDEX_MAX 4096      /* Entries of the vary index of a child */
+#define JOURNAL_BUFFER_SIZE 8192 /* Journal records buffered by a child */
+#define JOURNAL_FLUSH_TIME apr_time_from_sec(1) /* And for how long */
+#define JOURNAL_MAX_SIZE (64 * 1024 * 1024) /* Journal removed past this */
+
+struct disk_cache_journal;
 
 typedef struct {
     const char* cache_root;
     apr_size_t cache_root_len;
     int dirlevels;               /* Number of levels of subdirectories */
     int dirlength;               /* Length of subdirectory names */
+    int journal;                 /* Keep a journal for htcacheclean */
+    struct disk_cache_journal *jbuf; /* Records buffered by the child */
+    apr_uint32_t segments;       /* Number of segment files, 0 if unused */
+    apr_off_t segment_size;      /* Size of a segment file */
+    apr_interval_time_t vary_index; /* Lifetime of the vary index entries */
 } disk_cache_conf;
 
 typedef struct {
@@ -87,5 +99,8 @@ typedef struct {
     unsigned int readtime_set:1;
 } disk_cache_dir_conf;
 
+/* The "segment" provider, in cache_disk_segment.c */
+void cache_disk_segment_register_hook(apr_pool_t *p);
+
 #endif /*MOD_CACHE_DISK_H*/
 
@@ -0,0 +1,1953 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apr_lib.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "apr_buckets.h"
+
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_main.h"
+#include "http_core.h"
+#include "http_protocol.h"
+#include "ap_provider.h"
+#include "util_mutex.h"
+#include "ap_mpm.h"
+
+#include "mod_cache.h"
+#include "mod_status.h"
+
+#include "cache_common.h"
+
+/*
+ * mod_cache_shm: Shared Memory Based HTTP 1.1 Cache.
+ *
+ * Entities are stored in a single shared memory segment, created at startup
+ * and shared by all the children. The segment is split into shards, each
+ * with its own mutex, hash index, and slab allocator:
+ *
+ *   cache_shm_shard_t
+ *   apr_uint16_t page_class[npages]   (slab class owning each page)
+ *   cache_shm_pin_t pins[npins]       (processes serving the entries)
+ *   apr_uint32_t buckets[nbuckets]    (hash index, chained via entries)
+ *   pages[npages]                     (page_size bytes each)
+ *
+ * A page is given to a slab class on demand and cut in chunks of that
+ * class' size, each chunk holding one entry:
+ *
+ *   cache_shm_entry_t
+ *   key (aligned)
+ *   data: either a Vary entry or an entity, laid out like in
+ *         mod_cache_socache:
+ *
+ * Vary entry:
+ *   apr_uint32_t format;
+ *   apr_time_t expire;
+ *   apr_array_t vary_headers (delimited by CRLF)
+ *
+ * Entity:
+ *   cache_shm_info_t (first sizeof(apr_uint32_t) bytes is the format)
+ *   entity name (sobj->name) [length is in cache_shm_info_t->name_len]
+ *   r->headers_out (delimited by CRLF)
+ *   CRLF
+ *   r->headers_in (delimited by CRLF)
+ *   CRLF
+ *   body
+ *
+ * The body is served straight from the shared memory with a CACHE_SHM
+ * bucket, which pins the entry (refcount) until the bucket is destroyed,
+ * so that it can't be evicted or reused meanwhile. An entry removed while
+ * pinned is marked dead and its chunk released by the last unpin.
+ *
+ * Eviction is per slab class, with a CLOCK-Pro like policy: entries are
+ * stored cold, a cold entry referenced since the hand's last pass becomes
+ * hot (up to CACHE_SHM_HOT_PERCENT of the class), a hot entry not
+ * referenced since the last pass is demoted to cold, and the hand evicts
+ * the first unreferenced cold entry. One-time accesses (scans) thus never
+ * push out the entries which are hit repeatedly. When a class has nothing
+ * to evict, a page is taken back from another class.
+ */
+
+module AP_MODULE_DECLARE_DATA cache_shm_module;
+
+#define CACHE_SHM_VARY_FORMAT_VERSION 1
+#define CACHE_SHM_DISK_FORMAT_VERSION 2
+
+typedef struct {
+    /* Indicates the format of the header struct stored in memory. */
+    apr_uint32_t format;
+    /* The HTTP status code returned for this response.  */
+    int status;
+    /* The size of the entity name that follows. */
+    apr_size_t name_len;
+    /* Miscellaneous time values. */
+    apr_time_t date;
+    apr_time_t expire;
+    apr_time_t request_time;
+    apr_time_t response_time;
+    /* Does this cached request have a body? */
+    unsigned int header_only:1;
+    /* The parsed cache control header */
+    cache_control_t control;
+} cache_shm_info_t;
+
+/*
+ * Shared memory layout
+ */
+#define CACHE_SHM_NIL           APR_UINT32_MAX
+#define CACHE_SHM_MAX_CLASSES   64
+#define CACHE_SHM_MIN_CHUNK     128
+#define CACHE_SHM_KEY_ROOM      1024
+#define CACHE_SHM_HOT_PERCENT   75
+#define CACHE_SHM_PINS          256 /* per shard */
+#define CACHE_SHM_SHARD_PAGES   8   /* when choosing the number of shards */
+
+#define CACHE_SHM_USED  0x01 /* stored and indexed */
+#define CACHE_SHM_HOT   0x02 /* hot (CLOCK-Pro) */
+#define CACHE_SHM_REF   0x04 /* referenced since the hand's last pass */
+#define CACHE_SHM_DEAD  0x08 /* removed while pinned, freed by last unpin */
+
+typedef struct {
+    apr_uint32_t nshards;
+    apr_uint32_t npages;        /* pages per shard */
+    apr_uint32_t nbuckets;      /* hash buckets per shard */
+    apr_uint32_t page_size;
+    apr_uint32_t nclasses;
+    apr_uint32_t class_size[CACHE_SHM_MAX_CLASSES];
+    apr_uint32_t npins;         /* pins per shard */
+    apr_size_t max;             /* largest entity (headers and body) */
+    apr_size_t shard_size;      /* distance between two shards */
+    apr_size_t page_class_offset;
+    apr_size_t pins_offset;
+    apr_size_t buckets_offset;
+    apr_size_t pages_offset;
+} cache_shm_header_t;
+
+typedef struct {
+    apr_uint32_t free;          /* free chunks list */
+    apr_uint32_t npages;        /* pages owned by the class */
+    apr_uint32_t nused;         /* entries stored */
+    apr_uint32_t nhot;          /* hot entries */
+    apr_uint32_t hand_page;     /* clock hand */
+    apr_uint32_t hand_chunk;
+} cache_shm_class_t;
+
+typedef struct {
+    apr_uint32_t next_page;     /* first page never given to a class */
+    apr_uint32_t reclaim_page;  /* where to look for a page to take back */
+    apr_uint32_t free_pin;      /* free pins list */
+    apr_uint64_t hits;
+    apr_uint64_t misses;
+    apr_uint64_t stores;
+    apr_uint64_t evictions;
+    apr_uint64_t reclaims;
+    apr_uint64_t nospace;
+    apr_uint64_t nopin;         /* hits not served, no pin left */
+    cache_shm_class_t classes[CACHE_SHM_MAX_CLASSES];
+} cache_shm_shard_t;
+
+typedef struct {
+    apr_uint32_t next;          /* hash chain, or free chunks list */
+    apr_uint32_t hash;
+    apr_uint32_t keylen;
+    apr_uint32_t datalen;
+    apr_uint32_t refcount;      /* pins on this entry */
+    apr_uint16_t sclass;
+    apr_uint16_t flags;
+    apr_time_t expire;
+} cache_shm_entry_t;
+
+/* An entry served by a process, which the parent unpins should the process
+ * die without doing it.
+ */
+typedef struct {
+    apr_uint32_t next;          /* free pins list */
+    apr_uint32_t off;           /* pinned entry, or CACHE_SHM_NIL */
+    pid_t pid;
+} cache_shm_pin_t;
+
+#define SHM_ENTRY_KEY(e)  ((char *)(e) + sizeof(cache_shm_entry_t))
+#define SHM_ENTRY_DATA(e) (SHM_ENTRY_KEY(e) + APR_ALIGN_DEFAULT((e)->keylen))
+
+/*
+ * cache_shm_object_t
+ * Pointed to by cache_object_t::vobj
+ */
+typedef struct cache_shm_object_t
+{
+    apr_pool_t *pool; /* pool */
+    unsigned char *buffer; /* the cache buffer */
+    apr_size_t buffer_len; /* size of the buffer */
+    apr_bucket_brigade *body; /* brigade containing the body, if any */
+    apr_table_t *headers_in; /* Input headers to save */
+    apr_table_t *headers_out; /* Output headers to save */
+    cache_shm_info_t shm_info; /* Header information. */
+    apr_size_t body_offset; /* offset to the start of the body */
+    apr_off_t body_length; /* length of the cached entity body */
+    apr_time_t expire; /* when to expire the entry */
+
+    const char *name; /* Requested URI without vary bits - suitable for mortals. */
+    const char *key; /* Cache key; URI with Vary bits (if present) */
+    unsigned int newbody :1; /* whether a new body is present */
+    unsigned int done :1; /* Is the attempt to cache complete? */
+} cache_shm_object_t;
+
+/*
+ * mod_cache_shm configuration
+ */
+#define DEFAULT_SHARDS 16
+#define DEFAULT_MAX_SIZE 100*1024
+#define DEFAULT_MAXTIME 86400
+#define DEFAULT_MINTIME 600
+
+typedef struct cache_shm_conf
+{
+    apr_size_t size;
+    apr_uint32_t shards;
+    apr_size_t max;
+} cache_shm_conf;
+
+/* The shared memory segment and the mutexes of its shards */
+static const char * const cache_shm_id = "cache-shm";
+static apr_shm_t *shm_segment = NULL;
+static cache_shm_header_t *shm_header = NULL;
+static char *shm_base = NULL;
+static apr_global_mutex_t **shm_mutexes = NULL;
+static pid_t shm_pid = 0;
+
+/*
+ * Shared memory management, all the shm_*() functions but shm_lock(),
+ * shm_unlock() and shm_shard_of() require the shard to be locked.
+ */
+
+static APR_INLINE cache_shm_shard_t *shm_shard(apr_uint32_t i)
+{
+    return (cache_shm_shard_t *)(shm_base + i * shm_header->shard_size);
+}
+
+static APR_INLINE apr_uint16_t *shm_page_class(cache_shm_shard_t *shard)
+{
+    return (apr_uint16_t *)((char *)shard + shm_header->page_class_offset);
+}
+
+static APR_INLINE cache_shm_pin_t *shm_pins(cache_shm_shard_t *shard)
+{
+    return (cache_shm_pin_t *)((char *)shard + shm_header->pins_offset);
+}
+
+static APR_INLINE apr_uint32_t *shm_buckets(cache_shm_shard_t *shard)
+{
+    return (apr_uint32_t *)((char *)shard + shm_header->buckets_offset);
+}
+
+static APR_INLINE cache_shm_entry_t *shm_entry(cache_shm_shard_t *shard,
+                                               apr_uint32_t off)
+{
+    return (cache_shm_entry_t *)((char *)shard + shm_header->pages_offset
+                                 + off);
+}
+
+static apr_uint32_t shm_shard_of(const char *key, apr_size_t klen,
+                                 apr_uint32_t *hash)
+{
+    apr_ssize_t len = klen;
+
+    *hash = apr_hashfunc_default(key, &len);
+    return *hash % shm_header->nshards;
+}
+
+static APR_INLINE apr_uint32_t *shm_chain(cache_shm_shard_t *shard,
+                                          apr_uint32_t hash)
+{
+    return shm_buckets(shard)
+           + (hash / shm_header->nshards) % shm_header->nbuckets;
+}
+
+static apr_status_t shm_lock(apr_uint32_t i)
+{
+    return apr_global_mutex_lock(shm_mutexes[i]);
+}
+
+static apr_status_t shm_unlock(apr_uint32_t i)
+{
+    return apr_global_mutex_unlock(shm_mutexes[i]);
+}
+
+static void shm_release(cache_shm_shard_t *shard, apr_uint32_t off)
+{
+    cache_shm_entry_t *e = shm_entry(shard, off);
+    cache_shm_class_t *cls = &shard->classes[e->sclass];
+
+    e->flags = 0;
+    e->next = cls->free;
+    cls->free = off;
+}
+
+/* Unlink an entry from the index, and free it unless it is pinned */
+static void shm_drop(cache_shm_shard_t *shard, apr_uint32_t off)
+{
+    cache_shm_entry_t *e = shm_entry(shard, off);
+    cache_shm_class_t *cls = &shard->classes[e->sclass];
+    apr_uint32_t *prev = shm_chain(shard, e->hash);
+
+    while (*prev != off) {
+        prev = &shm_entry(shard, *prev)->next;
+    }
+    *prev = e->next;
+
+    cls->nused--;
+    if (e->flags & CACHE_SHM_HOT) {
+        cls->nhot--;
+    }
+    if (e->refcount) {
+        e->flags = CACHE_SHM_DEAD;
+    }
+    else {
+        shm_release(shard, off);
+    }
+}
+
+static apr_uint32_t shm_lookup(cache_shm_shard_t *shard, apr_uint32_t hash,
+                               const char *key, apr_size_t klen)
+{
+    apr_uint32_t off = *shm_chain(shard, hash);
+
+    while (off != CACHE_SHM_NIL) {
+        cache_shm_entry_t *e = shm_entry(shard, off);
+        if (e->hash == hash && e->keylen == klen
+                && !memcmp(SHM_ENTRY_KEY(e), key, klen)) {
+            break;
+        }
+        off = e->next;
+    }
+
+    return off;
+}
+
+/* Give a page to a class and put its chunks on the free list */
+static void shm_carve(cache_shm_shard_t *shard, apr_uint32_t page,
+                      apr_uint32_t k)
+{
+    cache_shm_class_t *cls = &shard->classes[k];
+    apr_uint32_t size = shm_header->class_size[k];
+    apr_uint32_t n = shm_header->page_size / size;
+
+    shm_page_class(shard)[page] = k;
+    cls->npages++;
+    while (n--) {
+        apr_uint32_t off = page * shm_header->page_size + n * size;
+        cache_shm_entry_t *e = shm_entry(shard, off);
+        e->sclass = k;
+        e->refcount = 0;
+        shm_release(shard, off);
+    }
+}
+
+/* Move the clock hand of a class (owning pages) to its next chunk */
+static void shm_clock_advance(cache_shm_shard_t *shard, apr_uint32_t k)
+{
+    cache_shm_class_t *cls = &shard->classes[k];
+    apr_uint16_t *page_class = shm_page_class(shard);
+    apr_uint32_t per_page = shm_header->page_size / shm_header->class_size[k];
+    apr_uint32_t page = cls->hand_page;
+
+    if (page_class[page] == k && cls->hand_chunk + 1 < per_page) {
+        cls->hand_chunk++;
+        return;
+    }
+    do {
+        page = (page + 1) % shm_header->npages;
+    } while (page_class[page] != k);
+    cls->hand_page = page;
+    cls->hand_chunk = 0;
+}
+
+/* Run the clock of a class until an entry is evicted */
+static int shm_clock_evict(cache_shm_shard_t *shard, apr_uint32_t k,
+                           apr_time_t now)
+{
+    cache_shm_class_t *cls = &shard->classes[k];
+    apr_uint32_t size = shm_header->class_size[k];
+    apr_uint32_t nchunks, steps;
+
+    if (!cls->nused) {
+        return 0;
+    }
+
+    /* A hot entry needs three passes of the hand to go: one to clear its
+     * reference, one to demote it, and a last one to evict it.
+     */
+    nchunks = cls->npages * (shm_header->page_size / size);
+    for (steps = 0; steps < 3 * nchunks; steps++) {
+        apr_uint32_t off;
+        cache_shm_entry_t *e;
+
+        shm_clock_advance(shard, k);
+        off = cls->hand_page * shm_header->page_size + cls->hand_chunk * size;
+        e = shm_entry(shard, off);
+
+        if (!(e->flags & CACHE_SHM_USED) || e->refcount) {
+            continue;
+        }
+        if (e->expire >= now) {
+            if (e->flags & CACHE_SHM_REF) {
+                e->flags &= ~CACHE_SHM_REF;
+                if (!(e->flags & CACHE_SHM_HOT) && cls->nhot
+                        < (apr_uint64_t)cls->nused * CACHE_SHM_HOT_PERCENT / 100) {
+                    e->flags |= CACHE_SHM_HOT;
+                    cls->nhot++;
+                }
+                continue;
+            }
+            if (e->flags & CACHE_SHM_HOT) {
+                e->flags &= ~CACHE_SHM_HOT;
+                cls->nhot--;
+                continue;
+            }
+        }
+
+        /* expired, or cold and not referenced since the last pass */
+        shm_drop(shard, off);
+        shard->evictions++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Take a page from another class, if none of its entries is pinned */
+static int shm_reclaim_page(cache_shm_shard_t *shard, apr_uint32_t k)
+{
+    apr_uint16_t *page_class = shm_page_class(shard);
+    apr_uint32_t page_size = shm_header->page_size;
+    apr_uint32_t n;
+
+    for (n = 0; n < shm_header->npages; n++) {
+        apr_uint32_t page = (shard->reclaim_page + n) % shm_header->npages;
+        apr_uint32_t j = page_class[page], size, per_page, c, *prev;
+        apr_uint32_t start = page * page_size, end = start + page_size;
+        cache_shm_class_t *cls;
+
+        if (j == k || j >= shm_header->nclasses) {
+            continue;
+        }
+        size = shm_header->class_size[j];
+        per_page = page_size / size;
+        for (c = 0; c < per_page; c++) {
+            cache_shm_entry_t *e = shm_entry(shard, start + c * size);
+            if (e->refcount || (e->flags & CACHE_SHM_DEAD)) {
+                break;
+            }
+        }
+        if (c < per_page) {
+            continue;
+        }
+
+        /* evict everything, then unlink the page from the free list */
+        for (c = 0; c < per_page; c++) {
+            apr_uint32_t off = start + c * size;
+            if (shm_entry(shard, off)->flags & CACHE_SHM_USED) {
+                shm_drop(shard, off);
+                shard->evictions++;
+            }
+        }
+        cls = &shard->classes[j];
+        prev = &cls->free;
+        while (*prev != CACHE_SHM_NIL) {
+            if (*prev >= start && *prev < end) {
+                *prev = shm_entry(shard, *prev)->next;
+            }
+            else {
+                prev = &shm_entry(shard, *prev)->next;
+            }
+        }
+        cls->npages--;
+
+        shm_carve(shard, page, k);
+        shard->reclaim_page = (page + 1) % shm_header->npages;
+        shard->reclaims++;
+        return 1;
+    }
+
+    return 0;
+}
+
+static apr_uint32_t shm_alloc(cache_shm_shard_t *shard, apr_uint32_t k,
+                              apr_time_t now)
+{
+    cache_shm_class_t *cls = &shard->classes[k];
+    apr_uint32_t off;
+
+    if (cls->free == CACHE_SHM_NIL) {
+        if (shard->next_page < shm_header->npages) {
+            shm_carve(shard, shard->next_page++, k);
+        }
+        else if (!shm_clock_evict(shard, k, now)
+                 && !shm_reclaim_page(shard, k)) {
+            return CACHE_SHM_NIL;
+        }
+    }
+
+    off = cls->free;
+    cls->free = shm_entry(shard, off)->next;
+    return off;
+}
+
+static apr_status_t shm_store(cache_shm_shard_t *shard, apr_uint32_t hash,
+                              const char *key, apr_size_t klen,
+                              const unsigned char *data, apr_size_t dlen,
+                              apr_time_t expire, apr_time_t now)
+{
+    apr_size_t total = sizeof(cache_shm_entry_t) + APR_ALIGN_DEFAULT(klen)
+                       + dlen;
+    apr_uint32_t k, off, *bucket;
+    cache_shm_entry_t *e;
+
+    for (k = 0; k < shm_header->nclasses; k++) {
+        if (shm_header->class_size[k] >= total) {
+            break;
+        }
+    }
+    if (k == shm_header->nclasses) {
+        shard->nospace++;
+        return APR_ENOSPC;
+    }
+
+    off = shm_lookup(shard, hash, key, klen);
+    if (off != CACHE_SHM_NIL) {
+        shm_drop(shard, off);
+    }
+
+    off = shm_alloc(shard, k, now);
+    if (off == CACHE_SHM_NIL) {
+        shard->nospace++;
+        return APR_ENOSPC;
+    }
+
+    e = shm_entry(shard, off);
+    e->hash = hash;
+    e->keylen = klen;
+    e->datalen = dlen;
+    e->refcount = 0;
+    e->flags = CACHE_SHM_USED;
+    e->expire = expire;
+    memcpy(SHM_ENTRY_KEY(e), key, klen);
+    memcpy(SHM_ENTRY_DATA(e), data, dlen);
+
+    bucket = shm_chain(shard, hash);
+    e->next = *bucket;
+    *bucket = off;
+
+    shard->classes[k].nused++;
+    shard->stores++;
+
+    return APR_SUCCESS;
+}
+
+static apr_uint32_t shm_pin(cache_shm_shard_t *shard, apr_uint32_t off)
+{
+    cache_shm_pin_t *pins = shm_pins(shard);
+    apr_uint32_t pin = shard->free_pin;
+
+    if (pin != CACHE_SHM_NIL) {
+        shard->free_pin = pins[pin].next;
+        pins[pin].off = off;
+        pins[pin].pid = shm_pid;
+        shm_entry(shard, off)->refcount++;
+    }
+
+    return pin;
+}
+
+static void shm_unpin(cache_shm_shard_t *shard, apr_uint32_t pin)
+{
+    cache_shm_pin_t *p = &shm_pins(shard)[pin];
+    cache_shm_entry_t *e = shm_entry(shard, p->off);
+
+    if (!--e->refcount && (e->flags & CACHE_SHM_DEAD)) {
+        shm_release(shard, p->off);
+    }
+
+    p->off = CACHE_SHM_NIL;
+    p->pid = 0;
+    p->next = shard->free_pin;
+    shard->free_pin = pin;
+}
+
+/*
+ * The CACHE_SHM bucket, whose data live in the shared memory for as long
+ * as the entry is pinned.
+ */
+typedef struct {
+    apr_bucket_refcount refcount;
+    apr_uint32_t shard;
+    apr_uint32_t pin;
+    const char *base;
+} cache_shm_bucket_t;
+
+static apr_status_t shm_bucket_read(apr_bucket *b, const char **str,
+                                    apr_size_t *len, apr_read_type_e block)
+{
+    cache_shm_bucket_t *h = b->data;
+
+    *str = h->base + b->start;
+    *len = b->length;
+    return APR_SUCCESS;
+}
+
+static void shm_bucket_destroy(void *data)
+{
+    cache_shm_bucket_t *h = data;
+
+    if (apr_bucket_shared_destroy(h)) {
+        apr_status_t rv = shm_lock(h->shard);
+        if (rv == APR_SUCCESS) {
+            shm_unpin(shm_shard(h->shard), h->pin);
+            shm_unlock(h->shard);
+        }
+        else {
+            /* the entry stays pinned until this process exits */
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, ap_server_conf, APLOGNO(10524)
+                    "could not acquire lock, entry left pinned");
+        }
+        apr_bucket_free(h);
+    }
+}
+
+static const apr_bucket_type_t bucket_type_cache_shm = {
+    "CACHE_SHM", 5, APR_BUCKET_DATA,
+    shm_bucket_destroy,
+    shm_bucket_read,
+    apr_bucket_setaside_noop,
+    apr_bucket_shared_split,
+    apr_bucket_shared_copy
+};
+
+static apr_bucket *shm_bucket_create(apr_uint32_t shard, apr_uint32_t pin,
+                                     const char *base, apr_size_t len,
+                                     apr_bucket_alloc_t *list)
+{
+    apr_bucket *b = apr_bucket_alloc(sizeof(*b), list);
+    cache_shm_bucket_t *h = apr_bucket_alloc(sizeof(*h), list);
+
+    APR_BUCKET_INIT(b);
+    b->free = apr_bucket_free;
+    b->list = list;
+
+    h->shard = shard;
+    h->pin = pin;
+    h->base = base;
+
+    b = apr_bucket_shared_make(b, h, 0, len);
+    b->type = &bucket_type_cache_shm;
+    return b;
+}
+
+/*
+ * Locked accessors, for the request processing
+ */
+
+static apr_status_t cache_shm_pin(request_rec *r, const char *key,
+                                  apr_size_t klen, apr_uint32_t *shard,
+                                  apr_uint32_t *pin,
+                                  const unsigned char **data,
+                                  apr_size_t *dlen)
+{
+    cache_shm_shard_t *s;
+    cache_shm_entry_t *e;
+    apr_uint32_t hash, off;
+    apr_status_t rv;
+    int first_nopin = 0;
+
+    *shard = shm_shard_of(key, klen, &hash);
+    s = shm_shard(*shard);
+
+    rv = shm_lock(*shard);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10525)
+                "could not acquire lock, ignoring: %s", key);
+        return rv;
+    }
+
+    off = shm_lookup(s, hash, key, klen);
+    if (off != CACHE_SHM_NIL
+            && shm_entry(s, off)->expire < r->request_time) {
+        shm_drop(s, off);
+        off = CACHE_SHM_NIL;
+    }
+    if (off == CACHE_SHM_NIL) {
+        s->misses++;
+        rv = APR_NOTFOUND;
+    }
+    else if ((*pin = shm_pin(s, off)) == CACHE_SHM_NIL) {
+        /* as many responses as pins are served from this shard already */
+        s->misses++;
+        rv = APR_EBUSY;
+        first_nopin = !s->nopin++;
+    }
+    else {
+        e = shm_entry(s, off);
+        e->flags |= CACHE_SHM_REF;
+        s->hits++;
+        *data = (const unsigned char *)SHM_ENTRY_DATA(e);
+        *dlen = e->datalen;
+    }
+
+    shm_unlock(*shard);
+
+    if (first_nopin) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10679)
+                "%u responses served from shard %u at once, its entries "
+                "are missed meanwhile (counted by mod_status): %s",
+                shm_header->npins, *shard, key);
+    }
+    return rv;
+}
+
+static void cache_shm_unpin(request_rec *r, apr_uint32_t shard,
+                            apr_uint32_t pin)
+{
+    apr_status_t rv = shm_lock(shard);
+
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10526)
+                "could not acquire lock, entry left pinned");
+        return;
+    }
+    shm_unpin(shm_shard(shard), pin);
+    shm_unlock(shard);
+}
+
+static apr_status_t cache_shm_store(request_rec *r, const char *key,
+                                    const unsigned char *data,
+                                    apr_size_t dlen, apr_time_t expire)
+{
+    apr_size_t klen = strlen(key);
+    apr_uint32_t hash, shard = shm_shard_of(key, klen, &hash);
+    apr_status_t rv;
+
+    rv = shm_lock(shard);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10527)
+                "could not acquire lock, ignoring: %s", key);
+        return rv;
+    }
+    rv = shm_store(shm_shard(shard), hash, key, klen, data, dlen, expire,
+                   r->request_time);
+    shm_unlock(shard);
+
+    return rv;
+}
+
+static apr_status_t cache_shm_remove(request_rec *r, const char *key,
+                                     int invalidate)
+{
+    apr_size_t klen = strlen(key);
+    apr_uint32_t hash, shard = shm_shard_of(key, klen, &hash), off;
+    cache_shm_shard_t *s = shm_shard(shard);
+    apr_status_t rv;
+
+    rv = shm_lock(shard);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10528)
+                "could not acquire lock, ignoring: %s", key);
+        return rv;
+    }
+    off = shm_lookup(s, hash, key, klen);
+    if (off == CACHE_SHM_NIL) {
+        rv = APR_NOTFOUND;
+    }
+    else if (invalidate) {
+        /* flip the bit in place, the entry is still usable as stale */
+        cache_shm_entry_t *e = shm_entry(s, off);
+        cache_shm_info_t *info = (cache_shm_info_t *)SHM_ENTRY_DATA(e);
+        if (e->datalen >= sizeof(*info)
+                && info->format == CACHE_SHM_DISK_FORMAT_VERSION) {
+            info->control.invalidated = 1;
+        }
+    }
+    else {
+        shm_drop(s, off);
+    }
+    shm_unlock(shard);
+
+    return rv;
+}
+
+/*
+ * Local static functions
+ */
+
+static apr_status_t read_array(request_rec *r, apr_array_header_t *arr,
+        const unsigned char *buffer, apr_size_t buffer_len, apr_size_t *slider)
+{
+    apr_size_t val = *slider;
+
+    while (*slider < buffer_len) {
+        if (buffer[*slider] == '\r') {
+            if (val == *slider) {
+                (*slider)++;
+                return APR_SUCCESS;
+            }
+            *((const char **) apr_array_push(arr)) = apr_pstrndup(r->pool,
+                    (const char *) buffer + val, *slider - val);
+            (*slider)++;
+            if (*slider < buffer_len && buffer[*slider] == '\n') {
+                (*slider)++;
+            }
+            val = *slider;
+        }
+        else if (buffer[*slider] == '\0') {
+            (*slider)++;
+            return APR_SUCCESS;
+        }
+        else {
+            (*slider)++;
+        }
+    }
+
+    return APR_EOF;
+}
+
+static apr_status_t store_array(apr_array_header_t *arr, unsigned char *buffer,
+        apr_size_t buffer_len, apr_size_t *slider)
+{
+    int i, len;
+    const char **elts;
+
+    elts = (const char **) arr->elts;
+
+    for (i = 0; i < arr->nelts; i++) {
+        apr_size_t e_len = strlen(elts[i]);
+        if (e_len + 3 >= buffer_len - *slider) {
+            return APR_EOF;
+        }
+        len = apr_snprintf(buffer ? (char *) buffer + *slider : NULL,
+                buffer ? buffer_len - *slider : 0, "%s" CRLF, elts[i]);
+        *slider += len;
+    }
+    if (buffer) {
+        memcpy(buffer + *slider, CRLF, sizeof(CRLF) - 1);
+    }
+    *slider += sizeof(CRLF) - 1;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t read_table(request_rec *r, apr_table_t *table,
+        const unsigned char *buffer, apr_size_t buffer_len,
+        apr_size_t *slider)
+{
+    apr_size_t key = *slider, colon = 0, len = 0;
+
+    while (*slider < buffer_len) {
+        if (buffer[*slider] == ':') {
+            if (!colon) {
+                colon = *slider;
+            }
+            (*slider)++;
+        }
+        else if (buffer[*slider] == '\r') {
+            len = colon;
+            if (key == *slider) {
+                (*slider)++;
+                if (*slider < buffer_len && buffer[*slider] == '\n') {
+                    (*slider)++;
+                }
+                return APR_SUCCESS;
+            }
+            if (!colon || buffer[colon++] != ':') {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10529)
+                        "Premature end of cache headers.");
+                return APR_EGENERAL;
+            }
+            /* Do not go past the \r from above as apr_isspace('\r') is true */
+            while (apr_isspace(buffer[colon]) && (colon < *slider)) {
+                colon++;
+            }
+            apr_table_addn(table, apr_pstrmemdup(r->pool, (const char *) buffer
+                    + key, len - key), apr_pstrmemdup(r->pool,
+                    (const char *) buffer + colon, *slider - colon));
+            (*slider)++;
+            if (*slider < buffer_len && buffer[*slider] == '\n') {
+                (*slider)++;
+            }
+            key = *slider;
+            colon = 0;
+        }
+        else if (buffer[*slider] == '\0') {
+            (*slider)++;
+            return APR_SUCCESS;
+        }
+        else {
+            (*slider)++;
+        }
+    }
+
+    return APR_EOF;
+}
+
+static apr_status_t store_table(apr_table_t *table, unsigned char *buffer,
+        apr_size_t buffer_len, apr_size_t *slider)
+{
+    int i, len;
+    apr_table_entry_t *elts;
+
+    elts = (apr_table_entry_t *) apr_table_elts(table)->elts;
+    for (i = 0; i < apr_table_elts(table)->nelts; ++i) {
+        if (elts[i].key != NULL) {
+            apr_size_t key_len = strlen(elts[i].key);
+            apr_size_t val_len = strlen(elts[i].val);
+            if (key_len + val_len + 5 >= buffer_len - *slider) {
+                return APR_EOF;
+            }
+            len = apr_snprintf(buffer ? (char *) buffer + *slider : NULL,
+                    buffer ? buffer_len - *slider : 0, "%s: %s" CRLF,
+                    elts[i].key, elts[i].val);
+            *slider += len;
+        }
+    }
+    if (3 >= buffer_len - *slider) {
+        return APR_EOF;
+    }
+    if (buffer) {
+        memcpy(buffer + *slider, CRLF, sizeof(CRLF) - 1);
+    }
+    *slider += sizeof(CRLF) - 1;
+
+    return APR_SUCCESS;
+}
+
+static const char* regen_key(request_rec *r, apr_table_t *headers,
+                             apr_array_header_t *varray, const char *oldkey,
+                             apr_size_t *newkeylen)
+{
+    struct iovec *iov;
+    int i, k;
+    int nvec;
+    const char *header;
+    const char **elts;
+
+    nvec = (varray->nelts * 2) + 1;
+    iov = apr_palloc(r->pool, sizeof(struct iovec) * nvec);
+    elts = (const char **) varray->elts;
+
+    for (i = 0, k = 0; i < varray->nelts; i++) {
+        header = ap_cache_vary_value(r, elts[i],
+                                     apr_table_get(headers, elts[i]));
+        if (!header) {
+            header = "";
+        }
+        iov[k].iov_base = (char*) elts[i];
+        iov[k].iov_len = strlen(elts[i]);
+        k++;
+        iov[k].iov_base = (char*) header;
+        iov[k].iov_len = strlen(header);
+        k++;
+    }
+    iov[k].iov_base = (char*) oldkey;
+    iov[k].iov_len = strlen(oldkey);
+    k++;
+
+    return apr_pstrcatv(r->pool, iov, k, newkeylen);
+}
+
+static int array_alphasort(const void *fn1, const void *fn2)
+{
+    return strcmp(*(char**) fn1, *(char**) fn2);
+}
+
+static void tokens_to_array(apr_pool_t *p, const char *data,
+        apr_array_header_t *arr)
+{
+    char *token;
+
+    while ((token = ap_get_list_item(p, &data)) != NULL) {
+        *((const char **) apr_array_push(arr)) = token;
+    }
+
+    /* Sort it so that "Vary: A, B" and "Vary: B, A" are stored the same. */
+    qsort((void *) arr->elts, arr->nelts, sizeof(char *), array_alphasort);
+}
+
+/*
+ * Hook and mod_cache callback functions
+ */
+static int create_entity(cache_handle_t *h, request_rec *r, const char *key,
+        apr_off_t len, apr_bucket_brigade *bb)
+{
+    cache_object_t *obj;
+    cache_shm_object_t *sobj;
+    apr_size_t total;
+
+    if (!shm_header) {
+        return DECLINED;
+    }
+
+    /* we don't support caching of range requests (yet) */
+    if (r->status == HTTP_PARTIAL_CONTENT) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10530)
+                "URL %s partial content response not cached",
+                key);
+        return DECLINED;
+    }
+
+    /*
+     * Like mod_cache_socache, decline early what can't fit so that
+     * another provider (e.g. mod_cache_disk) gets the opportunity to
+     * cache it.
+     */
+    if (len < 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10531)
+                "URL '%s' had no explicit size, ignoring", key);
+        return DECLINED;
+    }
+    if (len > (apr_off_t)shm_header->max) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10532)
+                "URL '%s' body larger than limit, ignoring "
+                "(%" APR_OFF_T_FMT " > %" APR_SIZE_T_FMT ")",
+                key, len, shm_header->max);
+        return DECLINED;
+    }
+
+    /* estimate the total cached size, given current headers */
+    total = len + sizeof(cache_shm_info_t) + strlen(key);
+    if (APR_SUCCESS != store_table(r->headers_out, NULL, shm_header->max,
+                                   &total)
+            || APR_SUCCESS != store_table(r->headers_in, NULL,
+                                          shm_header->max, &total)
+            || total >= shm_header->max) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10533)
+                "URL '%s' body and headers larger than limit, ignoring "
+                "(%" APR_SIZE_T_FMT ")", key, shm_header->max);
+        return DECLINED;
+    }
+
+    /* Allocate and initialize cache_object_t and cache_shm_object_t */
+    h->cache_obj = obj = apr_pcalloc(r->pool, sizeof(*obj));
+    obj->vobj = sobj = apr_pcalloc(r->pool, sizeof(*sobj));
+
+    obj->key = apr_pstrdup(r->pool, key);
+    sobj->key = obj->key;
+    sobj->name = obj->key;
+
+    return OK;
+}
+
+static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
+{
+    const unsigned char *data = NULL;
+    apr_size_t dlen = 0, slider, len;
+    apr_uint32_t format, shard, pin;
+    const char *nkey = NULL;
+    apr_status_t rc;
+    cache_object_t *obj;
+    cache_info *info;
+    cache_shm_object_t *sobj;
+
+    h->cache_obj = NULL;
+
+    if (!shm_header) {
+        return DECLINED;
+    }
+
+    /* Create and init the cache object */
+    obj = apr_pcalloc(r->pool, sizeof(cache_object_t));
+    sobj = apr_pcalloc(r->pool, sizeof(cache_shm_object_t));
+
+    info = &(obj->info);
+
+    /* attempt to retrieve the cached entry */
+    rc = cache_shm_pin(r, key, strlen(key), &shard, &pin, &data, &dlen);
+    if (rc != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(10534)
+                "Key not found in cache: %s", key);
+        return DECLINED;
+    }
+    if (dlen < sizeof(format)) {
+        goto fail;
+    }
+
+    /* read the format from the cache entry */
+    memcpy(&format, data, sizeof(format));
+    slider = sizeof(format);
+
+    if (format == CACHE_SHM_VARY_FORMAT_VERSION) {
+        apr_array_header_t* varray;
+
+        slider += sizeof(apr_time_t);
+
+        varray = apr_array_make(r->pool, 5, sizeof(char*));
+        rc = read_array(r, varray, data, dlen, &slider);
+        cache_shm_unpin(r, shard, pin);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(10535)
+                    "Cannot parse vary entry for key: %s", key);
+            cache_shm_remove(r, key, 0);
+            return DECLINED;
+        }
+
+        nkey = regen_key(r, r->headers_in, varray, key, &len);
+
+        /* attempt to retrieve the cached entry */
+        rc = cache_shm_pin(r, nkey, len, &shard, &pin, &data, &dlen);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(10536)
+                    "Key not found in cache: %s", key);
+            return DECLINED;
+        }
+        if (dlen < sizeof(format)) {
+            goto fail;
+        }
+        memcpy(&format, data, sizeof(format));
+    }
+    else {
+        nkey = key;
+    }
+
+    if (format != CACHE_SHM_DISK_FORMAT_VERSION) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10537)
+                "Key '%s' found in cache has version %d, expected %d, ignoring",
+                nkey, format, CACHE_SHM_DISK_FORMAT_VERSION);
+        goto fail;
+    }
+
+    obj->key = nkey;
+    sobj->key = nkey;
+    sobj->name = key;
+
+    if (dlen < sizeof(cache_shm_info_t)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10538)
+                "Cache entry for key '%s' too short, removing", nkey);
+        goto fail;
+    }
+    memcpy(&sobj->shm_info, data, sizeof(cache_shm_info_t));
+    slider = sizeof(cache_shm_info_t);
+
+    /* Store it away so we can get it later. */
+    info->status = sobj->shm_info.status;
+    info->date = sobj->shm_info.date;
+    info->expire = sobj->shm_info.expire;
+    info->request_time = sobj->shm_info.request_time;
+    info->response_time = sobj->shm_info.response_time;
+
+    memcpy(&info->control, &sobj->shm_info.control, sizeof(cache_control_t));
+
+    if (sobj->shm_info.name_len > dlen - slider
+            || strncmp((const char *) data + slider, sobj->name,
+                       sobj->shm_info.name_len)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10539)
+                "Cache entry for key '%s' URL mismatch, ignoring", nkey);
+        cache_shm_unpin(r, shard, pin);
+        return DECLINED;
+    }
+    slider += sobj->shm_info.name_len;
+
+    /* Is this a cached HEAD request? */
+    if (sobj->shm_info.header_only && !r->header_only) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, APLOGNO(10540)
+                "HEAD request cached, non-HEAD requested, ignoring: %s",
+                sobj->key);
+        cache_shm_unpin(r, shard, pin);
+        return DECLINED;
+    }
+
+    h->req_hdrs = apr_table_make(r->pool, 20);
+    h->resp_hdrs = apr_table_make(r->pool, 20);
+
+    /* Call routine to read the header lines/status line */
+    if (APR_SUCCESS != read_table(r, h->resp_hdrs, data, dlen, &slider)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10541)
+                "Cache entry for key '%s' response headers unreadable, removing", nkey);
+        goto fail;
+    }
+    if (APR_SUCCESS != read_table(r, h->req_hdrs, data, dlen, &slider)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10542)
+                "Cache entry for key '%s' request headers unreadable, removing", nkey);
+        goto fail;
+    }
+
+    /* Serve the body, if any, from the shared memory; the bucket takes
+     * over our pin on the entry and releases it when it's destroyed.
+     */
+    len = dlen - slider;
+    if (len > 0) {
+        apr_bucket *e;
+        sobj->body = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+        e = shm_bucket_create(shard, pin, (const char *) data + slider, len,
+                              r->connection->bucket_alloc);
+        APR_BRIGADE_INSERT_TAIL(sobj->body, e);
+    }
+    else {
+        cache_shm_unpin(r, shard, pin);
+    }
+
+    /* make the configuration stick */
+    h->cache_obj = obj;
+    obj->vobj = sobj;
+
+    return OK;
+
+fail:
+    cache_shm_unpin(r, shard, pin);
+    cache_shm_remove(r, nkey ? nkey : key, 0);
+    return DECLINED;
+}
+
+static int remove_entity(cache_handle_t *h)
+{
+    /* Null out the cache object pointer so next time we start from scratch  */
+    h->cache_obj = NULL;
+    return OK;
+}
+
+static int remove_url(cache_handle_t *h, request_rec *r)
+{
+    cache_shm_object_t *sobj;
+
+    sobj = (cache_shm_object_t *) h->cache_obj->vobj;
+    if (!sobj) {
+        return DECLINED;
+    }
+
+    /* Remove the key from the cache */
+    cache_shm_remove(r, sobj->key, 0);
+
+    return OK;
+}
+
+static apr_status_t recall_headers(cache_handle_t *h, request_rec *r)
+{
+    /* we recalled the headers during open_entity, so do nothing */
+    return APR_SUCCESS;
+}
+
+static apr_status_t recall_body(cache_handle_t *h, apr_pool_t *p,
+        apr_bucket_brigade *bb)
+{
+    cache_shm_object_t *sobj = (cache_shm_object_t*) h->cache_obj->vobj;
+
+    if (sobj->body) {
+        APR_BRIGADE_CONCAT(bb, sobj->body);
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t store_headers(cache_handle_t *h, request_rec *r,
+        cache_info *info)
+{
+    apr_size_t slider;
+    apr_status_t rv;
+    cache_object_t *obj = h->cache_obj;
+    cache_shm_object_t *sobj = (cache_shm_object_t*) obj->vobj;
+    cache_shm_info_t *shm_info;
+
+    memcpy(&h->cache_obj->info, info, sizeof(cache_info));
+
+    if (r->headers_out) {
+        sobj->headers_out = ap_cache_cacheable_headers_out(r);
+    }
+
+    if (r->headers_in) {
+        sobj->headers_in = ap_cache_cacheable_headers_in(r);
+    }
+
+    sobj->expire
+            = obj->info.expire > r->request_time + apr_time_from_sec(DEFAULT_MAXTIME)
+                    ? r->request_time + apr_time_from_sec(DEFAULT_MAXTIME)
+                    : obj->info.expire + apr_time_from_sec(DEFAULT_MINTIME);
+
+    apr_pool_create(&sobj->pool, r->pool);
+    apr_pool_tag(sobj->pool, "mod_cache_shm (store_headers)");
+
+    sobj->buffer = apr_palloc(sobj->pool, shm_header->max);
+    sobj->buffer_len = shm_header->max;
+    shm_info = (cache_shm_info_t *) sobj->buffer;
+
+    if (sobj->headers_out) {
+        const char *vary;
+
+        vary = apr_table_get(sobj->headers_out, "Vary");
+
+        if (vary) {
+            apr_array_header_t* varray;
+            apr_uint32_t format = CACHE_SHM_VARY_FORMAT_VERSION;
+
+            memcpy(sobj->buffer, &format, sizeof(format));
+            slider = sizeof(format);
+
+            memcpy(sobj->buffer + slider, &obj->info.expire,
+                    sizeof(obj->info.expire));
+            slider += sizeof(obj->info.expire);
+
+            varray = apr_array_make(r->pool, 6, sizeof(char*));
+            tokens_to_array(r->pool, vary, varray);
+
+            if (APR_SUCCESS != (rv = store_array(varray, sobj->buffer,
+                    sobj->buffer_len, &slider))) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10543)
+                        "buffer too small for Vary array, caching aborted: %s",
+                        obj->key);
+                apr_pool_destroy(sobj->pool);
+                sobj->pool = NULL;
+                return rv;
+            }
+            rv = cache_shm_store(r, obj->key, sobj->buffer, slider,
+                                 sobj->expire);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(10544)
+                        "Vary not written to cache, ignoring: %s", obj->key);
+                apr_pool_destroy(sobj->pool);
+                sobj->pool = NULL;
+                return rv;
+            }
+
+            obj->key = sobj->key = regen_key(r, sobj->headers_in, varray,
+                                             sobj->name, NULL);
+        }
+    }
+
+    memset(shm_info, 0, sizeof(*shm_info));
+    shm_info->format = CACHE_SHM_DISK_FORMAT_VERSION;
+    shm_info->date = obj->info.date;
+    shm_info->expire = obj->info.expire;
+    shm_info->request_time = obj->info.request_time;
+    shm_info->response_time = obj->info.response_time;
+    shm_info->status = obj->info.status;
+
+    if (r->header_only && r->status != HTTP_NOT_MODIFIED) {
+        shm_info->header_only = 1;
+    }
+    else {
+        shm_info->header_only = sobj->shm_info.header_only;
+    }
+
+    shm_info->name_len = strlen(sobj->name);
+
+    memcpy(&shm_info->control, &obj->info.control, sizeof(cache_control_t));
+    slider = sizeof(cache_shm_info_t);
+
+    if (slider + shm_info->name_len >= sobj->buffer_len) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10545)
+                "cache buffer too small for name: %s",
+                sobj->name);
+        apr_pool_destroy(sobj->pool);
+        sobj->pool = NULL;
+        return APR_EGENERAL;
+    }
+    memcpy(sobj->buffer + slider, sobj->name, shm_info->name_len);
+    slider += shm_info->name_len;
+
+    if (sobj->headers_out) {
+        if (APR_SUCCESS != store_table(sobj->headers_out, sobj->buffer,
+                sobj->buffer_len, &slider)) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10546)
+                    "out-headers didn't fit in buffer: %s", sobj->name);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+    }
+
+    if (sobj->headers_in) {
+        if (APR_SUCCESS != store_table(sobj->headers_in, sobj->buffer,
+                sobj->buffer_len, &slider)) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10547)
+                    "in-headers didn't fit in buffer %s",
+                    sobj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+    }
+
+    sobj->body_offset = slider;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t store_body(cache_handle_t *h, request_rec *r,
+        apr_bucket_brigade *in, apr_bucket_brigade *out)
+{
+    apr_bucket *e;
+    apr_status_t rv = APR_SUCCESS;
+    cache_shm_object_t *sobj =
+            (cache_shm_object_t *) h->cache_obj->vobj;
+    int seen_eos = 0;
+
+    if (!sobj->newbody) {
+        sobj->body_length = 0;
+        sobj->newbody = 1;
+    }
+
+    while (APR_SUCCESS == rv && !APR_BRIGADE_EMPTY(in)) {
+        const char *str;
+        apr_size_t length;
+
+        e = APR_BRIGADE_FIRST(in);
+
+        /* are we done completely? if so, pass any trailing buckets right through */
+        if (sobj->done || !sobj->pool) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            continue;
+        }
+
+        /* have we seen eos yet? */
+        if (APR_BUCKET_IS_EOS(e)) {
+            seen_eos = 1;
+            sobj->done = 1;
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            break;
+        }
+
+        /* honour flush buckets, we'll get called again */
+        if (APR_BUCKET_IS_FLUSH(e)) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            break;
+        }
+
+        /* metadata buckets are preserved as is */
+        if (APR_BUCKET_IS_METADATA(e)) {
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(out, e);
+            continue;
+        }
+
+        /* read the bucket, write to the cache */
+        rv = apr_bucket_read(e, &str, &length, APR_BLOCK_READ);
+        APR_BUCKET_REMOVE(e);
+        APR_BRIGADE_INSERT_TAIL(out, e);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10548)
+                    "Error when reading bucket for URL %s",
+                    h->cache_obj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return rv;
+        }
+
+        /* don't write empty buckets to the cache */
+        if (!length) {
+            continue;
+        }
+
+        sobj->body_length += length;
+        if (sobj->body_length >= sobj->buffer_len - sobj->body_offset) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10549)
+                    "URL %s failed the buffer size check "
+                    "(%" APR_OFF_T_FMT ">=%" APR_SIZE_T_FMT ")",
+                    h->cache_obj->key, sobj->body_length,
+                    sobj->buffer_len - sobj->body_offset);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+        memcpy(sobj->buffer + sobj->body_offset + sobj->body_length - length,
+               str, length);
+    }
+
+    /* Was this the final bucket? If yes, perform sanity checks.
+     */
+    if (seen_eos) {
+        const char *cl_header;
+        apr_off_t cl;
+
+        if (r->connection->aborted || r->no_cache) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(10550)
+                    "Discarding body for URL %s "
+                    "because connection has been aborted.",
+                    h->cache_obj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+
+        cl_header = apr_table_get(r->headers_out, "Content-Length");
+        if (cl_header && (!ap_parse_strict_length(&cl, cl_header)
+                          || cl != sobj->body_length)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10551)
+                    "URL %s didn't receive complete response, not caching",
+                    h->cache_obj->key);
+            apr_pool_destroy(sobj->pool);
+            sobj->pool = NULL;
+            return APR_EGENERAL;
+        }
+
+        /* All checks were fine, we're good to go when the commit comes */
+
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_object_t *obj = h->cache_obj;
+    cache_shm_object_t *sobj = (cache_shm_object_t *) obj->vobj;
+    apr_status_t rv;
+
+    if (!sobj->pool) {
+        return APR_EGENERAL;
+    }
+
+    rv = cache_shm_store(r, sobj->key, sobj->buffer,
+                         sobj->body_offset + sobj->body_length, sobj->expire);
+    if (rv != APR_SUCCESS) {
+        /* For safety, remove any existing entry on failure, just in case it
+         * could not be revalidated successfully.
+         */
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(10552)
+                "could not write to cache, ignoring: %s", sobj->key);
+        cache_shm_remove(r, sobj->key, 0);
+    }
+    else {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10553)
+                "commit_entity: Headers and body for URL %s cached for maximum of %d seconds.",
+                sobj->name, (apr_uint32_t)apr_time_sec(sobj->expire - r->request_time));
+    }
+
+    apr_pool_destroy(sobj->pool);
+    sobj->pool = NULL;
+
+    return rv;
+}
+
+static apr_status_t invalidate_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_shm_object_t *sobj = (cache_shm_object_t *) h->cache_obj->vobj;
+
+    /* mark the entity as invalidated */
+    h->cache_obj->info.control.invalidated = 1;
+    cache_shm_remove(r, sobj->key, 1);
+
+    return APR_SUCCESS;
+}
+
+static void *create_config(apr_pool_t *p, server_rec *s)
+{
+    cache_shm_conf *conf = apr_pcalloc(p, sizeof(cache_shm_conf));
+
+    conf->max = DEFAULT_MAX_SIZE;
+
+    return conf;
+}
+
+/*
+ * mod_cache_shm configuration directives handlers.
+ */
+static const char *set_cache_shm_size(cmd_parms *cmd, void *dummy,
+        const char *arg)
+{
+    cache_shm_conf *conf = ap_get_module_config(cmd->server->module_config,
+            &cache_shm_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t size;
+
+    if (err) {
+        return err;
+    }
+    if (apr_strtoff(&size, arg, NULL, 10) != APR_SUCCESS
+            || size < 1024 * 1024 || (apr_uint64_t)size > APR_SIZE_MAX) {
+        return "CacheShmSize argument must be the size in bytes of the "
+               "shared memory, at least 1048576";
+    }
+    conf->size = (apr_size_t)size;
+    return NULL;
+}
+
+static const char *set_cache_shm_shards(cmd_parms *cmd, void *dummy,
+        const char *arg)
+{
+    cache_shm_conf *conf = ap_get_module_config(cmd->server->module_config,
+            &cache_shm_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int shards;
+
+    if (err) {
+        return err;
+    }
+    shards = atoi(arg);
+    if (shards < 1 || shards > 256) {
+        return "CacheShmShards argument must be a number of shards "
+               "between 1 and 256";
+    }
+    conf->shards = shards;
+    return NULL;
+}
+
+static const char *set_cache_shm_max(cmd_parms *cmd, void *dummy,
+        const char *arg)
+{
+    cache_shm_conf *conf = ap_get_module_config(cmd->server->module_config,
+            &cache_shm_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t max;
+
+    if (err) {
+        return err;
+    }
+    if (apr_strtoff(&max, arg, NULL, 10) != APR_SUCCESS
+            || max < 1024 || max > 1024 * 1024) {
+        return "CacheShmMaxSize argument must be a integer representing "
+               "the max size of a cached entry (headers and body), at least "
+               "1024 and at most 1048576";
+    }
+    conf->max = (apr_size_t)max;
+    return NULL;
+}
+
+static apr_status_t cache_shm_cleanup(void *data)
+{
+    if (shm_segment) {
+        apr_shm_destroy(shm_segment);
+        shm_segment = NULL;
+    }
+    shm_header = NULL;
+    shm_base = NULL;
+    shm_mutexes = NULL;
+    return APR_SUCCESS;
+}
+
+static int cache_shm_status_hook(request_rec *r, int flags)
+{
+    apr_uint64_t hits = 0, misses = 0, stores = 0, evictions = 0;
+    apr_uint64_t reclaims = 0, nospace = 0, nopin = 0;
+    apr_uint32_t i, k, entries = 0, hot = 0, pages = 0;
+
+    if (!shm_header) {
+        return DECLINED;
+    }
+
+    for (i = 0; i < shm_header->nshards; i++) {
+        cache_shm_shard_t *shard = shm_shard(i);
+        apr_status_t rv = shm_lock(i);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10554)
+                    "could not acquire lock for cache status");
+            continue;
+        }
+        hits += shard->hits;
+        misses += shard->misses;
+        stores += shard->stores;
+        evictions += shard->evictions;
+        reclaims += shard->reclaims;
+        nospace += shard->nospace;
+        nopin += shard->nopin;
+        pages += shard->next_page;
+        for (k = 0; k < shm_header->nclasses; k++) {
+            entries += shard->classes[k].nused;
+            hot += shard->classes[k].nhot;
+        }
+        shm_unlock(i);
+    }
+
+    if (!(flags & AP_STATUS_SHORT)) {
+        ap_rputs("<hr>\n"
+                 "<table cellspacing=0 cellpadding=0>\n"
+                 "<tr><td bgcolor=\"#000000\">\n"
+                 "<b><font color=\"#ffffff\" face=\"Arial,Helvetica\">"
+                 "mod_cache_shm Status:</font></b>\n"
+                 "</td></tr>\n"
+                 "<tr><td bgcolor=\"#ffffff\">\n", r);
+        ap_rprintf(r, "size: <b>%" APR_SIZE_T_FMT "</b> bytes, "
+                   "<b>%u</b> shards, <b>%u</b> of <b>%u</b> pages "
+                   "of <b>%u</b> bytes in use<br>",
+                   apr_shm_size_get(shm_segment), shm_header->nshards, pages,
+                   shm_header->npages * shm_header->nshards,
+                   shm_header->page_size);
+        ap_rprintf(r, "entries: <b>%u</b>, of which hot: <b>%u</b><br>",
+                   entries, hot);
+        ap_rprintf(r, "hits: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "misses: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "stores: <b>%" APR_UINT64_T_FMT "</b><br>",
+                   hits, misses, stores);
+        ap_rprintf(r, "evictions: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "pages reclaimed: <b>%" APR_UINT64_T_FMT "</b>, "
+                   "stores without space: <b>%" APR_UINT64_T_FMT "</b><br>",
+                   evictions, reclaims, nospace);
+        ap_rprintf(r, "hits missed without a pin left: <b>%"
+                   APR_UINT64_T_FMT "</b><br>", nopin);
+        ap_rputs("</td></tr>\n</table>\n", r);
+    }
+    else {
+        ap_rputs("ModCacheShmStatus\n", r);
+        ap_rprintf(r, "CacheShmEntries: %u\n", entries);
+        ap_rprintf(r, "CacheShmHotEntries: %u\n", hot);
+        ap_rprintf(r, "CacheShmHits: %" APR_UINT64_T_FMT "\n", hits);
+        ap_rprintf(r, "CacheShmMisses: %" APR_UINT64_T_FMT "\n", misses);
+        ap_rprintf(r, "CacheShmStores: %" APR_UINT64_T_FMT "\n", stores);
+        ap_rprintf(r, "CacheShmEvictions: %" APR_UINT64_T_FMT "\n", evictions);
+        ap_rprintf(r, "CacheShmReclaims: %" APR_UINT64_T_FMT "\n", reclaims);
+        ap_rprintf(r, "CacheShmNoSpace: %" APR_UINT64_T_FMT "\n", nospace);
+        ap_rprintf(r, "CacheShmNoPin: %" APR_UINT64_T_FMT "\n", nopin);
+    }
+
+    return OK;
+}
+
+static int cache_shm_precfg(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptmp)
+{
+    apr_status_t rv = ap_mutex_register(pconf, cache_shm_id, NULL,
+            APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(10555)
+                "failed to register %s mutex", cache_shm_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+
+    /* Register to handle mod_status status page generation */
+    APR_OPTIONAL_HOOK(ap, status_hook, cache_shm_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
+
+    return OK;
+}
+
+/* Lay out a segment of size bytes split in the given number of shards */
+static void shm_layout(cache_shm_header_t *header, apr_size_t size,
+                       apr_uint32_t shards)
+{
+    apr_size_t hdr_size = APR_ALIGN_DEFAULT(sizeof(cache_shm_header_t));
+    apr_size_t shard_size = ((size - hdr_size) / shards) & ~(apr_size_t)7;
+
+    header->nshards = shards;
+    header->shard_size = shard_size;
+    header->npins = CACHE_SHM_PINS;
+    header->page_class_offset = APR_ALIGN_DEFAULT(sizeof(cache_shm_shard_t));
+    header->npages = shard_size / header->page_size;
+    do {
+        header->nbuckets = (apr_uint64_t)header->npages * header->page_size
+                           / 1024 + 64;
+        header->pins_offset = header->page_class_offset
+                + APR_ALIGN_DEFAULT(header->npages * sizeof(apr_uint16_t));
+        header->buckets_offset = header->pins_offset
+                + APR_ALIGN_DEFAULT(header->npins * sizeof(cache_shm_pin_t));
+        header->pages_offset = APR_ALIGN(header->buckets_offset
+                + header->nbuckets * sizeof(apr_uint32_t), 64);
+    } while (header->pages_offset
+                    + (apr_size_t)header->npages * header->page_size
+                    > shard_size
+             && --header->npages);
+}
+
+static int cache_shm_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptmp, server_rec *s)
+{
+    cache_shm_conf *conf = ap_get_module_config(s->module_config,
+            &cache_shm_module);
+    cache_shm_header_t header;
+    apr_size_t hdr_size;
+    apr_uint32_t i, k, size;
+    char *base;
+    apr_status_t rv;
+
+    if (!conf->size) {
+        return OK;
+    }
+
+    /* Compute the layout: the slab classes grow by 25% up to the page */
+    memset(&header, 0, sizeof(header));
+    header.max = conf->max;
+    header.page_size = APR_ALIGN(conf->max + CACHE_SHM_KEY_ROOM, 4096);
+    for (size = CACHE_SHM_MIN_CHUNK; size < header.page_size;
+         size = APR_ALIGN_DEFAULT(size + size / 4)) {
+        header.class_size[header.nclasses++] = size;
+    }
+    header.class_size[header.nclasses++] = header.page_size;
+
+    if (conf->shards) {
+        shm_layout(&header, conf->size, conf->shards);
+    }
+    else {
+        /* As many shards as DEFAULT_SHARDS, unless it leaves them with
+         * less than CACHE_SHM_SHARD_PAGES pages each.
+         */
+        for (i = DEFAULT_SHARDS; i > 1; i--) {
+            shm_layout(&header, conf->size, i);
+            if (header.npages >= CACHE_SHM_SHARD_PAGES) {
+                break;
+            }
+        }
+        if (i == 1) {
+            shm_layout(&header, conf->size, 1);
+        }
+    }
+    if (header.npages < 2) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, APLOGNO(10556)
+                "CacheShmSize %" APR_SIZE_T_FMT " too small for %u shards "
+                "of at least two pages of %u bytes", conf->size,
+                header.nshards, header.page_size);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    hdr_size = APR_ALIGN_DEFAULT(sizeof(cache_shm_header_t));
+
+    /* Use anonymous shm, the children inherit it */
+    rv = apr_shm_create(&shm_segment, conf->size, NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10557)
+                "could not allocate %" APR_SIZE_T_FMT " bytes of shared "
+                "memory for %s", conf->size, cache_shm_id);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    apr_pool_cleanup_register(pconf, NULL, cache_shm_cleanup,
+            apr_pool_cleanup_null);
+
+    shm_header = apr_shm_baseaddr_get(shm_segment);
+    memcpy(shm_header, &header, sizeof(header));
+    shm_base = (char *)shm_header + hdr_size;
+
+    shm_mutexes = apr_pcalloc(pconf, header.nshards * sizeof(*shm_mutexes));
+    for (i = 0; i < header.nshards; i++) {
+        cache_shm_shard_t *shard = shm_shard(i);
+        cache_shm_pin_t *pins = shm_pins(shard);
+
+        rv = ap_global_mutex_create(&shm_mutexes[i], NULL, cache_shm_id,
+                apr_psprintf(ptmp, "%u", i), s, pconf, 0);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10558)
+                    "failed to create %s mutex", cache_shm_id);
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+
+        memset(shard, 0, header.page_class_offset);
+        for (k = 0; k < CACHE_SHM_MAX_CLASSES; k++) {
+            shard->classes[k].free = CACHE_SHM_NIL;
+        }
+        memset(shm_page_class(shard), 0xff,
+               header.npages * sizeof(apr_uint16_t));
+        for (k = 0; k < header.npins; k++) {
+            pins[k].next = k + 1 < header.npins ? k + 1 : CACHE_SHM_NIL;
+            pins[k].off = CACHE_SHM_NIL;
+            pins[k].pid = 0;
+        }
+        shard->free_pin = 0;
+        memset(shm_buckets(shard), 0xff,
+               header.nbuckets * sizeof(apr_uint32_t));
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10559)
+            "%s: %u shards of %u pages of %u bytes, %u slab classes",
+            cache_shm_id, header.nshards, header.npages, header.page_size,
+            header.nclasses);
+
+    return OK;
+}
+
+/* Unpin the entries a child left pinned, if it crashed while serving them,
+ * so that their pages can be reclaimed. This runs in the parent when it
+ * reaps the child, hence before its pid can be reused.
+ */
+static void cache_shm_child_status(server_rec *s, pid_t pid,
+                                   ap_generation_t gen, int slot,
+                                   mpm_child_status state)
+{
+    apr_uint32_t i, k, n = 0;
+
+    if (!shm_header || state != MPM_CHILD_EXITED) {
+        return;
+    }
+    for (i = 0; i < shm_header->nshards; i++) {
+        cache_shm_shard_t *shard = shm_shard(i);
+        cache_shm_pin_t *pins = shm_pins(shard);
+        apr_status_t rv = shm_lock(i);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10658)
+                    "could not acquire lock, entries of child %" APR_PID_T_FMT
+                    " left pinned", pid);
+            continue;
+        }
+        for (k = 0; k < shm_header->npins; k++) {
+            if (pins[k].off != CACHE_SHM_NIL && pins[k].pid == pid) {
+                shm_unpin(shard, k);
+                n++;
+            }
+        }
+        shm_unlock(i);
+    }
+    if (n) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(10659)
+                "%u entries left pinned by child %" APR_PID_T_FMT
+                " unpinned", n, pid);
+    }
+}
+
+static void cache_shm_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_uint32_t i;
+
+    if (!shm_header) {
+        return; /* don't waste the overhead of creating mutexes */
+    }
+    shm_pid = getpid();
+    for (i = 0; i < shm_header->nshards; i++) {
+        const char *lock = apr_global_mutex_lockfile(shm_mutexes[i]);
+        apr_status_t rv = apr_global_mutex_child_init(&shm_mutexes[i], lock,
+                                                      p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10560)
+                    "failed to initialise mutex in child_init");
+        }
+    }
+}
+
+static const command_rec cache_shm_cmds[] =
+{
+    AP_INIT_TAKE1("CacheShmSize", set_cache_shm_size, NULL, RSRC_CONF,
+            "The size in bytes of the shared memory storing cached entities"),
+    AP_INIT_TAKE1("CacheShmShards", set_cache_shm_shards, NULL, RSRC_CONF,
+            "The number of independently locked parts of the shared memory"),
+    AP_INIT_TAKE1("CacheShmMaxSize", set_cache_shm_max, NULL, RSRC_CONF,
+            "The maximum cache entry size (headers and body) to cache a document"),
+    { NULL }
+};
+
+static const cache_provider cache_shm_provider =
+{
+    &remove_entity, &store_headers, &store_body, &recall_headers, &recall_body,
+    &create_entity, &open_entity, &remove_url, &commit_entity,
+    &invalidate_entity
+};
+
+static void cache_shm_register_hook(apr_pool_t *p)
+{
+    /* cache initializer */
+    ap_register_provider(p, CACHE_PROVIDER_GROUP, "shm", "0",
+            &cache_shm_provider);
+    ap_hook_pre_config(cache_shm_precfg, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(cache_shm_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(cache_shm_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_status(cache_shm_child_status, NULL, NULL, APR_HOOK_MIDDLE);
+}
+
+AP_DECLARE_MODULE(cache_shm) = { STANDARD20_MODULE_STUFF,
+    NULL,               /* create per-directory config structure */
+    NULL,               /* merge per-directory config structures */
+    create_config,      /* create per-server config structure */
+    NULL,               /* merge per-server config structures */
+    cache_shm_cmds,     /* command apr_table_t */
+    cache_shm_register_hook /* register hooks */
+};
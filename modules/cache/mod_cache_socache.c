@@ -276,7 +276,7 @@ static apr_status_t store_table(apr_table_t *table, unsigned char *buffer,
     return APR_SUCCESS;
 }
 
-static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
+static const char* regen_key(request_rec *r, apr_table_t *headers,
                              apr_array_header_t *varray, const char *oldkey,
                              apr_size_t *newkeylen)
 {
@@ -287,7 +287,7 @@ static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
     const char **elts;
 
     nvec = (varray->nelts * 2) + 1;
-    iov = apr_palloc(p, sizeof(struct iovec) * nvec);
+    iov = apr_palloc(r->pool, sizeof(struct iovec) * nvec);
     elts = (const char **) varray->elts;
 
     /* TODO:
@@ -315,7 +315,8 @@ static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
      */
 
     for (i = 0, k = 0; i < varray->nelts; i++) {
-        header = apr_table_get(headers, elts[i]);
+        header = ap_cache_vary_value(r, elts[i],
+                                     apr_table_get(headers, elts[i]));
         if (!header) {
             header = "";
         }
@@ -330,7 +331,7 @@ static const char* regen_key(apr_pool_t *p, apr_table_t *headers,
     iov[k].iov_len = strlen(oldkey);
     k++;
 
-    return apr_pstrcatv(p, iov, k, newkeylen);
+    return apr_pstrcatv(r->pool, iov, k, newkeylen);
 }
 
 static int array_alphasort(const void *fn1, const void *fn2)
@@ -543,7 +544,7 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
             return DECLINED;
         }
 
-        nkey = regen_key(r->pool, r->headers_in, varray, key, &len);
+        nkey = regen_key(r, r->headers_in, varray, key, &len);
 
         /* attempt to retrieve the cached entry */
         if (socache_mutex) {
@@ -873,7 +874,7 @@ static apr_status_t store_headers(cache_handle_t *h, request_rec *r,
                 return rv;
             }
 
-            obj->key = sobj->key = regen_key(r->pool, sobj->headers_in, varray,
+            obj->key = sobj->key = regen_key(r, sobj->headers_in, varray,
                                              sobj->name, NULL);
         }
     }
@@ -51,6 +51,17 @@
     change the list, or if the files are changed, then you'll need to
     restart the server.
 
+    Alternatively, the files can be listed in a manifest maintained by
+    the module itself:
+
+        cachefilemanifest /path/to/manifest [limit]
+
+    The children count the regular files served with a 200 by GET
+    requests, and periodically merge these counts into the manifest,
+    halving the previous ones. At startup or restart, the (limit) most
+    requested files of the manifest are cached as with cachefile, and
+    the kernel is asked to read them ahead.
+
     To reiterate that point:  if the files are modified *in place*
     without restarting the server you may end up serving requests that
     are completely bogus.  You should update files by unlinking the old
@@ -78,6 +89,7 @@
 #include "apr_strings.h"
 #include "apr_hash.h"
 #include "apr_buckets.h"
+#include "apr_thread_mutex.h"
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -85,6 +97,15 @@
 #if APR_HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if APR_HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#if APR_HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "httpd.h"
 #include "http_config.h"
@@ -111,18 +132,43 @@ typedef struct {
 
 typedef struct {
     apr_hash_t *fileht;
+    /* CacheFileManifest */
+    const char *manifest;
+    int manifest_limit;
+    struct a_manifest_hits *hits;
 } a_server_config;
 
+/* The requests counted by a child since the last merge in the manifest */
+typedef struct a_manifest_hits {
+    server_rec *s;
+    apr_pool_t *pool;           /* of the counts, cleared on merge */
+    apr_hash_t *counts;         /* of apr_uint32_t, by filename */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    apr_time_t merged;
+} a_manifest_hits;
+
+/* A manifest entry */
+typedef struct {
+    const char *filename;
+    apr_uint32_t count;
+} a_manifest_entry;
+
+#define MANIFEST_DEFAULT_LIMIT 1000
+#define MANIFEST_MERGE_INTERVAL apr_time_from_sec(60)
+
 
 static void *create_server_config(apr_pool_t *p, server_rec *s)
 {
-    a_server_config *sconf = apr_palloc(p, sizeof(*sconf));
+    a_server_config *sconf = apr_pcalloc(p, sizeof(*sconf));
 
     sconf->fileht = apr_hash_make(p);
     return sconf;
 }
 
-static void cache_the_file(cmd_parms *cmd, const char *filename, int mmap)
+static void cache_the_file(server_rec *s, apr_pool_t *pool, apr_pool_t *ptemp,
+                           const char *filename, int mmap, int level)
 {
     a_server_config *sconf;
     a_file *new_file;
@@ -131,41 +177,53 @@ static void cache_the_file(cmd_parms *cmd, const char *filename, int mmap)
     apr_status_t rc;
     const char *fspec;
 
-    fspec = ap_server_root_relative(cmd->pool, filename);
+    fspec = ap_server_root_relative(pool, filename);
     if (!fspec) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, APR_EBADPATH, cmd->server, APLOGNO(00794)
+        ap_log_error(APLOG_MARK, level, APR_EBADPATH, s, APLOGNO(00794)
                      "invalid file path "
                      "%s, skipping", filename);
         return;
     }
     if ((rc = apr_stat(&tmp.finfo, fspec, APR_FINFO_MIN,
-                                 cmd->temp_pool)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, rc, cmd->server, APLOGNO(00795)
+                                 ptemp)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, level, rc, s, APLOGNO(00795)
                      "unable to stat(%s), skipping", fspec);
         return;
     }
     if (tmp.finfo.filetype != APR_REG) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, cmd->server, APLOGNO(00796)
+        ap_log_error(APLOG_MARK, level, 0, s, APLOGNO(00796)
                      "%s isn't a regular file, skipping", fspec);
         return;
     }
     if (tmp.finfo.size > AP_MAX_SENDFILE) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, cmd->server, APLOGNO(00797)
+        ap_log_error(APLOG_MARK, level, 0, s, APLOGNO(00797)
                      "%s is too large to cache, skipping", fspec);
         return;
     }
 
     rc = apr_file_open(&fd, fspec, APR_READ | APR_BINARY | APR_XTHREAD,
-                       APR_OS_DEFAULT, cmd->pool);
+                       APR_OS_DEFAULT, pool);
     if (rc != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, rc, cmd->server, APLOGNO(00798)
+        ap_log_error(APLOG_MARK, level, rc, s, APLOGNO(00798)
                      "unable to open(%s, O_RDONLY), skipping", fspec);
         return;
     }
     apr_file_inherit_set(fd);
 
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+    {
+        /* Have the kernel read the file ahead in the background, so that
+         * it is in the page cache by the time it is first served */
+        apr_os_file_t osfd;
+
+        if (apr_os_file_get(&osfd, fd) == APR_SUCCESS) {
+            posix_fadvise(osfd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+    }
+#endif
+
     /* WooHoo, we have a file to put in the cache */
-    new_file = apr_pcalloc(cmd->pool, sizeof(a_file));
+    new_file = apr_pcalloc(pool, sizeof(a_file));
     new_file->finfo = tmp.finfo;
 
 #if APR_HAS_MMAP
@@ -176,9 +234,9 @@ static void cache_the_file(cmd_parms *cmd, const char *filename, int mmap)
          */
         if ((rc = apr_mmap_create(&new_file->mm, fd, 0,
                                   (apr_size_t)new_file->finfo.size,
-                                  APR_MMAP_READ, cmd->pool)) != APR_SUCCESS) {
+                                  APR_MMAP_READ, pool)) != APR_SUCCESS) {
             apr_file_close(fd);
-            ap_log_error(APLOG_MARK, APLOG_WARNING, rc, cmd->server, APLOGNO(00799)
+            ap_log_error(APLOG_MARK, level, rc, s, APLOGNO(00799)
                          "unable to mmap %s, skipping", filename);
             return;
         }
@@ -198,7 +256,7 @@ static void cache_the_file(cmd_parms *cmd, const char *filename, int mmap)
     apr_rfc822_date(new_file->mtimestr, new_file->finfo.mtime);
     apr_snprintf(new_file->sizestr, sizeof new_file->sizestr, "%" APR_OFF_T_FMT, new_file->finfo.size);
 
-    sconf = ap_get_module_config(cmd->server->module_config, &file_cache_module);
+    sconf = ap_get_module_config(s->module_config, &file_cache_module);
     apr_hash_set(sconf->fileht, new_file->filename, strlen(new_file->filename), new_file);
 
 }
@@ -206,7 +264,8 @@ static void cache_the_file(cmd_parms *cmd, const char *filename, int mmap)
 static const char *cachefilehandle(cmd_parms *cmd, void *dummy, const char *filename)
 {
 #if APR_HAS_SENDFILE
-    cache_the_file(cmd, filename, 0);
+    cache_the_file(cmd->server, cmd->pool, cmd->temp_pool, filename, 0,
+                   APLOG_WARNING);
 #else
     /* Sendfile not supported by this OS */
     ap_log_error(APLOG_MARK, APLOG_WARNING, 0, cmd->server, APLOGNO(00800)
@@ -217,7 +276,8 @@ static const char *cachefilehandle(cmd_parms *cmd, void *dummy, const char *file
 static const char *cachefilemmap(cmd_parms *cmd, void *dummy, const char *filename)
 {
 #if APR_HAS_MMAP
-    cache_the_file(cmd, filename, 1);
+    cache_the_file(cmd->server, cmd->pool, cmd->temp_pool, filename, 1,
+                   APLOG_WARNING);
 #else
     /* MMAP not supported by this OS */
     ap_log_error(APLOG_MARK, APLOG_WARNING, 0, cmd->server, APLOGNO(00801)
@@ -226,13 +286,290 @@ static const char *cachefilemmap(cmd_parms *cmd, void *dummy, const char *filena
     return NULL;
 }
 
+static const char *cachefilemanifest(cmd_parms *cmd, void *dummy,
+                                     const char *filename, const char *limit)
+{
+    a_server_config *sconf = ap_get_module_config(cmd->server->module_config,
+                                                  &file_cache_module);
+
+    sconf->manifest = ap_server_root_relative(cmd->pool, filename);
+    if (!sconf->manifest) {
+        return apr_pstrcat(cmd->pool, "Invalid CacheFileManifest path ",
+                           filename, NULL);
+    }
+    sconf->manifest_limit = MANIFEST_DEFAULT_LIMIT;
+    if (limit) {
+        sconf->manifest_limit = atoi(limit);
+        if (sconf->manifest_limit <= 0) {
+            return "CacheFileManifest limit must be a positive number";
+        }
+    }
+    return NULL;
+}
+
+/* Read the manifest, sorted by decreasing count, into an array of
+ * a_manifest_entry (NULL if it can't be read) */
+static apr_array_header_t *manifest_read(const char *manifest, apr_pool_t *p)
+{
+    apr_array_header_t *entries;
+    apr_file_t *f;
+    char line[HUGE_STRING_LEN];
+
+    if (apr_file_open(&f, manifest, APR_FOPEN_READ | APR_FOPEN_BUFFERED,
+                      APR_OS_DEFAULT, p) != APR_SUCCESS) {
+        return NULL;
+    }
+    entries = apr_array_make(p, 64, sizeof(a_manifest_entry));
+    while (apr_file_gets(line, sizeof(line), f) == APR_SUCCESS) {
+        char *filename, *end;
+        apr_size_t len;
+        a_manifest_entry *e;
+
+        filename = strchr(line, ' ');
+        len = strlen(line);
+        if (!filename || !len || line[len - 1] != '\n') {
+            continue;
+        }
+        line[len - 1] = '\0';
+        *filename++ = '\0';
+        e = apr_array_push(entries);
+        e->count = (apr_uint32_t)strtoul(line, &end, 10);
+        e->filename = apr_pstrdup(p, filename);
+        if (*end || !*filename) {
+            apr_array_pop(entries);
+        }
+    }
+    apr_file_close(f);
+
+    return entries;
+}
+
+static int manifest_compare(const void *a, const void *b)
+{
+    const a_manifest_entry *ea = a, *eb = b;
+
+    return (ea->count < eb->count) - (ea->count > eb->count);
+}
+
+/* Merge the counts of this child into the manifest, halving the previous
+ * ones so that the files no longer requested fade out */
+static void manifest_merge(a_server_config *sconf, apr_pool_t *p)
+{
+    a_manifest_hits *hits = sconf->hits;
+    apr_array_header_t *entries, *merged;
+    apr_hash_t *counts;
+    apr_hash_index_t *hi;
+    apr_file_t *lock, *f;
+    const char *tmp;
+    apr_status_t rv;
+    int i;
+
+    /* take the counts over, and start counting afresh so that the files
+     * first requested from now on have room too */
+    counts = apr_hash_make(p);
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(hits->mutex);
+#endif
+    for (hi = apr_hash_first(p, hits->counts); hi; hi = apr_hash_next(hi)) {
+        const void *key;
+        apr_ssize_t klen;
+        void *val;
+
+        apr_hash_this(hi, &key, &klen, &val);
+        apr_hash_set(counts, apr_pstrmemdup(p, key, klen), klen,
+                     apr_pmemdup(p, val, sizeof(apr_uint32_t)));
+    }
+    apr_pool_clear(hits->pool);
+    hits->counts = apr_hash_make(hits->pool);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(hits->mutex);
+#endif
+    if (!apr_hash_count(counts)) {
+        return;
+    }
+
+    rv = apr_file_open(&lock, apr_pstrcat(p, sconf->manifest, ".lock", NULL),
+                       APR_FOPEN_WRITE | APR_FOPEN_CREATE, APR_OS_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_lock(lock, APR_FLOCK_EXCLUSIVE);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, hits->s, APLOGNO(10611)
+                     "unable to lock the manifest %s", sconf->manifest);
+        return;
+    }
+
+    merged = apr_array_make(p, apr_hash_count(counts) + 64,
+                            sizeof(a_manifest_entry));
+    entries = manifest_read(sconf->manifest, p);
+    for (i = 0; entries && i < entries->nelts; i++) {
+        a_manifest_entry *e = &APR_ARRAY_IDX(entries, i, a_manifest_entry);
+        apr_uint32_t *count = apr_hash_get(counts, e->filename,
+                                           APR_HASH_KEY_STRING);
+
+        e->count /= 2;
+        if (count) {
+            e->count += *count;
+            apr_hash_set(counts, e->filename, APR_HASH_KEY_STRING, NULL);
+        }
+        if (e->count) {
+            APR_ARRAY_PUSH(merged, a_manifest_entry) = *e;
+        }
+    }
+    for (hi = apr_hash_first(p, counts); hi; hi = apr_hash_next(hi)) {
+        const void *key;
+        void *val;
+        a_manifest_entry *e = apr_array_push(merged);
+
+        apr_hash_this(hi, &key, NULL, &val);
+        e->filename = key;
+        e->count = *(apr_uint32_t *)val;
+    }
+    qsort(merged->elts, merged->nelts, sizeof(a_manifest_entry),
+          manifest_compare);
+
+    tmp = apr_psprintf(p, "%s.%" APR_PID_T_FMT, sconf->manifest, getpid());
+    rv = apr_file_open(&f, tmp, APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                       | APR_FOPEN_TRUNCATE | APR_FOPEN_BUFFERED,
+                       APR_OS_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        /* keep some more than what is loaded, for the counts to settle */
+        for (i = 0; i < merged->nelts && i < 2 * sconf->manifest_limit; i++) {
+            a_manifest_entry *e = &APR_ARRAY_IDX(merged, i, a_manifest_entry);
+            apr_file_printf(f, "%u %s\n", e->count, e->filename);
+        }
+        rv = apr_file_close(f);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_rename(tmp, sconf->manifest, p);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, hits->s, APLOGNO(10612)
+                     "unable to write the manifest %s", sconf->manifest);
+        apr_file_remove(tmp, p);
+    }
+
+    apr_file_unlock(lock);
+    apr_file_close(lock);
+}
+
+static apr_status_t manifest_child_exit(void *data)
+{
+    a_server_config *sconf = data;
+    apr_pool_t *p;
+
+    apr_pool_create(&p, NULL);
+    manifest_merge(sconf, p);
+    apr_pool_destroy(p);
+
+    return APR_SUCCESS;
+}
+
 static int file_cache_post_config(apr_pool_t *p, apr_pool_t *plog,
                                    apr_pool_t *ptemp, server_rec *s)
 {
-    /* Hummm, anything to do here? */
+    /* Cache the most requested files of the manifests */
+    for (; s; s = s->next) {
+        a_server_config *sconf = ap_get_module_config(s->module_config,
+                                                      &file_cache_module);
+        apr_array_header_t *entries;
+        unsigned int cached = apr_hash_count(sconf->fileht);
+        int i;
+
+        if (!sconf->manifest) {
+            continue;
+        }
+        entries = manifest_read(sconf->manifest, ptemp);
+        for (i = 0; entries && i < entries->nelts
+                    && i < sconf->manifest_limit; i++) {
+            a_manifest_entry *e = &APR_ARRAY_IDX(entries, i,
+                                                 a_manifest_entry);
+
+            if (apr_hash_get(sconf->fileht, e->filename,
+                             APR_HASH_KEY_STRING)) {
+                continue; /* listed by CacheFile or MMapFile */
+            }
+            cache_the_file(s, p, ptemp, e->filename, !APR_HAS_SENDFILE,
+                           APLOG_DEBUG);
+        }
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(10613)
+                     "cached %u files from the manifest %s",
+                     apr_hash_count(sconf->fileht) - cached, sconf->manifest);
+    }
+
     return OK;
 }
 
+static void file_cache_child_init(apr_pool_t *p, server_rec *s)
+{
+    for (; s; s = s->next) {
+        a_server_config *sconf = ap_get_module_config(s->module_config,
+                                                      &file_cache_module);
+
+        if (!sconf->manifest) {
+            continue;
+        }
+        /* the counts are allocated under the mutex only */
+        sconf->hits = apr_pcalloc(p, sizeof(a_manifest_hits));
+        sconf->hits->s = s;
+        apr_pool_create(&sconf->hits->pool, p);
+        sconf->hits->counts = apr_hash_make(sconf->hits->pool);
+        sconf->hits->merged = apr_time_now();
+#if APR_HAS_THREADS
+        apr_thread_mutex_create(&sconf->hits->mutex,
+                                APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+        /* before the counts are gone with the subpool */
+        apr_pool_pre_cleanup_register(p, sconf, manifest_child_exit);
+    }
+}
+
+/* Count the files served, for the manifest */
+static int file_cache_log_transaction(request_rec *r)
+{
+    a_server_config *sconf;
+    a_manifest_hits *hits;
+    apr_uint32_t *count;
+    apr_time_t now;
+    int merge = 0;
+
+    sconf = ap_get_module_config(r->server->module_config, &file_cache_module);
+    hits = sconf->hits;
+    if (!hits || r->status != HTTP_OK || r->method_number != M_GET
+            || !r->filename || r->finfo.filetype != APR_REG
+            || ap_strchr_c(r->filename, '\n')) {
+        return DECLINED;
+    }
+
+    now = apr_time_now();
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(hits->mutex);
+#endif
+    count = apr_hash_get(hits->counts, r->filename, APR_HASH_KEY_STRING);
+    if (!count && apr_hash_count(hits->counts)
+                  < 4 * (unsigned int)sconf->manifest_limit) {
+        count = apr_pcalloc(hits->pool, sizeof(*count));
+        apr_hash_set(hits->counts, apr_pstrdup(hits->pool, r->filename),
+                     APR_HASH_KEY_STRING, count);
+    }
+    if (count) {
+        (*count)++;
+    }
+    if (now - hits->merged > MANIFEST_MERGE_INTERVAL) {
+        hits->merged = now;
+        merge = 1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(hits->mutex);
+#endif
+
+    if (merge) {
+        manifest_merge(sconf, r->pool);
+    }
+
+    return DECLINED;
+}
+
 /* If it's one of ours, fill in r->finfo now to avoid extra stat()... this is a
  * bit of a kludge, because we really want to run after core_translate runs.
  */
@@ -386,6 +723,9 @@ AP_INIT_ITERATE("cachefile", cachefilehandle, NULL, RSRC_CONF,
      "A space separated list of files to add to the file handle cache at config time"),
 AP_INIT_ITERATE("mmapfile", cachefilemmap, NULL, RSRC_CONF,
      "A space separated list of files to mmap at config time"),
+AP_INIT_TAKE12("cachefilemanifest", cachefilemanifest, NULL, RSRC_CONF,
+     "A file to record the most requested files to, and the number of them "
+     "to cache at startup"),
     {NULL}
 };
 
@@ -393,6 +733,9 @@ static void register_hooks(apr_pool_t *p)
 {
     ap_hook_handler(file_cache_handler, NULL, NULL, APR_HOOK_LAST);
     ap_hook_post_config(file_cache_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(file_cache_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_log_transaction(file_cache_log_transaction, NULL, NULL,
+                            APR_HOOK_MIDDLE);
     ap_hook_translate_name(file_cache_xlat, NULL, NULL, APR_HOOK_MIDDLE);
     /* This trick doesn't work apparently because the translate hooks
        are single shot. If the core_hook returns OK, then our hook is
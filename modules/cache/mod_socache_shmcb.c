@@ -20,11 +20,13 @@
 #include "http_protocol.h"
 #include "http_config.h"
 #include "mod_status.h"
+#include "util_mutex.h"
 
 #include "apr.h"
 #include "apr_strings.h"
 #include "apr_time.h"
 #include "apr_shm.h"
+#include "apr_global_mutex.h"
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
 #include "apr_general.h"
@@ -48,6 +50,9 @@
 
 #define DEFAULT_SHMCB_SUFFIX ".cache"
 
+/* The subcaches share this many mutexes at most, round-robin */
+#define SHMCB_MAX_LOCKS 64
+
 #define ALIGNED_HEADER_SIZE APR_ALIGN_DEFAULT(sizeof(SHMCBHeader))
 #define ALIGNED_SUBCACHE_SIZE APR_ALIGN_DEFAULT(sizeof(SHMCBSubcache))
 #define ALIGNED_INDEX_SIZE APR_ALIGN_DEFAULT(sizeof(SHMCBIndex))
@@ -56,15 +61,6 @@
  * Header structure - the start of the shared-mem segment
  */
 typedef struct {
-    /* Stats for cache operations */
-    unsigned long stat_stores;
-    unsigned long stat_replaced;
-    unsigned long stat_expiries;
-    unsigned long stat_scrolled;
-    unsigned long stat_retrieves_hit;
-    unsigned long stat_retrieves_miss;
-    unsigned long stat_removes_hit;
-    unsigned long stat_removes_miss;
     /* Number of subcaches */
     unsigned int subcache_num;
     /* How many indexes each subcache's queue has */
@@ -86,6 +82,17 @@ typedef struct {
     unsigned int idx_pos, idx_used;
     /* Same for the data area */
     unsigned int data_pos, data_used;
+    /* Stamp of the last entry split in parts from this subcache */
+    apr_uint32_t stamp;
+    /* Stats for cache operations, under the lock of the subcache */
+    unsigned long stat_stores;
+    unsigned long stat_replaced;
+    unsigned long stat_expiries;
+    unsigned long stat_scrolled;
+    unsigned long stat_retrieves_hit;
+    unsigned long stat_retrieves_miss;
+    unsigned long stat_removes_hit;
+    unsigned long stat_removes_miss;
 } SHMCBSubcache;
 
 /*
@@ -100,8 +107,13 @@ typedef struct {
     unsigned int data_used;
     /* length of the used data which contains the id */
     unsigned int id_len;
+    /* Stamp shared by the parts of an entry split in parts */
+    apr_uint32_t stamp;
     /* Used to mark explicitly-removed socache entries */
     unsigned char removed;
+    /* Which part of the entry this is, and how many parts it has
+     * (only meaningful for the first part) */
+    unsigned char part, parts;
 } SHMCBIndex;
 
 struct ap_socache_instance_t {
@@ -110,8 +122,16 @@ struct ap_socache_instance_t {
     apr_size_t shm_size;
     apr_shm_t *shm;
     SHMCBHeader *header;
+    /* The mutexes of the subcaches */
+    apr_global_mutex_t **locks;
+    unsigned int nlocks;
 };
 
+/* The mutex type of the subcaches, and the instances whose mutexes need
+ * to be reopened in the children */
+static const char * const shmcb_lock_type = "socache-shmcb";
+static apr_array_header_t *shmcb_instances = NULL;
+
 /* The SHM data segment is of fixed size and stores data as follows.
  *
  *   [ SHMCBHeader | Subcaches ]
@@ -152,6 +172,20 @@ struct ap_socache_instance_t {
  * idx1 = { data_pos = 0, data_used = 3, id_len = 1, ...}
  * idx2 = { data_pos = 3, data_used = 3, id_len = 1, ...}
  * ...
+ *
+ * Each subcache is protected by its own mutex (the subcaches share
+ * SHMCB_MAX_LOCKS mutexes at most), so that the provider needs no
+ * external global mutex and operations on different subcaches don't
+ * serialize. No operation holds more than one of these mutexes at a
+ * time.
+ *
+ * An entry larger than half of a subcache's data area is split in parts
+ * of at most that size, stored in the subcache of its id and the
+ * following ones (modulo subcache_num), each part carrying the id, its
+ * part number and a stamp unique to this version of the entry. The first
+ * part tells how many parts there are, and an entry is only retrieved if
+ * all its parts with the same stamp are still there. Parts left by a
+ * removed or replaced entry simply scroll out of their subcache.
  */
 
 /* This macro takes a pointer to the header and a zero-based index and returns
@@ -171,6 +205,15 @@ struct ap_socache_instance_t {
 #define SHMCB_MASK_DBG(pHeader, id) \
                 *(id), (*(id) & ((pHeader)->subcache_num - 1))
 
+/* This macro takes a pointer to the header and an id and returns the
+ * zero-based index of the corresponding subcache. */
+#define SHMCB_MASK_NUM(pHeader, id) \
+                (*(id) & ((pHeader)->subcache_num - 1))
+
+/* The maximum number of parts of an entry. */
+#define SHMCB_MAX_PARTS(pHeader) \
+                ((pHeader)->subcache_num < 255 ? (pHeader)->subcache_num : 255)
+
 /* This macro takes a pointer to a subcache and a zero-based index and returns
  * a pointer to the corresponding SHMCBIndex. */
 #define SHMCB_INDEX(pSubcache, num) \
@@ -261,14 +304,20 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
                                 SHMCBSubcache *subcache,
                                 unsigned char *data, unsigned int data_len,
                                 const unsigned char *id, unsigned int id_len,
-                                apr_time_t expiry);
-/* Returns zero on success, non-zero on failure. */
+                                apr_time_t expiry, apr_uint32_t stamp,
+                                unsigned char part, unsigned char parts);
+/* Returns zero on success, non-zero on failure. For the first part,
+ * the stamp and number of parts of the entry are returned, for the
+ * other parts the stamp must match. */
 static int shmcb_subcache_retrieve(server_rec *, SHMCBHeader *, SHMCBSubcache *,
                                    const unsigned char *id, unsigned int idlen,
-                                   unsigned char *data, unsigned int *datalen);
+                                   unsigned char *data, unsigned int *datalen,
+                                   unsigned char part, apr_uint32_t *stamp,
+                                   unsigned char *parts);
 /* Returns zero on success, non-zero on failure. */
 static int shmcb_subcache_remove(server_rec *, SHMCBHeader *, SHMCBSubcache *,
-                                 const unsigned char *, unsigned int);
+                                 const unsigned char *, unsigned int,
+                                 unsigned char part);
 
 /* Returns result of the (iterator)() call, zero is success (continue) */
 static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
@@ -279,9 +328,67 @@ static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
                                            ap_socache_iterator_t *iterator,
                                            unsigned char **buf,
                                            apr_size_t *buf_len,
+                                           apr_array_header_t *split,
                                            apr_pool_t *pool,
                                            apr_time_t now);
 
+/* An entry split in parts, to be iterated once its subcache is unlocked */
+typedef struct {
+    unsigned char *id;
+    unsigned int id_len;
+    unsigned char parts;
+} SHMCBSplit;
+
+static apr_status_t shmcb_lock(ap_socache_instance_t *ctx, server_rec *s,
+                               unsigned int num)
+{
+    apr_global_mutex_t *lock = ctx->locks[num % ctx->nlocks];
+    apr_status_t rv;
+
+    if (!lock) {
+        return APR_SUCCESS;
+    }
+    rv = apr_global_mutex_lock(lock);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10605)
+                     "failed to lock shmcb subcache %u", num);
+    }
+    return rv;
+}
+
+static void shmcb_unlock(ap_socache_instance_t *ctx, server_rec *s,
+                         unsigned int num)
+{
+    apr_global_mutex_t *lock = ctx->locks[num % ctx->nlocks];
+    apr_status_t rv;
+
+    if (!lock) {
+        return;
+    }
+    rv = apr_global_mutex_unlock(lock);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10606)
+                     "failed to unlock shmcb subcache %u", num);
+    }
+}
+
+/* The number of parts an entry is split in, 1 if it is stored whole */
+static unsigned int shmcb_parts(SHMCBHeader *header, unsigned int id_len,
+                                unsigned int data_len)
+{
+    unsigned int half = header->subcache_data_size / 2, parts;
+
+    if (id_len + data_len <= half || id_len >= half) {
+        return 1;
+    }
+    parts = (data_len + (half - id_len) - 1) / (half - id_len);
+    if (parts > SHMCB_MAX_PARTS(header)) {
+        /* too large to be split, stored whole if at all possible */
+        return 1;
+    }
+    return parts;
+}
+
 /*
  * High-Level "handlers" as per ssl_scache.c
  * subcache internals are deferred to shmcb_subcache_*** functions lower down
@@ -439,14 +546,6 @@ static apr_status_t socache_shmcb_init(ap_socache_instance_t *ctx,
     }
     /* OK, we're sorted */
     ctx->header = header = shm_segment;
-    header->stat_stores = 0;
-    header->stat_replaced = 0;
-    header->stat_expiries = 0;
-    header->stat_scrolled = 0;
-    header->stat_retrieves_hit = 0;
-    header->stat_retrieves_miss = 0;
-    header->stat_removes_hit = 0;
-    header->stat_removes_miss = 0;
     header->subcache_num = num_subcache;
     /* Convert the subcache size (in bytes) to a value that is suitable for
      * structure alignment on the host platform, by rounding down if necessary. */
@@ -477,9 +576,27 @@ static apr_status_t socache_shmcb_init(ap_socache_instance_t *ctx,
     /* The header is done, make the caches empty */
     for (loop = 0; loop < header->subcache_num; loop++) {
         SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, loop);
-        subcache->idx_pos = subcache->idx_used = 0;
-        subcache->data_pos = subcache->data_used = 0;
+        memset(subcache, 0, sizeof(*subcache));
+    }
+
+    /* One mutex per subcache, up to SHMCB_MAX_LOCKS */
+    ctx->nlocks = header->subcache_num < SHMCB_MAX_LOCKS ?
+                  header->subcache_num : SHMCB_MAX_LOCKS;
+    ctx->locks = apr_pcalloc(p, ctx->nlocks * sizeof(*ctx->locks));
+    for (loop = 0; loop < ctx->nlocks; loop++) {
+        rv = ap_global_mutex_create(&ctx->locks[loop], NULL, shmcb_lock_type,
+                                    apr_psprintf(p, "%s-%u", namespace, loop),
+                                    s, p, 0);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10607)
+                         "failed to create %s mutex", shmcb_lock_type);
+            return rv;
+        }
     }
+    if (shmcb_instances) {
+        APR_ARRAY_PUSH(shmcb_instances, ap_socache_instance_t *) = ctx;
+    }
+
     ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(00830)
                  "Shared memory socache initialised");
     /* Success ... */
@@ -502,8 +619,12 @@ static apr_status_t socache_shmcb_store(ap_socache_instance_t *ctx,
                                         apr_pool_t *p)
 {
     SHMCBHeader *header = ctx->header;
-    SHMCBSubcache *subcache = SHMCB_MASK(header, id);
-    int tryreplace;
+    unsigned int num = SHMCB_MASK_NUM(header, id);
+    SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, num);
+    unsigned int parts, part, part_len = 0;
+    apr_uint32_t stamp = 0;
+    apr_status_t rv;
+    int tryreplace, failed;
 
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00831)
                  "socache_shmcb_store (0x%02x -> subcache %d)",
@@ -514,19 +635,66 @@ static apr_status_t socache_shmcb_store(ap_socache_instance_t *ctx,
                 "(%u bytes)", idlen);
         return APR_EINVAL;
     }
-    tryreplace = shmcb_subcache_remove(s, header, subcache, id, idlen);
-    if (shmcb_subcache_store(s, header, subcache, encoded,
-                             len_encoded, id, idlen, expiry)) {
+
+    parts = shmcb_parts(header, idlen, len_encoded);
+    if (parts > 1) {
+        /* Stamp this version of the entry, then store the parts but the
+         * first one in the following subcaches, so that the entry can
+         * only be found once all of them are there.
+         */
+        if ((rv = shmcb_lock(ctx, s, num)) != APR_SUCCESS) {
+            return rv;
+        }
+        stamp = ++subcache->stamp;
+        shmcb_unlock(ctx, s, num);
+
+        part_len = header->subcache_data_size / 2 - idlen;
+        for (part = parts - 1; part > 0; part--) {
+            unsigned int pnum = (num + part) % header->subcache_num;
+            SHMCBSubcache *psubcache = SHMCB_SUBCACHE(header, pnum);
+            unsigned int offset = part * part_len;
+
+            if ((rv = shmcb_lock(ctx, s, pnum)) != APR_SUCCESS) {
+                return rv;
+            }
+            shmcb_subcache_remove(s, header, psubcache, id, idlen, part);
+            failed = shmcb_subcache_store(s, header, psubcache,
+                                          encoded + offset,
+                                          part == parts - 1 ?
+                                          len_encoded - offset : part_len,
+                                          id, idlen, expiry, stamp, part,
+                                          parts);
+            shmcb_unlock(ctx, s, pnum);
+            if (failed) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(10608)
+                             "can't store part %u of an socache entry!",
+                             part);
+                return APR_ENOSPC;
+            }
+        }
+    }
+
+    if ((rv = shmcb_lock(ctx, s, num)) != APR_SUCCESS) {
+        return rv;
+    }
+    tryreplace = shmcb_subcache_remove(s, header, subcache, id, idlen, 0);
+    failed = shmcb_subcache_store(s, header, subcache, encoded,
+                                  parts > 1 ? part_len : len_encoded,
+                                  id, idlen, expiry, stamp, 0, parts);
+    if (!failed) {
+        if (tryreplace == 0) {
+            subcache->stat_replaced++;
+        }
+        else {
+            subcache->stat_stores++;
+        }
+    }
+    shmcb_unlock(ctx, s, num);
+    if (failed) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(00833)
                      "can't store an socache entry!");
         return APR_ENOSPC;
     }
-    if (tryreplace == 0) {
-        header->stat_replaced++;
-    }
-    else {
-        header->stat_stores++;
-    }
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00834)
                  "leaving socache_shmcb_store successfully");
     return APR_SUCCESS;
@@ -539,7 +707,11 @@ static apr_status_t socache_shmcb_retrieve(ap_socache_instance_t *ctx,
                                            apr_pool_t *p)
 {
     SHMCBHeader *header = ctx->header;
-    SHMCBSubcache *subcache = SHMCB_MASK(header, id);
+    unsigned int num = SHMCB_MASK_NUM(header, id);
+    SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, num);
+    unsigned int len = *destlen;
+    unsigned char part, parts = 1;
+    apr_uint32_t stamp = 0;
     int rv;
 
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00835)
@@ -547,12 +719,42 @@ static apr_status_t socache_shmcb_retrieve(ap_socache_instance_t *ctx,
                  SHMCB_MASK_DBG(header, id));
 
     /* Get the entry corresponding to the id, if it exists. */
+    if (shmcb_lock(ctx, s, num) != APR_SUCCESS) {
+        return APR_NOTFOUND;
+    }
     rv = shmcb_subcache_retrieve(s, header, subcache, id, idlen,
-                                 dest, destlen);
+                                 dest, &len, 0, &stamp, &parts);
     if (rv == 0)
-        header->stat_retrieves_hit++;
+        subcache->stat_retrieves_hit++;
     else
-        header->stat_retrieves_miss++;
+        subcache->stat_retrieves_miss++;
+    shmcb_unlock(ctx, s, num);
+
+    /* Then its other parts, if any */
+    for (part = 1; rv == 0 && part < parts; part++) {
+        unsigned int pnum = (num + part) % header->subcache_num;
+        unsigned int plen = *destlen - len;
+
+        if (shmcb_lock(ctx, s, pnum) != APR_SUCCESS) {
+            rv = -1;
+            break;
+        }
+        rv = shmcb_subcache_retrieve(s, header, SHMCB_SUBCACHE(header, pnum),
+                                     id, idlen, dest + len, &plen, part,
+                                     &stamp, NULL);
+        shmcb_unlock(ctx, s, pnum);
+        len += plen;
+    }
+    if (rv != 0 && parts > 1
+            && shmcb_lock(ctx, s, num) == APR_SUCCESS) {
+        /* a part is missing, this is a miss after all */
+        subcache->stat_retrieves_hit--;
+        subcache->stat_retrieves_miss++;
+        shmcb_unlock(ctx, s, num);
+    }
+    if (rv == 0) {
+        *destlen = len;
+    }
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00836)
                  "leaving socache_shmcb_retrieve successfully");
 
@@ -564,7 +766,8 @@ static apr_status_t socache_shmcb_remove(ap_socache_instance_t *ctx,
                                          unsigned int idlen, apr_pool_t *p)
 {
     SHMCBHeader *header = ctx->header;
-    SHMCBSubcache *subcache = SHMCB_MASK(header, id);
+    unsigned int num = SHMCB_MASK_NUM(header, id);
+    SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, num);
     apr_status_t rv;
 
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00837)
@@ -575,13 +778,19 @@ static apr_status_t socache_shmcb_remove(ap_socache_instance_t *ctx,
                 "(%u bytes)", idlen);
         return APR_EINVAL;
     }
-    if (shmcb_subcache_remove(s, header, subcache, id, idlen) == 0) {
-        header->stat_removes_hit++;
+    if ((rv = shmcb_lock(ctx, s, num)) != APR_SUCCESS) {
+        return rv;
+    }
+    /* The other parts of a split entry can't be found without the first
+     * one, they will scroll out of their subcaches. */
+    if (shmcb_subcache_remove(s, header, subcache, id, idlen, 0) == 0) {
+        subcache->stat_removes_hit++;
         rv = APR_SUCCESS;
     } else {
-        header->stat_removes_miss++;
+        subcache->stat_removes_miss++;
         rv = APR_NOTFOUND;
     }
+    shmcb_unlock(ctx, s, num);
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00839)
                  "leaving socache_shmcb_remove successfully");
 
@@ -598,16 +807,29 @@ static void socache_shmcb_status(ap_socache_instance_t *ctx,
     apr_time_t now = apr_time_now();
     double expiry_total = 0;
     int index_pct, cache_pct;
+    SHMCBSubcache stats;
 
     AP_DEBUG_ASSERT(header->subcache_num > 0);
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00840) "inside shmcb_status");
-    /* Perform the iteration inside the mutex to avoid corruption or invalid
-     * pointer arithmetic. The rest of our logic uses read-only header data so
-     * doesn't need the lock. */
+    memset(&stats, 0, sizeof(stats));
+    /* Perform the iteration of each subcache inside its mutex to avoid
+     * corruption or invalid pointer arithmetic. The rest of our logic uses
+     * read-only header data so doesn't need the lock. */
     /* Iterate over the subcaches */
     for (loop = 0; loop < header->subcache_num; loop++) {
         SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, loop);
+        if (shmcb_lock(ctx, s, loop) != APR_SUCCESS) {
+            continue;
+        }
         shmcb_subcache_expire(s, header, subcache, now);
+        stats.stat_stores += subcache->stat_stores;
+        stats.stat_replaced += subcache->stat_replaced;
+        stats.stat_expiries += subcache->stat_expiries;
+        stats.stat_scrolled += subcache->stat_scrolled;
+        stats.stat_retrieves_hit += subcache->stat_retrieves_hit;
+        stats.stat_retrieves_miss += subcache->stat_retrieves_miss;
+        stats.stat_removes_hit += subcache->stat_removes_hit;
+        stats.stat_removes_miss += subcache->stat_removes_miss;
         total += subcache->idx_used;
         cache_total += subcache->data_used;
         if (subcache->idx_used) {
@@ -621,6 +843,7 @@ static void socache_shmcb_status(ap_socache_instance_t *ctx,
             else
                 min_expiry = ((idx_expiry < min_expiry) ? idx_expiry : min_expiry);
         }
+        shmcb_unlock(ctx, s, loop);
     }
     index_pct = (100 * total) / (header->index_num *
                                  header->subcache_num);
@@ -648,19 +871,19 @@ static void socache_shmcb_status(ap_socache_instance_t *ctx,
         ap_rprintf(r, "index usage: <b>%d%%</b>, cache usage: <b>%d%%</b><br>",
                    index_pct, cache_pct);
         ap_rprintf(r, "total entries stored since starting: <b>%lu</b><br>",
-                   header->stat_stores);
+                   stats.stat_stores);
         ap_rprintf(r, "total entries replaced since starting: <b>%lu</b><br>",
-                   header->stat_replaced);
+                   stats.stat_replaced);
         ap_rprintf(r, "total entries expired since starting: <b>%lu</b><br>",
-                   header->stat_expiries);
+                   stats.stat_expiries);
         ap_rprintf(r, "total (pre-expiry) entries scrolled out of the cache: "
-                   "<b>%lu</b><br>", header->stat_scrolled);
+                   "<b>%lu</b><br>", stats.stat_scrolled);
         ap_rprintf(r, "total retrieves since starting: <b>%lu</b> hit, "
-                   "<b>%lu</b> miss<br>", header->stat_retrieves_hit,
-                   header->stat_retrieves_miss);
+                   "<b>%lu</b> miss<br>", stats.stat_retrieves_hit,
+                   stats.stat_retrieves_miss);
         ap_rprintf(r, "total removes since starting: <b>%lu</b> hit, "
-                   "<b>%lu</b> miss<br>", header->stat_removes_hit,
-                   header->stat_removes_miss);
+                   "<b>%lu</b> miss<br>", stats.stat_removes_hit,
+                   stats.stat_removes_miss);
     }
     else {
         ap_rputs("CacheType: SHMCB\n", r);
@@ -680,14 +903,14 @@ static void socache_shmcb_status(ap_socache_instance_t *ctx,
 
         ap_rprintf(r, "CacheIndexUsage: %d%%\n", index_pct);
         ap_rprintf(r, "CacheUsage: %d%%\n", cache_pct);
-        ap_rprintf(r, "CacheStoreCount: %lu\n", header->stat_stores);
-        ap_rprintf(r, "CacheReplaceCount: %lu\n", header->stat_replaced);
-        ap_rprintf(r, "CacheExpireCount: %lu\n", header->stat_expiries);
-        ap_rprintf(r, "CacheDiscardCount: %lu\n", header->stat_scrolled);
-        ap_rprintf(r, "CacheRetrieveHitCount: %lu\n", header->stat_retrieves_hit);
-        ap_rprintf(r, "CacheRetrieveMissCount: %lu\n", header->stat_retrieves_miss);
-        ap_rprintf(r, "CacheRemoveHitCount: %lu\n", header->stat_removes_hit);
-        ap_rprintf(r, "CacheRemoveMissCount: %lu\n", header->stat_removes_miss);
+        ap_rprintf(r, "CacheStoreCount: %lu\n", stats.stat_stores);
+        ap_rprintf(r, "CacheReplaceCount: %lu\n", stats.stat_replaced);
+        ap_rprintf(r, "CacheExpireCount: %lu\n", stats.stat_expiries);
+        ap_rprintf(r, "CacheDiscardCount: %lu\n", stats.stat_scrolled);
+        ap_rprintf(r, "CacheRetrieveHitCount: %lu\n", stats.stat_retrieves_hit);
+        ap_rprintf(r, "CacheRetrieveMissCount: %lu\n", stats.stat_retrieves_miss);
+        ap_rprintf(r, "CacheRemoveHitCount: %lu\n", stats.stat_removes_hit);
+        ap_rprintf(r, "CacheRemoveMissCount: %lu\n", stats.stat_removes_miss);
     }
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00841) "leaving shmcb_status");
 }
@@ -703,15 +926,41 @@ static apr_status_t socache_shmcb_iterate(ap_socache_instance_t *instance,
     apr_status_t rv = APR_SUCCESS;
     apr_size_t buflen = 0;
     unsigned char *buf = NULL;
+    apr_array_header_t *split = apr_array_make(pool, 0, sizeof(SHMCBSplit));
 
-    /* Perform the iteration inside the mutex to avoid corruption or invalid
-     * pointer arithmetic. The rest of our logic uses read-only header data so
-     * doesn't need the lock. */
+    /* Perform the iteration of each subcache inside its mutex to avoid
+     * corruption or invalid pointer arithmetic. The rest of our logic uses
+     * read-only header data so doesn't need the lock. */
     /* Iterate over the subcaches */
     for (loop = 0; loop < header->subcache_num && rv == APR_SUCCESS; loop++) {
         SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, loop);
+        int i;
+
+        if ((rv = shmcb_lock(instance, s, loop)) != APR_SUCCESS) {
+            break;
+        }
+        split->nelts = 0;
         rv = shmcb_subcache_iterate(instance, s, userctx, header, subcache,
-                                    iterator, &buf, &buflen, pool, now);
+                                    iterator, &buf, &buflen, split, pool,
+                                    now);
+        shmcb_unlock(instance, s, loop);
+
+        /* The entries split in parts are retrieved (and iterated) without
+         * the mutex, which can't be held while locking other subcaches */
+        for (i = 0; i < split->nelts && rv == APR_SUCCESS; i++) {
+            SHMCBSplit *e = &APR_ARRAY_IDX(split, i, SHMCBSplit);
+            unsigned int dest_len = e->parts
+                                    * (header->subcache_data_size / 2);
+            unsigned char *dest = apr_palloc(pool, dest_len + 1);
+
+            if (socache_shmcb_retrieve(instance, s, e->id, e->id_len,
+                                       dest, &dest_len,
+                                       pool) == APR_SUCCESS) {
+                dest[dest_len] = '\0';
+                rv = iterator(instance, s, userctx, e->id, e->id_len,
+                              dest, dest_len, pool);
+            }
+        }
     }
     return rv;
 }
@@ -761,7 +1010,7 @@ static void shmcb_subcache_expire(server_rec *s, SHMCBHeader *header,
         subcache->data_used -= diff;
         subcache->data_pos = idx->data_pos;
     }
-    header->stat_expiries += expired;
+    subcache->stat_expiries += expired;
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00843)
                  "we now have %u socache entries", subcache->idx_used);
 }
@@ -770,7 +1019,8 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
                                 SHMCBSubcache *subcache,
                                 unsigned char *data, unsigned int data_len,
                                 const unsigned char *id, unsigned int id_len,
-                                apr_time_t expiry)
+                                apr_time_t expiry, apr_uint32_t stamp,
+                                unsigned char part, unsigned char parts)
 {
     unsigned int data_offset, new_idx, id_offset;
     SHMCBIndex *idx;
@@ -816,7 +1066,7 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
                                                       header->subcache_data_size);
             subcache->data_pos = idx2->data_pos;
             /* Stats */
-            header->stat_scrolled++;
+            subcache->stat_scrolled++;
             /* Loop admin */
             idx = idx2;
         } while (header->subcache_data_size - subcache->data_used < total_len);
@@ -855,7 +1105,10 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
     idx->data_pos = id_offset;
     idx->data_used = total_len;
     idx->id_len = id_len;
+    idx->stamp = stamp;
     idx->removed = 0;
+    idx->part = part;
+    idx->parts = parts;
     subcache->idx_used++;
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00847)
                  "insert happened at idx=%d, data=(%u:%u)", new_idx,
@@ -871,7 +1124,9 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
 static int shmcb_subcache_retrieve(server_rec *s, SHMCBHeader *header,
                                    SHMCBSubcache *subcache,
                                    const unsigned char *id, unsigned int idlen,
-                                   unsigned char *dest, unsigned int *destlen)
+                                   unsigned char *dest, unsigned int *destlen,
+                                   unsigned char part, apr_uint32_t *stamp,
+                                   unsigned char *parts)
 {
     unsigned int pos;
     unsigned int loop = 0;
@@ -882,12 +1137,14 @@ static int shmcb_subcache_retrieve(server_rec *s, SHMCBHeader *header,
     while (loop < subcache->idx_used) {
         SHMCBIndex *idx = SHMCB_INDEX(subcache, pos);
 
-        /* Only consider 'idx' if the id matches, and the "removed"
+        /* Only consider 'idx' if the id and part match, and the "removed"
          * flag isn't set, and the record is not expired.
          * Check the data length too to avoid a buffer overflow
          * in case of corruption, which should be impossible,
          * but it's cheap to be safe. */
         if (!idx->removed
+            && idx->part == part
+            && (part == 0 || idx->stamp == *stamp)
             && idx->id_len == idlen
             && (idx->data_used - idx->id_len) <= *destlen
             && shmcb_cyclic_memcmp(header->subcache_data_size,
@@ -909,13 +1166,17 @@ static int shmcb_subcache_retrieve(server_rec *s, SHMCBHeader *header,
                 shmcb_cyclic_cton_memcpy(header->subcache_data_size,
                                          dest, SHMCB_DATA(header, subcache),
                                          data_offset, *destlen);
+                if (part == 0) {
+                    *stamp = idx->stamp;
+                    *parts = idx->parts ? idx->parts : 1;
+                }
 
                 return 0;
             }
             else {
                 /* Already stale, quietly remove and treat as not-found */
                 idx->removed = 1;
-                header->stat_expiries++;
+                subcache->stat_expiries++;
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00850)
                              "shmcb_subcache_retrieve discarding expired entry");
                 return -1;
@@ -934,7 +1195,7 @@ static int shmcb_subcache_retrieve(server_rec *s, SHMCBHeader *header,
 static int shmcb_subcache_remove(server_rec *s, SHMCBHeader *header,
                                  SHMCBSubcache *subcache,
                                  const unsigned char *id,
-                                 unsigned int idlen)
+                                 unsigned int idlen, unsigned char part)
 {
     unsigned int pos;
     unsigned int loop = 0;
@@ -943,9 +1204,9 @@ static int shmcb_subcache_remove(server_rec *s, SHMCBHeader *header,
     while (loop < subcache->idx_used) {
         SHMCBIndex *idx = SHMCB_INDEX(subcache, pos);
 
-        /* Only consider 'idx' if the id matches, and the "removed"
+        /* Only consider 'idx' if the id and part match, and the "removed"
          * flag isn't set. */
-        if (!idx->removed && idx->id_len == idlen
+        if (!idx->removed && idx->part == part && idx->id_len == idlen
             && shmcb_cyclic_memcmp(header->subcache_data_size,
                                    SHMCB_DATA(header, subcache),
                                    idx->data_pos, id, idx->id_len) == 0) {
@@ -975,6 +1236,7 @@ static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
                                            ap_socache_iterator_t *iterator,
                                            unsigned char **buf,
                                            apr_size_t *buf_len,
+                                           apr_array_header_t *split,
                                            apr_pool_t *pool,
                                            apr_time_t now)
 {
@@ -986,8 +1248,22 @@ static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
     while (loop < subcache->idx_used) {
         SHMCBIndex *idx = SHMCB_INDEX(subcache, pos);
 
-        /* Only consider 'idx' if the "removed" flag isn't set. */
-        if (!idx->removed) {
+        /* Only consider 'idx' if the "removed" flag isn't set, and
+         * leave the entries split in parts to the caller. */
+        if (!idx->removed && idx->part == 0 && idx->parts > 1) {
+            if (idx->expires > now) {
+                SHMCBSplit *e = apr_array_push(split);
+
+                e->id = apr_palloc(pool, idx->id_len + 1);
+                shmcb_cyclic_cton_memcpy(header->subcache_data_size, e->id,
+                                         SHMCB_DATA(header, subcache),
+                                         idx->data_pos, idx->id_len);
+                e->id[idx->id_len] = '\0';
+                e->id_len = idx->id_len;
+                e->parts = idx->parts;
+            }
+        }
+        else if (!idx->removed && idx->part == 0) {
 
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00854)
                          "iterating idx=%d, data=%d", pos, idx->data_pos);
@@ -1039,7 +1315,7 @@ static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
             else {
                 /* Already stale, quietly remove and treat as not-found */
                 idx->removed = 1;
-                header->stat_expiries++;
+                subcache->stat_expiries++;
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00856)
                              "shmcb_subcache_iterate discarding expired entry");
             }
@@ -1054,7 +1330,7 @@ static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
 
 static const ap_socache_provider_t socache_shmcb = {
     "shmcb",
-    AP_SOCACHE_FLAG_NOTMPSAFE,
+    0,
     socache_shmcb_create,
     socache_shmcb_init,
     socache_shmcb_destroy,
@@ -1065,8 +1341,55 @@ static const ap_socache_provider_t socache_shmcb = {
     socache_shmcb_iterate
 };
 
+static int socache_shmcb_precfg(apr_pool_t *pconf, apr_pool_t *plog,
+                                apr_pool_t *ptmp)
+{
+    apr_status_t rv = ap_mutex_register(pconf, shmcb_lock_type, NULL,
+                                        APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(10609)
+                      "failed to register %s mutex", shmcb_lock_type);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    shmcb_instances = apr_array_make(pconf, 4,
+                                     sizeof(ap_socache_instance_t *));
+    return OK;
+}
+
+static void socache_shmcb_child_init(apr_pool_t *p, server_rec *s)
+{
+    int i;
+    unsigned int loop;
+
+    for (i = 0; shmcb_instances && i < shmcb_instances->nelts; i++) {
+        ap_socache_instance_t *ctx = APR_ARRAY_IDX(shmcb_instances, i,
+                                                   ap_socache_instance_t *);
+        if (!ctx->shm) {
+            continue; /* destroyed */
+        }
+        for (loop = 0; loop < ctx->nlocks; loop++) {
+            const char *lock;
+            apr_status_t rv;
+
+            if (!ctx->locks[loop]) {
+                continue;
+            }
+            lock = apr_global_mutex_lockfile(ctx->locks[loop]);
+            rv = apr_global_mutex_child_init(&ctx->locks[loop], lock, p);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10610)
+                             "failed to initialise %s mutex in child_init",
+                             shmcb_lock_type);
+            }
+        }
+    }
+}
+
 static void register_hooks(apr_pool_t *p)
 {
+    ap_hook_pre_config(socache_shmcb_precfg, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(socache_shmcb_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+
     ap_register_provider(p, AP_SOCACHE_PROVIDER_GROUP, "shmcb",
                          AP_SOCACHE_PROVIDER_VERSION,
                          &socache_shmcb);
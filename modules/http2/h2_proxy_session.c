@@ -39,8 +39,7 @@ typedef struct h2_proxy_stream {
     request_rec *r;
     conn_rec *cfront;
     h2_proxy_request *req;
-    const char *real_server_uri;
-    const char *p_server_uri;
+    h2_proxy_head head;
     int standalone;
 
     h2_proxy_stream_state_t state;
@@ -48,14 +47,13 @@ typedef struct h2_proxy_stream {
     unsigned int waiting_on_100 : 1;
     unsigned int waiting_on_ping : 1;
     unsigned int headers_ended : 1;
+    int status;                /* of the response head being received */
     uint32_t error_code;
 
     apr_bucket_brigade *input;
     apr_off_t data_sent;
     apr_bucket_brigade *output;
     apr_off_t data_received;
-    
-    apr_table_t *saves;
 } h2_proxy_stream;
 
 
@@ -259,7 +257,6 @@ static int on_frame_recv(nghttp2_session *ngh2, const nghttp2_frame *frame,
 {
     h2_proxy_session *session = user_data;
     h2_proxy_stream *stream;
-    request_rec *r;
     int n;
     
     if (APLOGcdebug(session->c)) {
@@ -279,35 +276,28 @@ static int on_frame_recv(nghttp2_session *ngh2, const nghttp2_frame *frame,
             if (!stream) {
                 return NGHTTP2_ERR_CALLBACK_FAILURE;
             }
-            r = stream->r;
-            if (r->status >= 100 && r->status < 200) {
+            if (stream->status >= 100 && stream->status < 200) {
                 /* By default, we will forward all interim responses when
                  * we are sitting on a HTTP/2 connection to the client */
                 int forward = session->h2_front;
-                switch(r->status) {
-                    case 100:
-                        if (stream->waiting_on_100) {
-                            stream->waiting_on_100 = 0;
-                            r->status_line = ap_get_status_line(r->status);
-                            forward = 1;
-                        } 
-                        break;
-                    case 103:
-                        /* workaround until we get this into http protocol base
-                         * parts. without this, unknown codes are converted to
-                         * 500... */
-                        r->status_line = "103 Early Hints";
-                        break;
-                    default:
-                        r->status_line = ap_get_status_line(r->status);
-                        break;
+                if (stream->status == 100 && stream->waiting_on_100) {
+                    stream->waiting_on_100 = 0;
+                    forward = 1;
                 }
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(03487) 
+                /* the request belongs to its own thread on shared sessions */
+                ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0,
+                              session->stream_out? session->c : stream->cfront,
+                              APLOGNO(03487)
                               "h2_proxy_session(%s): got interim HEADERS, "
                               "status=%d, will forward=%d",
-                              session->id, r->status, forward);
-                if (forward) {
-                    ap_send_interim_response(r, 1);
+                              session->id, stream->status, forward);
+                if (forward && session->stream_out) {
+                    session->stream_out(session, &stream->head, stream->id,
+                                        H2_PROXY_OUT_INTERIM, NULL, 0,
+                                        NULL, 0);
+                }
+                else if (forward) {
+                    h2_proxy_head_interim(session, &stream->head);
                 }
             }
             stream_resume(stream);
@@ -357,7 +347,7 @@ static int add_header(void *table, const char *n, const char *v)
     return 1;
 }
 
-static void process_proxy_header(apr_table_t *headers, h2_proxy_stream *stream, 
+static void process_proxy_header(apr_table_t *headers, h2_proxy_head *head,
                                  const char *n, const char *v)
 {
     static const struct {
@@ -371,7 +361,7 @@ static void process_proxy_header(apr_table_t *headers, h2_proxy_stream *stream,
         { "Set-Cookie", ap_proxy_cookie_reverse_map },
         { NULL, NULL }
     };
-    request_rec *r = stream->r;
+    request_rec *r = head->r;
     proxy_dir_conf *dconf;
     int i;
     
@@ -386,77 +376,137 @@ static void process_proxy_header(apr_table_t *headers, h2_proxy_stream *stream,
         if (!ap_cstr_casecmp("Link", n)) {
             dconf = ap_get_module_config(r->per_dir_config, &proxy_module);
             apr_table_add(headers, n, h2_proxy_link_reverse_map(r, dconf, 
-                            stream->real_server_uri, stream->p_server_uri, v));
+                            head->real_server_uri, head->p_server_uri, v));
             return;
         }
     }
     apr_table_add(headers, n, v);
 }
 
-static apr_status_t h2_proxy_stream_add_header_out(h2_proxy_stream *stream,
-                                                   const char *n, apr_size_t nlen,
-                                                   const char *v, apr_size_t vlen)
+apr_status_t h2_proxy_head_add(h2_proxy_session *session, h2_proxy_head *head,
+                               int trailer, const char *n, apr_size_t nlen,
+                               const char *v, apr_size_t vlen)
 {
+    request_rec *r = head->r;
+
     if (n[0] == ':') {
-        if (!stream->data_received && !strncmp(":status", n, nlen)) {
-            char *s = apr_pstrndup(stream->r->pool, v, vlen);
+        if (!trailer && !strncmp(":status", n, nlen)) {
+            char *s = apr_pstrndup(r->pool, v, vlen);
             
-            apr_table_setn(stream->r->notes, "proxy-status", s);
-            ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, stream->cfront,
-                          "h2_proxy_stream(%s-%d): got status %s", 
-                          stream->session->id, stream->id, s);
-            stream->r->status = (int)apr_atoi64(s);
-            if (stream->r->status <= 0) {
-                stream->r->status = 500;
+            apr_table_setn(r->notes, "proxy-status", s);
+            ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r,
+                          "h2_proxy_session(%s): got status %s", 
+                          session->id, s);
+            r->status = (int)apr_atoi64(s);
+            if (r->status <= 0) {
+                r->status = 500;
                 return APR_EGENERAL;
             }
         }
         return APR_SUCCESS;
     }
     
-    ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, stream->cfront,
-                  "h2_proxy_stream(%s-%d): on_header %s: %s", 
-                  stream->session->id, stream->id, n, v);
     if (!h2_proxy_res_ignore_header(n, nlen)) {
         char *hname, *hvalue;
-        apr_table_t *headers = (stream->headers_ended? 
-                               stream->r->trailers_out : stream->r->headers_out);
+        apr_table_t *headers = (trailer? r->trailers_out : r->headers_out);
     
-        hname = apr_pstrndup(stream->pool, n, nlen);
+        hname = apr_pstrndup(r->pool, n, nlen);
         h2_proxy_util_camel_case_header(hname, nlen);
-        hvalue = apr_pstrndup(stream->pool, v, vlen);
+        hvalue = apr_pstrndup(r->pool, v, vlen);
         
-        ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, stream->cfront,
-                      "h2_proxy_stream(%s-%d): got header %s: %s", 
-                      stream->session->id, stream->id, hname, hvalue);
-        process_proxy_header(headers, stream, hname, hvalue);
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r,
+                      "h2_proxy_session(%s): got %s %s: %s", session->id,
+                      trailer? "trailer" : "header", hname, hvalue);
+        process_proxy_header(headers, head, hname, hvalue);
     }
     return APR_SUCCESS;
 }
 
+static apr_status_t h2_proxy_stream_add_header_out(h2_proxy_stream *stream,
+                                                   const char *n, apr_size_t nlen,
+                                                   const char *v, apr_size_t vlen)
+{
+    h2_proxy_session *session = stream->session;
+    int trailer = stream->headers_ended;
+
+    if (n[0] == ':') {
+        if (!trailer && !strncmp(":status", n, nlen)) {
+            char s[16];
+
+            /* the session's own account, the request may be another
+             * thread's */
+            apr_cpystrn(s, v, (vlen < sizeof(s))? vlen + 1 : sizeof(s));
+            stream->status = (int)apr_atoi64(s);
+            if (stream->status <= 0) {
+                stream->status = 500;
+                if (session->stream_out) {
+                    return APR_EGENERAL;
+                }
+            }
+        }
+        else {
+            return APR_SUCCESS;
+        }
+    }
+    else if (h2_proxy_res_ignore_header(n, nlen)) {
+        return APR_SUCCESS;
+    }
+    
+    ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0,
+                  session->stream_out? session->c : stream->cfront,
+                  "h2_proxy_stream(%s-%d): on_header %.*s: %.*s",
+                  session->id, stream->id, (int)nlen, n, (int)vlen, v);
+    if (session->stream_out) {
+        /* for the request's thread to apply, which may be writing the
+         * response meanwhile */
+        session->stream_out(session, &stream->head, stream->id,
+                            trailer? H2_PROXY_OUT_TRAILER : H2_PROXY_OUT_HEADER,
+                            n, nlen, v, vlen);
+        return APR_SUCCESS;
+    }
+    return h2_proxy_head_add(session, &stream->head, trailer, n, nlen, v, vlen);
+}
+
 static int log_header(void *ctx, const char *key, const char *value)
 {
-    h2_proxy_stream *stream = ctx;
-    ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, stream->r, 
-                  "h2_proxy_stream(%s-%d), header_out %s: %s", 
-                  stream->session->id, stream->id, key, value);
+    h2_proxy_head *head = ctx;
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, head->r, 
+                  "h2_proxy_head, header_out %s: %s", key, value);
     return 1;
 }
 
-static void h2_proxy_stream_end_headers_out(h2_proxy_stream *stream) 
+void h2_proxy_head_interim(h2_proxy_session *session, h2_proxy_head *head)
 {
-    h2_proxy_session *session = stream->session;
-    request_rec *r = stream->r;
+    request_rec *r = head->r;
+
+    if (r->status == 103) {
+        /* workaround until we get this into http protocol base
+         * parts. without this, unknown codes are converted to
+         * 500... */
+        r->status_line = "103 Early Hints";
+    }
+    else {
+        r->status_line = ap_get_status_line(r->status);
+    }
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r,
+                  "h2_proxy_session(%s): forwarding interim response %d",
+                  session->id, r->status);
+    ap_send_interim_response(r, 1);
+}
+
+void h2_proxy_head_end(h2_proxy_session *session, h2_proxy_head *head)
+{
+    request_rec *r = head->r;
     apr_pool_t *p = r->pool;
     const char *buf;
     
     /* Now, add in the cookies from the response to the ones already saved */
-    apr_table_do(add_header, stream->saves, r->headers_out, "Set-Cookie", NULL);
+    apr_table_do(add_header, head->saves, r->headers_out, "Set-Cookie", NULL);
     
     /* and now load 'em all in */
-    if (!apr_is_empty_table(stream->saves)) {
+    if (!apr_is_empty_table(head->saves)) {
         apr_table_unset(r->headers_out, "Set-Cookie");
-        r->headers_out = apr_table_overlay(p, r->headers_out, stream->saves);
+        r->headers_out = apr_table_overlay(p, r->headers_out, head->saves);
     }
 
     if ((buf = apr_table_get(r->headers_out, "Content-Type"))) {
@@ -466,8 +516,8 @@ static void h2_proxy_stream_end_headers_out(h2_proxy_stream *stream)
     /* handle Via header in response */
     if (session->conf->viaopt != via_off 
         && session->conf->viaopt != via_block) {
-        const char *server_name = ap_get_server_name(stream->r);
-        apr_port_t port = ap_get_server_port(stream->r);
+        const char *server_name = ap_get_server_name(r);
+        apr_port_t port = ap_get_server_port(r);
         char portstr[32];
         
         /* If USE_CANONICAL_NAME_OFF was configured for the proxy virtual host,
@@ -475,10 +525,10 @@ static void h2_proxy_stream_end_headers_out(h2_proxy_stream *stream)
          * origin server name (which doesn't make sense with Via: headers)
          * so we use the proxy vhost's name instead.
          */
-        if (server_name == stream->r->hostname) {
-            server_name = stream->r->server->server_hostname;
+        if (server_name == r->hostname) {
+            server_name = r->server->server_hostname;
         }
-        if (ap_is_default_port(port, stream->r)) {
+        if (ap_is_default_port(port, r)) {
             portstr[0] = '\0';
         }
         else {
@@ -499,14 +549,27 @@ static void h2_proxy_stream_end_headers_out(h2_proxy_stream *stream)
                                       server_name, portstr)
                        );
     }
-    if (r->status >= 200) stream->headers_ended = 1;
     
-    if (APLOGrtrace2(stream->r)) {
-        ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, stream->r, 
-                      "h2_proxy_stream(%s-%d), header_out after merging", 
-                      stream->session->id, stream->id);
-        apr_table_do(log_header, stream, stream->r->headers_out, NULL);
+    if (APLOGrtrace2(r)) {
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r, 
+                      "h2_proxy_session(%s), header_out after merging", 
+                      session->id);
+        apr_table_do(log_header, head, r->headers_out, NULL);
+    }
+}
+
+static void h2_proxy_stream_end_headers_out(h2_proxy_stream *stream) 
+{
+    h2_proxy_session *session = stream->session;
+
+    if (session->stream_out) {
+        session->stream_out(session, &stream->head, stream->id,
+                            H2_PROXY_OUT_HEADERS_END, NULL, 0, NULL, 0);
+    }
+    else {
+        h2_proxy_head_end(session, &stream->head);
     }
+    if (stream->status >= 200) stream->headers_ended = 1;
 }
 
 static int stream_response_data(nghttp2_session *ngh2, uint8_t flags,
@@ -524,6 +587,9 @@ static int stream_response_data(nghttp2_session *ngh2, uint8_t flags,
                      "h2_proxy_session(%s): recv data chunk for "
                      "unknown stream %d, ignored", 
                      session->id, stream_id);
+        if (session->shared) {
+            nghttp2_session_consume(ngh2, stream_id, len);
+        }
         return 0;
     }
     
@@ -533,6 +599,13 @@ static int stream_response_data(nghttp2_session *ngh2, uint8_t flags,
         h2_proxy_stream_end_headers_out(stream);
     }
     stream->data_received += len;
+    if (session->stream_out) {
+        /* the request's thread writes it, and gives the window back */
+        session->stream_out(session, &stream->head, stream_id,
+                            H2_PROXY_OUT_DATA, NULL, 0,
+                        (const char *)data, len);
+        return 0;
+    }
     b = apr_bucket_transient_create((const char*)data, len,
                                     stream->cfront->bucket_alloc);
     APR_BRIGADE_INSERT_TAIL(stream->output, b);
@@ -600,10 +673,12 @@ static int on_header(nghttp2_session *ngh2, const nghttp2_frame *frame,
     return 0;
 }
 
-static ssize_t stream_request_data(nghttp2_session *ngh2, int32_t stream_id, 
-                                   uint8_t *buf, size_t length,
-                                   uint32_t *data_flags, 
-                                   nghttp2_data_source *source, void *user_data)
+static ssize_t stream_read_request_data(nghttp2_session *ngh2,
+                                        int32_t stream_id,
+                                        uint8_t *buf, size_t length,
+                                        uint32_t *data_flags, 
+                                        nghttp2_data_source *source,
+                                        void *user_data)
 {
     h2_proxy_stream *stream;
     apr_status_t status = APR_SUCCESS;
@@ -698,6 +773,33 @@ static ssize_t stream_request_data(nghttp2_session *ngh2, int32_t stream_id,
     }
 }
 
+static ssize_t stream_request_data(nghttp2_session *ngh2, int32_t stream_id, 
+                                   uint8_t *buf, size_t length,
+                                   uint32_t *data_flags, 
+                                   nghttp2_data_source *source, void *user_data)
+{
+    h2_proxy_session *session = user_data;
+    h2_proxy_stream *stream;
+    ssize_t rv;
+
+    stream = nghttp2_session_get_stream_user_data(ngh2, stream_id);
+    if (stream && session->front) {
+        if (!session->front(session, stream->r, 1, 0)) {
+            /* the request's thread is writing to its client, later */
+            *data_flags = 0;
+            stream->suspended = 1;
+            h2_proxy_iq_add(session->suspended, stream->id, NULL, NULL);
+            return NGHTTP2_ERR_DEFERRED;
+        }
+        rv = stream_read_request_data(ngh2, stream_id, buf, length,
+                                      data_flags, source, user_data);
+        session->front(session, stream->r, 0, rv > 0 ? (apr_size_t)rv : 0);
+        return rv;
+    }
+    return stream_read_request_data(ngh2, stream_id, buf, length,
+                                    data_flags, source, user_data);
+}
+
 #ifdef H2_NG2_INVALID_HEADER_CB
 static int on_invalid_header_cb(nghttp2_session *ngh2,
                                 const nghttp2_frame *frame, 
@@ -721,7 +823,7 @@ static int on_invalid_header_cb(nghttp2_session *ngh2,
 
 h2_proxy_session *h2_proxy_session_setup(const char *id, proxy_conn_rec *p_conn,
                                          proxy_server_conf *conf,
-                                         int h2_front, 
+                                         int h2_front, int shared,
                                          unsigned char window_bits_connection,
                                          unsigned char window_bits_stream,
                                          h2_proxy_request_done *done)
@@ -743,11 +845,13 @@ h2_proxy_session *h2_proxy_session_setup(const char *id, proxy_conn_rec *p_conn,
         session->pool = p_conn->scpool;
         session->state = H2_PROXYS_ST_INIT;
         session->h2_front = h2_front;
+        session->shared = shared;
         session->window_bits_stream = window_bits_stream;
         session->window_bits_connection = window_bits_connection;
         session->streams = h2_proxy_ihash_create(pool, offsetof(h2_proxy_stream, id));
         session->suspended = h2_proxy_iq_create(pool, 5);
         session->done = done;
+        session->last_io = apr_time_now();
     
         session->input = apr_brigade_create(session->pool, session->c->bucket_alloc);
         session->output = apr_brigade_create(session->pool, session->c->bucket_alloc);
@@ -764,7 +868,11 @@ h2_proxy_session *h2_proxy_session_setup(const char *id, proxy_conn_rec *p_conn,
 #endif
         nghttp2_option_new(&option);
         nghttp2_option_set_peer_max_concurrent_streams(option, 100);
-        nghttp2_option_set_no_auto_window_update(option, 0);
+        if (shared) {
+            /* the window of a stream is given back by the request's
+             * thread, once its DATA is written */
+            nghttp2_option_set_no_auto_window_update(option, 1);
+        }
         
         nghttp2_session_client_new2(&session->ngh2, cbs, session, option);
         
@@ -827,6 +935,7 @@ static apr_status_t open_stream(h2_proxy_session *session, const char *url,
     stream->pool = r->pool;
     stream->url = url;
     stream->r = r;
+    stream->head.r = r;
     stream->cfront = r->connection;
     stream->standalone = standalone;
     stream->session = session;
@@ -870,8 +979,8 @@ static apr_status_t open_stream(h2_proxy_session *session, const char *url,
 
     /* we need this for mapping relative uris in headers ("Link") back
      * to local uris */
-    stream->real_server_uri = apr_psprintf(stream->pool, "%s://%s", scheme, authority); 
-    stream->p_server_uri = apr_psprintf(stream->pool, "%s://%s", puri.scheme, authority); 
+    stream->head.real_server_uri = apr_psprintf(stream->pool, "%s://%s", scheme, authority); 
+    stream->head.p_server_uri = apr_psprintf(stream->pool, "%s://%s", puri.scheme, authority); 
     path = apr_uri_unparse(stream->pool, &puri, APR_URI_UNP_OMITSITEPART);
 
     h2_proxy_req_make(stream->req, stream->pool, r->method, scheme,
@@ -903,8 +1012,8 @@ static apr_status_t open_stream(h2_proxy_session *session, const char *url,
     }
 
     /* Tuck away all already existing cookies */
-    stream->saves = apr_table_make(r->pool, 2);
-    apr_table_do(add_header, stream->saves, r->headers_out, "Set-Cookie", NULL);
+    stream->head.saves = apr_table_make(r->pool, 2);
+    apr_table_do(add_header, stream->head.saves, r->headers_out, "Set-Cookie", NULL);
 
     *pstream = stream;
     
@@ -1119,10 +1228,21 @@ static apr_status_t check_suspended(h2_proxy_session *session)
             if (stream->waiting_on_100 || stream->waiting_on_ping) {
                 status = APR_EAGAIN;
             }
+            else if (!APR_BRIGADE_EMPTY(stream->input)) {
+                /* read already, the front was busy when it was to be sent */
+                status = APR_SUCCESS;
+            }
+            else if (session->front
+                     && !session->front(session, stream->r, 1, 0)) {
+                status = APR_EAGAIN;
+            }
             else {
                 status = ap_get_brigade(stream->r->input_filters, stream->input,
                                         AP_MODE_READBYTES, APR_NONBLOCK_READ,
                                         APR_BUCKET_BUFF_SIZE);
+                if (session->front) {
+                    session->front(session, stream->r, 0, 0);
+                }
             }
             if (status == APR_SUCCESS && !APR_BRIGADE_EMPTY(stream->input)) {
                 stream_resume(stream);
@@ -1369,12 +1489,26 @@ static void ev_stream_done(h2_proxy_session *session, int stream_id,
         apr_status_t status = (stream->error_code == 0)? APR_SUCCESS : APR_EINVAL;
         int touched = (stream->data_sent || stream->data_received ||
                        stream_id <= session->last_stream_id);
-        if (!stream->cfront->aborted) {
-            ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, stream->cfront, APLOGNO(03364)
+        if (session->stream_out || !stream->cfront->aborted) {
+            /* the front connection belongs to the request's thread when
+             * the session is shared */
+            ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0,
+                          session->stream_out? session->c : stream->cfront,
+                          APLOGNO(03364)
                           "h2_proxy_sesssion(%s): stream(%d) closed "
                           "(touched=%d, error=%d)",
                           session->id, stream_id, touched, stream->error_code);
-
+        }
+        if (session->stream_out) {
+            /* The request's thread finishes the response, which it may be
+             * writing meanwhile; only the end of the headers of a response
+             * without body is left for us to queue */
+            if (status == APR_SUCCESS && !stream->data_received) {
+                h2_proxy_stream_end_headers_out(stream);
+                stream->data_received = 1;
+            }
+        }
+        else if (!stream->cfront->aborted) {
             if (status != APR_SUCCESS) {
               /* stream failed. If we have received (and forwarded) response
                * data already, we need to append an error buckt to inform
@@ -1577,7 +1711,37 @@ run_loop:
             break;
             
         case H2_PROXYS_ST_WAIT:
-            if (is_waiting_for_backend(session)) {
+            if (is_waiting_for_backend(session) && session->shared) {
+                /* Other threads may have requests to submit on this
+                 * session, which is only possible between two calls, so
+                 * don't block for the whole ProxyTimeout but enforce it. */
+                status = h2_proxy_session_read(session, 1,
+                                               H2_PROXY_SHARED_WAIT);
+                if (status == APR_SUCCESS) {
+                    have_read = 1;
+                    dispatch_event(session, H2_PROXYS_EV_DATA_READ, 0, NULL);
+                }
+                else if (APR_STATUS_IS_TIMEUP(status)
+                         || APR_STATUS_IS_EAGAIN(status)) {
+                    apr_interval_time_t timeout = -1;
+                    apr_socket_t *socket = ap_get_conn_socket(session->c);
+
+                    if (socket) {
+                        apr_socket_timeout_get(socket, &timeout);
+                    }
+                    if (timeout > 0
+                        && apr_time_now() - session->last_io > timeout) {
+                        dispatch_event(session, H2_PROXYS_EV_CONN_TIMEOUT,
+                                       0, "timeout");
+                        return APR_TIMEUP;
+                    }
+                }
+                else {
+                    dispatch_event(session, H2_PROXYS_EV_CONN_ERROR, status, NULL);
+                    return status;
+                }
+            }
+            else if (is_waiting_for_backend(session)) {
                 /* we can do a blocking read with the default timeout (as
                  * configured via ProxyTimeout in our socket. There is
                  * nothing we want to send or check until we get more data
@@ -1637,6 +1801,7 @@ run_loop:
 
     if (have_read || have_written) {
         session->wait_timeout = 0;
+        session->last_io = apr_time_now();
     }
     
     if (!nghttp2_session_want_read(session->ngh2)
@@ -1675,13 +1840,44 @@ void h2_proxy_session_cancel_all(h2_proxy_session *session)
     }
 }
 
+typedef struct {
+    h2_proxy_session *session;
+    request_rec *r;
+} cancel_ctx;
+
+static int cancel_one_iter(void *udata, void *val)
+{
+    cancel_ctx *ctx = udata;
+    h2_proxy_stream *stream = val;
+    if (stream->r == ctx->r) {
+        nghttp2_submit_rst_stream(ctx->session->ngh2, NGHTTP2_FLAG_NONE,
+                                  stream->id, NGHTTP2_CANCEL);
+        return 0;
+    }
+    return 1;
+}
+
+void h2_proxy_session_cancel(h2_proxy_session *session, request_rec *r)
+{
+    cancel_ctx ctx;
+    ctx.session = session;
+    ctx.r = r;
+    ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, session->c,
+                  "h2_proxy_session(%s): cancel stream of %s",
+                  session->id, r->the_request);
+    h2_proxy_ihash_iter(session->streams, cancel_one_iter, &ctx);
+    /* let the RST_STREAM be sent */
+    dispatch_event(session, H2_PROXYS_EV_STREAM_RESUMED, 0, NULL);
+}
+
 static int done_iter(void *udata, void *val)
 {
     cleanup_iter_ctx *ctx = udata;
     h2_proxy_stream *stream = val;
     int touched = (stream->data_sent || stream->data_received ||
                    stream->id <= ctx->session->last_stream_id);
-    if (touched && stream->output) {
+    /* on shared sessions, the request's thread finishes the response */
+    if (touched && stream->output && !ctx->session->stream_out) {
       apr_bucket *b = ap_bucket_error_create(HTTP_BAD_GATEWAY, NULL,
                                              stream->r->pool,
                                              stream->cfront->bucket_alloc);
@@ -1695,6 +1891,14 @@ static int done_iter(void *udata, void *val)
     return 1;
 }
 
+void h2_proxy_session_consume(h2_proxy_session *session, int stream_id,
+                              apr_size_t len)
+{
+    nghttp2_session_consume(session->ngh2, stream_id, len);
+    /* let the WINDOW_UPDATE be sent */
+    dispatch_event(session, H2_PROXYS_EV_STREAM_RESUMED, 0, NULL);
+}
+
 void h2_proxy_session_cleanup(h2_proxy_session *session, 
                               h2_proxy_request_done *done)
 {
@@ -70,6 +70,35 @@ typedef struct h2_proxy_session h2_proxy_session;
 typedef void h2_proxy_request_done(h2_proxy_session *s, request_rec *r,
                                    apr_status_t status, int touched,
                                    int error_code);
+/* The response head of a request, made by the thread writing the
+ * response: the session's or, on shared sessions, the request's own */
+typedef struct h2_proxy_head {
+    request_rec *r;
+    const char *real_server_uri;  /* for mapping "Link"s back */
+    const char *p_server_uri;
+    apr_table_t *saves;           /* Set-Cookie of the request so far */
+} h2_proxy_head;
+
+typedef enum {
+    H2_PROXY_OUT_DATA,            /* DATA of the response body */
+    H2_PROXY_OUT_HEADER,          /* a field of the response head */
+    H2_PROXY_OUT_INTERIM,         /* the head is an interim response to send */
+    H2_PROXY_OUT_HEADERS_END,     /* the head is complete */
+    H2_PROXY_OUT_TRAILER,         /* a trailer */
+} h2_proxy_out_t;
+
+/* Shared sessions: what was received for the stream of a request, for
+ * the request's thread to apply or write it; name and data are the
+ * field's (HEADER, TRAILER) or the DATA */
+typedef void h2_proxy_stream_output(h2_proxy_session *s, h2_proxy_head *head,
+                                    int stream_id, h2_proxy_out_t type,
+                                    const char *name, apr_size_t nlen,
+                                    const char *data, apr_size_t len);
+/* Shared sessions: enter (non-zero if the request's thread does not use
+ * its front connection meanwhile) or leave the reading of the request
+ * body, sent being what was read for the backend */
+typedef int h2_proxy_front_access(h2_proxy_session *s, request_rec *r,
+                                  int enter, apr_size_t sent);
 
 struct h2_proxy_session {
     const char *id;
@@ -81,8 +110,11 @@ struct h2_proxy_session {
     
     unsigned int aborted : 1;
     unsigned int h2_front : 1; /* if front-end connection is HTTP/2 */
+    unsigned int shared : 1;   /* streams of requests from other threads */
 
     h2_proxy_request_done *done;
+    h2_proxy_stream_output *stream_out; /* if set, never touch the requests */
+    h2_proxy_front_access *front;
     void *user_data;
     
     unsigned char window_bits_stream;
@@ -96,6 +128,7 @@ struct h2_proxy_session {
     apr_size_t remote_max_concurrent;
     int last_stream_id;     /* last stream id processed by backend, or 0 */
     apr_time_t last_frame_received;
+    apr_time_t last_io;     /* last time something was read or written */
     
     apr_bucket_brigade *input;
     apr_bucket_brigade *output;
@@ -107,7 +140,7 @@ struct h2_proxy_session {
 
 h2_proxy_session *h2_proxy_session_setup(const char *id, proxy_conn_rec *p_conn,
                                          proxy_server_conf *conf,
-                                         int h2_front, 
+                                         int h2_front, int shared,
                                          unsigned char window_bits_connection,
                                          unsigned char window_bits_stream,
                                          h2_proxy_request_done *done);
@@ -127,10 +160,61 @@ apr_status_t h2_proxy_session_process(h2_proxy_session *s);
 
 void h2_proxy_session_cancel_all(h2_proxy_session *s);
 
+/**
+ * Reset the stream of the request, if any, leaving the other streams of
+ * the session alone.
+ * @param s the session
+ * @param r the request whose stream to cancel
+ */
+void h2_proxy_session_cancel(h2_proxy_session *s, request_rec *r);
+
 void h2_proxy_session_cleanup(h2_proxy_session *s, h2_proxy_request_done *done);
 
+/**
+ * Apply a field of the response head (or a trailer) received on the
+ * stream of the request, on the thread writing its response.
+ * @param s the session
+ * @param head the response head
+ * @param trailer non-zero for a trailer
+ * @param n the name of the field, ":status" included
+ * @param nlen the length of the name
+ * @param v the value of the field
+ * @param vlen the length of the value
+ * @return APR_EGENERAL for an invalid status, APR_SUCCESS otherwise
+ */
+apr_status_t h2_proxy_head_add(h2_proxy_session *s, h2_proxy_head *head,
+                               int trailer, const char *n, apr_size_t nlen,
+                               const char *v, apr_size_t vlen);
+
+/**
+ * Send the interim response made by the head so far.
+ * @param s the session
+ * @param head the response head
+ */
+void h2_proxy_head_interim(h2_proxy_session *s, h2_proxy_head *head);
+
+/**
+ * Complete the response head, before its body is written.
+ * @param s the session
+ * @param head the response head
+ */
+void h2_proxy_head_end(h2_proxy_session *s, h2_proxy_head *head);
+
+/**
+ * Give back the flow control window of DATA passed to the session's
+ * stream_out callback, once written.
+ * @param s the session
+ * @param stream_id the stream the DATA was received on, possibly closed
+ * @param len the length of the DATA
+ */
+void h2_proxy_session_consume(h2_proxy_session *s, int stream_id,
+                              apr_size_t len);
+
 #define H2_PROXY_REQ_URL_NOTE   "h2-proxy-req-url"
 
+/* Longest blocking read on a shared session, new streams wait for it */
+#define H2_PROXY_SHARED_WAIT    apr_time_from_msec(10)
+
 int h2_proxy_session_is_reusable(h2_proxy_session *s);
 
 #endif /* h2_proxy_session_h */
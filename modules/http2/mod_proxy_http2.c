@@ -18,8 +18,15 @@
 
 #include <ap_mmn.h>
 #include <httpd.h>
+#include <ap_mpm.h>
+#include <mpm_common.h>
 #include <mod_proxy.h>
 #include "mod_http2.h"
+#if APR_HAS_THREADS
+#include <apr_hash.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
 
 
 #include "mod_proxy_http2.h"
@@ -31,6 +38,7 @@
 #define H2MIN(x,y) ((x) < (y) ? (x) : (y))
 
 static void register_hook(apr_pool_t *p);
+static const command_rec h2_proxy_cmds[];
 
 AP_DECLARE_MODULE(proxy_http2) = {
     STANDARD20_MODULE_STUFF,
@@ -38,7 +46,7 @@ AP_DECLARE_MODULE(proxy_http2) = {
     NULL,              /* merge per-directory config structures */
     NULL,              /* create per-server config structure */
     NULL,              /* merge per-server config structures */
-    NULL,              /* command apr_table_t */
+    h2_proxy_cmds,     /* command apr_table_t */
     register_hook,     /* register hooks */
 #if defined(AP_MODULE_FLAG_NONE)
     AP_MODULE_FLAG_ALWAYS_MERGE
@@ -48,6 +56,20 @@ AP_DECLARE_MODULE(proxy_http2) = {
 /* Optional functions from mod_http2 */
 static int (*is_h2)(conn_rec *c);
 
+typedef struct h2_proxy_group h2_proxy_group;
+
+/* DATA, a field (name then value) or the end of the response head,
+ * received on a shared session for the request's thread to write */
+typedef struct h2_proxy_chunk h2_proxy_chunk;
+struct h2_proxy_chunk {
+    h2_proxy_chunk *next;
+    h2_proxy_head *head;       /* of the response, made by the request */
+    h2_proxy_out_t type;
+    apr_size_t nlen;           /* of the field's name, 0 otherwise */
+    apr_size_t len;
+    char data[1];
+};
+
 typedef struct h2_proxy_ctx {
     const char *id;
     conn_rec *cfront;
@@ -69,8 +91,86 @@ typedef struct h2_proxy_ctx {
     int r_done;                /* request was processed, not necessarily successfully */
     int r_may_retry;           /* request may be retried */
     int has_reusable_session;  /* http2 session is live and clean */
+    
+    h2_proxy_group *group;     /* the shared session used, if any */
+    int r_cancel;              /* stream to be cancelled by the driver */
+    int r_timedout;            /* no response within the request's timeout */
+    apr_interval_time_t timeout;
+    apr_time_t last_activity;  /* of the stream on the shared session */
+    int stream_id;
+    h2_proxy_chunk *out_first; /* received by the driver, to write */
+    h2_proxy_chunk *out_last;
+    apr_off_t out_received;    /* DATA received so far */
+    apr_bucket_brigade *output;
+    int out_failed;            /* writing to the client failed */
+    int writing;               /* the front connection is in use, by the */
+    int reading;               /* request's thread or by the driver */
 } h2_proxy_ctx;
 
+/* Whether requests to the same worker share backend sessions */
+static int h2_proxy_multiplex = 0;
+
+#if APR_HAS_THREADS
+/*
+ * A backend session shared by the requests to a worker, processed by
+ * one of their threads at a time (the driver) on behalf of all: the
+ * driver submits the streams of the others and queues their response to
+ * them, while they wait for the completion of their stream. Each request
+ * writes its response to its client on its own thread, handing over the
+ * driver role meanwhile if it has it, and the flow control window of the
+ * stream is given back to the backend once written, so neither a slow
+ * client blocks the others nor the queues grow. The driver reads the
+ * request bodies, though not while their thread writes. Each request
+ * enforces its own timeout. When the driver's own request is done,
+ * another waiting one takes over. Idle sessions are kept for the next
+ * requests.
+ */
+typedef struct h2_proxy_backend h2_proxy_backend;
+
+struct h2_proxy_group {
+    h2_proxy_group *next;         /* session of the same worker */
+    h2_proxy_backend *backend;
+    apr_pool_t *pool;
+    apr_thread_cond_t *cond;      /* request done, or no driver anymore */
+    server_rec *server;
+    const char *proxy_func;
+    proxy_conn_rec *p_conn;
+    h2_proxy_session *session;
+    apr_array_header_t *pending;  /* of h2_proxy_ctx *, to submit */
+    apr_array_header_t *cancels;  /* of h2_proxy_ctx *, to cancel */
+    apr_array_header_t *submitting; /* taken by the driver */
+    apr_array_header_t *cancelling;
+    apr_array_header_t *consumed; /* of h2_proxy_consumed, written */
+    apr_array_header_t *consuming;
+    h2_proxy_ctx *driver;
+    int attached;                 /* requests using the session */
+    int max_streams;
+    int dead;                     /* failed or not accepting streams */
+    apr_time_t idle_since;
+};
+
+/* DATA written by a request, whose window can be given back */
+typedef struct {
+    int stream_id;
+    apr_size_t len;
+} h2_proxy_consumed;
+
+/* The sessions of a worker */
+struct h2_proxy_backend {
+    proxy_worker *worker;
+    h2_proxy_group *groups;
+};
+
+#define H2_PROXY_GROUP_MAX_STREAMS  100
+#define H2_PROXY_GROUP_TTL          apr_time_from_sec(60)
+/* How often waiting requests check their front connection */
+#define H2_PROXY_GROUP_WAIT         apr_time_from_msec(100)
+
+static apr_pool_t *groups_pool;
+static apr_thread_mutex_t *groups_mutex;
+static apr_hash_t *backends;      /* proxy_worker * -> h2_proxy_backend */
+#endif
+
 static int h2_proxy_post_config(apr_pool_t *p, apr_pool_t *plog,
                                 apr_pool_t *ptemp, server_rec *s)
 {
@@ -97,6 +197,83 @@ static int h2_proxy_post_config(apr_pool_t *p, apr_pool_t *plog,
     return status;
 }
 
+static int h2_proxy_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                               apr_pool_t *ptemp)
+{
+    (void)pconf;(void)plog;(void)ptemp;
+    h2_proxy_multiplex = 0;
+    return OK;
+}
+
+static void h2_proxy_child_init(apr_pool_t *pchild, server_rec *s)
+{
+#if APR_HAS_THREADS
+    apr_allocator_t *allocator;
+    apr_thread_mutex_t *mutex;
+    apr_status_t rv;
+    int threaded = 0;
+
+    backends = NULL;
+    if (!h2_proxy_multiplex) {
+        return;
+    }
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS
+        || threaded == AP_MPMQ_NOT_SUPPORTED) {
+        /* one request at a time, nothing to share */
+        return;
+    }
+
+    /* Sessions are created and destroyed by any thread */
+    rv = apr_allocator_create(&allocator);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, pchild);
+        if (rv == APR_SUCCESS) {
+            apr_allocator_mutex_set(allocator, mutex);
+            apr_allocator_max_free_set(allocator, ap_max_mem_free);
+            rv = apr_pool_create_ex(&groups_pool, pchild, NULL, allocator);
+        }
+        if (rv == APR_SUCCESS) {
+            apr_allocator_owner_set(allocator, groups_pool);
+            apr_pool_tag(groups_pool, "h2_proxy_groups");
+            rv = apr_thread_mutex_create(&groups_mutex,
+                                         APR_THREAD_MUTEX_DEFAULT,
+                                         groups_pool);
+        }
+        else {
+            apr_allocator_destroy(allocator);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10641)
+                     "h2_proxy: could not set up shared sessions, "
+                     "ProxyH2Multiplex disabled");
+        return;
+    }
+    backends = apr_hash_make(groups_pool);
+#else
+    (void)pchild;(void)s;
+#endif
+}
+
+static const char *h2_proxy_set_multiplex(cmd_parms *cmd, void *dummy,
+                                          int flag)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    (void)dummy;
+    if (err != NULL) {
+        return err;
+    }
+    h2_proxy_multiplex = flag;
+    return NULL;
+}
+
+static const command_rec h2_proxy_cmds[] = {
+    AP_INIT_FLAG("ProxyH2Multiplex", h2_proxy_set_multiplex, NULL, RSRC_CONF,
+                 "on to share the HTTP/2 sessions with a backend between "
+                 "concurrent requests, off by default"),
+    { NULL }
+};
+
 /**
  * canonicalize the url into the request, if it is meant for us.
  * slightly modified copy from mod_http
@@ -212,19 +389,19 @@ static int proxy_http2_canon(request_rec *r, char *url)
 
 static apr_status_t add_request(h2_proxy_session *session, request_rec *r)
 {
-    h2_proxy_ctx *ctx = session->user_data;
+    proxy_conn_rec *p_conn = session->p_conn;
     const char *url;
     apr_status_t status;
 
     url = apr_table_get(r->notes, H2_PROXY_REQ_URL_NOTE);
     apr_table_setn(r->notes, "proxy-source-port", apr_psprintf(r->pool, "%hu",
-                   ctx->p_conn->connection->local_addr->port));
+                   p_conn->connection->local_addr->port));
     status = h2_proxy_session_submit(session, url, r, 1);
     if (status != APR_SUCCESS) {
         ap_log_cerror(APLOG_MARK, APLOG_ERR, status, r->connection, APLOGNO(03351)
                       "pass request body failed to %pI (%s) from %s (%s)",
-                      ctx->p_conn->addr, ctx->p_conn->hostname ? 
-                      ctx->p_conn->hostname: "", session->c->client_ip, 
+                      p_conn->addr, p_conn->hostname ? 
+                      p_conn->hostname: "", session->c->client_ip, 
                       session->c->remote_host ? session->c->remote_host: "");
     }
     return status;
@@ -248,6 +425,23 @@ static void request_done(h2_proxy_ctx *ctx, request_rec *r,
 static void session_req_done(h2_proxy_session *session, request_rec *r,
                              apr_status_t status, int touched, int error_code)
 {
+#if APR_HAS_THREADS
+    if (session->shared) {
+        /* possibly the request of another thread, waiting for this */
+        h2_proxy_ctx *ctx = ap_get_module_config(r->connection->conn_config,
+                                                 &proxy_http2_module);
+        if (ctx) {
+            /* the group is left by the request's thread, under the lock */
+            apr_thread_mutex_lock(groups_mutex);
+            if (ctx->group) {
+                request_done(ctx, r, status, touched, error_code);
+                apr_thread_cond_broadcast(ctx->group->cond);
+            }
+            apr_thread_mutex_unlock(groups_mutex);
+        }
+        return;
+    }
+#endif
     request_done(session->user_data, r, status, touched, error_code);
 }
 
@@ -262,7 +456,7 @@ static apr_status_t ctx_run(h2_proxy_ctx *ctx) {
     ctx->has_reusable_session = 0; /* don't know yet */
     h2_front = is_h2? is_h2(ctx->cfront) : 0;
     session = h2_proxy_session_setup(ctx->id, ctx->p_conn, ctx->conf,
-                                     h2_front, 30,
+                                     h2_front, 0, 30,
                                      h2_proxy_log2((int)ctx->req_buffer_size),
                                      session_req_done);
     if (!session) {
@@ -309,6 +503,681 @@ out:
     return status;
 }
 
+static int setup_backend(h2_proxy_ctx *ctx, char *url,
+                         const char *proxyname, apr_port_t proxyport)
+{
+    char *locurl = url;
+    apr_uri_t uri;
+    int status;
+
+    /* Get a proxy_conn_rec from the worker, might be a new one, might
+     * be one still open from another request, or it might fail if the
+     * worker is stopped or in error. */
+    if ((status = ap_proxy_acquire_connection(ctx->proxy_func, &ctx->p_conn,
+                                              ctx->worker, ctx->server)) != OK) {
+        return status;
+    }
+
+    ctx->p_conn->is_ssl = ctx->is_ssl;
+
+    /* Step One: Determine the URL to connect to (might be a proxy),
+     * initialize the backend accordingly and determine the server 
+     * port string we can expect in responses. */
+    if ((status = ap_proxy_determine_connection(ctx->pool, ctx->r, ctx->conf,
+                                                ctx->worker, ctx->p_conn,
+                                                &uri, &locurl, 
+                                                proxyname, proxyport, 
+                                                ctx->server_portstr,
+                                                sizeof(ctx->server_portstr))) != OK) {
+        return status;
+    }
+    
+    /* Step Two: Make the Connection (or check that an already existing
+     * socket is still usable). On success, we have a socket connected to
+     * backend->hostname. */
+    if (ap_proxy_connect_backend(ctx->proxy_func, ctx->p_conn, ctx->worker, 
+                                 ctx->server)) {
+        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->cfront, APLOGNO(03352)
+                      "H2: failed to make connection to backend: %s",
+                      ctx->p_conn->hostname);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    
+    /* Step Three: Create conn_rec for the socket we have open now. */
+    status = ap_proxy_connection_create_ex(ctx->proxy_func, ctx->p_conn, ctx->r);
+    if (status != OK) {
+        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, status, ctx->cfront, APLOGNO(03353)
+                      "setup new connection: is_ssl=%d %s %s %s", 
+                      ctx->p_conn->is_ssl, ctx->p_conn->ssl_hostname, 
+                      locurl, ctx->p_conn->hostname);
+        ctx->r_status = ap_map_http_request_error(status, HTTP_SERVICE_UNAVAILABLE);
+        return status;
+    }
+    
+    if (!ctx->p_conn->data && ctx->is_ssl) {
+        /* New SSL connection: set a note on the connection about what
+         * protocol we need. */
+        apr_table_setn(ctx->p_conn->connection->notes,
+                       "proxy-request-alpn-protos", "h2");
+    }
+    return OK;
+}
+
+#if APR_HAS_THREADS
+/* Whether the request may use a session shared with other requests */
+static int group_usable(h2_proxy_ctx *ctx, const char *proxyname)
+{
+    proxy_dir_conf *dconf;
+
+    if (!backends || proxyname || PROXY_WORKER_IS_GENERIC(ctx->worker)
+        || !ctx->worker->s->is_address_reusable
+        || ctx->worker->s->disablereuse) {
+        return 0;
+    }
+    /* the TLS connection would be specific to the Host of the request */
+    dconf = ap_get_module_config(ctx->r->per_dir_config, &proxy_module);
+    return !(ctx->is_ssl && dconf->preserve_host);
+}
+
+static void group_destroy(h2_proxy_group *group)
+{
+    ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, group->session->c,
+                  APLOGNO(10642) "h2_proxy_session(%s): shared session "
+                  "closed", group->session->id);
+    group->p_conn->close = 1;
+    ap_proxy_release_connection(group->proxy_func, group->p_conn,
+                                group->server);
+    apr_pool_destroy(group->pool);
+}
+
+/* Fail the requests whose stream was never submitted, they may retry;
+ * groups_mutex held */
+static void group_fail_pending(h2_proxy_group *group)
+{
+    int i;
+
+    for (i = 0; i < group->pending->nelts; ++i) {
+        h2_proxy_ctx *ctx = APR_ARRAY_IDX(group->pending, i, h2_proxy_ctx *);
+        ctx->r_status = HTTP_SERVICE_UNAVAILABLE;
+        ctx->r_done = 1;
+    }
+    if (group->pending->nelts) {
+        apr_array_clear(group->pending);
+        apr_thread_cond_broadcast(group->cond);
+    }
+}
+
+static void group_forget(apr_array_header_t *list, h2_proxy_ctx *ctx)
+{
+    int i, n;
+
+    for (i = n = 0; i < list->nelts; ++i) {
+        h2_proxy_ctx *other = APR_ARRAY_IDX(list, i, h2_proxy_ctx *);
+        if (other != ctx) {
+            APR_ARRAY_IDX(list, n++, h2_proxy_ctx *) = other;
+        }
+    }
+    list->nelts = n;
+}
+
+/* Have the driver reset the stream; groups_mutex held */
+static void group_cancel(h2_proxy_group *group, h2_proxy_ctx *ctx)
+{
+    ctx->r_cancel = 1;
+    APR_ARRAY_PUSH(group->cancels, h2_proxy_ctx *) = ctx;
+}
+
+/*
+ * What the driver received for the request of another thread (or its
+ * own), queued for it to write. By the driver, outside groups_mutex.
+ */
+static void session_stream_output(h2_proxy_session *session,
+                                  h2_proxy_head *head, int stream_id,
+                                  h2_proxy_out_t type, const char *name,
+                                  apr_size_t nlen, const char *data,
+                                  apr_size_t len)
+{
+    h2_proxy_group *group = session->user_data;
+    request_rec *r = head->r;
+    h2_proxy_ctx *ctx = ap_get_module_config(r->connection->conn_config,
+                                             &proxy_http2_module);
+    h2_proxy_chunk *chunk;
+
+    chunk = ap_malloc(sizeof(*chunk) + nlen + len);
+    chunk->next = NULL;
+    chunk->head = head;
+    chunk->type = type;
+    chunk->nlen = nlen;
+    chunk->len = len;
+    if (nlen) {
+        memcpy(chunk->data, name, nlen);
+    }
+    if (len) {
+        memcpy(chunk->data + nlen, data, len);
+    }
+
+    apr_thread_mutex_lock(groups_mutex);
+    if (ctx && ctx->r == r && ctx->group == group && !ctx->out_failed) {
+        if (ctx->out_last) {
+            ctx->out_last->next = chunk;
+        }
+        else {
+            ctx->out_first = chunk;
+        }
+        ctx->out_last = chunk;
+        ctx->stream_id = stream_id;
+        if (type == H2_PROXY_OUT_DATA) {
+            ctx->out_received += len;
+        }
+        ctx->last_activity = apr_time_now();
+        apr_thread_cond_broadcast(group->cond);
+        chunk = NULL;
+    }
+    apr_thread_mutex_unlock(groups_mutex);
+
+    if (chunk) {
+        /* nobody to write it */
+        if (type == H2_PROXY_OUT_DATA) {
+            h2_proxy_session_consume(session, stream_id, len);
+        }
+        free(chunk);
+    }
+}
+
+/* The driver reads the body of a request, unless its thread writes */
+static int session_front_access(h2_proxy_session *session, request_rec *r,
+                                int enter, apr_size_t sent)
+{
+    h2_proxy_group *group = session->user_data;
+    h2_proxy_ctx *ctx = ap_get_module_config(r->connection->conn_config,
+                                             &proxy_http2_module);
+    int rv = 1;
+
+    if (!ctx || ctx->r != r) {
+        return rv;
+    }
+    apr_thread_mutex_lock(groups_mutex);
+    if (enter) {
+        if (ctx->writing) {
+            rv = 0;
+        }
+        else {
+            ctx->reading = 1;
+        }
+    }
+    else {
+        ctx->reading = 0;
+        if (sent) {
+            ctx->last_activity = apr_time_now();
+        }
+        apr_thread_cond_broadcast(group->cond);
+    }
+    apr_thread_mutex_unlock(groups_mutex);
+    return rv;
+}
+
+/*
+ * Find a session of the worker with room for one more stream, or
+ * start a new one. Sessions that failed, or idle for longer than the
+ * worker's ttl, are closed on the way.
+ */
+static int group_attach(h2_proxy_ctx *ctx, char *url,
+                        const char *proxyname, apr_port_t proxyport)
+{
+    h2_proxy_backend *backend;
+    h2_proxy_group *group, **pgroup, *expired = NULL;
+    h2_proxy_session *session;
+    apr_interval_time_t ttl;
+    apr_time_t now = apr_time_now();
+    apr_pool_t *pool;
+    int status;
+
+    ttl = (ctx->worker->s->ttl > 0)? ctx->worker->s->ttl : H2_PROXY_GROUP_TTL;
+
+    apr_thread_mutex_lock(groups_mutex);
+    backend = apr_hash_get(backends, &ctx->worker, sizeof(ctx->worker));
+    if (!backend) {
+        backend = apr_pcalloc(groups_pool, sizeof(*backend));
+        backend->worker = ctx->worker;
+        apr_hash_set(backends, &backend->worker, sizeof(backend->worker),
+                     backend);
+    }
+    pgroup = &backend->groups;
+    while ((group = *pgroup) != NULL) {
+        if (!group->attached
+            && (group->dead || now - group->idle_since > ttl)) {
+            *pgroup = group->next;
+            group->next = expired;
+            expired = group;
+            continue;
+        }
+        if (!group->dead && group->attached < group->max_streams) {
+            ++group->attached;
+            break;
+        }
+        pgroup = &group->next;
+    }
+    apr_thread_mutex_unlock(groups_mutex);
+
+    while (expired) {
+        h2_proxy_group *next = expired->next;
+        group_destroy(expired);
+        expired = next;
+    }
+
+    if (group) {
+        ctx->group = group;
+        return OK;
+    }
+
+    /* None available, start a new session for this worker */
+    if ((status = setup_backend(ctx, url, proxyname, proxyport)) != OK) {
+        return status;
+    }
+    session = h2_proxy_session_setup(ctx->id, ctx->p_conn, ctx->conf,
+                                     0, 1, 30,
+                                     h2_proxy_log2((int)ctx->req_buffer_size),
+                                     session_req_done);
+    if (!session) {
+        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->cfront,
+                      APLOGNO(10643) "shared session unavailable");
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    /* interim responses are forwarded according to the stream only, the
+     * front connections of the session's requests may differ */
+    session->h2_front = 0;
+    session->stream_out = session_stream_output;
+    session->front = session_front_access;
+
+    apr_pool_create(&pool, groups_pool);
+    apr_pool_tag(pool, "h2_proxy_group");
+    group = apr_pcalloc(pool, sizeof(*group));
+    group->pool = pool;
+    group->backend = backend;
+    group->server = ctx->server;
+    group->proxy_func = ctx->proxy_func;
+    group->p_conn = ctx->p_conn;
+    group->session = session;
+    group->pending = apr_array_make(pool, 10, sizeof(h2_proxy_ctx *));
+    group->cancels = apr_array_make(pool, 10, sizeof(h2_proxy_ctx *));
+    group->submitting = apr_array_make(pool, 10, sizeof(h2_proxy_ctx *));
+    group->cancelling = apr_array_make(pool, 10, sizeof(h2_proxy_ctx *));
+    group->consumed = apr_array_make(pool, 10, sizeof(h2_proxy_consumed));
+    group->consuming = apr_array_make(pool, 10, sizeof(h2_proxy_consumed));
+    group->max_streams = H2_PROXY_GROUP_MAX_STREAMS;
+    group->attached = 1;
+    if ((status = apr_thread_cond_create(&group->cond, pool)) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    session->user_data = group;
+    /* the connection belongs to the session now */
+    ctx->p_conn = NULL;
+    ctx->group = group;
+
+    ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->cfront, APLOGNO(10644)
+                  "eng(%s): new shared session %s to %s", ctx->id,
+                  session->id, group->p_conn->hostname);
+
+    apr_thread_mutex_lock(groups_mutex);
+    group->next = backend->groups;
+    backend->groups = group;
+    apr_thread_mutex_unlock(groups_mutex);
+    return OK;
+}
+
+/* Leave the session, the request being done; groups_mutex held */
+static h2_proxy_group *group_leave(h2_proxy_ctx *ctx)
+{
+    h2_proxy_group *group = ctx->group, **pgroup;
+
+    group_forget(group->pending, ctx);
+    group_forget(group->cancels, ctx);
+    group_forget(group->cancelling, ctx);
+    if (group->driver == ctx) {
+        group->driver = NULL;
+        apr_thread_cond_broadcast(group->cond);
+    }
+    ctx->group = NULL;
+    group->idle_since = apr_time_now();
+    if (--group->attached > 0 || !group->dead) {
+        return NULL;
+    }
+    /* nobody else to run it, close it */
+    for (pgroup = &group->backend->groups; *pgroup; pgroup = &(*pgroup)->next) {
+        if (*pgroup == group) {
+            *pgroup = group->next;
+            break;
+        }
+    }
+    return group;
+}
+
+static void group_detach(h2_proxy_ctx *ctx)
+{
+    h2_proxy_group *dead;
+
+    apr_thread_mutex_lock(groups_mutex);
+    dead = group_leave(ctx);
+    apr_thread_mutex_unlock(groups_mutex);
+    if (dead) {
+        group_destroy(dead);
+    }
+}
+
+/* The work of the driver, outside groups_mutex */
+static apr_status_t group_process(h2_proxy_ctx *ctx, h2_proxy_group *group)
+{
+    h2_proxy_session *session = group->session;
+    apr_status_t status;
+    int i;
+
+    if (group->submitting->nelts && h2_proxy_session_is_reusable(session)) {
+        /* idle so far, let the session check the backend is still there */
+        h2_proxy_session_setup(ctx->id, group->p_conn, ctx->conf, 0, 1, 30,
+                               h2_proxy_log2((int)ctx->req_buffer_size),
+                               session_req_done);
+    }
+    for (i = 0; i < group->submitting->nelts; ++i) {
+        h2_proxy_ctx *sctx = APR_ARRAY_IDX(group->submitting, i,
+                                           h2_proxy_ctx *);
+        status = add_request(session, sctx->r);
+        if (status != APR_SUCCESS) {
+            apr_thread_mutex_lock(groups_mutex);
+            request_done(sctx, sctx->r, status, 0, 0);
+            apr_thread_cond_broadcast(group->cond);
+            apr_thread_mutex_unlock(groups_mutex);
+        }
+    }
+    apr_array_clear(group->submitting);
+
+    /* Under the mutex, for the requests which failed above to be either
+     * done or gone (not in the list anymore) */
+    apr_thread_mutex_lock(groups_mutex);
+    for (i = 0; i < group->cancelling->nelts; ++i) {
+        h2_proxy_ctx *cctx = APR_ARRAY_IDX(group->cancelling, i,
+                                           h2_proxy_ctx *);
+        if (!cctx->r_done) {
+            h2_proxy_session_cancel(session, cctx->r);
+        }
+    }
+    apr_array_clear(group->cancelling);
+    apr_thread_mutex_unlock(groups_mutex);
+
+    for (i = 0; i < group->consuming->nelts; ++i) {
+        h2_proxy_consumed *consumed = &APR_ARRAY_IDX(group->consuming, i,
+                                                     h2_proxy_consumed);
+        h2_proxy_session_consume(session, consumed->stream_id,
+                                 consumed->len);
+    }
+    apr_array_clear(group->consuming);
+
+    status = h2_proxy_session_process(session);
+    if (status != APR_SUCCESS) {
+        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, status, ctx->cfront,
+                      APLOGNO(10645) "eng(%s): end of shared session %s",
+                      ctx->id, session->id);
+        h2_proxy_session_cleanup(session, session_req_done);
+    }
+    return status;
+}
+
+/*
+ * Apply or write what the driver received for the request, on the
+ * request's thread, outside groups_mutex. Returns the length of the
+ * DATA, written or not, for its window to be given back.
+ */
+static apr_size_t group_write(h2_proxy_ctx *ctx, h2_proxy_chunk *chunk,
+                              apr_status_t *pstatus)
+{
+    request_rec *r = ctx->r;
+    h2_proxy_session *session = ctx->group->session;
+    apr_bucket_alloc_t *ba = ctx->cfront->bucket_alloc;
+    apr_size_t len = 0;
+
+    *pstatus = APR_SUCCESS;
+    if (!ctx->output) {
+        ctx->output = apr_brigade_create(r->pool, ba);
+    }
+    while (chunk) {
+        h2_proxy_chunk *next = chunk->next;
+
+        switch (chunk->type) {
+        case H2_PROXY_OUT_DATA:
+            len += chunk->len;
+            if (!ctx->out_failed) {
+                APR_BRIGADE_INSERT_TAIL(ctx->output,
+                    apr_bucket_heap_create(chunk->data, chunk->len, NULL, ba));
+            }
+            break;
+        case H2_PROXY_OUT_HEADER:
+        case H2_PROXY_OUT_TRAILER:
+            /* the status was checked by the driver */
+            h2_proxy_head_add(session, chunk->head,
+                              chunk->type == H2_PROXY_OUT_TRAILER,
+                              chunk->data, chunk->nlen,
+                              chunk->data + chunk->nlen, chunk->len);
+            break;
+        case H2_PROXY_OUT_INTERIM:
+            if (!ctx->out_failed) {
+                h2_proxy_head_interim(session, chunk->head);
+            }
+            break;
+        case H2_PROXY_OUT_HEADERS_END:
+            h2_proxy_head_end(session, chunk->head);
+            break;
+        }
+        free(chunk);
+        chunk = next;
+    }
+    if (!APR_BRIGADE_EMPTY(ctx->output)) {
+        /* as the session does, no other indication of buffer use */
+        APR_BRIGADE_INSERT_TAIL(ctx->output, apr_bucket_flush_create(ba));
+        *pstatus = ap_pass_brigade(r->output_filters, ctx->output);
+        apr_brigade_cleanup(ctx->output);
+        if (*pstatus != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, *pstatus, r, APLOGNO(10661)
+                          "eng(%s): passing output of stream %d", ctx->id,
+                          ctx->stream_id);
+        }
+    }
+    return len;
+}
+
+/* End the response of a request processed on a shared session, once
+ * done, as the session does on its own */
+static void group_finish(h2_proxy_ctx *ctx)
+{
+    request_rec *r = ctx->r;
+    apr_bucket_alloc_t *ba = ctx->cfront->bucket_alloc;
+
+    if (ctx->r_timedout) {
+        apr_table_setn(r->notes, "proxy_timedout", "1");
+        ctx->r_status = HTTP_GATEWAY_TIME_OUT;
+        ctx->r_may_retry = 0;
+    }
+    if (ctx->out_failed || ctx->cfront->aborted) {
+        return;
+    }
+    if (!ctx->output) {
+        ctx->output = apr_brigade_create(r->pool, ba);
+    }
+    if (ctx->out_received) {
+        if (ctx->r_status == OK) {
+            return;
+        }
+        /* the response is broken, tell the consumers */
+        APR_BRIGADE_INSERT_TAIL(ctx->output,
+                                ap_bucket_error_create(ctx->r_status, NULL,
+                                                       r->pool, ba));
+    }
+    else if (ctx->r_status == OK) {
+        /* no body, write the headers */
+        APR_BRIGADE_INSERT_TAIL(ctx->output, apr_bucket_flush_create(ba));
+    }
+    else {
+        return;
+    }
+    APR_BRIGADE_INSERT_TAIL(ctx->output, apr_bucket_eos_create(ba));
+    ap_pass_brigade(r->output_filters, ctx->output);
+    apr_brigade_cleanup(ctx->output);
+}
+
+/*
+ * Have the request's stream processed on the shared session, either by
+ * the current driver or by becoming the driver, and write its response
+ * as it is received. In any case, only return when the stream is done:
+ * its body may be read by another thread until then.
+ */
+static apr_status_t group_run(h2_proxy_ctx *ctx)
+{
+    h2_proxy_group *group = ctx->group, *dead;
+    apr_array_header_t *tmp;
+    apr_status_t status;
+    int i;
+
+    ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->cfront, APLOGNO(10646)
+                  "eng(%s): run shared session %s", ctx->id,
+                  group->session->id);
+
+    if (ctx->worker->s->timeout_set) {
+        ctx->timeout = ctx->worker->s->timeout;
+    }
+    else if (ctx->conf->timeout_set) {
+        ctx->timeout = ctx->conf->timeout;
+    }
+    else {
+        ctx->timeout = ctx->server->timeout;
+    }
+
+    apr_thread_mutex_lock(groups_mutex);
+    ctx->r_done = 0;
+    ctx->r_cancel = 0;
+    ctx->r_timedout = 0;
+    ctx->stream_id = 0;
+    ctx->out_received = 0;
+    ctx->out_failed = 0;
+    ctx->last_activity = apr_time_now();
+    APR_ARRAY_PUSH(group->pending, h2_proxy_ctx *) = ctx;
+
+    while (!ctx->r_done || ctx->out_first) {
+        if (ctx->out_first && !ctx->reading) {
+            h2_proxy_chunk *chunks = ctx->out_first;
+            apr_size_t len;
+
+            if (group->driver == ctx) {
+                /* don't keep the others waiting while writing */
+                group->driver = NULL;
+                apr_thread_cond_broadcast(group->cond);
+            }
+            ctx->out_first = ctx->out_last = NULL;
+            ctx->writing = 1;
+            apr_thread_mutex_unlock(groups_mutex);
+
+            len = group_write(ctx, chunks, &status);
+
+            apr_thread_mutex_lock(groups_mutex);
+            ctx->writing = 0;
+            if (len) {
+                h2_proxy_consumed *consumed = apr_array_push(group->consumed);
+                consumed->stream_id = ctx->stream_id;
+                consumed->len = len;
+            }
+            if (status != APR_SUCCESS) {
+                /* the client is gone, nothing more to write */
+                ctx->out_failed = 1;
+                if (!ctx->r_cancel && !ctx->r_done) {
+                    group_cancel(group, ctx);
+                }
+            }
+            continue;
+        }
+        if (ctx->out_first) {
+            /* the driver is reading the request body, shortly */
+            apr_thread_cond_timedwait(group->cond, groups_mutex,
+                                      H2_PROXY_GROUP_WAIT);
+            continue;
+        }
+        if (!ctx->r_cancel) {
+            if (ctx->cfront->aborted) {
+                /* master connection gone, cancel the stream */
+                group_cancel(group, ctx);
+            }
+            else if (ctx->timeout > 0
+                     && apr_time_now() - ctx->last_activity > ctx->timeout) {
+                ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->cfront,
+                              APLOGNO(10662) "eng(%s): timeout on shared "
+                              "session %s", ctx->id, group->session->id);
+                ctx->r_timedout = 1;
+                group_cancel(group, ctx);
+            }
+            if (ctx->r_cancel) {
+                /* not submitted yet, nothing to reset */
+                i = group->pending->nelts;
+                group_forget(group->pending, ctx);
+                if (i != group->pending->nelts) {
+                    ctx->r_done = 1;
+                    continue;
+                }
+            }
+        }
+        if (group->dead) {
+            group_fail_pending(group);
+            if (ctx->r_done) {
+                continue;
+            }
+        }
+        if (group->driver && group->driver != ctx) {
+            apr_thread_cond_timedwait(group->cond, groups_mutex,
+                                      H2_PROXY_GROUP_WAIT);
+            continue;
+        }
+
+        group->driver = ctx;
+        tmp = group->submitting;
+        group->submitting = group->pending;
+        group->pending = tmp;
+        /* those done meanwhile may be gone already */
+        for (i = 0; i < group->cancels->nelts; ++i) {
+            h2_proxy_ctx *other = APR_ARRAY_IDX(group->cancels, i,
+                                                h2_proxy_ctx *);
+            if (!other->r_done) {
+                APR_ARRAY_PUSH(group->cancelling, h2_proxy_ctx *) = other;
+            }
+        }
+        apr_array_clear(group->cancels);
+        tmp = group->consuming;
+        group->consuming = group->consumed;
+        group->consumed = tmp;
+        apr_thread_mutex_unlock(groups_mutex);
+
+        status = group_process(ctx, group);
+
+        apr_thread_mutex_lock(groups_mutex);
+        if (group->session->remote_max_concurrent > 0) {
+            group->max_streams = (int)H2MIN(H2_PROXY_GROUP_MAX_STREAMS,
+                                     group->session->remote_max_concurrent);
+        }
+        if (status != APR_SUCCESS
+            || group->session->state == H2_PROXYS_ST_DONE
+            || group->session->state == H2_PROXYS_ST_LOCAL_SHUTDOWN
+            || group->session->state == H2_PROXYS_ST_REMOTE_SHUTDOWN) {
+            /* no more streams on this one */
+            group->dead = 1;
+        }
+    }
+
+    dead = group_leave(ctx);
+    apr_thread_mutex_unlock(groups_mutex);
+    if (dead) {
+        group_destroy(dead);
+    }
+
+    group_finish(ctx);
+    return APR_SUCCESS;
+}
+#endif /* APR_HAS_THREADS */
+
 static int proxy_http2_handler(request_rec *r, 
                                proxy_worker *worker,
                                proxy_server_conf *conf,
@@ -317,12 +1186,11 @@ static int proxy_http2_handler(request_rec *r,
                                apr_port_t proxyport)
 {
     const char *proxy_func;
-    char *locurl, *u;
+    char *u;
     apr_size_t slen;
     int is_ssl = 0;
     apr_status_t status;
     h2_proxy_ctx *ctx;
-    apr_uri_t uri;
     int reconnects = 0;
     
     /* find the scheme */
@@ -374,60 +1242,27 @@ static int proxy_http2_handler(request_rec *r,
 run_connect:    
     if (ctx->cfront->aborted) goto cleanup;
 
-    /* Get a proxy_conn_rec from the worker, might be a new one, might
-     * be one still open from another request, or it might fail if the
-     * worker is stopped or in error. */
-    if ((status = ap_proxy_acquire_connection(ctx->proxy_func, &ctx->p_conn,
-                                              ctx->worker, ctx->server)) != OK) {
-        goto cleanup;
-    }
-
-    locurl = url;
-    ctx->p_conn->is_ssl = ctx->is_ssl;
-
-    /* Step One: Determine the URL to connect to (might be a proxy),
-     * initialize the backend accordingly and determine the server 
-     * port string we can expect in responses. */
-    if ((status = ap_proxy_determine_connection(ctx->pool, ctx->r, conf, worker, 
-                                                ctx->p_conn, &uri, &locurl, 
-                                                proxyname, proxyport, 
-                                                ctx->server_portstr,
-                                                sizeof(ctx->server_portstr))) != OK) {
-        goto cleanup;
-    }
-    
-    /* Step Two: Make the Connection (or check that an already existing
-     * socket is still usable). On success, we have a socket connected to
-     * backend->hostname. */
-    if (ap_proxy_connect_backend(ctx->proxy_func, ctx->p_conn, ctx->worker, 
-                                 ctx->server)) {
-        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctx->cfront, APLOGNO(03352)
-                      "H2: failed to make connection to backend: %s",
-                      ctx->p_conn->hostname);
-        goto cleanup;
-    }
-    
-    /* Step Three: Create conn_rec for the socket we have open now. */
-    status = ap_proxy_connection_create_ex(ctx->proxy_func, ctx->p_conn, ctx->r);
-    if (status != OK) {
-        ap_log_cerror(APLOG_MARK, APLOG_DEBUG, status, ctx->cfront, APLOGNO(03353)
-                      "setup new connection: is_ssl=%d %s %s %s", 
-                      ctx->p_conn->is_ssl, ctx->p_conn->ssl_hostname, 
-                      locurl, ctx->p_conn->hostname);
-        ctx->r_status = ap_map_http_request_error(status, HTTP_SERVICE_UNAVAILABLE);
-        goto cleanup;
+#if APR_HAS_THREADS
+    if (group_usable(ctx, proxyname)) {
+        if ((status = group_attach(ctx, url, proxyname, proxyport)) != OK) {
+            goto cleanup;
+        }
+        if (ctx->cfront->aborted) {
+            group_detach(ctx);
+            goto cleanup;
+        }
+        status = group_run(ctx);
     }
-    
-    if (!ctx->p_conn->data && ctx->is_ssl) {
-        /* New SSL connection: set a note on the connection about what
-         * protocol we need. */
-        apr_table_setn(ctx->p_conn->connection->notes,
-                       "proxy-request-alpn-protos", "h2");
+    else
+#endif
+    {
+        if ((status = setup_backend(ctx, url, proxyname, proxyport)) != OK) {
+            goto cleanup;
+        }
+        if (ctx->cfront->aborted) goto cleanup;
+        status = ctx_run(ctx);
     }
 
-    if (ctx->cfront->aborted) goto cleanup;
-    status = ctx_run(ctx);
-
     if (ctx->r_status != OK && ctx->r_may_retry && !ctx->cfront->aborted) {
         /* Not successfully processed, but may retry, tear down old conn and start over */
         if (ctx->p_conn) {
@@ -475,7 +1310,9 @@ cleanup:
 
 static void register_hook(apr_pool_t *p)
 {
+    ap_hook_pre_config(h2_proxy_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(h2_proxy_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(h2_proxy_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 
     proxy_hook_scheme_handler(proxy_http2_handler, NULL, NULL, APR_HOOK_FIRST);
     proxy_hook_canon_handler(proxy_http2_canon, NULL, NULL, APR_HOOK_FIRST);
@@ -54,6 +54,7 @@
 #include "apr_global_mutex.h"
 #include "apr_dbm.h"
 #include "apr_dbd.h"
+#include "apr_mmap.h"
 
 #include "apr_version.h"
 #if !APR_VERSION_AT_LEAST(2,0,0)
@@ -93,6 +94,7 @@
 #include "util_mutex.h"
 
 #include "mod_rewrite.h"
+#include "rewrite_idx_common.h"
 #include "ap_expr.h"
 
 #if APR_CHARSET_EBCDIC
@@ -196,6 +198,7 @@ static const char* really_last_key = "rewrite_really_last";
 #define MAPTYPE_RND                 (1<<4)
 #define MAPTYPE_DBD                 (1<<5)
 #define MAPTYPE_DBD_CACHE           (1<<6)
+#define MAPTYPE_IDX                 (1<<7)
 
 #define ENGINE_DISABLED             (1<<0)
 #define ENGINE_ENABLED              (1<<1)
@@ -252,6 +255,17 @@ static const char* really_last_key = "rewrite_really_last";
 #define REWRITE_MAX_ROUNDS 10000
 #endif
 
+/*
+ * number of independently locked shards per cached map, and the default
+ * upper bound of entries kept per cached map (see RewriteMapCache)
+ */
+#ifndef REWRITE_CACHE_SHARDS
+#define REWRITE_CACHE_SHARDS 16
+#endif
+#ifndef REWRITE_CACHE_MAX_ENTRIES
+#define REWRITE_CACHE_MAX_ENTRIES 65536
+#endif
+
 /*
  * +-------------------------------------------------------+
  * |                                                       |
@@ -260,11 +274,18 @@ static const char* really_last_key = "rewrite_really_last";
  * +-------------------------------------------------------+
  */
 
+struct cachedmap;
+struct idxmap;
+
 typedef struct {
     const char *datafile;          /* filename for map data files         */
     const char *dbmtype;           /* dbm type for dbm map data files     */
     const char *checkfile;         /* filename to check for map existence */
-    const char *cachename;         /* for cached maps (txt/rnd/dbm)       */
+    int   cached;                  /* cached map (txt/rnd/dbm/fastdbd)    */
+    apr_interval_time_t cachettl;  /* lifetime of cached values, 0=map's  */
+    int   cachemax;                /* max number of cached values         */
+    struct cachedmap *cache;       /* the (per-child) cache of this map   */
+    struct idxmap *idx;            /* the (per-child) mapping of idx maps */
     int   type;                    /* the type of the map                 */
     apr_file_t *fpin;              /* in  file pointer for program maps   */
     apr_file_t *fpout;             /* out file pointer for program maps   */
@@ -320,6 +341,20 @@ typedef struct {
     int             pskip;   /* back-index to display pattern */
 } rewritecond_entry;
 
+/* the literal prefixes of the rules of a configuration section, which are
+ * looked up for the URI at once rather than compared rule by rule
+ */
+typedef struct {
+    apr_hash_t         *rules;   /* prefix -> offsets of its rules  */
+    apr_array_header_t *lengths; /* prefix lengths, ascending       */
+} prefix_table;
+
+typedef struct {
+    prefix_table exact;
+    prefix_table nocase;         /* lowercased prefixes of [NC] rules */
+    int          nrules;         /* number of rules indexed           */
+} prefix_index;
+
 /* single linked list for env vars and cookies */
 typedef struct data_item {
     struct data_item *next;
@@ -341,6 +376,9 @@ typedef struct {
     int        maxrounds;            /* limit on number of loops with N flag  */
     const char *escapes;             /* specific backref escapes              */
     const char *noescapes;           /* specific backref chars not to escape  */
+    const char *prefix;              /* literal prefix of matching URIs       */
+    prefix_index *index;             /* the index of the literal prefix       */
+    int         indexoff;            /* offset of the rule in the index       */
 } rewriterule_entry;
 
 typedef struct {
@@ -349,6 +387,7 @@ typedef struct {
     apr_hash_t         *rewritemaps;  /* the RewriteMap entries             */
     apr_array_header_t *rewriteconds; /* the RewriteCond entries (temp.)    */
     apr_array_header_t *rewriterules; /* the RewriteRule entries            */
+    prefix_index *prefixindex;        /* their literal prefixes (temp.)     */
     server_rec   *server;             /* the corresponding server indicator */
     unsigned int state_set:1;
     unsigned int options_set:1;
@@ -359,6 +398,7 @@ typedef struct {
     int           options;            /* the RewriteOption state           */
     apr_array_header_t *rewriteconds; /* the RewriteCond entries (temp.)   */
     apr_array_header_t *rewriterules; /* the RewriteRule entries           */
+    prefix_index *prefixindex;        /* their literal prefixes (temp.)    */
     char         *directory;          /* the directory where it applies    */
     const char   *baseurl;            /* the base-URL  where it applies    */
     unsigned int state_set:1;
@@ -367,23 +407,70 @@ typedef struct {
 } rewrite_perdir_conf;
 
 /* the (per-child) cache structures.
+ *
+ * Each cached map is split into REWRITE_CACHE_SHARDS shards selected by
+ * the hash of the key, every shard having its own lock, so that concurrent
+ * lookups of different keys don't serialize on a single mutex.
+ *
+ * A shard holds two generations of entries, each living in its own subpool.
+ * New values go to the current generation, and hits in the previous one are
+ * promoted to the current. Once the current generation is full the previous
+ * one is dropped at once and replaced by the current, which bounds the
+ * memory used by the map and approximates LRU without any per entry
+ * bookkeeping. All the entries of a shard are also forgotten whenever the
+ * mtime of the map changes.
  */
-typedef struct cache {
-    apr_pool_t         *pool;
-    apr_hash_t         *maps;
+typedef struct {
+    apr_pool_t *pool;
+    apr_hash_t *entries;
+    unsigned int count;
+} cachegen;
+
+typedef struct {
 #if APR_HAS_THREADS
     apr_thread_mutex_t *lock;
 #endif
-} cache;
+    apr_time_t mtime;
+    cachegen gen[2];               /* current and previous generations */
+} cacheshard;
+
+typedef struct cachedmap {
+    unsigned int maxcount;         /* max entries per shard generation */
+    apr_interval_time_t ttl;
+    cacheshard shards[REWRITE_CACHE_SHARDS];
+} cachedmap;
 
-/* cached maps contain an mtime for the whole map and live in a subpool
- * of the cachep->pool. That makes it easy to forget them if necessary.
- */
 typedef struct {
+    apr_time_t expiry;             /* 0 if the value never expires */
+    char *val;
+} cacheentry;
+
+#if APR_HAS_MMAP
+/* idx: map files are memory mapped by each child and shared by its threads.
+ * When the file is replaced, the new one gets mapped and the previous
+ * mapping is released by the last thread using it.
+ */
+typedef struct idxfile {
+    apr_pool_t *pool;
+    apr_mmap_t *mm;
+    const rewrite_idx_slot_t *slots;
+    apr_uint32_t mask;
     apr_time_t mtime;
+    apr_ino_t inode;
+    apr_off_t size;
+    int refcount;
+} idxfile;
+
+typedef struct idxmap {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+#endif
     apr_pool_t *pool;
-    apr_hash_t *entries;
-} cachedmap;
+    idxfile *current;
+} idxmap;
+
+static idxmap *create_idxmap(void);
+#endif
 
 /* the regex structure for the
  * substitution of backreferences
@@ -413,6 +500,8 @@ typedef struct {
     backrefinfo briRR;
     backrefinfo briRC;
     apr_pool_t *temp_pool;
+    prefix_index *index;   /* the prefix index looked up for uri */
+    char *prefixmatch;     /* its rules whose prefix matches uri */
 } rewrite_ctx;
 
 /*
@@ -429,8 +518,8 @@ module AP_MODULE_DECLARE_DATA rewrite_module;
 /* rewritemap int: handler function registry */
 static apr_hash_t *mapfunc_hash;
 
-/* the cache */
-static cache *cachep;
+/* the pool of the (per-child) map caches */
+static apr_pool_t *cachep;
 
 /* whether proxy module is available or not */
 static int proxy_available;
@@ -1107,110 +1196,210 @@ static char *subst_prefix_path(request_rec *r, char *input, const char *match,
  * +-------------------------------------------------------+
  */
 
-static void set_cache_value(const char *name, apr_time_t t, char *key,
-                            char *val)
+static APR_INLINE cacheshard *get_cache_shard(cachedmap *map,
+                                              const char *key)
 {
-    cachedmap *map;
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    unsigned int hash = apr_hashfunc_default(key, &len);
 
-    if (cachep) {
-#if APR_HAS_THREADS
-        apr_thread_mutex_lock(cachep->lock);
-#endif
-        map = apr_hash_get(cachep->maps, name, APR_HASH_KEY_STRING);
+    /* apr_hash uses the low bits of the very same hash to select buckets,
+     * so pick the shard from scrambled high bits to not leave most of the
+     * buckets of each shard unused.
+     */
+    return &map->shards[((hash * 2654435761U) >> 16) % REWRITE_CACHE_SHARDS];
+}
 
-        if (!map) {
-            apr_pool_t *p;
+static void reset_cache_shard(cacheshard *shard, apr_time_t t)
+{
+    int i;
 
-            if (apr_pool_create(&p, cachep->pool) != APR_SUCCESS) {
-#if APR_HAS_THREADS
-                apr_thread_mutex_unlock(cachep->lock);
-#endif
-                return;
-            }
-            apr_pool_tag(p, "rewrite_cachedmap");
+    for (i = 0; i < 2; ++i) {
+        apr_pool_clear(shard->gen[i].pool);
+        shard->gen[i].entries = apr_hash_make(shard->gen[i].pool);
+        shard->gen[i].count = 0;
+    }
+    shard->mtime = t;
+}
 
-            map = apr_palloc(cachep->pool, sizeof(cachedmap));
-            map->pool = p;
-            map->entries = apr_hash_make(map->pool);
-            map->mtime = t;
+/* must be called with the shard locked */
+static void store_cache_entry(cachedmap *map, cacheshard *shard,
+                              const char *key, const char *val,
+                              apr_time_t expiry)
+{
+    cachegen *gen = &shard->gen[0];
+    cacheentry *entry;
 
-            apr_hash_set(cachep->maps, name, APR_HASH_KEY_STRING, map);
-        }
-        else if (map->mtime != t) {
-            apr_pool_clear(map->pool);
-            map->entries = apr_hash_make(map->pool);
-            map->mtime = t;
+    if (gen->count >= map->maxcount) {
+        /* current generation is full, forget the previous one and
+         * start a new current generation
+         */
+        cachegen prev = shard->gen[1];
+
+        apr_pool_clear(prev.pool);
+        prev.entries = apr_hash_make(prev.pool);
+        prev.count = 0;
+        shard->gen[1] = shard->gen[0];
+        shard->gen[0] = prev;
+    }
+
+    /* We need to copy the key and the value into OUR pool,
+     * so that we don't leave it during the r->pool cleanup.
+     */
+    entry = apr_palloc(gen->pool, sizeof(cacheentry));
+    entry->expiry = expiry;
+    entry->val = apr_pstrdup(gen->pool, val);
+    apr_hash_set(gen->entries, apr_pstrdup(gen->pool, key),
+                 APR_HASH_KEY_STRING, entry);
+    gen->count++;
+}
+
+static void set_cache_value(cachedmap *map, apr_time_t t, char *key,
+                            char *val)
+{
+    cacheshard *shard;
+
+    if (map) {
+        shard = get_cache_shard(map, key);
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(shard->lock);
+#endif
+        if (shard->mtime != t) {
+            reset_cache_shard(shard, t);
         }
 
-        /* Now we should have a valid map->entries hash, where we
-         * can store our value.
-         *
-         * We need to copy the key and the value into OUR pool,
-         * so that we don't leave it during the r->pool cleanup.
-         */
-        apr_hash_set(map->entries,
-                     apr_pstrdup(map->pool, key), APR_HASH_KEY_STRING,
-                     apr_pstrdup(map->pool, val));
+        store_cache_entry(map, shard, key, val,
+                          map->ttl ? apr_time_now() + map->ttl : 0);
 
 #if APR_HAS_THREADS
-        apr_thread_mutex_unlock(cachep->lock);
+        apr_thread_mutex_unlock(shard->lock);
 #endif
     }
 
     return;
 }
 
-static char *get_cache_value(const char *name, apr_time_t t, char *key,
+static char *get_cache_value(cachedmap *map, apr_time_t t, char *key,
                              apr_pool_t *p)
 {
-    cachedmap *map;
+    cacheshard *shard;
+    cacheentry *entry;
     char *val = NULL;
 
-    if (cachep) {
+    if (map) {
+        shard = get_cache_shard(map, key);
 #if APR_HAS_THREADS
-        apr_thread_mutex_lock(cachep->lock);
+        apr_thread_mutex_lock(shard->lock);
 #endif
-        map = apr_hash_get(cachep->maps, name, APR_HASH_KEY_STRING);
-
-        if (map) {
-            /* if this map is outdated, forget it. */
-            if (map->mtime != t) {
-                apr_pool_clear(map->pool);
-                map->entries = apr_hash_make(map->pool);
-                map->mtime = t;
-            }
-            else {
-                val = apr_hash_get(map->entries, key, APR_HASH_KEY_STRING);
-                if (val) {
-                    /* copy the cached value into the supplied pool,
-                     * where it belongs (r->pool usually)
+        /* if this map is outdated, forget it. */
+        if (shard->mtime != t) {
+            reset_cache_shard(shard, t);
+        }
+        else {
+            int promote = 0;
+
+            entry = apr_hash_get(shard->gen[0].entries, key,
+                                 APR_HASH_KEY_STRING);
+            if (!entry) {
+                entry = apr_hash_get(shard->gen[1].entries, key,
+                                     APR_HASH_KEY_STRING);
+                promote = 1;
+            }
+            if (entry && (!entry->expiry || entry->expiry > apr_time_now())) {
+                /* copy the cached value into the supplied pool,
+                 * where it belongs (r->pool usually)
+                 */
+                val = apr_pstrdup(p, entry->val);
+                if (promote) {
+                    /* the entry may vanish with its generation here,
+                     * hence store our copy of the value
                      */
-                    val = apr_pstrdup(p, val);
+                    store_cache_entry(map, shard, key, val, entry->expiry);
                 }
             }
         }
-
 #if APR_HAS_THREADS
-        apr_thread_mutex_unlock(cachep->lock);
+        apr_thread_mutex_unlock(shard->lock);
 #endif
     }
 
     return val;
 }
 
-static int init_cache(apr_pool_t *p)
+static cachedmap *create_cachedmap(rewritemap_entry *s)
+{
+    cachedmap *map;
+    unsigned int max;
+    int i, j;
+
+    map = apr_pcalloc(cachep, sizeof(cachedmap));
+    map->ttl = s->cachettl;
+
+    /* two generations per shard */
+    max = s->cachemax > 0 ? s->cachemax : REWRITE_CACHE_MAX_ENTRIES;
+    map->maxcount = (max + 2 * REWRITE_CACHE_SHARDS - 1)
+                    / (2 * REWRITE_CACHE_SHARDS);
+
+    for (i = 0; i < REWRITE_CACHE_SHARDS; ++i) {
+        cacheshard *shard = &map->shards[i];
+
+#if APR_HAS_THREADS
+        if (apr_thread_mutex_create(&shard->lock, APR_THREAD_MUTEX_DEFAULT,
+                                    cachep) != APR_SUCCESS) {
+            return NULL;
+        }
+#endif
+        for (j = 0; j < 2; ++j) {
+            if (apr_pool_create(&shard->gen[j].pool, cachep) != APR_SUCCESS) {
+                return NULL;
+            }
+            apr_pool_tag(shard->gen[j].pool, "rewrite_cachedmap");
+            shard->gen[j].entries = apr_hash_make(shard->gen[j].pool);
+        }
+    }
+
+    return map;
+}
+
+static int init_cache(apr_pool_t *p, server_rec *s)
 {
-    cachep = apr_palloc(p, sizeof(cache));
-    if (apr_pool_create(&cachep->pool, p) != APR_SUCCESS) {
+    if (apr_pool_create(&cachep, p) != APR_SUCCESS) {
         cachep = NULL; /* turns off cache */
         return 0;
     }
-    apr_pool_tag(cachep->pool, "rewrite_cachep");
+    apr_pool_tag(cachep, "rewrite_cachep");
 
-    cachep->maps = apr_hash_make(cachep->pool);
-#if APR_HAS_THREADS
-    (void)apr_thread_mutex_create(&(cachep->lock), APR_THREAD_MUTEX_DEFAULT, p);
+    /* Create the caches of all the cached maps upfront, so that finding
+     * the cache of a map at lookup time needs no locking.
+     */
+    for (; s; s = s->next) {
+        rewrite_server_conf *conf;
+        apr_hash_index_t *hi;
+
+        conf = ap_get_module_config(s->module_config, &rewrite_module);
+        for (hi = apr_hash_first(p, conf->rewritemaps); hi;
+             hi = apr_hash_next(hi)) {
+            rewritemap_entry *map;
+            void *val;
+
+            apr_hash_this(hi, NULL, NULL, &val);
+            map = val;
+
+            if (map->cached && !map->cache) {
+                map->cache = create_cachedmap(map);
+                if (!map->cache) {
+                    return 0;
+                }
+            }
+#if APR_HAS_MMAP
+            if (map->type == MAPTYPE_IDX && !map->idx) {
+                map->idx = create_idxmap();
+                if (!map->idx) {
+                    return 0;
+                }
+            }
 #endif
+        }
+    }
 
     return 1;
 }
@@ -1498,6 +1687,189 @@ static char *lookup_map_dbmfile(request_rec *r, const char *file,
 
     return value;
 }
+#if APR_HAS_MMAP
+static apr_status_t open_idxfile(idxfile **pf, const char *file,
+                                 apr_pool_t *p)
+{
+    const rewrite_idx_header_t *hdr;
+    apr_file_t *fp;
+    apr_finfo_t st;
+    apr_status_t rv;
+    idxfile *f;
+
+    rv = apr_file_open(&fp, file, APR_FOPEN_READ, APR_OS_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    f = apr_pcalloc(p, sizeof(idxfile));
+    f->pool = p;
+
+    rv = apr_file_info_get(&st, APR_FINFO_MIN | APR_FINFO_INODE, fp);
+    if (rv == APR_SUCCESS || rv == APR_INCOMPLETE) {
+        rv = APR_EINVAL;
+        if (st.size >= (apr_off_t)sizeof(rewrite_idx_header_t)) {
+            rv = apr_mmap_create(&f->mm, fp, 0, (apr_size_t)st.size,
+                                 APR_MMAP_READ, p);
+        }
+    }
+    apr_file_close(fp);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    hdr = f->mm->mm;
+    if (memcmp(hdr->magic, REWRITE_IDX_MAGIC, REWRITE_IDX_MAGIC_LEN)
+        || hdr->bom != REWRITE_IDX_BOM
+        || !hdr->nslots || (hdr->nslots & (hdr->nslots - 1))
+        || (apr_uint64_t)st.size < sizeof(rewrite_idx_header_t)
+                                   + (apr_uint64_t)hdr->nslots
+                                     * sizeof(rewrite_idx_slot_t)) {
+        return APR_EINVAL;
+    }
+
+    f->slots = (const rewrite_idx_slot_t *)(hdr + 1);
+    f->mask = hdr->nslots - 1;
+    f->mtime = st.mtime;
+    f->inode = st.inode;
+    f->size = st.size;
+
+    *pf = f;
+    return APR_SUCCESS;
+}
+
+static char *lookup_idxfile(idxfile *f, const char *key, apr_pool_t *p)
+{
+    apr_size_t len = strlen(key);
+    apr_uint32_t hash = rewrite_idx_hash(key, len);
+    apr_uint32_t i, n;
+
+    for (i = hash & f->mask, n = 0; n <= f->mask; i = (i + 1) & f->mask, ++n) {
+        const rewrite_idx_slot_t *slot = &f->slots[i];
+        const char *data;
+
+        if (!slot->keylen) {
+            break;
+        }
+        if (slot->hash != hash || slot->keylen != len) {
+            continue;
+        }
+        if (slot->offset > (apr_uint64_t)f->size
+            || (apr_uint64_t)f->size - slot->offset
+               < (apr_uint64_t)slot->keylen + slot->vallen + 2) {
+            /* corrupted */
+            break;
+        }
+
+        data = (const char *)f->mm->mm + slot->offset;
+        if (!memcmp(data, key, len)) {
+            return apr_pstrmemdup(p, data + len + 1, slot->vallen);
+        }
+    }
+
+    return NULL;
+}
+
+static char *lookup_map_idxfile(request_rec *r, rewritemap_entry *s,
+                                char *key)
+{
+    idxmap *map = s->idx;
+    idxfile *f;
+    apr_finfo_t st;
+    apr_status_t rv;
+    char *value;
+
+    if (!map) {
+        return NULL;
+    }
+
+    rv = apr_stat(&st, s->datafile, APR_FINFO_MIN | APR_FINFO_INODE,
+                  r->pool);
+    if (rv != APR_SUCCESS && rv != APR_INCOMPLETE) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10664)
+                      "mod_rewrite: can't access idx RewriteMap file %s",
+                      s->datafile);
+        return NULL;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(map->lock);
+#endif
+    f = map->current;
+    if (!f || f->mtime != st.mtime || f->inode != st.inode
+           || f->size != st.size) {
+        idxfile *newf = NULL;
+        apr_pool_t *p;
+
+        rv = apr_pool_create(&p, map->pool);
+        if (rv == APR_SUCCESS) {
+            apr_pool_tag(p, "rewrite_idxfile");
+            rv = open_idxfile(&newf, s->datafile, p);
+            if (rv != APR_SUCCESS) {
+                apr_pool_destroy(p);
+            }
+        }
+        if (rv == APR_SUCCESS) {
+            rewritelog(r, 5, NULL, "(re)mapped idx map file %s",
+                       s->datafile);
+            if (f && !f->refcount) {
+                apr_pool_destroy(f->pool);
+            }
+            map->current = f = newf;
+        }
+        else {
+            /* keep using the previous mapping, if any */
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10665)
+                          "mod_rewrite: can't map idx RewriteMap file %s",
+                          s->datafile);
+        }
+    }
+    if (f) {
+        f->refcount++;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(map->lock);
+#endif
+
+    if (!f) {
+        return NULL;
+    }
+
+    value = lookup_idxfile(f, key, r->pool);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(map->lock);
+#endif
+    if (!--f->refcount && f != map->current) {
+        apr_pool_destroy(f->pool);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(map->lock);
+#endif
+
+    return value;
+}
+
+static idxmap *create_idxmap(void)
+{
+    idxmap *map;
+
+    map = apr_pcalloc(cachep, sizeof(idxmap));
+    if (apr_pool_create(&map->pool, cachep) != APR_SUCCESS) {
+        return NULL;
+    }
+    apr_pool_tag(map->pool, "rewrite_idxmap");
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&map->lock, APR_THREAD_MUTEX_DEFAULT,
+                                map->pool) != APR_SUCCESS) {
+        return NULL;
+    }
+#endif
+
+    return map;
+}
+#endif /* APR_HAS_MMAP */
+
 static char *lookup_map_dbd(request_rec *r, char *key, const char *label)
 {
     apr_status_t rv;
@@ -1755,7 +2127,7 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             return NULL;
         }
 
-        value = get_cache_value(s->cachename, st.mtime, key, r->pool);
+        value = get_cache_value(s->cache, st.mtime, key, r->pool);
         if (!value) {
             rewritelog(r, 6, NULL,
                        "cache lookup FAILED, forcing new map lookup");
@@ -1764,13 +2136,13 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             if (!value) {
                 rewritelog(r, 5, NULL, "map lookup FAILED: map=%s[txt] key=%s",
                            name, key);
-                set_cache_value(s->cachename, st.mtime, key, "");
+                set_cache_value(s->cache, st.mtime, key, "");
                 return NULL;
             }
 
             rewritelog(r, 5, NULL, "map lookup OK: map=%s[txt] key=%s -> val=%s",
                        name, key, value);
-            set_cache_value(s->cachename, st.mtime, key, value);
+            set_cache_value(s->cache, st.mtime, key, value);
         }
         else {
             rewritelog(r, 5, NULL, "cache lookup OK: map=%s[txt] key=%s -> val=%s",
@@ -1811,7 +2183,7 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             return NULL;
         }
 
-        value = get_cache_value(s->cachename, st.mtime, key, r->pool);
+        value = get_cache_value(s->cache, st.mtime, key, r->pool);
         if (!value) {
             rewritelog(r, 6, NULL,
                        "cache lookup FAILED, forcing new map lookup");
@@ -1820,14 +2192,14 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             if (!value) {
                 rewritelog(r, 5, NULL, "map lookup FAILED: map=%s[dbm] key=%s",
                            name, key);
-                set_cache_value(s->cachename, st.mtime, key, "");
+                set_cache_value(s->cache, st.mtime, key, "");
                 return NULL;
             }
 
             rewritelog(r, 5, NULL, "map lookup OK: map=%s[dbm] key=%s -> "
                        "val=%s", name, key, value);
 
-            set_cache_value(s->cachename, st.mtime, key, value);
+            set_cache_value(s->cache, st.mtime, key, value);
             return value;
         }
 
@@ -1835,6 +2207,23 @@ static char *lookup_map(request_rec *r, char *name, char *key)
                    name, key, value);
         return *value ? value : NULL;
 
+#if APR_HAS_MMAP
+    /*
+     * Memory mapped index file map
+     */
+    case MAPTYPE_IDX:
+        value = lookup_map_idxfile(r, s, key);
+        if (!value) {
+            rewritelog(r, 5, NULL, "map lookup FAILED: map=%s[idx] key=%s",
+                       name, key);
+            return NULL;
+        }
+
+        rewritelog(r, 5, NULL, "map lookup OK: map=%s[idx] key=%s -> val=%s",
+                   name, key, value);
+        return *value ? value : NULL;
+#endif
+
     /*
      * SQL map without cache
      */
@@ -1855,7 +2244,7 @@ static char *lookup_map(request_rec *r, char *name, char *key)
      * SQL map with cache
      */
     case MAPTYPE_DBD_CACHE:
-        value = get_cache_value(s->cachename, 0, key, r->pool);
+        value = get_cache_value(s->cache, 0, key, r->pool);
         if (!value) {
             rewritelog(r, 6, NULL,
                        "cache lookup FAILED, forcing new map lookup");
@@ -1864,14 +2253,14 @@ static char *lookup_map(request_rec *r, char *name, char *key)
             if (!value) {
                 rewritelog(r, 5, NULL, "SQL map lookup FAILED: map %s key=%s",
                            name, key);
-                set_cache_value(s->cachename, 0, key, "");
+                set_cache_value(s->cache, 0, key, "");
                 return NULL;
             }
 
             rewritelog(r, 5, NULL, "SQL map lookup OK: map %s key=%s, val=%s",
                        name, key, value);
 
-            set_cache_value(s->cachename, 0, key, value);
+            set_cache_value(s->cache, 0, key, value);
             return value;
         }
 
@@ -1883,15 +2272,28 @@ static char *lookup_map(request_rec *r, char *name, char *key)
      * Program file map
      */
     case MAPTYPE_PRG:
+        if (s->cache) {
+            value = get_cache_value(s->cache, 0, key, r->pool);
+            if (value) {
+                rewritelog(r, 5, NULL, "cache lookup OK: map=%s[prg] key=%s "
+                           "-> val=%s", name, key, value);
+                return *value ? value : NULL;
+            }
+            rewritelog(r, 6, NULL,
+                       "cache lookup FAILED, forcing new map lookup");
+        }
+
         value = lookup_map_program(r, s->fpin, s->fpout, key);
         if (!value) {
             rewritelog(r, 5, NULL, "map lookup FAILED: map=%s key=%s", name,
                        key);
+            set_cache_value(s->cache, 0, key, "");
             return NULL;
         }
 
         rewritelog(r, 5, NULL, "map lookup OK: map=%s key=%s -> val=%s",
                    name, key, value);
+        set_cache_value(s->cache, 0, key, value);
         return value;
 
     /*
@@ -3279,8 +3681,7 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
         newmap->type      = MAPTYPE_TXT;
         newmap->datafile  = fname;
         newmap->checkfile = fname;
-        newmap->cachename = apr_psprintf(cmd->pool, "%pp:%s",
-                                         (void *)cmd->server, a1);
+        newmap->cached    = 1;
     }
     else if (strncasecmp(a2, "rnd:", 4) == 0) {
         if ((fname = ap_server_root_relative(cmd->pool, a2+4)) == NULL) {
@@ -3291,16 +3692,14 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
         newmap->type      = MAPTYPE_RND;
         newmap->datafile  = fname;
         newmap->checkfile = fname;
-        newmap->cachename = apr_psprintf(cmd->pool, "%pp:%s",
-                                         (void *)cmd->server, a1);
+        newmap->cached    = 1;
     }
     else if (strncasecmp(a2, "dbm", 3) == 0) {
         apr_status_t rv;
 
         newmap->type = MAPTYPE_DBM;
         fname = NULL;
-        newmap->cachename = apr_psprintf(cmd->pool, "%pp:%s",
-                                         (void *)cmd->server, a1);
+        newmap->cached = 1;
 
         if (a2[3] == ':') {
             newmap->dbmtype = "default";
@@ -3335,6 +3734,31 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
                                newmap->dbmtype, " is invalid", NULL);
         }
     }
+    else if (strncasecmp(a2, "idx:", 4) == 0) {
+#if APR_HAS_MMAP
+        idxfile *f;
+        apr_status_t rv;
+
+        if ((fname = ap_server_root_relative(cmd->pool, a2+4)) == NULL) {
+            return apr_pstrcat(cmd->pool, "RewriteMap: bad path to idx map: ",
+                               a2+4, NULL);
+        }
+
+        /* check the file (format) early */
+        rv = open_idxfile(&f, fname, cmd->temp_pool);
+        if (rv != APR_SUCCESS && !APR_STATUS_IS_ENOENT(rv)) {
+            return apr_psprintf(cmd->pool, "RewriteMap: invalid idx map "
+                                "file %s (%pm), use httxt2dbm -f IDX to "
+                                "create it", fname, &rv);
+        }
+
+        newmap->type      = MAPTYPE_IDX;
+        newmap->datafile  = fname;
+        newmap->checkfile = fname;
+#else
+        return "RewriteMap: idx maps are not supported on this platform";
+#endif
+    }
     else if ((strncasecmp(a2, "dbd:", 4) == 0)
              || (strncasecmp(a2, "fastdbd:", 8) == 0)) {
         if (dbd_prepare == NULL) {
@@ -3347,8 +3771,7 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
         else {
             newmap->type = MAPTYPE_DBD_CACHE;
             fname = a2+8;
-            newmap->cachename = apr_psprintf(cmd->pool, "%pp:%s",
-                                             (void *)cmd->server, a1);
+            newmap->cached = 1;
         }
         newmap->dbdq = a1;
         dbd_prepare(cmd->server, fname, newmap->dbdq);
@@ -3391,8 +3814,7 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
         newmap->type      = MAPTYPE_TXT;
         newmap->datafile  = fname;
         newmap->checkfile = fname;
-        newmap->cachename = apr_psprintf(cmd->pool, "%pp:%s",
-                                         (void *)cmd->server, a1);
+        newmap->cached    = 1;
     }
 
     if (newmap->checkfile
@@ -3408,6 +3830,49 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
     return NULL;
 }
 
+static const char *cmd_rewritemapcache(cmd_parms *cmd, void *dconf,
+                                       const char *a1, const char *a2,
+                                       const char *a3)
+{
+    rewrite_server_conf *sconf;
+    rewritemap_entry *map;
+
+    sconf = ap_get_module_config(cmd->server->module_config, &rewrite_module);
+
+    map = apr_hash_get(sconf->rewritemaps, a1, APR_HASH_KEY_STRING);
+    if (!map) {
+        return apr_pstrcat(cmd->pool, "RewriteMapCache: map ", a1,
+                           " must be defined by a preceding RewriteMap",
+                           NULL);
+    }
+
+    switch (map->type) {
+    case MAPTYPE_INT:
+        return apr_pstrcat(cmd->pool, "RewriteMapCache: internal map ", a1,
+                           " can't be cached", NULL);
+    case MAPTYPE_DBD:
+        /* turns dbd: into fastdbd: */
+        map->type = MAPTYPE_DBD_CACHE;
+        break;
+    }
+
+    if (ap_timeout_parameter_parse(a2, &map->cachettl, "s") != APR_SUCCESS
+        || map->cachettl < 0) {
+        return apr_pstrcat(cmd->pool, "RewriteMapCache: invalid MaxAge ",
+                           a2, NULL);
+    }
+    if (a3) {
+        map->cachemax = atoi(a3);
+        if (map->cachemax <= 0) {
+            return apr_pstrcat(cmd->pool, "RewriteMapCache: invalid "
+                               "MaxEntries ", a3, NULL);
+        }
+    }
+    map->cached = 1;
+
+    return NULL;
+}
+
 static const char *cmd_rewritebase(cmd_parms *cmd, void *in_dconf,
                                    const char *a1)
 {
@@ -3966,6 +4431,161 @@ static const char *cmd_rewriterule_setflag(apr_pool_t *p, void *_cfg,
     return NULL;
 }
 
+/*
+ * Check whether a regex has an alternation at the top level, which would
+ * make any literal prefix after the initial anchor meaningless.
+ */
+static int has_toplevel_alternation(const char *s)
+{
+    int depth = 0;
+
+    for (; *s; ++s) {
+        switch (*s) {
+        case '\\':
+            if (s[1]) {
+                ++s;
+            }
+            break;
+        case '[':
+            /* skip the bracket expression, where ']' may come first */
+            if (*++s == '^') {
+                ++s;
+            }
+            if (*s == ']') {
+                ++s;
+            }
+            while (*s && *s != ']') {
+                if (*s == '\\' && s[1]) {
+                    ++s;
+                }
+                ++s;
+            }
+            if (!*s) {
+                return 1;
+            }
+            break;
+        case '(':
+            ++depth;
+            break;
+        case ')':
+            --depth;
+            break;
+        case '|':
+            if (depth <= 0) {
+                return 1;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Determine the literal prefix which any URI matching the pattern of the
+ * rule has to start with, e.g. "/legacy/" for "^/legacy/(.*)\.html$".
+ * Returns NULL if there is none (not anchored, negated, ...).
+ */
+static const char *rule_literal_prefix(apr_pool_t *p, rewriterule_entry *rule)
+{
+    const char *s = rule->pattern;
+    char *prefix, *d;
+
+    if (*s != '^' || (rule->flags & RULEFLAG_NOTMATCH)
+        || has_toplevel_alternation(s)) {
+        return NULL;
+    }
+
+    prefix = d = apr_palloc(p, strlen(s));
+    for (++s; *s; ++s) {
+        char c = *s;
+
+        if (c == '\\') {
+            /* escaped punctuation is literal, anything else (\d, \x..)
+             * is a class or something we don't want to know about.
+             */
+            if (!s[1] || apr_isalnum(s[1])) {
+                break;
+            }
+            c = *++s;
+        }
+        else if (strchr(".[]()*+?{}|^$", c)) {
+            break;
+        }
+        if ((rule->flags & RULEFLAG_NOCASE) && !apr_isascii(c)) {
+            break;
+        }
+        /* a following quantifier makes this char optional */
+        if (s[1] == '?' || s[1] == '*' || s[1] == '{') {
+            break;
+        }
+        *d++ = c;
+    }
+    *d = '\0';
+
+    return (d > prefix) ? prefix : NULL;
+}
+
+/*
+ * Add the literal prefix of the new rule to the index of its configuration
+ * section, where the rules starting with the prefix of a URI can be looked
+ * up at once.
+ */
+static void index_rewriterule(apr_pool_t *p, prefix_index **pindex,
+                              rewriterule_entry *newrule)
+{
+    prefix_index *index = *pindex;
+    prefix_table *table;
+    apr_array_header_t *offsets;
+    apr_size_t len = strlen(newrule->prefix);
+    const char *key = newrule->prefix;
+
+    if (!index) {
+        index = *pindex = apr_pcalloc(p, sizeof(prefix_index));
+        index->exact.rules = apr_hash_make(p);
+        index->exact.lengths = apr_array_make(p, 2, sizeof(apr_size_t));
+        index->nocase.rules = apr_hash_make(p);
+        index->nocase.lengths = apr_array_make(p, 2, sizeof(apr_size_t));
+    }
+
+    if (newrule->flags & RULEFLAG_NOCASE) {
+        char *lower = apr_pstrdup(p, key);
+
+        ap_str_tolower(lower);
+        key = lower;
+        table = &index->nocase;
+    }
+    else {
+        table = &index->exact;
+    }
+
+    offsets = apr_hash_get(table->rules, key, len);
+    if (!offsets) {
+        apr_size_t *lengths;
+        int i, n = table->lengths->nelts;
+
+        offsets = apr_array_make(p, 1, sizeof(int));
+        apr_hash_set(table->rules, key, len, offsets);
+
+        /* a new length is inserted in order, for the lookup to stop at the
+         * length of the URI
+         */
+        lengths = (apr_size_t *)table->lengths->elts;
+        for (i = 0; i < n && lengths[i] < len; ++i)
+            ;
+        if (i == n || lengths[i] != len) {
+            apr_array_push(table->lengths);
+            lengths = (apr_size_t *)table->lengths->elts;
+            memmove(lengths + i + 1, lengths + i, (n - i) * sizeof(apr_size_t));
+            lengths[i] = len;
+        }
+    }
+
+    newrule->index = index;
+    newrule->indexoff = index->nrules++;
+    APR_ARRAY_PUSH(offsets, int) = newrule->indexoff;
+}
+
 static const char *cmd_rewriterule(cmd_parms *cmd, void *in_dconf,
                                    const char *in_str)
 {
@@ -4072,6 +4692,15 @@ static const char *cmd_rewriterule(cmd_parms *cmd, void *in_dconf,
                                              sizeof(rewritecond_entry));
     }
 
+    /* literal prefix, for skipping rules which can't match early */
+    newrule->prefix = rule_literal_prefix(cmd->pool, newrule);
+    newrule->index = NULL;
+    if (newrule->prefix) {
+        index_rewriterule(cmd->pool, (cmd->path == NULL) ? &sconf->prefixindex
+                                                         : &dconf->prefixindex,
+                          newrule);
+    }
+
     return NULL;
 }
 
@@ -4310,6 +4939,55 @@ static APR_INLINE void force_type_handler(rewriterule_entry *p,
     }
 }
 
+/*
+ * Mark the rules of the table whose literal prefix starts the URI
+ */
+static void lookup_prefixes(const prefix_table *table, const char *uri,
+                            apr_size_t urilen, char *matches)
+{
+    const apr_size_t *lengths = (const apr_size_t *)table->lengths->elts;
+    int i, j;
+
+    for (i = 0; i < table->lengths->nelts && lengths[i] <= urilen; ++i) {
+        apr_array_header_t *offsets = apr_hash_get(table->rules, uri,
+                                                   lengths[i]);
+        if (offsets) {
+            for (j = 0; j < offsets->nelts; ++j) {
+                matches[APR_ARRAY_IDX(offsets, j, int)] = 1;
+            }
+        }
+    }
+}
+
+/*
+ * Whether the URI starts with the literal prefix of the rule, looked up
+ * once for all the rules of its index until the URI changes.
+ */
+static int rule_prefix_matches(rewriterule_entry *p, rewrite_ctx *ctx)
+{
+    if (ctx->index != p->index) {
+        prefix_index *index = p->index;
+        apr_size_t len = strlen(ctx->uri);
+
+        ctx->prefixmatch = apr_pcalloc(ctx->r->pool, index->nrules);
+        lookup_prefixes(&index->exact, ctx->uri, len, ctx->prefixmatch);
+        if (index->nocase.lengths->nelts) {
+            apr_size_t maxlen = APR_ARRAY_IDX(index->nocase.lengths,
+                                              index->nocase.lengths->nelts - 1,
+                                              apr_size_t);
+            char *lower = apr_pstrmemdup(ctx->r->pool, ctx->uri,
+                                         (len < maxlen) ? len : maxlen);
+
+            ap_str_tolower(lower);
+            lookup_prefixes(&index->nocase, lower, strlen(lower),
+                            ctx->prefixmatch);
+        }
+        ctx->index = index;
+    }
+
+    return ctx->prefixmatch[p->indexoff];
+}
+
 /*
  * Apply a single RewriteRule
  */
@@ -4357,6 +5035,15 @@ static rule_return_type apply_rewrite_rule(rewriterule_entry *p,
         }
     }
 
+    /* Try the literal prefix first, which avoids running the regex of
+     * rules that can't match the URI.
+     */
+    if (p->index && !rule_prefix_matches(p, ctx)) {
+        rewritelog(r, 3, ctx->perdir, "uri '%s' doesn't start with '%s',"
+                   " skipping pattern '%s'", ctx->uri, p->prefix, p->pattern);
+        return RULE_RC_NOMATCH;
+    }
+
     /* Try to match the URI against the RewriteRule pattern
      * and exit immediately if it didn't apply.
      */
@@ -4613,6 +5300,7 @@ static int apply_rewrite_list(request_rec *r, apr_array_header_t *rewriterules,
     ctx = apr_palloc(r->pool, sizeof(*ctx));
     ctx->perdir = perdir;
     ctx->r = r;
+    ctx->index = NULL;
     *lastsub = NULL;
 
     if (dconf->options & OPTION_LONGOPT) { 
@@ -4650,6 +5338,8 @@ static int apply_rewrite_list(request_rec *r, apr_array_header_t *rewriterules,
         rc = apply_rewrite_rule(p, ctx);
 
         if (rc != RULE_RC_NOMATCH) {
+            /* the uri changed, its prefixes have to be looked up again */
+            ctx->index = NULL;
 
             if (!(p->flags & RULEFLAG_NOSUB)) {
                 rewritelog(r, 2, perdir, "setting lastsub to rule with output %s", p->output);
@@ -4847,7 +5537,7 @@ static void init_child(apr_pool_t *p, server_rec *s)
     }
 
     /* create the lookup cache */
-    if (!init_cache(p)) {
+    if (!init_cache(p, s)) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(00667)
                      "mod_rewrite: could not init map cache in child");
     }
@@ -5681,6 +6371,9 @@ static const command_rec command_table[] = {
                      "an URL-applied regexp-pattern and a substitution URL"),
     AP_INIT_TAKE23(   "RewriteMap",      cmd_rewritemap,      NULL, RSRC_CONF,
                      "a mapname and a filename and options"),
+    AP_INIT_TAKE23(  "RewriteMapCache", cmd_rewritemapcache, NULL, RSRC_CONF,
+                     "a mapname, the max age of its cached values and "
+                     "optionally the max number of cached values"),
     { NULL }
 };
 
@@ -0,0 +1,82 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file rewrite_idx_common.h
+ * @brief Format of the RewriteMap idx: files, shared by mod_rewrite and
+ *        httxt2dbm
+ *
+ * @defgroup MOD_REWRITE_IDX  RewriteMap idx: files
+ * @ingroup  MOD_REWRITE
+ * @{
+ */
+
+#ifndef REWRITE_IDX_COMMON_H
+#define REWRITE_IDX_COMMON_H
+
+/*
+ * An idx: file is an immutable open addressing hash table, meant to be
+ * memory mapped read-only. It consists of:
+ *   - a rewrite_idx_header_t,
+ *   - nslots (a power of two) rewrite_idx_slot_t, linearly probed from the
+ *     slot given by the hash of the key; a slot with a keylen of zero is
+ *     empty and terminates the probing,
+ *   - the data, where each slot points to the key and the value, both
+ *     NUL terminated and following each other.
+ * Integers are stored in the native byte order of the host, which is
+ * checked with the "bom" field of the header.
+ */
+
+#define REWRITE_IDX_MAGIC     "APRWIDX1"
+#define REWRITE_IDX_MAGIC_LEN 8
+#define REWRITE_IDX_BOM       0x01020304
+
+typedef struct {
+    char magic[REWRITE_IDX_MAGIC_LEN];
+    apr_uint32_t bom;
+    /* The number of slots, a power of two */
+    apr_uint32_t nslots;
+    /* The number of used slots */
+    apr_uint32_t nentries;
+    apr_uint32_t reserved;
+} rewrite_idx_header_t;
+
+typedef struct {
+    apr_uint32_t hash;
+    apr_uint32_t keylen;
+    apr_uint32_t vallen;
+    apr_uint32_t reserved;
+    /* Offset of the key (then value) from the start of the file */
+    apr_uint64_t offset;
+} rewrite_idx_slot_t;
+
+/* FNV-1a */
+static APR_INLINE apr_uint32_t rewrite_idx_hash(const char *key,
+                                                apr_size_t len)
+{
+    const unsigned char *s = (const unsigned char *)key;
+    apr_uint32_t hash = 2166136261U;
+
+    while (len--) {
+        hash ^= *s++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+#endif /* REWRITE_IDX_COMMON_H */
+/** @} */
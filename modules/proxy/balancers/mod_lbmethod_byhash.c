@@ -0,0 +1,407 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mod_proxy.h"
+#include "proxy_util.h"
+#include "scoreboard.h"
+#include "ap_mpm.h"
+#include "apr_version.h"
+#include "ap_expr.h"
+#include "ap_hooks.h"
+
+module AP_MODULE_DECLARE_DATA lbmethod_byhash_module;
+
+static APR_OPTIONAL_FN_TYPE(proxy_balancer_get_best_worker)
+                            *ap_proxy_balancer_get_best_worker_fn = NULL;
+
+/*
+ * Consistent hashing with bounded loads: each worker owns HASH_POINTS
+ * points on a ring (times its lbfactor), and a request goes to the owner of
+ * the first point following the hash of its key, unless that worker is not
+ * usable or already serves more than its share of the requests in flight
+ * (the bound, in percent of the average), in which case the next points are
+ * tried. Thus a given key always goes to the same worker as long as it's
+ * available and not overloaded, and only the keys of a worker which
+ * disappears move to the others.
+ *
+ * The ring is built in each child for each balancer (balancer->context),
+ * and rebuilt only when the members or their lbfactor change; a worker
+ * whose status changes is simply skipped while walking the ring, which
+ * maps its keys just like if it were removed. Whether each worker can be
+ * elected is determined once per request, the points refer to the
+ * workers by their index in the balancer.
+ */
+#define HASH_POINTS         100
+#define DEFAULT_HASH_BOUND  125
+#define MAX_HASH_BOUND      10000
+
+/* Per worker for a request: not usable (0), usable, and within the bound */
+#define HASH_USABLE         1
+#define HASH_IN_BOUND       2
+
+typedef struct {
+    apr_uint32_t hash;
+    int index;                  /* of the worker in balancer->workers */
+} hash_point;
+
+typedef struct {
+    apr_uint32_t signature;     /* of the members the ring was built for */
+    int npoints;
+    hash_point *points;
+} hash_ring;
+
+typedef struct {
+    ap_expr_info_t *key;
+    int bound;
+    unsigned int key_set:1;
+    unsigned int bound_set:1;
+} byhash_dir_conf;
+
+/* The candidates given by ap_proxy_balancer_get_best_worker() */
+typedef struct {
+    proxy_balancer *balancer;
+    unsigned char *elect;       /* HASH_* flags, by index of the worker */
+    int next;                   /* where to look for the next candidate */
+    apr_size_t busy;
+    apr_int64_t lbfactor;
+} hash_baton;
+
+/* Final mix of murmur3, spreads the FNV hashes on the whole ring */
+static APR_INLINE apr_uint32_t hash_mix(apr_uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static int hash_point_cmp(const void *a, const void *b)
+{
+    apr_uint32_t ha = ((const hash_point *)a)->hash;
+    apr_uint32_t hb = ((const hash_point *)b)->hash;
+
+    return (ha < hb) ? -1 : (ha > hb);
+}
+
+static apr_uint32_t ring_signature(proxy_balancer *balancer)
+{
+    apr_uint32_t sig = 2166136261U;
+    int i;
+
+    for (i = 0; i < balancer->workers->nelts; i++) {
+        proxy_worker *worker = APR_ARRAY_IDX(balancer->workers, i,
+                                             proxy_worker *);
+        sig = (sig ^ worker->s->hash.fnv) * 16777619U;
+        sig = (sig ^ (apr_uint32_t)worker->s->lbfactor) * 16777619U;
+    }
+    return sig ^ (apr_uint32_t)balancer->workers->nelts;
+}
+
+/* Called with the balancer's thread mutex held (find_best_worker()) */
+static hash_ring *ring_get(proxy_balancer *balancer)
+{
+    hash_ring *ring = balancer->context;
+    apr_uint32_t sig = ring_signature(balancer);
+    int i, j, n = 0;
+
+    if (!ring) {
+        ring = balancer->context = ap_calloc(1, sizeof(*ring));
+    }
+    else if (ring->points && ring->signature == sig) {
+        return ring;
+    }
+
+    for (i = 0; i < balancer->workers->nelts; i++) {
+        proxy_worker *worker = APR_ARRAY_IDX(balancer->workers, i,
+                                             proxy_worker *);
+        n += HASH_POINTS * worker->s->lbfactor / 100;
+    }
+    ring->points = ap_realloc(ring->points, (n ? n : 1) * sizeof(hash_point));
+    for (n = i = 0; i < balancer->workers->nelts; i++) {
+        proxy_worker *worker = APR_ARRAY_IDX(balancer->workers, i,
+                                             proxy_worker *);
+        int npoints = HASH_POINTS * worker->s->lbfactor / 100;
+
+        for (j = 0; j < npoints; j++, n++) {
+            ring->points[n].hash = hash_mix(worker->s->hash.fnv
+                                            + (apr_uint32_t)j * 0x9e3779b9U);
+            ring->points[n].index = i;
+        }
+    }
+    qsort(ring->points, n, sizeof(hash_point), hash_point_cmp);
+    ring->npoints = n;
+    ring->signature = sig;
+
+    return ring;
+}
+
+static int is_best_byhash(proxy_worker *current, proxy_worker *prev_best,
+                          void *baton)
+{
+    hash_baton *hb = baton;
+    apr_array_header_t *workers = hb->balancer->workers;
+    int i, n;
+
+    /* The candidates come in the order of the members, usually */
+    for (n = 0; n < workers->nelts; n++) {
+        i = (hb->next + n) % workers->nelts;
+        if (APR_ARRAY_IDX(workers, i, proxy_worker *) == current) {
+            hb->elect[i] = HASH_USABLE;
+            hb->next = i + 1;
+            break;
+        }
+    }
+    hb->busy += ap_proxy_get_busy_count(current);
+    hb->lbfactor += current->s->lbfactor;
+
+    /* Let get_best_worker() know there is a candidate in this lbset */
+    return !prev_best;
+}
+
+static const char *hash_key(request_rec *r, byhash_dir_conf *conf)
+{
+    if (conf->key) {
+        const char *err = NULL;
+        const char *key = ap_expr_str_exec(r, conf->key, &err);
+        if (!err) {
+            return key;
+        }
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10630)
+                      "Failure while evaluating BalancerHashKey: %s", err);
+    }
+    return r->unparsed_uri ? r->unparsed_uri : "";
+}
+
+static proxy_worker *find_best_byhash(proxy_balancer *balancer,
+                                      request_rec *r)
+{
+    byhash_dir_conf *conf = ap_get_module_config(r->per_dir_config,
+                                                 &lbmethod_byhash_module);
+    proxy_worker *worker = NULL;
+    const char *key;
+    hash_baton hb;
+    hash_ring *ring;
+    apr_uint32_t hash;
+    int lo, hi, i, best = -1;
+
+    hb.balancer = balancer;
+    hb.elect = apr_pcalloc(r->pool, balancer->workers->nelts);
+    hb.next = 0;
+    hb.busy = 0;
+    hb.lbfactor = 0;
+    if (!ap_proxy_balancer_get_best_worker_fn(balancer, r, is_best_byhash,
+                                              &hb)) {
+        return NULL;
+    }
+
+    for (i = 0; i < balancer->workers->nelts; i++) {
+        proxy_worker *candidate;
+
+        if (!hb.elect[i]) {
+            /* Not usable (or not in the elected lbset) */
+            continue;
+        }
+        candidate = APR_ARRAY_IDX(balancer->workers, i, proxy_worker *);
+        if (conf->bound > 0) {
+            /* Its share of the requests in flight, this one included */
+            apr_int64_t cap = ((apr_int64_t)(hb.busy + 1) * conf->bound
+                               * candidate->s->lbfactor
+                               + (apr_int64_t)100 * hb.lbfactor - 1)
+                              / ((apr_int64_t)100 * hb.lbfactor);
+            if ((apr_int64_t)ap_proxy_get_busy_count(candidate) >= cap) {
+                continue;
+            }
+        }
+        hb.elect[i] |= HASH_IN_BOUND;
+    }
+
+    ring = ring_get(balancer);
+    key = hash_key(r, conf);
+    hash = hash_mix(ap_proxy_hashfunc(key, PROXY_HASHFUNC_FNV));
+
+    /* First point at or after the key's hash */
+    lo = 0;
+    hi = ring->npoints;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < hash) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    for (i = 0; i < ring->npoints; i++) {
+        int index = ring->points[(lo + i) % ring->npoints].index;
+
+        if (hb.elect[index] & HASH_IN_BOUND) {
+            best = index;
+            break;
+        }
+        if (best < 0 && hb.elect[index]) {
+            /* The fallback if all the candidates are overloaded */
+            best = index;
+        }
+    }
+
+    if (best >= 0) {
+        worker = APR_ARRAY_IDX(balancer->workers, best, proxy_worker *);
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                      "%s: key \"%s\" hashed to worker %s",
+                      balancer->s->name, key,
+                      ap_proxy_worker_get_name(worker));
+    }
+    return worker;
+}
+
+/* assumed to be mutex protected by caller */
+static apr_status_t reset(proxy_balancer *balancer, server_rec *s)
+{
+    int i;
+    proxy_worker **worker;
+    worker = (proxy_worker **)balancer->workers->elts;
+    for (i = 0; i < balancer->workers->nelts; i++, worker++) {
+        (*worker)->s->lbstatus = 0;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t age(proxy_balancer *balancer, server_rec *s)
+{
+    return APR_SUCCESS;
+}
+
+static const proxy_balancer_method byhash =
+{
+    "byhash",
+    &find_best_byhash,
+    NULL,
+    &reset,
+    &age,
+    NULL
+};
+
+static void *create_byhash_dir_config(apr_pool_t *p, char *dummy)
+{
+    byhash_dir_conf *conf = apr_pcalloc(p, sizeof(*conf));
+
+    conf->bound = DEFAULT_HASH_BOUND;
+    return conf;
+}
+
+static void *merge_byhash_dir_config(apr_pool_t *p, void *basev, void *addv)
+{
+    byhash_dir_conf *new = apr_pcalloc(p, sizeof(*new));
+    byhash_dir_conf *add = addv;
+    byhash_dir_conf *base = basev;
+
+    new->key = (add->key_set == 0) ? base->key : add->key;
+    new->key_set = add->key_set || base->key_set;
+    new->bound = (add->bound_set == 0) ? base->bound : add->bound;
+    new->bound_set = add->bound_set || base->bound_set;
+
+    return new;
+}
+
+static const char *set_hash_key(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    byhash_dir_conf *conf = dconf;
+    const char *err = NULL;
+
+    conf->key = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+                                  &err, NULL);
+    if (err) {
+        return apr_psprintf(cmd->pool,
+                            "Cannot parse expression '%s' in %s: %s",
+                            arg, cmd->cmd->name, err);
+    }
+    conf->key_set = 1;
+    return NULL;
+}
+
+static const char *set_hash_bound(cmd_parms *cmd, void *dconf,
+                                  const char *arg)
+{
+    byhash_dir_conf *conf = dconf;
+    apr_int64_t bound;
+    char *end;
+
+    bound = apr_strtoi64(arg, &end, 10);
+    if (end == arg || *end || bound < 0 || (bound > 0 && bound < 100)
+        || bound > MAX_HASH_BOUND) {
+        return apr_psprintf(cmd->pool, "BalancerHashBound must be 0 "
+                            "(unbounded) or between 100 and %d",
+                            MAX_HASH_BOUND);
+    }
+    conf->bound = (int)bound;
+    conf->bound_set = 1;
+    return NULL;
+}
+
+static const command_rec lbmethod_byhash_cmds[] =
+{
+    AP_INIT_TAKE1("BalancerHashKey", set_hash_key, NULL,
+                  RSRC_CONF|ACCESS_CONF,
+                  "Expression giving the key hashed to elect a worker, "
+                  "the request URI by default"),
+    AP_INIT_TAKE1("BalancerHashBound", set_hash_bound, NULL,
+                  RSRC_CONF|ACCESS_CONF,
+                  "Maximum load of a worker, in percent of the average "
+                  "load, before its keys go to the next workers "
+                  "(0 for unbounded)"),
+    {NULL}
+};
+
+/* post_config hook: */
+static int lbmethod_byhash_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptemp, server_rec *s)
+{
+
+    /* lbmethod_byhash_post_config() will be called twice during startup.  So, don't
+     * set up the static data the 1st time through. */
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+
+    ap_proxy_balancer_get_best_worker_fn =
+                 APR_RETRIEVE_OPTIONAL_FN(proxy_balancer_get_best_worker);
+    if (!ap_proxy_balancer_get_best_worker_fn) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(10631)
+                     "mod_proxy must be loaded for mod_lbmethod_byhash");
+        return !OK;
+    }
+
+    return OK;
+}
+
+static void register_hook(apr_pool_t *p)
+{
+    ap_register_provider(p, PROXY_LBMETHOD, "byhash", "0", &byhash);
+    ap_hook_post_config(lbmethod_byhash_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+}
+
+AP_DECLARE_MODULE(lbmethod_byhash) = {
+    STANDARD20_MODULE_STUFF,
+    create_byhash_dir_config,   /* create per-directory config structure */
+    merge_byhash_dir_config,    /* merge per-directory config structures */
+    NULL,       /* create per-server config structure */
+    NULL,       /* merge per-server config structures */
+    lbmethod_byhash_cmds,   /* command apr_table_t */
+    register_hook /* register hooks */
+};
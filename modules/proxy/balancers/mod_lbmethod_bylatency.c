@@ -0,0 +1,324 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mod_proxy.h"
+#include "proxy_util.h"
+#include "scoreboard.h"
+#include "ap_mpm.h"
+#include "apr_version.h"
+#include "apr_atomic.h"
+#include "apr_shm.h"
+#include "ap_hooks.h"
+
+module AP_MODULE_DECLARE_DATA lbmethod_bylatency_module;
+
+static APR_OPTIONAL_FN_TYPE(proxy_balancer_get_best_worker)
+                            *ap_proxy_balancer_get_best_worker_fn = NULL;
+
+/*
+ * The latency of each worker is a peak-EWMA of the response times of its
+ * requests, up to the response headers when the scheme handler notes when
+ * they arrived ("proxy-response-time", mod_proxy_http), so that neither the
+ * body transfer to the client nor a tunnel count, or up to the end of the
+ * request otherwise (including asynchronous completions, for which
+ * post_request runs when they finish): a slower response raises the
+ * average at once, a faster one lowers it according to the time elapsed
+ * since the previous sample, (decay / (decay + elapsed)), so that a worker
+ * which slows down is avoided immediately and recovers progressively.
+ *
+ * The averages live in a shared memory table, indexed by the hash of the
+ * workers' names, so that all the children see the same latencies.
+ */
+#define LATENCY_SLOTS       1024
+#define LATENCY_PROBES      16
+#define LATENCY_MAX         APR_UINT32_MAX
+/* The sample of a failed request (5xx), at least */
+#define LATENCY_PENALTY     apr_time_from_sec(1)
+
+typedef struct {
+    proxy_worker_slot key;
+    apr_uint32_t ewma;      /* usecs */
+    apr_uint32_t stamp;     /* msecs of the last sample, truncated */
+} latency_slot;
+
+static apr_shm_t *latency_shm = NULL;
+static latency_slot *latency_table = NULL;
+static apr_interval_time_t latency_decay = 0;
+
+#define DEFAULT_LATENCY_DECAY apr_time_from_sec(10)
+
+/* The worker's slot, claimed if needed, or NULL if the table is full */
+static latency_slot *latency_get(proxy_worker *worker)
+{
+    return ap_proxy_worker_slot_get(worker, latency_table,
+                                    sizeof(latency_slot),
+                                    LATENCY_SLOTS, LATENCY_PROBES);
+}
+
+static void latency_sample(latency_slot *slot, apr_interval_time_t sample)
+{
+    apr_uint32_t now = (apr_uint32_t)apr_time_as_msec(apr_time_now());
+    apr_uint32_t elapsed = now - apr_atomic_xchg32(&slot->stamp, now);
+    apr_uint32_t value, cur, avg;
+    apr_uint64_t decay = apr_time_as_msec(latency_decay);
+
+    value = (sample < 0) ? 0 : (sample > LATENCY_MAX) ? LATENCY_MAX
+                                                     : (apr_uint32_t)sample;
+    do {
+        cur = apr_atomic_read32(&slot->ewma);
+        if (value >= cur || !decay) {
+            avg = value;
+        }
+        else {
+            avg = (apr_uint32_t)(((apr_uint64_t)cur * decay
+                                  + (apr_uint64_t)value * elapsed)
+                                 / (decay + elapsed));
+        }
+    } while (apr_atomic_cas32(&slot->ewma, avg, cur) != cur);
+}
+
+/* The expected cost of a new request: the latency of the worker for each
+ * request in flight plus this one, relative to its lbfactor */
+static apr_uint64_t latency_cost(proxy_worker *worker)
+{
+    latency_slot *slot = latency_get(worker);
+    apr_uint64_t ewma = slot ? apr_atomic_read32(&slot->ewma) : 0;
+    apr_uint64_t busy = ap_proxy_get_busy_count(worker);
+    int lbfactor = worker->s->lbfactor > 0 ? worker->s->lbfactor : 1;
+
+    return ewma * (busy + 1) * 100 / lbfactor;
+}
+
+/*
+ * Power of two choices: two of the usable workers are picked at random
+ * (reservoir sampling, so that the lbset/spare/standby logic of
+ * ap_proxy_balancer_get_best_worker() still applies), and the one with
+ * the lowest cost is elected. This avoids sending all the requests to
+ * the same fastest worker until its latency catches up.
+ */
+typedef struct {
+    proxy_worker *choice[2];
+    apr_uint32_t count;
+} latency_baton;
+
+static int is_best_bylatency(proxy_worker *current, proxy_worker *prev_best,
+                             void *baton)
+{
+    latency_baton *lb = baton;
+
+    lb->count++;
+    if (lb->count <= 2) {
+        lb->choice[lb->count - 1] = current;
+    }
+    else if (ap_random_pick(0, lb->count - 1) < 2) {
+        lb->choice[ap_random_pick(0, 1)] = current;
+    }
+
+    /* Let get_best_worker() know there is a candidate in this lbset */
+    return !prev_best;
+}
+
+static proxy_worker *find_best_bylatency(proxy_balancer *balancer,
+                                         request_rec *r)
+{
+    latency_baton lb;
+    proxy_worker *worker;
+
+    memset(&lb, 0, sizeof(lb));
+    worker = ap_proxy_balancer_get_best_worker_fn(balancer, r,
+                                                  is_best_bylatency, &lb);
+    if (!worker) {
+        return NULL;
+    }
+
+    worker = lb.choice[0];
+    if (lb.choice[1] && latency_cost(lb.choice[1]) < latency_cost(worker)) {
+        worker = lb.choice[1];
+    }
+
+    /* Start of the request, for the sample in post_request */
+    {
+        apr_time_t *start = ap_get_module_config(r->request_config,
+                                                 &lbmethod_bylatency_module);
+        if (!start) {
+            start = apr_palloc(r->pool, sizeof(*start));
+            ap_set_module_config(r->request_config,
+                                 &lbmethod_bylatency_module, start);
+        }
+        *start = apr_time_now();
+        /* From a previous attempt */
+        apr_table_unset(r->notes, "proxy-response-time");
+    }
+
+    return worker;
+}
+
+/* assumed to be mutex protected by caller */
+static apr_status_t reset(proxy_balancer *balancer, server_rec *s)
+{
+    int i;
+    proxy_worker **worker;
+    worker = (proxy_worker **)balancer->workers->elts;
+    for (i = 0; i < balancer->workers->nelts; i++, worker++) {
+        latency_slot *slot = latency_get(*worker);
+        if (slot) {
+            apr_atomic_set32(&slot->ewma, 0);
+        }
+        (*worker)->s->lbstatus = 0;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t age(proxy_balancer *balancer, server_rec *s)
+{
+    return APR_SUCCESS;
+}
+
+static const proxy_balancer_method bylatency =
+{
+    "bylatency",
+    &find_best_bylatency,
+    NULL,
+    &reset,
+    &age,
+    NULL
+};
+
+/* Runs before the balancer's (which returns OK), never stops the hook */
+static int lbmethod_bylatency_post_request(proxy_worker *worker,
+                                           proxy_balancer *balancer,
+                                           request_rec *r,
+                                           proxy_server_conf *conf)
+{
+    apr_time_t *start, end;
+    apr_interval_time_t sample;
+    latency_slot *slot;
+    const char *note;
+
+    if (!balancer || !worker || balancer->lbmethod != &bylatency
+            || r->status == SUSPENDED) {
+        return DECLINED;
+    }
+    start = ap_get_module_config(r->request_config,
+                                 &lbmethod_bylatency_module);
+    if (!start || !(slot = latency_get(worker))) {
+        return DECLINED;
+    }
+
+    note = apr_table_get(r->notes, "proxy-response-time");
+    if (!note || (end = apr_atoi64(note)) < *start) {
+        end = apr_time_now();
+    }
+    sample = end - *start;
+    if (ap_is_HTTP_SERVER_ERROR(r->status) && sample < LATENCY_PENALTY) {
+        sample = LATENCY_PENALTY;
+    }
+    latency_sample(slot, sample);
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                  "%s: worker %s latency %" APR_TIME_T_FMT "us, "
+                  "average %uus", balancer->s->name,
+                  ap_proxy_worker_get_name(worker), sample,
+                  apr_atomic_read32(&slot->ewma));
+    return DECLINED;
+}
+
+static const char *set_latency_decay(cmd_parms *cmd, void *dummy,
+                                     const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+    if (ap_timeout_parameter_parse(arg, &latency_decay, "s") != APR_SUCCESS
+            || latency_decay < 0) {
+        return "BalancerLatencyDecay has wrong format";
+    }
+    return NULL;
+}
+
+static const command_rec lbmethod_bylatency_cmds[] =
+{
+    AP_INIT_TAKE1("BalancerLatencyDecay", set_latency_decay, NULL, RSRC_CONF,
+                  "Time for the latency of a worker to recover from a slow "
+                  "response by half"),
+    {NULL}
+};
+
+static int lbmethod_bylatency_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                         apr_pool_t *ptemp)
+{
+    latency_decay = DEFAULT_LATENCY_DECAY;
+    latency_table = NULL;
+    latency_shm = NULL;
+    return OK;
+}
+
+/* post_config hook: */
+static int lbmethod_bylatency_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptemp, server_rec *s)
+{
+    apr_status_t rv;
+
+    /* lbmethod_bylatency_post_config() will be called twice during startup.  So, don't
+     * set up the static data the 1st time through. */
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+
+    ap_proxy_balancer_get_best_worker_fn =
+                 APR_RETRIEVE_OPTIONAL_FN(proxy_balancer_get_best_worker);
+    if (!ap_proxy_balancer_get_best_worker_fn) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(10628)
+                     "mod_proxy must be loaded for mod_lbmethod_bylatency");
+        return !OK;
+    }
+
+    rv = apr_shm_create(&latency_shm, LATENCY_SLOTS * sizeof(latency_slot),
+                        NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        /* Each child will learn the latencies by itself */
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10629)
+                     "mod_lbmethod_bylatency: couldn't create shared memory, "
+                     "latencies won't be shared by the children");
+        latency_table = apr_pcalloc(pconf, LATENCY_SLOTS
+                                           * sizeof(latency_slot));
+        return OK;
+    }
+    latency_table = apr_shm_baseaddr_get(latency_shm);
+    memset(latency_table, 0, LATENCY_SLOTS * sizeof(latency_slot));
+
+    return OK;
+}
+
+static void register_hook(apr_pool_t *p)
+{
+    ap_register_provider(p, PROXY_LBMETHOD, "bylatency", "0", &bylatency);
+    ap_hook_pre_config(lbmethod_bylatency_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(lbmethod_bylatency_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    proxy_hook_post_request(lbmethod_bylatency_post_request, NULL, NULL,
+                            APR_HOOK_REALLY_FIRST);
+}
+
+AP_DECLARE_MODULE(lbmethod_bylatency) = {
+    STANDARD20_MODULE_STUFF,
+    NULL,       /* create per-directory config structure */
+    NULL,       /* merge per-directory config structures */
+    NULL,       /* create per-server config structure */
+    NULL,       /* merge per-server config structures */
+    lbmethod_bylatency_cmds, /* command apr_table_t */
+    register_hook /* register hooks */
+};
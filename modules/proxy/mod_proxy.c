@@ -1228,6 +1228,73 @@ static int proxy_needsdomain(request_rec *r, const char *url, const char *domain
 /* -------------------------------------------------------------- */
 /* Invoke handler */
 
+/* What proxy_handler() needs to finish a request suspended by the scheme
+ * handler, in ap_proxy_suspended_done().
+ */
+typedef struct {
+    proxy_worker *worker;
+    proxy_balancer *balancer;
+    proxy_server_conf *conf;
+    int attempts;
+} proxy_suspended_t;
+
+#define PROXY_SUSPENDED_KEY "proxy-suspended"
+
+static int proxy_handler_done(request_rec *r, proxy_worker *worker,
+                              proxy_balancer *balancer,
+                              proxy_server_conf *conf, int attempts,
+                              int access_status)
+{
+    int saved_status;
+
+    /*
+     * Save current r->status and set it to the value of access_status which
+     * might be different (e.g. r->status could be HTTP_OK if e.g. we override
+     * the error page on the proxy or if the error was not generated by the
+     * backend itself but by the proxy e.g. a bad gateway) in order to give
+     * ap_proxy_post_request a chance to act correctly on the status code.
+     * But only do the above if access_status is not OK and not DONE, because
+     * in this case r->status might contain the true status and overwriting
+     * it with OK or DONE would be wrong.
+     */
+    if ((access_status != OK) && (access_status != DONE)) {
+        saved_status = r->status;
+        r->status = access_status;
+        ap_proxy_post_request(worker, balancer, r, conf);
+        /*
+         * Only restore r->status if it has not been changed by
+         * ap_proxy_post_request as we assume that this change was intentional.
+         */
+        if (r->status == access_status) {
+            r->status = saved_status;
+        }
+    }
+    else {
+        ap_proxy_post_request(worker, balancer, r, conf);
+    }
+
+    proxy_run_request_status(&access_status, r);
+    AP_PROXY_RUN_FINISHED(r, attempts, access_status);
+
+    return access_status;
+}
+
+/* Finish a request whose scheme handler returned SUSPENDED, once done */
+static int ap_proxy_suspended_done(request_rec *r, int access_status)
+{
+    proxy_suspended_t *suspended = NULL;
+
+    apr_pool_userdata_get((void **)&suspended, PROXY_SUSPENDED_KEY, r->pool);
+    if (!suspended) {
+        return access_status;
+    }
+    apr_pool_userdata_setn(NULL, PROXY_SUSPENDED_KEY, NULL, r->pool);
+
+    return proxy_handler_done(r, suspended->worker, suspended->balancer,
+                              suspended->conf, suspended->attempts,
+                              access_status);
+}
+
 static int proxy_handler(request_rec *r)
 {
     char *uri, *scheme, *p;
@@ -1243,9 +1310,9 @@ static int proxy_handler(request_rec *r)
     apr_int64_t maxfwd;
     proxy_balancer *balancer = NULL;
     proxy_worker *worker = NULL;
+    proxy_suspended_t *suspended = NULL;
     int attempts = 0, max_attempts = 0;
     struct dirconn_entry *list = (struct dirconn_entry *)conf->dirconn->elts;
-    int saved_status;
 
     /* is this for us? */
     if (!r->filename) {
@@ -1408,6 +1475,19 @@ static int proxy_handler(request_rec *r)
             ap_proxy_initialize_worker(worker, r->server, conf->pool);
         }
 
+        /* Should the scheme handler suspend the request, it may be done
+         * in another thread as soon as the handler returns.
+         */
+        if (!suspended) {
+            suspended = apr_palloc(r->pool, sizeof(*suspended));
+            apr_pool_userdata_setn(suspended, PROXY_SUSPENDED_KEY, NULL,
+                                   r->pool);
+        }
+        suspended->worker = worker;
+        suspended->balancer = balancer;
+        suspended->conf = conf;
+        suspended->attempts = attempts;
+
         if (balancer && balancer->s->max_attempts_set && !max_attempts)
             max_attempts = balancer->s->max_attempts;
         /* firstly, try a proxy, unless a NoProxy directive is active */
@@ -1537,36 +1617,16 @@ static int proxy_handler(request_rec *r)
         goto cleanup;
     }
 cleanup:
-    /*
-     * Save current r->status and set it to the value of access_status which
-     * might be different (e.g. r->status could be HTTP_OK if e.g. we override
-     * the error page on the proxy or if the error was not generated by the
-     * backend itself but by the proxy e.g. a bad gateway) in order to give
-     * ap_proxy_post_request a chance to act correctly on the status code.
-     * But only do the above if access_status is not OK and not DONE, because
-     * in this case r->status might contain the true status and overwriting
-     * it with OK or DONE would be wrong.
-     */
-    if ((access_status != OK) && (access_status != DONE)) {
-        saved_status = r->status;
-        r->status = access_status;
-        ap_proxy_post_request(worker, balancer, r, conf);
-        /*
-         * Only restore r->status if it has not been changed by
-         * ap_proxy_post_request as we assume that this change was intentional.
-         */
-        if (r->status == access_status) {
-            r->status = saved_status;
-        }
+    /* The scheme handler calls ap_proxy_suspended_done() when it's done */
+    if (access_status == SUSPENDED) {
+        return SUSPENDED;
     }
-    else {
-        ap_proxy_post_request(worker, balancer, r, conf);
+    if (suspended) {
+        apr_pool_userdata_setn(NULL, PROXY_SUSPENDED_KEY, NULL, r->pool);
     }
 
-    proxy_run_request_status(&access_status, r);
-    AP_PROXY_RUN_FINISHED(r, attempts, access_status);
-
-    return access_status;
+    return proxy_handler_done(r, worker, balancer, conf, attempts,
+                              access_status);
 }
 
 /* -------------------------------------------------------------- */
@@ -2497,6 +2557,29 @@ static const char *
     return NULL;
 }
 
+static const char *
+    set_shared_connections(cmd_parms *parms, void *dummy, const char *arg1,
+                           const char *arg2)
+{
+    apr_interval_time_t idle = apr_time_from_sec(60);
+    const char *err;
+    apr_int64_t max;
+    char *end;
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY)) != NULL) {
+        return err;
+    }
+    max = apr_strtoi64(arg1, &end, 10);
+    if (end == arg1 || *end || max < 0 || max > 65535) {
+        return "ProxySharedConnections must be a number between 0 and 65535";
+    }
+    if (arg2 && (ap_timeout_parameter_parse(arg2, &idle, "s") != APR_SUCCESS
+                 || idle <= 0)) {
+        return "ProxySharedConnections idle timeout has wrong format";
+    }
+    return proxy_broker_set((int)max, idle);
+}
+
 static const char *
     set_recv_buffer_size(cmd_parms *parms, void *dummy, const char *arg)
 {
@@ -3102,6 +3185,9 @@ static const command_rec proxy_cmds[] =
      "Amount of time to poll before going asynchronous"),
     AP_INIT_TAKE1("ProxyAsyncIdleTimeout", set_proxy_async_idle, NULL, RSRC_CONF|ACCESS_CONF,
      "Timeout for asynchronous inactivity, ProxyTimeout by default"),
+    AP_INIT_TAKE12("ProxySharedConnections", set_shared_connections, NULL, RSRC_CONF,
+     "Maximum number of idle backend connections per worker shared between "
+     "the children (0 to disable), and their idle timeout"),
     {NULL}
 };
 
@@ -3186,7 +3272,7 @@ static int proxy_post_config(apr_pool_t *pconf, apr_pool_t *plog,
         }
     }
 
-    return OK;
+    return proxy_broker_post_config(pconf, main_s);
 }
 
 /*
@@ -3325,6 +3411,10 @@ static void child_init(apr_pool_t *p, server_rec *s)
         exit(1); /* Ugly, but what else? */
     }
 
+    /* Before the workers are initialized, they may register to the broker */
+    proxy_broker_child_init(p, s);
+    proxy_thread_conns_child_init(p, s);
+
     main_conf = ap_get_module_config(s->module_config, &proxy_module);
     for (; s; s = s->next) {
         void *sconf = s->module_config;
@@ -3409,6 +3499,7 @@ static int proxy_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
                       APR_HOOK_MIDDLE);
     /* Reset workers count on graceful restart */
     proxy_lb_workers = 0;
+    proxy_broker_pre_config(pconf);
     set_worker_hc_param_f = APR_RETRIEVE_OPTIONAL_FN(set_worker_hc_param);
     return OK;
 }
@@ -3424,6 +3515,7 @@ static void register_hooks(apr_pool_t *p)
 
     /* handler */
     ap_hook_handler(proxy_handler, NULL, NULL, APR_HOOK_FIRST);
+    APR_REGISTER_OPTIONAL_FN(ap_proxy_suspended_done);
     /* filename-to-URI translation */
     ap_hook_pre_translate_name(proxy_pre_translate_name, NULL, NULL,
                                APR_HOOK_MIDDLE);
@@ -640,10 +640,11 @@ struct proxy_balancer_method {
 extern PROXY_DECLARE_DATA proxy_hcmethods_t proxy_hcmethods[];
 extern PROXY_DECLARE_DATA proxy_wstat_t proxy_wstat_tbl[];
 
-/* Following 4 from health check */
+/* Following 5 from health check */
 APR_DECLARE_OPTIONAL_FN(void, hc_show_exprs, (request_rec *));
 APR_DECLARE_OPTIONAL_FN(void, hc_select_exprs, (request_rec *, const char *));
 APR_DECLARE_OPTIONAL_FN(int, hc_valid_expr, (request_rec *, const char *));
+APR_DECLARE_OPTIONAL_FN(apr_interval_time_t, hc_get_latency, (proxy_worker *));
 APR_DECLARE_OPTIONAL_FN(const char *, set_worker_hc_param,
                         (apr_pool_t *, server_rec *, proxy_worker *,
                          const char *, const char *, void *));
@@ -1494,6 +1495,17 @@ PROXY_DECLARE_OPTIONAL_HOOK(proxy, PROXY, int, tunnel_forward,
 APR_DECLARE_OPTIONAL_FN(int, ap_proxy_clear_connection,
         (request_rec *r, apr_table_t *headers));
 
+/**
+ * Finish a request whose scheme handler returned SUSPENDED, once it is
+ * done: run the post_request and request_status hooks that the proxy
+ * handler skipped, like it would have on return.
+ * @param r request
+ * @param status the status the scheme handler would have returned
+ * @return the status to finish the request with
+ */
+APR_DECLARE_OPTIONAL_FN(int, ap_proxy_suspended_done,
+        (request_rec *r, int status));
+
 /**
  * Configure and create workers (and balancer) in mod_balancer.
  * @param r request
@@ -24,6 +24,8 @@
 #include "ap_hooks.h"
 #include "apr_date.h"
 #include "apr_escape.h"
+#include "apr_atomic.h"
+#include "apr_shm.h"
 #include "mod_watchdog.h"
 
 static const char *balancer_mutex_type = "proxy-balancer-shm";
@@ -39,6 +41,188 @@ static int (*ap_proxy_retry_worker_fn)(const char *proxy_function,
 static APR_OPTIONAL_FN_TYPE(hc_show_exprs) *hc_show_exprs_f = NULL;
 static APR_OPTIONAL_FN_TYPE(hc_select_exprs) *hc_select_exprs_f = NULL;
 static APR_OPTIONAL_FN_TYPE(hc_valid_expr) *hc_valid_expr_f = NULL;
+static APR_OPTIONAL_FN_TYPE(hc_get_latency) *hc_get_latency_f = NULL;
+
+/*
+ * Passive outlier detection: the outcome of the requests of each worker
+ * is tracked in shared memory (indexed by the hash of the worker's name),
+ * and a worker which fails too many of them (5xx, timeouts, or responses
+ * slower than BalancerOutlierLatency) is put in error state for its retry
+ * time, doubled at each ejection which follows too closely the previous
+ * one (up to BalancerOutlierMaxEjection). A recently ejected worker is
+ * ejected again on its first failure.
+ */
+#define OUTLIER_SLOTS           1024
+#define OUTLIER_PROBES          16
+#define OUTLIER_WINDOW          10      /* seconds */
+#define OUTLIER_MAX_EJECTED     50      /* percent of a balancer's workers */
+
+typedef struct {
+    proxy_worker_slot key;
+    apr_uint32_t window;    /* start of the current window, seconds */
+    apr_uint32_t requests;  /* in the current window */
+    apr_uint32_t failures;  /* in the current window */
+    apr_uint32_t consecutive;
+    apr_uint32_t ejections; /* not healed yet */
+    apr_uint32_t ejected;   /* end of the last ejection, seconds */
+} outlier_slot;
+
+typedef struct {
+    int failures;               /* consecutive, 0 to disable */
+    int error_rate;             /* percent, 0 to disable */
+    int min_requests;           /* in the window for the error rate */
+    apr_interval_time_t latency;
+    apr_interval_time_t max_ejection;
+    int max_pending;            /* circuit breaker, 0 to disable */
+    unsigned int failures_set:1;
+    unsigned int error_rate_set:1;
+    unsigned int latency_set:1;
+    unsigned int max_ejection_set:1;
+    unsigned int max_pending_set:1;
+} balancer_server_conf;
+
+#define DEFAULT_OUTLIER_MIN_REQUESTS    20
+#define DEFAULT_OUTLIER_MAX_EJECTION    apr_time_from_sec(300)
+
+static apr_shm_t *outlier_shm = NULL;
+static outlier_slot *outlier_table = NULL;
+
+static outlier_slot *outlier_get(proxy_worker *worker)
+{
+    return ap_proxy_worker_slot_get(worker, outlier_table,
+                                    sizeof(outlier_slot),
+                                    OUTLIER_SLOTS, OUTLIER_PROBES);
+}
+
+static void outlier_eject(proxy_balancer *balancer, proxy_worker *worker,
+                          outlier_slot *slot, balancer_server_conf *bconf,
+                          request_rec *r, const char *why)
+{
+    apr_time_t now = apr_time_now();
+    apr_uint32_t sec = (apr_uint32_t)apr_time_sec(now);
+    apr_interval_time_t duration;
+    int i, ejected = 0;
+
+    for (i = 0; i < balancer->workers->nelts; i++) {
+        proxy_worker *w = APR_ARRAY_IDX(balancer->workers, i, proxy_worker *);
+        if (w->s->status & PROXY_WORKER_IN_ERROR) {
+            ejected++;
+        }
+    }
+    if ((ejected + 1) * 100 > balancer->workers->nelts * OUTLIER_MAX_EJECTED) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10632)
+                      "%s: not ejecting worker (%s) (%s), too many workers "
+                      "in error state already", balancer->s->name,
+                      ap_proxy_worker_get_name(worker), why);
+        return;
+    }
+
+    /* Not healed if the last ejection ended within max_ejection */
+    if (slot->ejections && sec - slot->ejected
+                           > apr_time_sec(bconf->max_ejection)) {
+        slot->ejections = 0;
+    }
+    duration = worker->s->retry;
+    for (i = 0; i < (int)slot->ejections && duration < bconf->max_ejection;
+         i++) {
+        duration *= 2;
+    }
+    if (duration > bconf->max_ejection) {
+        duration = bconf->max_ejection;
+    }
+    if (duration < worker->s->retry) {
+        duration = worker->s->retry;
+    }
+    slot->ejections++;
+    slot->ejected = sec + (apr_uint32_t)apr_time_sec(duration);
+    slot->consecutive = 0;
+    slot->requests = slot->failures = 0;
+
+    /* ap_proxy_retry_worker() retries error_time + retry later */
+    worker->s->error_time = now + duration - worker->s->retry;
+    worker->s->status |= PROXY_WORKER_IN_ERROR;
+
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10633)
+                  "%s: ejecting worker (%s) for %" APR_TIME_T_FMT "s: %s",
+                  balancer->s->name, ap_proxy_worker_get_name(worker),
+                  apr_time_sec(duration), why);
+}
+
+/* Called with the balancer's thread mutex held, once the request is done:
+ * a request suspended by the scheme handler is evaluated when it finishes,
+ * from ap_proxy_suspended_done().
+ */
+static void outlier_detect(proxy_balancer *balancer, proxy_worker *worker,
+                           request_rec *r)
+{
+    balancer_server_conf *bconf =
+        ap_get_module_config(r->server->module_config,
+                             &proxy_balancer_module);
+    apr_time_t *start = ap_get_module_config(r->request_config,
+                                             &proxy_balancer_module);
+    apr_time_t now = apr_time_now(), end;
+    apr_uint32_t sec = (apr_uint32_t)apr_time_sec(now);
+    const char *why = NULL, *note;
+    outlier_slot *slot;
+
+    if ((!bconf->failures && !bconf->error_rate)
+            || r->status == SUSPENDED
+            || (worker->s->status & (PROXY_WORKER_IGNORE_ERRORS
+                                     | PROXY_WORKER_IN_ERROR))
+            || !(slot = outlier_get(worker))) {
+        return;
+    }
+
+    /* The latency up to the response headers if the scheme handler noted
+     * when they arrived, so that a long body or tunnel is no failure */
+    note = apr_table_get(r->notes, "proxy-response-time");
+    if (!note || !start || (end = apr_atoi64(note)) < *start) {
+        end = now;
+    }
+
+    if (ap_is_HTTP_SERVER_ERROR(r->status)) {
+        why = apr_psprintf(r->pool, "status %d", r->status);
+    }
+    else if (apr_table_get(r->notes, "proxy_timedout")) {
+        why = "timeout";
+    }
+    else if (bconf->latency && start && end - *start > bconf->latency) {
+        why = "latency";
+    }
+
+    /* The shared counters are not updated atomically as a whole, which is
+     * fine for statistics */
+    if (sec - slot->window >= OUTLIER_WINDOW) {
+        slot->window = sec;
+        slot->requests = slot->failures = 0;
+    }
+    slot->requests++;
+    if (!why) {
+        slot->consecutive = 0;
+        return;
+    }
+    slot->failures++;
+    slot->consecutive++;
+
+    if (slot->ejections
+            && sec - slot->ejected <= apr_time_sec(bconf->max_ejection)) {
+        outlier_eject(balancer, worker, slot, bconf, r,
+                      apr_pstrcat(r->pool, why, " after ejection", NULL));
+    }
+    else if (bconf->failures && slot->consecutive >= (apr_uint32_t)bconf->failures) {
+        outlier_eject(balancer, worker, slot, bconf, r,
+                      apr_psprintf(r->pool, "%u consecutive failures, "
+                                   "last %s", slot->consecutive, why));
+    }
+    else if (bconf->error_rate
+             && slot->requests >= (apr_uint32_t)bconf->min_requests
+             && slot->failures * 100 >= slot->requests * bconf->error_rate) {
+        outlier_eject(balancer, worker, slot, bconf, r,
+                      apr_psprintf(r->pool, "%u failures out of %u requests, "
+                                   "last %s", slot->failures, slot->requests,
+                                   why));
+    }
+}
 
 
 /*
@@ -60,6 +244,9 @@ static int balancer_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
     hc_show_exprs_f = APR_RETRIEVE_OPTIONAL_FN(hc_show_exprs);
     hc_select_exprs_f = APR_RETRIEVE_OPTIONAL_FN(hc_select_exprs);
     hc_valid_expr_f = APR_RETRIEVE_OPTIONAL_FN(hc_valid_expr);
+    hc_get_latency_f = APR_RETRIEVE_OPTIONAL_FN(hc_get_latency);
+    outlier_table = NULL;
+    outlier_shm = NULL;
     return OK;
 }
 
@@ -584,6 +771,35 @@ static int proxy_balancer_pre_request(proxy_worker **worker,
         *worker = runtime;
     }
 
+    /* Circuit breaker: fail fast rather than piling up requests */
+    {
+        balancer_server_conf *bconf =
+            ap_get_module_config(r->server->module_config,
+                                 &proxy_balancer_module);
+        apr_time_t *start;
+
+        if (bconf->max_pending
+                && ap_proxy_get_busy_count(*worker)
+                   >= (apr_size_t)bconf->max_pending) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(10634)
+                          "%s: worker (%s) has %d pending requests already, "
+                          "circuit open", (*balancer)->s->name,
+                          ap_proxy_worker_get_name(*worker),
+                          bconf->max_pending);
+            *worker = NULL;
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        start = ap_get_module_config(r->request_config,
+                                     &proxy_balancer_module);
+        if (!start) {
+            start = apr_palloc(r->pool, sizeof(*start));
+            ap_set_module_config(r->request_config, &proxy_balancer_module,
+                                 start);
+        }
+        *start = apr_time_now();
+    }
+
     ap_proxy_increment_busy_count(*worker);
     apr_pool_cleanup_register(r->pool, *worker, ap_proxy_decrement_busy_count,
                               apr_pool_cleanup_null);
@@ -669,6 +885,9 @@ static int proxy_balancer_post_request(proxy_worker *worker,
         worker->s->error_time = apr_time_now();
 
     }
+
+    outlier_detect(balancer, worker, r);
+
 #if APR_HAS_THREADS
     if ((rv = PROXY_THREAD_UNLOCK(balancer)) != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01175)
@@ -854,6 +1073,21 @@ static int balancer_post_config(apr_pool_t *pconf, apr_pool_t *plog,
         return !OK;
     }
 
+    rv = apr_shm_create(&outlier_shm, OUTLIER_SLOTS * sizeof(outlier_slot),
+                        NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        /* Each child will detect the outliers by itself */
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10635)
+                     "mod_proxy_balancer: couldn't create shared memory, "
+                     "outlier detection won't be shared by the children");
+        outlier_table = apr_pcalloc(pconf, OUTLIER_SLOTS
+                                           * sizeof(outlier_slot));
+    }
+    else {
+        outlier_table = apr_shm_baseaddr_get(outlier_shm);
+        memset(outlier_table, 0, OUTLIER_SLOTS * sizeof(outlier_slot));
+    }
+
     /*
      * Get slotmem setups
      */
@@ -1674,7 +1908,7 @@ static void balancer_display_page(request_rec *r, proxy_server_conf *conf,
                 "<th>Factor</th><th>Set</th><th>Status</th>"
                 "<th>Elected</th><th>Busy</th><th>Load</th><th>To</th><th>From</th>", r);
             if (set_worker_hc_param_f) {
-                ap_rputs("<th>HC Method</th><th>HC Interval</th><th>Passes</th><th>Fails</th><th>HC uri</th><th>HC Expr</th>", r);
+                ap_rputs("<th>HC Method</th><th>HC Interval</th><th>HC Latency</th><th>Passes</th><th>Fails</th><th>HC uri</th><th>HC Expr</th>", r);
             }
             ap_rputs("</tr>\n", r);
 
@@ -1707,6 +1941,13 @@ static void balancer_display_page(request_rec *r, proxy_server_conf *conf,
                 if (set_worker_hc_param_f) {
                     ap_rprintf(r, "</td><td>%s</td>", ap_proxy_show_hcmethod(worker->s->method));
                     ap_rprintf(r, "<td>%" APR_TIME_T_FMT "ms</td>", apr_time_as_msec(worker->s->interval));
+                    if (hc_get_latency_f && hc_get_latency_f(worker) >= 0) {
+                        ap_rprintf(r, "<td>%.3fms</td>",
+                                   (double)hc_get_latency_f(worker) / 1000.0);
+                    }
+                    else {
+                        ap_rputs("<td>-</td>", r);
+                    }
                     ap_rprintf(r, "<td>%d (%d)</td>", worker->s->passes,worker->s->pcount);
                     ap_rprintf(r, "<td>%d (%d)</td>", worker->s->fails, worker->s->fcount);
                     ap_rprintf(r, "<td>%s</td>", ap_escape_html(r->pool, worker->s->hcuri));
@@ -2030,6 +2271,161 @@ static void balancer_child_init(apr_pool_t *p, server_rec *s)
 
 }
 
+static void *balancer_create_server_config(apr_pool_t *p, server_rec *s)
+{
+    balancer_server_conf *bconf = apr_pcalloc(p, sizeof(*bconf));
+
+    bconf->min_requests = DEFAULT_OUTLIER_MIN_REQUESTS;
+    bconf->max_ejection = DEFAULT_OUTLIER_MAX_EJECTION;
+    return bconf;
+}
+
+static void *balancer_merge_server_config(apr_pool_t *p, void *basev,
+                                          void *overridesv)
+{
+    balancer_server_conf *base = basev;
+    balancer_server_conf *overrides = overridesv;
+    balancer_server_conf *bconf = apr_pcalloc(p, sizeof(*bconf));
+
+    bconf->failures = overrides->failures_set ? overrides->failures
+                                              : base->failures;
+    bconf->failures_set = overrides->failures_set || base->failures_set;
+    if (overrides->error_rate_set) {
+        bconf->error_rate = overrides->error_rate;
+        bconf->min_requests = overrides->min_requests;
+    }
+    else {
+        bconf->error_rate = base->error_rate;
+        bconf->min_requests = base->min_requests;
+    }
+    bconf->error_rate_set = overrides->error_rate_set || base->error_rate_set;
+    bconf->latency = overrides->latency_set ? overrides->latency
+                                            : base->latency;
+    bconf->latency_set = overrides->latency_set || base->latency_set;
+    bconf->max_ejection = overrides->max_ejection_set ? overrides->max_ejection
+                                                      : base->max_ejection;
+    bconf->max_ejection_set = overrides->max_ejection_set
+                              || base->max_ejection_set;
+    bconf->max_pending = overrides->max_pending_set ? overrides->max_pending
+                                                    : base->max_pending;
+    bconf->max_pending_set = overrides->max_pending_set
+                             || base->max_pending_set;
+    return bconf;
+}
+
+static const char *set_outlier_failures(cmd_parms *cmd, void *dummy,
+                                        const char *arg)
+{
+    balancer_server_conf *bconf =
+        ap_get_module_config(cmd->server->module_config,
+                             &proxy_balancer_module);
+    int val = atoi(arg);
+
+    if (val < 0) {
+        return "BalancerOutlierFailures must be a positive number";
+    }
+    bconf->failures = val;
+    bconf->failures_set = 1;
+    return NULL;
+}
+
+static const char *set_outlier_error_rate(cmd_parms *cmd, void *dummy,
+                                          const char *arg, const char *arg2)
+{
+    balancer_server_conf *bconf =
+        ap_get_module_config(cmd->server->module_config,
+                             &proxy_balancer_module);
+    int val = atoi(arg);
+
+    if (val < 0 || val > 100) {
+        return "BalancerOutlierErrorRate must be a percentage (0-100)";
+    }
+    bconf->error_rate = val;
+    bconf->min_requests = DEFAULT_OUTLIER_MIN_REQUESTS;
+    if (arg2) {
+        val = atoi(arg2);
+        if (val < 1) {
+            return "BalancerOutlierErrorRate minimum requests must be "
+                   "a positive number";
+        }
+        bconf->min_requests = val;
+    }
+    bconf->error_rate_set = 1;
+    return NULL;
+}
+
+static const char *set_outlier_latency(cmd_parms *cmd, void *dummy,
+                                       const char *arg)
+{
+    balancer_server_conf *bconf =
+        ap_get_module_config(cmd->server->module_config,
+                             &proxy_balancer_module);
+
+    if (ap_timeout_parameter_parse(arg, &bconf->latency, "ms") != APR_SUCCESS
+            || bconf->latency < 0) {
+        return "BalancerOutlierLatency has wrong format";
+    }
+    bconf->latency_set = 1;
+    return NULL;
+}
+
+static const char *set_outlier_max_ejection(cmd_parms *cmd, void *dummy,
+                                            const char *arg)
+{
+    balancer_server_conf *bconf =
+        ap_get_module_config(cmd->server->module_config,
+                             &proxy_balancer_module);
+
+    if (ap_timeout_parameter_parse(arg, &bconf->max_ejection, "s")
+                != APR_SUCCESS
+            || bconf->max_ejection <= 0) {
+        return "BalancerOutlierMaxEjection has wrong format";
+    }
+    bconf->max_ejection_set = 1;
+    return NULL;
+}
+
+static const char *set_max_pending(cmd_parms *cmd, void *dummy,
+                                   const char *arg)
+{
+    balancer_server_conf *bconf =
+        ap_get_module_config(cmd->server->module_config,
+                             &proxy_balancer_module);
+    int val = atoi(arg);
+
+    if (val < 0) {
+        return "BalancerMaxPending must be a positive number";
+    }
+    bconf->max_pending = val;
+    bconf->max_pending_set = 1;
+    return NULL;
+}
+
+static const command_rec balancer_cmds[] =
+{
+    AP_INIT_TAKE1("BalancerOutlierFailures", set_outlier_failures, NULL,
+                  RSRC_CONF,
+                  "Number of consecutive failed requests after which a "
+                  "balancer member is ejected, 0 to disable"),
+    AP_INIT_TAKE12("BalancerOutlierErrorRate", set_outlier_error_rate, NULL,
+                   RSRC_CONF,
+                   "Percentage of failed requests over 10 seconds after "
+                   "which a balancer member is ejected, 0 to disable, and "
+                   "the minimum number of requests to consider"),
+    AP_INIT_TAKE1("BalancerOutlierLatency", set_outlier_latency, NULL,
+                  RSRC_CONF,
+                  "Response time above which a request counts as failed "
+                  "(in milliseconds by default), 0 to disable"),
+    AP_INIT_TAKE1("BalancerOutlierMaxEjection", set_outlier_max_ejection,
+                  NULL, RSRC_CONF,
+                  "Maximum ejection time of a balancer member "
+                  "(in seconds by default)"),
+    AP_INIT_TAKE1("BalancerMaxPending", set_max_pending, NULL, RSRC_CONF,
+                  "Number of requests in flight to a balancer member above "
+                  "which new requests fail with 503, 0 for no limit"),
+    {NULL}
+};
+
 static void ap_proxy_balancer_register_hook(apr_pool_t *p)
 {
     /* Only the mpm_winnt has child init hook handler.
@@ -2053,8 +2449,8 @@ AP_DECLARE_MODULE(proxy_balancer) = {
     STANDARD20_MODULE_STUFF,
     NULL,       /* create per-directory config structure */
     NULL,       /* merge per-directory config structures */
-    NULL,       /* create per-server config structure */
-    NULL,       /* merge per-server config structures */
-    NULL,       /* command apr_table_t */
+    balancer_create_server_config, /* create per-server config structure */
+    balancer_merge_server_config,  /* merge per-server config structures */
+    balancer_cmds,                 /* command apr_table_t */
     ap_proxy_balancer_register_hook /* register hooks */
 };
@@ -18,6 +18,13 @@
 #include "util_fcgi.h"
 #include "util_script.h"
 #include "ap_expr.h"
+#include "ap_mpm.h"
+
+#if APR_HAS_THREADS
+#include "apr_hash.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#endif
 
 module AP_MODULE_DECLARE_DATA proxy_fcgi_module;
 
@@ -29,6 +36,7 @@ typedef struct {
 
 typedef struct {
     char *dirwalk_uri_path;
+    int environment_set;        /* by setup_environment() already */
 } fcgi_req_config_t;
 
 /* We will assume FPM, but still differentiate */
@@ -49,6 +57,83 @@ typedef struct {
     apr_array_header_t *env_fixups;
 } fcgi_dirconf_t;
 
+static int fcgi_multiplex = 0;
+
+#if APR_HAS_THREADS
+/*
+ * With ProxyFCGIMultiplex, the requests whose body was prefetched entirely
+ * share the connections to the backends which multiplex (FCGI_MPXS_CONNS),
+ * each with its own request ID. Like the shared sessions of
+ * mod_proxy_http2, one of the requests of a connection (the driver) writes
+ * the records of the others and queues the records read to them, while
+ * they wait for their response to be done. Each request writes its
+ * response to its client on its own thread, handing over the driver role
+ * meanwhile if it has it, and enforces its own timeout. FastCGI having no
+ * flow control, the driver stops reading while a request has more than
+ * FCGI_MPX_MAX_QUEUED bytes left to write, which does not count against
+ * the timeouts.
+ */
+typedef struct fcgi_mpx_conn fcgi_mpx_conn;
+typedef struct fcgi_mpx_backend fcgi_mpx_backend;
+typedef struct fcgi_mpx_req fcgi_mpx_req;
+
+/* The connections to the backend of a worker, and what it supports */
+struct fcgi_mpx_backend {
+    proxy_worker *worker;
+    int mpxs_conns;             /* FCGI_MPXS_CONNS, -1 until asked */
+    int probing;
+    int max_reqs;               /* FCGI_MAX_REQS, if told */
+    fcgi_mpx_conn *conns;
+};
+
+struct fcgi_mpx_conn {
+    fcgi_mpx_conn *next;        /* connection to the same backend */
+    fcgi_mpx_backend *backend;
+    apr_pool_t *pool;
+    apr_thread_cond_t *cond;    /* request done, or no driver anymore */
+    server_rec *server;
+    proxy_conn_rec *p_conn;
+    apr_pollfd_t pfd;
+    char *iobuf;
+    apr_size_t iobuf_size;
+    fcgi_mpx_req **reqs;        /* by request ID - 1 */
+    apr_array_header_t *pending;  /* of fcgi_mpx_req *, to submit */
+    apr_array_header_t *aborts;   /* of fcgi_mpx_req *, to abort */
+    apr_array_header_t *submitting; /* taken by the driver */
+    apr_array_header_t *aborting;
+    fcgi_mpx_req *driver;
+    int attached;               /* requests using the connection */
+    int stale;                  /* IDs of aborted requests, until ended */
+    int max_reqs;
+    int dead;
+    int checking;               /* idle, being checked before reuse */
+    apr_time_t last_io;
+    apr_time_t idle_since;
+    apr_time_t stalled;         /* since the driver stopped reading, or 0 */
+};
+
+#define FCGI_MPX_MAX_REQS       100
+#define FCGI_MPX_TTL            apr_time_from_sec(60)
+/* How often waiting requests check their client connection */
+#define FCGI_MPX_WAIT           apr_time_from_msec(100)
+/* How long the driver waits for records before submitting new requests */
+#define FCGI_MPX_POLL           apr_time_from_msec(10)
+/* Records read in a row by the driver */
+#define FCGI_MPX_MAX_RECORDS    16
+/* Output of a request not written yet, above which the driver waits */
+#define FCGI_MPX_MAX_QUEUED     (256 * 1024)
+/* For the backend to answer FCGI_GET_VALUES, if ever */
+#define FCGI_MPX_PROBE_TIMEOUT  apr_time_from_sec(1)
+
+/* protocolStatus of FCGI_END_REQUEST, the request was not processed */
+#define FCGI_CANT_MPX_CONN      1
+#define FCGI_OVERLOADED         2
+
+static apr_pool_t *mpx_pool;
+static apr_thread_mutex_t *mpx_mutex;
+static apr_hash_t *mpx_backends;    /* proxy_worker * -> fcgi_mpx_backend */
+#endif
+
 /*
  * Canonicalise http-like URLs.
  * scheme is the scheme for the URL
@@ -318,47 +403,19 @@ static apr_status_t get_data_full(proxy_conn_rec *conn,
     return APR_SUCCESS;
 }
 
-static apr_status_t send_begin_request(proxy_conn_rec *conn,
-                                       apr_uint16_t request_id)
-{
-    struct iovec vec[2];
-    ap_fcgi_header header;
-    unsigned char farray[AP_FCGI_HEADER_LEN];
-    ap_fcgi_begin_request_body brb;
-    unsigned char abrb[AP_FCGI_HEADER_LEN];
-    apr_size_t len;
-
-    ap_fcgi_fill_in_header(&header, AP_FCGI_BEGIN_REQUEST, request_id,
-                           sizeof(abrb), 0);
-
-    ap_fcgi_fill_in_request_body(&brb, AP_FCGI_RESPONDER,
-                                 ap_proxy_connection_reusable(conn)
-                                     ? AP_FCGI_KEEP_CONN : 0);
-
-    ap_fcgi_header_to_array(&header, farray);
-    ap_fcgi_begin_request_body_to_array(&brb, abrb);
+/* Our limit for the content of a FCGI_PARAMS record, which could have been
+ * up to AP_FCGI_MAX_CONTENT_LEN */
+#define FCGI_PARAMS_RECORD_LEN (16 * 1024)
 
-    vec[0].iov_base = (void *)farray;
-    vec[0].iov_len = sizeof(farray);
-    vec[1].iov_base = (void *)abrb;
-    vec[1].iov_len = sizeof(abrb);
+/* An entry of the environment not to be sent */
+#define FCGI_ENV_SKIP ((apr_size_t)-1)
 
-    return send_data(conn, vec, 2, &len);
-}
-
-static apr_status_t send_environment(proxy_conn_rec *conn, request_rec *r,
-                                     apr_pool_t *temp_pool,
-                                     apr_uint16_t request_id)
+/* Set up the CGI environment of the request, to be sent via FCGI_PARAMS */
+static apr_status_t setup_environment(request_rec *r)
 {
     const apr_array_header_t *envarr;
     const apr_table_entry_t *elts;
-    struct iovec vec[2];
-    ap_fcgi_header header;
-    unsigned char farray[AP_FCGI_HEADER_LEN];
-    char *body;
     apr_status_t rv;
-    apr_size_t avail_len, len, required_len;
-    int next_elem, starting_elem;
     fcgi_req_config_t *rconf = ap_get_module_config(r->request_config, &proxy_fcgi_module);
     fcgi_dirconf_t *dconf = ap_get_module_config(r->per_dir_config, &proxy_fcgi_module);
     char *proxy_filename = r->filename;
@@ -463,66 +520,166 @@ static apr_status_t send_environment(proxy_conn_rec *conn, request_rec *r,
         }
     }
 
-    /* Send envvars over in as many FastCGI records as it takes, */
-    next_elem = 0; /* starting with the first one */
+    return APR_SUCCESS;
+}
 
-    avail_len = 16 * 1024; /* our limit per record, which could have been up
-                            * to AP_FCGI_MAX_CONTENT_LEN
-                            */
+static char *put_record_header(char *itr, unsigned char type,
+                               apr_uint16_t request_id,
+                               apr_uint16_t content_len)
+{
+    ap_fcgi_header header;
 
-    while (next_elem < envarr->nelts) {
-        starting_elem = next_elem;
-        required_len = ap_fcgi_encoded_env_len(r->subprocess_env,
-                                               avail_len,
-                                               &next_elem);
+    ap_fcgi_fill_in_header(&header, type, request_id, content_len, 0);
+    ap_fcgi_header_to_array(&header, (unsigned char *)itr);
 
-        if (!required_len) {
-            if (next_elem < envarr->nelts) {
-                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
-                              APLOGNO(02536) "couldn't encode envvar '%s' in %"
-                              APR_SIZE_T_FMT " bytes",
-                              elts[next_elem].key, avail_len);
-                /* skip this envvar and continue */
-                ++next_elem;
-                continue;
-            }
-            /* only an unused element at the end of the array */
-            break;
-        }
+    return itr + AP_FCGI_HEADER_LEN;
+}
+
+static char *put_nv_len(char *itr, apr_size_t len)
+{
+    if (len >> 7 == 0) {
+        *itr++ = len & 0xff;
+    }
+    else {
+        *itr++ = ((len >> 24) & 0xff) | 0x80;
+        *itr++ = (len >> 16) & 0xff;
+        *itr++ = (len >> 8) & 0xff;
+        *itr++ = len & 0xff;
+    }
+    return itr;
+}
+
+/*
+ * Encode the records which start a request, so that they can be sent at
+ * once: FCGI_BEGIN_REQUEST, the environment in as many FCGI_PARAMS records
+ * as it takes and the empty one, then if the whole request body is given
+ * (at most AP_FCGI_MAX_CONTENT_LEN) its FCGI_STDIN record and the empty one.
+ *
+ * This is ap_fcgi_encoded_env_len() and ap_fcgi_encode_env() in a single
+ * pass, the length of each entry being computed only once.
+ */
+static void encode_request(request_rec *r, apr_pool_t *p,
+                           apr_uint16_t request_id, int keep_conn,
+                           apr_bucket_brigade *body,
+                           char **records, apr_size_t *records_len)
+{
+    const apr_array_header_t *envarr;
+    const apr_table_entry_t *elts;
+    ap_fcgi_begin_request_body brb;
+    apr_size_t *lens, total = 0, reclen, len;
+    apr_off_t body_len = 0;
+    char *buf, *itr, *rec = NULL;
+    int i, nrec = 0;
 
-        body = apr_palloc(temp_pool, required_len);
-        rv = ap_fcgi_encode_env(r, r->subprocess_env, body, required_len,
-                                &starting_elem);
-        /* we pre-compute, so we can't run out of space */
-        ap_assert(rv == APR_SUCCESS);
-        /* compute and encode must be in sync */
-        ap_assert(starting_elem == next_elem);
+    envarr = apr_table_elts(r->subprocess_env);
+    elts = (const apr_table_entry_t *) envarr->elts;
+
+    /* The key and value lengths of each entry, and the records they need */
+    lens = apr_palloc(p, (envarr->nelts + 1) * 2 * sizeof(apr_size_t));
+    reclen = FCGI_PARAMS_RECORD_LEN; /* no record yet */
+    for (i = 0; i < envarr->nelts; ++i) {
+        apr_size_t klen, vlen, elen;
+
+        if (!elts[i].key) {
+            lens[2 * i] = FCGI_ENV_SKIP;
+            continue;
+        }
+        klen = strlen(elts[i].key);
+        vlen = elts[i].val ? strlen(elts[i].val) : 0;
+        elen = ((klen >> 7) ? 4 : 1) + klen + ((vlen >> 7) ? 4 : 1) + vlen;
+        if (elen > FCGI_PARAMS_RECORD_LEN) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                          APLOGNO(02536) "couldn't encode envvar '%s' in %"
+                          APR_SIZE_T_FMT " bytes",
+                          elts[i].key, (apr_size_t)FCGI_PARAMS_RECORD_LEN);
+            /* skip this envvar and continue */
+            lens[2 * i] = FCGI_ENV_SKIP;
+            continue;
+        }
+        if (reclen + elen > FCGI_PARAMS_RECORD_LEN) {
+            ++nrec;
+            reclen = 0;
+        }
+        reclen += elen;
+        total += elen;
+        lens[2 * i] = klen;
+        lens[2 * i + 1] = vlen;
+    }
 
-        ap_fcgi_fill_in_header(&header, AP_FCGI_PARAMS, request_id,
-                               (apr_uint16_t)required_len, 0);
-        ap_fcgi_header_to_array(&header, farray);
+    len = 2 * AP_FCGI_HEADER_LEN /* FCGI_BEGIN_REQUEST */
+          + nrec * AP_FCGI_HEADER_LEN + total
+          + AP_FCGI_HEADER_LEN;  /* empty FCGI_PARAMS */
+    if (body) {
+        apr_brigade_length(body, 0, &body_len);
+        AP_DEBUG_ASSERT(body_len >= 0
+                        && body_len <= AP_FCGI_MAX_CONTENT_LEN);
+        if (body_len) {
+            len += AP_FCGI_HEADER_LEN + (apr_size_t)body_len;
+        }
+        len += AP_FCGI_HEADER_LEN; /* empty FCGI_STDIN */
+    }
+    itr = buf = apr_palloc(p, len);
 
-        vec[0].iov_base = (void *)farray;
-        vec[0].iov_len = sizeof(farray);
-        vec[1].iov_base = body;
-        vec[1].iov_len = required_len;
+    itr = put_record_header(itr, AP_FCGI_BEGIN_REQUEST, request_id,
+                            AP_FCGI_HEADER_LEN);
+    ap_fcgi_fill_in_request_body(&brb, AP_FCGI_RESPONDER,
+                                 keep_conn ? AP_FCGI_KEEP_CONN : 0);
+    ap_fcgi_begin_request_body_to_array(&brb, (unsigned char *)itr);
+    itr += AP_FCGI_HEADER_LEN;
 
-        rv = send_data(conn, vec, 2, &len);
-        apr_pool_clear(temp_pool);
+    reclen = FCGI_PARAMS_RECORD_LEN;
+    for (i = 0; i < envarr->nelts; ++i) {
+        apr_size_t klen = lens[2 * i], vlen, elen;
 
-        if (rv) {
-            return rv;
+        if (klen == FCGI_ENV_SKIP) {
+            continue;
         }
+        vlen = lens[2 * i + 1];
+        elen = ((klen >> 7) ? 4 : 1) + klen + ((vlen >> 7) ? 4 : 1) + vlen;
+        if (reclen + elen > FCGI_PARAMS_RECORD_LEN) {
+            /* the header of the previous record, now that it is complete */
+            if (rec) {
+                put_record_header(rec, AP_FCGI_PARAMS, request_id,
+                                  (apr_uint16_t)reclen);
+            }
+            rec = itr;
+            itr += AP_FCGI_HEADER_LEN;
+            reclen = 0;
+        }
+        itr = put_nv_len(itr, klen);
+        itr = put_nv_len(itr, vlen);
+        memcpy(itr, elts[i].key, klen);
+        itr += klen;
+        if (vlen) {
+            memcpy(itr, elts[i].val, vlen);
+            itr += vlen;
+        }
+        reclen += elen;
+    }
+    if (rec) {
+        put_record_header(rec, AP_FCGI_PARAMS, request_id,
+                          (apr_uint16_t)reclen);
     }
 
     /* Envvars sent, so say we're done */
-    ap_fcgi_fill_in_header(&header, AP_FCGI_PARAMS, request_id, 0, 0);
-    ap_fcgi_header_to_array(&header, farray);
+    itr = put_record_header(itr, AP_FCGI_PARAMS, request_id, 0);
 
-    vec[0].iov_base = (void *)farray;
-    vec[0].iov_len = sizeof(farray);
+    if (body) {
+        if (body_len) {
+            apr_size_t flat = (apr_size_t)body_len;
 
-    return send_data(conn, vec, 1, &len);
+            itr = put_record_header(itr, AP_FCGI_STDIN, request_id,
+                                    (apr_uint16_t)body_len);
+            apr_brigade_flatten(body, itr, &flat);
+            itr += flat;
+        }
+        /* signal EOF (empty FCGI_STDIN) */
+        itr = put_record_header(itr, AP_FCGI_STDIN, request_id, 0);
+    }
+    AP_DEBUG_ASSERT(itr == buf + len);
+
+    *records = buf;
+    *records_len = len;
 }
 
 enum {
@@ -593,16 +750,219 @@ static int handle_headers(request_rec *r, int *state,
     return 0;
 }
 
+/* The response to a request, as its FCGI_STDOUT records come */
+typedef struct {
+    request_rec *r;
+    proxy_dir_conf *conf;
+    apr_pool_t *setaside_pool;
+    apr_bucket_brigade *ob;
+    int header_state;
+    int seen_end_of_headers;
+    int ignore_body;
+    int script_error_status;
+    int has_responded;
+} fcgi_response_t;
+
+static void response_init(fcgi_response_t *resp, request_rec *r,
+                          proxy_dir_conf *conf, apr_pool_t *setaside_pool)
+{
+    memset(resp, 0, sizeof(*resp));
+    resp->r = r;
+    resp->conf = conf;
+    resp->setaside_pool = setaside_pool;
+    resp->ob = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    resp->header_state = HDR_STATE_READING_HEADERS;
+    resp->script_error_status = HTTP_OK;
+}
+
+/* Handle some (transient) FCGI_STDOUT data, *mayflush is set if some of
+ * the body was passed to the output filters */
+static apr_status_t response_stdout(fcgi_response_t *resp,
+                                    char *data, apr_size_t len,
+                                    int *mayflush, const char **err)
+{
+    request_rec *r = resp->r;
+    conn_rec *c = r->connection;
+    apr_bucket_brigade *ob = resp->ob;
+    apr_status_t rv;
+    apr_bucket *b;
+
+    b = apr_bucket_transient_create(data, len, c->bucket_alloc);
+
+    APR_BRIGADE_INSERT_TAIL(ob, b);
+
+    if (! resp->seen_end_of_headers) {
+        int st = handle_headers(r, &resp->header_state, data, len);
+
+        if (st == 1) {
+            int status;
+            resp->seen_end_of_headers = 1;
+
+            status = ap_scan_script_header_err_brigade_ex(r, ob,
+                NULL, APLOG_MODULE_INDEX);
+
+            /* FCGI has its own body framing mechanism which we don't
+             * match against any provided Content-Length, so let the
+             * core determine C-L vs T-E based on what's actually sent.
+             */
+            if (!apr_table_get(r->subprocess_env, AP_TRUST_CGILIKE_CL_ENVVAR))
+                apr_table_unset(r->headers_out, "Content-Length");
+            apr_table_unset(r->headers_out, "Transfer-Encoding");
+
+            /* suck in all the rest */
+            if (status != OK) {
+                apr_bucket *tmp_b;
+                apr_brigade_cleanup(ob);
+                tmp_b = apr_bucket_eos_create(c->bucket_alloc);
+                APR_BRIGADE_INSERT_TAIL(ob, tmp_b);
+
+                resp->has_responded = 1;
+                r->status = status;
+                rv = ap_pass_brigade(r->output_filters, ob);
+                if (rv != APR_SUCCESS) {
+                    *err = "passing headers brigade to output filters";
+                    return rv;
+                }
+                else if (status == HTTP_NOT_MODIFIED
+                         || status == HTTP_PRECONDITION_FAILED) {
+                    /* Special 'status' cases handled:
+                     * 1) HTTP 304 response MUST NOT contain
+                     *    a message-body, ignore it.
+                     * 2) HTTP 412 response.
+                     * The break is not added since there might
+                     * be more bytes to read from the FCGI
+                     * connection. Even if the message-body is
+                     * ignored (and the EOS bucket has already
+                     * been sent) we want to avoid subsequent
+                     * bogus reads. */
+                    resp->ignore_body = 1;
+                }
+                else {
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01070)
+                                    "Error parsing script headers");
+                    return APR_EINVAL;
+                }
+            }
+
+            if (ap_proxy_should_override(resp->conf, r->status)
+                    && ap_is_initial_req(r)) {
+                /*
+                 * set script_error_status to discard
+                 * everything after the headers
+                 */
+                resp->script_error_status = r->status;
+                /*
+                 * prevent ap_die() from treating this as a
+                 * recursive error, initially:
+                 */
+                r->status = HTTP_OK;
+            }
+
+            if (resp->script_error_status == HTTP_OK
+                && !APR_BRIGADE_EMPTY(ob) && !resp->ignore_body) {
+                /* Send the part of the body that we read while
+                 * reading the headers.
+                 */
+                resp->has_responded = 1;
+                rv = ap_pass_brigade(r->output_filters, ob);
+                if (rv != APR_SUCCESS) {
+                    *err = "passing brigade to output filters";
+                    return rv;
+                }
+                *mayflush = 1;
+            }
+            apr_brigade_cleanup(ob);
+
+            apr_pool_clear(resp->setaside_pool);
+        }
+        else {
+            /* We're still looking for the end of the
+             * headers, so this part of the data will need
+             * to persist. */
+            apr_bucket_setaside(b, resp->setaside_pool);
+        }
+    } else {
+        /* we've already passed along the headers, so now pass
+         * through the content.  we could simply continue to
+         * setaside the content and not pass until we see the
+         * 0 content-length (below, where we append the EOS),
+         * but that could be a huge amount of data; so we pass
+         * along smaller chunks
+         */
+        if (resp->script_error_status == HTTP_OK && !resp->ignore_body) {
+            resp->has_responded = 1;
+            rv = ap_pass_brigade(r->output_filters, ob);
+            if (rv != APR_SUCCESS) {
+                *err = "passing brigade to output filters";
+                return rv;
+            }
+            *mayflush = 1;
+        }
+        apr_brigade_cleanup(ob);
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Handle the empty FCGI_STDOUT record, end of the response */
+static apr_status_t response_stdout_end(fcgi_response_t *resp,
+                                        const char **err)
+{
+    request_rec *r = resp->r;
+    apr_status_t rv = APR_SUCCESS;
+
+    /* XXX what if we haven't seen end of the headers yet? */
+
+    if (resp->script_error_status == HTTP_OK) {
+        apr_bucket *b = apr_bucket_eos_create(r->connection->bucket_alloc);
+        APR_BRIGADE_INSERT_TAIL(resp->ob, b);
+
+        resp->has_responded = 1;
+        rv = ap_pass_brigade(r->output_filters, resp->ob);
+        if (rv != APR_SUCCESS) {
+            *err = "passing brigade to output filters";
+        }
+    }
+
+    /* XXX Why don't we cleanup here?  (logic from AJP) */
+    return rv;
+}
+
+static apr_status_t response_flush(fcgi_response_t *resp, const char **err)
+{
+    request_rec *r = resp->r;
+    apr_bucket* flush_b = apr_bucket_flush_create(r->connection->bucket_alloc);
+    apr_status_t rv;
+
+    APR_BRIGADE_INSERT_TAIL(resp->ob, flush_b);
+    rv = ap_pass_brigade(r->output_filters, resp->ob);
+    if (rv != APR_SUCCESS) {
+        *err = "passing headers brigade to output filters";
+    }
+    return rv;
+}
+
+/* Done with the response, send the ErrorDocument if overridden */
+static void response_finish(fcgi_response_t *resp)
+{
+    apr_brigade_destroy(resp->ob);
+
+    if (resp->script_error_status != HTTP_OK) {
+        ap_die(resp->script_error_status, resp->r); /* send ErrorDocument */
+        resp->has_responded = 1;
+    }
+}
+
 static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
                              request_rec *r, apr_pool_t *setaside_pool,
                              apr_uint16_t request_id, const char **err,
                              int *bad_request, int *has_responded,
                              apr_bucket_brigade *input_brigade)
 {
-    apr_bucket_brigade *ib, *ob;
-    int seen_end_of_headers = 0, done = 0, ignore_body = 0;
+    apr_bucket_brigade *ib;
+    fcgi_response_t resp;
+    int done = 0;
     apr_status_t rv = APR_SUCCESS;
-    int script_error_status = HTTP_OK;
     conn_rec *c = r->connection;
     struct iovec vec[2];
     ap_fcgi_header header;
@@ -610,7 +970,6 @@ static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
     apr_pollfd_t pfd;
     apr_pollfd_t *flushpoll = NULL;
     apr_int32_t flushpoll_fd;
-    int header_state = HDR_STATE_READING_HEADERS;
     char stack_iobuf[AP_IOBUFSIZE];
     apr_size_t iobuf_size = AP_IOBUFSIZE;
     char *iobuf = stack_iobuf;
@@ -638,7 +997,7 @@ static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
     }
 
     ib = apr_brigade_create(r->pool, c->bucket_alloc);
-    ob = apr_brigade_create(r->pool, c->bucket_alloc);
+    response_init(&resp, r, conf, setaside_pool);
 
     while (! done) {
         apr_interval_time_t timeout;
@@ -761,7 +1120,6 @@ static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
         if (pfd.rtnevents & APR_POLLIN) {
             apr_size_t readbuflen;
             apr_uint16_t clen, rid;
-            apr_bucket *b;
             unsigned char plen;
             unsigned char type, version;
             int mayflush = 0;
@@ -816,121 +1174,10 @@ recv_again:
             switch (type) {
             case AP_FCGI_STDOUT:
                 if (clen != 0) {
-                    b = apr_bucket_transient_create(iobuf,
-                                                    readbuflen,
-                                                    c->bucket_alloc);
-
-                    APR_BRIGADE_INSERT_TAIL(ob, b);
-
-                    if (! seen_end_of_headers) {
-                        int st = handle_headers(r, &header_state,
-                                                iobuf, readbuflen);
-
-                        if (st == 1) {
-                            int status;
-                            seen_end_of_headers = 1;
-
-                            status = ap_scan_script_header_err_brigade_ex(r, ob,
-                                NULL, APLOG_MODULE_INDEX);
-
-                            /* FCGI has its own body framing mechanism which we don't
-                             * match against any provided Content-Length, so let the
-                             * core determine C-L vs T-E based on what's actually sent.
-                             */
-                            if (!apr_table_get(r->subprocess_env, AP_TRUST_CGILIKE_CL_ENVVAR))
-                                apr_table_unset(r->headers_out, "Content-Length");
-                            apr_table_unset(r->headers_out, "Transfer-Encoding");
-
-                            /* suck in all the rest */
-                            if (status != OK) {
-                                apr_bucket *tmp_b;
-                                apr_brigade_cleanup(ob);
-                                tmp_b = apr_bucket_eos_create(c->bucket_alloc);
-                                APR_BRIGADE_INSERT_TAIL(ob, tmp_b);
-
-                                *has_responded = 1;
-                                r->status = status;
-                                rv = ap_pass_brigade(r->output_filters, ob);
-                                if (rv != APR_SUCCESS) {
-                                    *err = "passing headers brigade to output filters";
-                                    break;
-                                }
-                                else if (status == HTTP_NOT_MODIFIED
-                                         || status == HTTP_PRECONDITION_FAILED) {
-                                    /* Special 'status' cases handled:
-                                     * 1) HTTP 304 response MUST NOT contain
-                                     *    a message-body, ignore it.
-                                     * 2) HTTP 412 response.
-                                     * The break is not added since there might
-                                     * be more bytes to read from the FCGI
-                                     * connection. Even if the message-body is
-                                     * ignored (and the EOS bucket has already
-                                     * been sent) we want to avoid subsequent
-                                     * bogus reads. */
-                                    ignore_body = 1;
-                                }
-                                else {
-                                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01070)
-                                                    "Error parsing script headers");
-                                    rv = APR_EINVAL;
-                                    break;
-                                }
-                            }
-
-                            if (ap_proxy_should_override(conf, r->status) && ap_is_initial_req(r)) {
-                                /*
-                                 * set script_error_status to discard
-                                 * everything after the headers
-                                 */
-                                script_error_status = r->status;
-                                /*
-                                 * prevent ap_die() from treating this as a
-                                 * recursive error, initially:
-                                 */
-                                r->status = HTTP_OK;
-                            }
-
-                            if (script_error_status == HTTP_OK
-                                && !APR_BRIGADE_EMPTY(ob) && !ignore_body) {
-                                /* Send the part of the body that we read while
-                                 * reading the headers.
-                                 */
-                                *has_responded = 1;
-                                rv = ap_pass_brigade(r->output_filters, ob);
-                                if (rv != APR_SUCCESS) {
-                                    *err = "passing brigade to output filters";
-                                    break;
-                                }
-                                mayflush = 1;
-                            }
-                            apr_brigade_cleanup(ob);
-
-                            apr_pool_clear(setaside_pool);
-                        }
-                        else {
-                            /* We're still looking for the end of the
-                             * headers, so this part of the data will need
-                             * to persist. */
-                            apr_bucket_setaside(b, setaside_pool);
-                        }
-                    } else {
-                        /* we've already passed along the headers, so now pass
-                         * through the content.  we could simply continue to
-                         * setaside the content and not pass until we see the
-                         * 0 content-length (below, where we append the EOS),
-                         * but that could be a huge amount of data; so we pass
-                         * along smaller chunks
-                         */
-                        if (script_error_status == HTTP_OK && !ignore_body) {
-                            *has_responded = 1;
-                            rv = ap_pass_brigade(r->output_filters, ob);
-                            if (rv != APR_SUCCESS) {
-                                *err = "passing brigade to output filters";
-                                break;
-                            }
-                            mayflush = 1;
-                        }
-                        apr_brigade_cleanup(ob);
+                    rv = response_stdout(&resp, iobuf, readbuflen,
+                                         &mayflush, err);
+                    if (rv != APR_SUCCESS) {
+                        break;
                     }
 
                     /* If we didn't read all the data, go back and get the
@@ -940,21 +1187,7 @@ recv_again:
                         goto recv_again;
                     }
                 } else {
-                    /* XXX what if we haven't seen end of the headers yet? */
-
-                    if (script_error_status == HTTP_OK) {
-                        b = apr_bucket_eos_create(c->bucket_alloc);
-                        APR_BRIGADE_INSERT_TAIL(ob, b);
-
-                        *has_responded = 1;
-                        rv = ap_pass_brigade(r->output_filters, ob);
-                        if (rv != APR_SUCCESS) {
-                            *err = "passing brigade to output filters";
-                            break;
-                        }
-                    }
-
-                    /* XXX Why don't we cleanup here?  (logic from AJP) */
+                    rv = response_stdout_end(&resp, err);
                 }
                 break;
 
@@ -998,11 +1231,8 @@ recv_again:
                              ((conn->worker->s->flush_packets == flush_auto) && 
                               (apr_poll(flushpoll, 1, &flushpoll_fd,
                                conn->worker->s->flush_wait) == APR_TIMEUP)))) {
-                apr_bucket* flush_b = apr_bucket_flush_create(r->connection->bucket_alloc);
-                APR_BRIGADE_INSERT_TAIL(ob, flush_b);
-                rv = ap_pass_brigade(r->output_filters, ob);
+                rv = response_flush(&resp, err);
                 if (rv != APR_SUCCESS) {
-                    *err = "passing headers brigade to output filters";
                     break;
                 }
                 mayflush = 0;
@@ -1011,12 +1241,9 @@ recv_again:
     }
 
     apr_brigade_destroy(ib);
-    apr_brigade_destroy(ob);
 
-    if (script_error_status != HTTP_OK) {
-        ap_die(script_error_status, r); /* send ErrorDocument */
-        *has_responded = 1;
-    }
+    response_finish(&resp);
+    *has_responded = resp.has_responded;
 
     return rv;
 }
@@ -1033,34 +1260,49 @@ static int fcgi_do_request(apr_pool_t *p, request_rec *r,
                            apr_bucket_brigade *input_brigade)
 {
     /* Request IDs are arbitrary numbers that we assign to a
-     * single request. This would allow multiplex/pipelining of
-     * multiple requests to the same FastCGI connection, but
-     * we don't support that, and always use a value of '1' to
-     * keep things simple. */
+     * single request. This allows multiplex/pipelining of
+     * multiple requests to the same FastCGI connection, which
+     * is done on the shared connections only (ProxyFCGIMultiplex),
+     * so always use a value of '1' here to keep things simple. */
     apr_uint16_t request_id = 1;
     apr_status_t rv;
     apr_pool_t *temp_pool;
+    struct iovec vec;
+    char *records;
+    apr_size_t records_len, len;
     const char *err;
     int bad_request = 0,
         has_responded = 0;
-
-    /* Step 1: Send AP_FCGI_BEGIN_REQUEST */
-    rv = send_begin_request(conn, request_id);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01073)
-                      "Failed Writing Request to %s:", server_portstr);
-        conn->close = 1;
-        return HTTP_SERVICE_UNAVAILABLE;
-    }
+    fcgi_req_config_t *rconf = ap_get_module_config(r->request_config,
+                                                    &proxy_fcgi_module);
 
     apr_pool_create(&temp_pool, r->pool);
     apr_pool_tag(temp_pool, "proxy_fcgi_do_request");
 
-    /* Step 2: Send Environment via FCGI_PARAMS */
-    rv = send_environment(conn, r, temp_pool, request_id);
+    /* Step 1: Set up the Environment, unless done for a shared connection
+     * already (ProxyFCGIMultiplex) */
+    if (!rconf || !rconf->environment_set) {
+        rv = setup_environment(r);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01074)
+                          "Failed writing Environment to %s:", server_portstr);
+            conn->close = 1;
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+
+    /* Step 2: Send AP_FCGI_BEGIN_REQUEST and the Environment via
+     * FCGI_PARAMS, at once */
+    encode_request(r, temp_pool, request_id,
+                   ap_proxy_connection_reusable(conn), NULL,
+                   &records, &records_len);
+    vec.iov_base = records;
+    vec.iov_len = records_len;
+    rv = send_data(conn, &vec, 1, &len);
+    apr_pool_clear(temp_pool);
     if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01074)
-                      "Failed writing Environment to %s:", server_portstr);
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01073)
+                      "Failed Writing Request to %s:", server_portstr);
         conn->close = 1;
         return HTTP_SERVICE_UNAVAILABLE;
     }
@@ -1106,42 +1348,243 @@ static int fcgi_do_request(apr_pool_t *p, request_rec *r,
 
 #define MAX_MEM_SPOOL 16384
 
+#if APR_HAS_THREADS
+/* FCGI_STDOUT or FCGI_STDERR content read on a shared connection, for the
+ * request's thread to handle */
+typedef struct fcgi_mpx_chunk fcgi_mpx_chunk;
+struct fcgi_mpx_chunk {
+    fcgi_mpx_chunk *next;
+    unsigned char type;
+    apr_size_t len;
+    char data[1];
+};
+
+/* A request on a shared connection */
+struct fcgi_mpx_req {
+    request_rec *r;
+    fcgi_mpx_conn *mc;
+    const char *hostname;
+    apr_uint16_t request_id;
+    char *records;              /* encoded, to be sent by the driver */
+    apr_size_t records_len;
+    fcgi_response_t resp;
+    apr_status_t rv;
+    const char *err;
+    int submitted;
+    int cancel;                 /* client gone or timeout, to abort */
+    int aborted;                /* FCGI_ABORT_REQUEST sent */
+    int rejected;               /* not processed by the backend */
+    int timedout;               /* no response within the timeout */
+    int done;
+    apr_interval_time_t timeout;
+    apr_time_t last_activity;   /* of the request on the connection */
+    fcgi_mpx_chunk *out_first;  /* read by the driver, to handle */
+    fcgi_mpx_chunk *out_last;
+    apr_size_t out_queued;      /* not written yet */
+    apr_off_t out_received;     /* FCGI_STDOUT read so far */
+    int out_end;                /* empty FCGI_STDOUT read */
+    int out_failed;             /* writing to the client failed */
+};
+
+/* In place of a request aborted before the backend ended it, whose ID
+ * can't be given to another one until then */
+static fcgi_mpx_req mpx_aborted;
+
+/* Whether the request may use a connection shared with other requests */
+static int mpx_usable(proxy_worker *worker, const char *proxyname,
+                      apr_bucket_brigade *input_brigade)
+{
+    apr_off_t len = -1;
+
+    if (!mpx_backends || proxyname || PROXY_WORKER_IS_GENERIC(worker)
+        || !worker->s->is_address_reusable || worker->s->disablereuse) {
+        return 0;
+    }
+    /* the records of the request are sent at once, body included */
+    if (APR_BRIGADE_EMPTY(input_brigade)
+        || !APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(input_brigade))) {
+        return 0;
+    }
+    apr_brigade_length(input_brigade, 0, &len);
+    return len >= 0 && len <= AP_FCGI_MAX_CONTENT_LEN;
+}
+
+static void mpx_destroy(fcgi_mpx_conn *mc)
+{
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, mc->server, APLOGNO(10647)
+                 "FCGI: shared connection to %s closed",
+                 mc->p_conn->hostname);
+    mc->p_conn->close = 1;
+    ap_proxy_release_connection(FCGI_SCHEME, mc->p_conn, mc->server);
+    apr_pool_destroy(mc->pool);
+}
+
+static void mpx_forget(apr_array_header_t *list, fcgi_mpx_req *req)
+{
+    int i, n;
+
+    for (i = n = 0; i < list->nelts; ++i) {
+        fcgi_mpx_req *other = APR_ARRAY_IDX(list, i, fcgi_mpx_req *);
+        if (other != req) {
+            APR_ARRAY_IDX(list, n++, fcgi_mpx_req *) = other;
+        }
+    }
+    list->nelts = n;
+}
+
+/* Give the request a free ID on the connection it is attached to (so
+ * there is one); mpx_mutex held */
+static void mpx_reserve(fcgi_mpx_conn *mc, fcgi_mpx_req *req)
+{
+    int i;
+
+    for (i = 0; mc->reqs[i]; ++i)
+        ;
+    AP_DEBUG_ASSERT(i < mc->max_reqs);
+    mc->reqs[i] = req;
+    req->request_id = i + 1;
+    req->mc = mc;
+}
+
+/* Set the request ID in the records already encoded */
+static void mpx_set_request_id(fcgi_mpx_req *req)
+{
+    unsigned char *itr = (unsigned char *)req->records;
+    unsigned char *end = itr + req->records_len;
+
+    while (itr < end) {
+        itr[AP_FCGI_HDR_REQUEST_ID_B1_OFFSET] = (req->request_id >> 8) & 0xff;
+        itr[AP_FCGI_HDR_REQUEST_ID_B0_OFFSET] = req->request_id & 0xff;
+        itr += AP_FCGI_HEADER_LEN
+               + ((itr[AP_FCGI_HDR_CONTENT_LEN_B1_OFFSET] << 8)
+                  | itr[AP_FCGI_HDR_CONTENT_LEN_B0_OFFSET])
+               + itr[AP_FCGI_HDR_PADDING_LEN_OFFSET];
+    }
+}
+
+static const char *get_nv_len(const char *itr, const char *end,
+                              apr_size_t *len)
+{
+    const unsigned char *u = (const unsigned char *)itr;
+
+    if (itr >= end) {
+        return NULL;
+    }
+    if (!(u[0] & 0x80)) {
+        *len = u[0];
+        return itr + 1;
+    }
+    if (end - itr < 4) {
+        return NULL;
+    }
+    *len = ((apr_size_t)(u[0] & 0x7f) << 24) | ((apr_size_t)u[1] << 16)
+           | ((apr_size_t)u[2] << 8) | u[3];
+    return itr + 4;
+}
+
 /*
- * This handles fcgi:(dest) URLs
+ * Ask the backend whether it multiplexes connections (FCGI_MPXS_CONNS) and
+ * how many requests it handles at once (FCGI_MAX_REQS), with a
+ * FCGI_GET_VALUES record on a new connection.
  */
-static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
-                              proxy_server_conf *conf,
-                              char *url, const char *proxyname,
-                              apr_port_t proxyport)
+static apr_status_t mpx_probe(proxy_conn_rec *conn, request_rec *r,
+                              int *mpxs_conns, int *max_reqs)
 {
-    int status;
-    char server_portstr[32];
-    conn_rec *origin = NULL;
-    proxy_conn_rec *backend = NULL;
-    apr_bucket_brigade *input_brigade;
-    apr_off_t input_bytes = 0;
-    apr_uri_t *uri;
+    static const char names[] = "\x0f\x00" "FCGI_MPXS_CONNS"
+                                "\x0d\x00" "FCGI_MAX_REQS";
+    char buf[AP_FCGI_HEADER_LEN + sizeof(names) - 1];
+    unsigned char farray[AP_FCGI_HEADER_LEN];
+    unsigned char type, version, plen = 0;
+    apr_uint16_t rid, clen = 0;
+    apr_interval_time_t timeout;
+    const char *itr, *end;
+    char *content = NULL;
+    struct iovec vec;
+    apr_size_t len;
+    apr_status_t rv;
 
-    proxy_dir_conf *dconf = ap_get_module_config(r->per_dir_config,
-                                                 &proxy_module);
+    *mpxs_conns = 0;
+    *max_reqs = 0;
 
-    apr_pool_t *p = r->pool;
+    memcpy(put_record_header(buf, AP_FCGI_GET_VALUES, 0, sizeof(names) - 1),
+           names, sizeof(names) - 1);
+    vec.iov_base = buf;
+    vec.iov_len = sizeof(buf);
 
+    /* Some applications ignore management records */
+    apr_socket_timeout_get(conn->sock, &timeout);
+    apr_socket_timeout_set(conn->sock, FCGI_MPX_PROBE_TIMEOUT);
+    rv = send_data(conn, &vec, 1, &len);
+    if (rv == APR_SUCCESS) {
+        rv = get_data_full(conn, (char *)farray, AP_FCGI_HEADER_LEN);
+    }
+    if (rv == APR_SUCCESS) {
+        ap_fcgi_header_fields_from_array(&version, &type, &rid,
+                                         &clen, &plen, farray);
+        content = apr_palloc(r->pool, clen + plen + 1);
+        if (clen + plen) {
+            rv = get_data_full(conn, content, clen + plen);
+        }
+    }
+    apr_socket_timeout_set(conn->sock, timeout);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    if (version != AP_FCGI_VERSION_1 || type != AP_FCGI_GET_VALUES_RESULT
+        || rid != 0) {
+        /* FCGI_UNKNOWN_TYPE probably, nothing to expect */
+        return APR_SUCCESS;
+    }
 
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01076)
-                  "url: %s proxyname: %s proxyport: %d",
-                  url, proxyname, proxyport);
+    for (itr = content, end = content + clen; itr < end; ) {
+        apr_size_t nlen, vlen;
 
-    if (ap_cstr_casecmpn(url, "fcgi:", 5) != 0) {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01077) "declining URL %s", url);
-        return DECLINED;
+        if (!(itr = get_nv_len(itr, end, &nlen))
+            || !(itr = get_nv_len(itr, end, &vlen))
+            || (apr_size_t)(end - itr) < nlen + vlen) {
+            break;
+        }
+        if (nlen == 15 && !memcmp(itr, "FCGI_MPXS_CONNS", 15)) {
+            *mpxs_conns = (vlen == 1 && itr[nlen] == '1');
+        }
+        else if (nlen == 13 && !memcmp(itr, "FCGI_MAX_REQS", 13)) {
+            *max_reqs = atoi(apr_pstrmemdup(r->pool, itr + nlen, vlen));
+        }
+        itr += nlen + vlen;
     }
+    return APR_SUCCESS;
+}
 
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01078) "serving URL %s", url);
+/* A new connection to the backend of the worker */
+static int mpx_connect(request_rec *r, proxy_worker *worker,
+                       proxy_server_conf *conf, char *url,
+                       const char *proxyname, apr_port_t proxyport,
+                       proxy_conn_rec **p_conn)
+{
+    proxy_conn_rec *backend = NULL;
+    char server_portstr[32];
+    apr_uri_t *uri;
+    int status;
 
-    /* Create space for state information */
     status = ap_proxy_acquire_connection(FCGI_SCHEME, &backend, worker,
                                          r->server);
+    if (status == OK) {
+        backend->is_ssl = 0;
+        uri = apr_palloc(r->pool, sizeof(*uri));
+        status = ap_proxy_determine_connection(r->pool, r, conf, worker,
+                                               backend, uri, &url,
+                                               proxyname, proxyport,
+                                               server_portstr,
+                                               sizeof(server_portstr));
+    }
+    if (status == OK
+        && ap_proxy_connect_backend(FCGI_SCHEME, backend, worker,
+                                    r->server)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10648)
+                      "failed to make connection to backend: %s",
+                      backend->hostname);
+        status = HTTP_SERVICE_UNAVAILABLE;
+    }
     if (status != OK) {
         if (backend) {
             backend->close = 1;
@@ -1149,13 +1592,880 @@ static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
         }
         return status;
     }
+    *p_conn = backend;
+    return OK;
+}
 
-    backend->is_ssl = 0;
+/*
+ * Find a shared connection to the backend of the worker with room for one
+ * more request, or open a new one. Connections that failed, or idle for
+ * longer than the worker's ttl, are closed on the way. *fallback is set
+ * if the backend does not multiplex (or is being asked).
+ */
+static int mpx_attach(fcgi_mpx_req *req, proxy_worker *worker,
+                      proxy_server_conf *conf, char *url,
+                      const char *proxyname, apr_port_t proxyport,
+                      int *fallback)
+{
+    request_rec *r = req->r;
+    fcgi_mpx_backend *backend;
+    fcgi_mpx_conn *mc, **pmc, *expired, *dead;
+    proxy_conn_rec *p_conn = NULL;
+    apr_interval_time_t ttl;
+    apr_time_t now;
+    apr_pool_t *pool;
+    int status, probe = 0, mpxs_conns = 1, max_reqs = 0, checking;
+    apr_status_t rv;
 
-    /* Step One: Determine Who To Connect To */
-    uri = apr_palloc(p, sizeof(*uri));
+    ttl = (worker->s->ttl > 0) ? worker->s->ttl : FCGI_MPX_TTL;
+
+again:
+    now = apr_time_now();
+    expired = NULL;
+    checking = 0;
+    apr_thread_mutex_lock(mpx_mutex);
+    backend = apr_hash_get(mpx_backends, &worker, sizeof(worker));
+    if (!backend) {
+        backend = apr_pcalloc(mpx_pool, sizeof(*backend));
+        backend->worker = worker;
+        backend->mpxs_conns = -1;
+        apr_hash_set(mpx_backends, &backend->worker, sizeof(backend->worker),
+                     backend);
+    }
+    pmc = &backend->conns;
+    while ((mc = *pmc) != NULL) {
+        if (!mc->attached
+            && (mc->dead || now - mc->idle_since > ttl)) {
+            *pmc = mc->next;
+            mc->next = expired;
+            expired = mc;
+            continue;
+        }
+        if (!mc->dead && !mc->checking
+            && mc->attached + mc->stale < mc->max_reqs) {
+            /* the backend may have closed an idle one meanwhile, which is
+             * checked below, outside mpx_mutex and alone on it */
+            checking = mc->checking = !mc->attached;
+            ++mc->attached;
+            mpx_reserve(mc, req);
+            break;
+        }
+        pmc = &mc->next;
+    }
+    if (!mc) {
+        if (!backend->mpxs_conns || backend->probing) {
+            *fallback = 1;
+        }
+        else if (backend->mpxs_conns < 0) {
+            backend->probing = probe = 1;
+        }
+    }
+    apr_thread_mutex_unlock(mpx_mutex);
+
+    while (expired) {
+        fcgi_mpx_conn *next = expired->next;
+        mpx_destroy(expired);
+        expired = next;
+    }
+
+    if (checking) {
+        int connected = ap_proxy_is_socket_connected(mc->p_conn->sock);
+
+        dead = NULL;
+        apr_thread_mutex_lock(mpx_mutex);
+        mc->checking = 0;
+        if (!connected) {
+            mc->dead = 1;
+            dead = mpx_leave(req);
+        }
+        apr_thread_mutex_unlock(mpx_mutex);
+        if (!connected) {
+            if (dead) {
+                mpx_destroy(dead);
+            }
+            goto again;
+        }
+    }
+
+    if (mc || *fallback) {
+        return OK;
+    }
+
+    /* None available, open a new connection to the backend */
+    status = mpx_connect(r, worker, conf, url, proxyname, proxyport, &p_conn);
+    if (status == OK && probe) {
+        rv = mpx_probe(p_conn, r, &mpxs_conns, &max_reqs);
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(10649)
+                      "FCGI: backend %s: FCGI_MPXS_CONNS=%d, "
+                      "FCGI_MAX_REQS=%d", p_conn->hostname,
+                      mpxs_conns, max_reqs);
+    }
+    if (probe) {
+        apr_thread_mutex_lock(mpx_mutex);
+        backend->probing = 0;
+        if (status == OK) {
+            /* no answer counts as no */
+            backend->mpxs_conns = mpxs_conns;
+            backend->max_reqs = max_reqs;
+        }
+        apr_thread_mutex_unlock(mpx_mutex);
+    }
+    if (status != OK) {
+        return status;
+    }
+    if (!mpxs_conns) {
+        p_conn->close = 1;
+        ap_proxy_release_connection(FCGI_SCHEME, p_conn, r->server);
+        *fallback = 1;
+        return OK;
+    }
+
+    apr_pool_create(&pool, mpx_pool);
+    apr_pool_tag(pool, "proxy_fcgi_mpx");
+    mc = apr_pcalloc(pool, sizeof(*mc));
+    mc->pool = pool;
+    mc->backend = backend;
+    mc->server = r->server;
+    mc->p_conn = p_conn;
+    mc->pfd.desc_type = APR_POLL_SOCKET;
+    mc->pfd.desc.s = p_conn->sock;
+    mc->pfd.p = pool;
+    mc->pfd.reqevents = APR_POLLIN;
+    mc->iobuf_size = AP_IOBUFSIZE;
+    if (worker->s->io_buffer_size_set) {
+        mc->iobuf_size = worker->s->io_buffer_size;
+    }
+    mc->iobuf = apr_palloc(pool, mc->iobuf_size);
+    mc->reqs = apr_pcalloc(pool, FCGI_MPX_MAX_REQS * sizeof(fcgi_mpx_req *));
+    mc->pending = apr_array_make(pool, 10, sizeof(fcgi_mpx_req *));
+    mc->aborts = apr_array_make(pool, 10, sizeof(fcgi_mpx_req *));
+    mc->submitting = apr_array_make(pool, 10, sizeof(fcgi_mpx_req *));
+    mc->aborting = apr_array_make(pool, 10, sizeof(fcgi_mpx_req *));
+    mc->max_reqs = FCGI_MPX_MAX_REQS;
+    mc->attached = 1;
+    mc->last_io = mc->idle_since = now;
+    if (apr_thread_cond_create(&mc->cond, pool) != APR_SUCCESS) {
+        p_conn->close = 1;
+        ap_proxy_release_connection(FCGI_SCHEME, p_conn, r->server);
+        apr_pool_destroy(pool);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(10650)
+                  "FCGI: new shared connection to %s", p_conn->hostname);
+
+    apr_thread_mutex_lock(mpx_mutex);
+    if (backend->max_reqs > 0 && backend->max_reqs < mc->max_reqs) {
+        mc->max_reqs = backend->max_reqs;
+    }
+    mpx_reserve(mc, req);
+    mc->next = backend->conns;
+    backend->conns = mc;
+    apr_thread_mutex_unlock(mpx_mutex);
+    return OK;
+}
+
+/* Leave the connection, the request being done; mpx_mutex held */
+static fcgi_mpx_conn *mpx_leave(fcgi_mpx_req *req)
+{
+    fcgi_mpx_conn *mc = req->mc, **pmc;
+
+    if (mc->reqs[req->request_id - 1] == req) {
+        mc->reqs[req->request_id - 1] = NULL;
+    }
+    mpx_forget(mc->pending, req);
+    mpx_forget(mc->aborts, req);
+    if (mc->driver == req) {
+        mc->driver = NULL;
+        apr_thread_cond_broadcast(mc->cond);
+    }
+    req->mc = NULL;
+    mc->idle_since = apr_time_now();
+    if (--mc->attached > 0 || !mc->dead) {
+        return NULL;
+    }
+    /* nobody else to run it, close it */
+    for (pmc = &mc->backend->conns; *pmc; pmc = &(*pmc)->next) {
+        if (*pmc == mc) {
+            *pmc = mc->next;
+            break;
+        }
+    }
+    return mc;
+}
+
+static void mpx_detach(fcgi_mpx_req *req)
+{
+    fcgi_mpx_conn *dead;
+
+    apr_thread_mutex_lock(mpx_mutex);
+    dead = mpx_leave(req);
+    apr_thread_mutex_unlock(mpx_mutex);
+    if (dead) {
+        mpx_destroy(dead);
+    }
+}
+
+/* The connection failed: so do the requests submitted, the others may
+ * go to another connection; mpx_mutex held */
+static void mpx_fail(fcgi_mpx_conn *mc, apr_status_t rv, const char *err)
+{
+    int i;
+
+    mc->dead = 1;
+    for (i = 0; i < mc->max_reqs; ++i) {
+        fcgi_mpx_req *req = mc->reqs[i];
+
+        mc->reqs[i] = NULL;
+        if (!req || req == &mpx_aborted) {
+            continue;
+        }
+        if (!req->submitted) {
+            req->rejected = 1;
+        }
+        else if (req->rv == APR_SUCCESS) {
+            req->rv = rv;
+            req->err = err;
+        }
+        req->done = 1;
+    }
+    mc->stale = 0;
+    apr_array_clear(mc->pending);
+    apr_array_clear(mc->submitting);
+    apr_array_clear(mc->aborts);
+    apr_array_clear(mc->aborting);
+    apr_thread_cond_broadcast(mc->cond);
+}
+
+static apr_status_t mpx_send_abort(fcgi_mpx_conn *mc, fcgi_mpx_req *req)
+{
+    char buf[AP_FCGI_HEADER_LEN];
+    struct iovec vec;
+    apr_size_t len;
+
+    req->aborted = 1;
+    put_record_header(buf, AP_FCGI_ABORT_REQUEST, req->request_id, 0);
+    vec.iov_base = buf;
+    vec.iov_len = sizeof(buf);
+    return send_data(mc->p_conn, &vec, 1, &len);
+}
+
+/* Have the driver abort the request; mpx_mutex held */
+static void mpx_cancel(fcgi_mpx_conn *mc, fcgi_mpx_req *req)
+{
+    req->cancel = 1;
+    APR_ARRAY_PUSH(mc->aborts, fcgi_mpx_req *) = req;
+}
+
+/* Queue what the driver read for the request, for its thread to handle;
+ * by the driver, outside mpx_mutex */
+static void mpx_queue(fcgi_mpx_conn *mc, fcgi_mpx_req *req,
+                      unsigned char type, const char *data, apr_size_t len)
+{
+    fcgi_mpx_chunk *chunk;
+
+    chunk = ap_malloc(sizeof(*chunk) + len);
+    chunk->next = NULL;
+    chunk->type = type;
+    chunk->len = len;
+    memcpy(chunk->data, data, len);
+
+    apr_thread_mutex_lock(mpx_mutex);
+    if (type == AP_FCGI_STDOUT) {
+        req->out_received += len;
+    }
+    if (type == AP_FCGI_STDOUT && req->out_failed) {
+        /* nobody to write it */
+        free(chunk);
+    }
+    else {
+        if (req->out_last) {
+            req->out_last->next = chunk;
+        }
+        else {
+            req->out_first = chunk;
+        }
+        req->out_last = chunk;
+        req->out_queued += len;
+    }
+    req->last_activity = apr_time_now();
+    apr_thread_cond_broadcast(mc->cond);
+    apr_thread_mutex_unlock(mpx_mutex);
+}
+
+/* Read a record from the backend, for the request of its ID */
+static apr_status_t mpx_read_record(fcgi_mpx_conn *mc, const char **err)
+{
+    proxy_conn_rec *conn = mc->p_conn;
+    unsigned char farray[AP_FCGI_HEADER_LEN];
+    unsigned char type, version, plen;
+    unsigned char protocol_status = 0;
+    apr_uint16_t rid, clen;
+    apr_size_t offset = 0;
+    fcgi_mpx_req *req = NULL;
+    apr_status_t rv;
+
+    rv = get_data_full(conn, (char *)farray, AP_FCGI_HEADER_LEN);
+    if (rv != APR_SUCCESS) {
+        *err = "reading header";
+        return rv;
+    }
+    ap_fcgi_header_fields_from_array(&version, &type, &rid,
+                                     &clen, &plen, farray);
+    if (version != AP_FCGI_VERSION_1) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, mc->server, APLOGNO(10651)
+                     "FCGI: got bogus version %d from %s", (int)version,
+                     conn->hostname);
+        *err = "bogus version";
+        return APR_EINVAL;
+    }
+
+    if (rid && rid <= mc->max_reqs) {
+        apr_thread_mutex_lock(mpx_mutex);
+        req = mc->reqs[rid - 1];
+        if (req == &mpx_aborted) {
+            if (type == AP_FCGI_END_REQUEST) {
+                /* finally, the ID can be used again */
+                mc->reqs[rid - 1] = NULL;
+                --mc->stale;
+            }
+            req = NULL;
+        }
+        /* a stale ID otherwise */
+        else if (req && (!req->submitted || req->done)) {
+            req = NULL;
+        }
+        apr_thread_mutex_unlock(mpx_mutex);
+    }
+
+    while (clen) {
+        apr_size_t readlen = clen < mc->iobuf_size ? clen : mc->iobuf_size;
+
+        rv = get_data(conn, mc->iobuf, &readlen);
+        if (rv != APR_SUCCESS) {
+            *err = "reading response body";
+            return rv;
+        }
+        clen -= readlen;
+        if (!req) {
+            continue;
+        }
+
+        switch (type) {
+        case AP_FCGI_STDOUT:
+        case AP_FCGI_STDERR:
+            if (!req->aborted) {
+                mpx_queue(mc, req, type, mc->iobuf, readlen);
+            }
+            break;
+
+        case AP_FCGI_END_REQUEST:
+            if (offset <= 4 && 4 < offset + readlen) {
+                protocol_status = mc->iobuf[4 - offset];
+            }
+            break;
+        }
+        offset += readlen;
+    }
+    if (plen) {
+        rv = get_data_full(conn, mc->iobuf, plen);
+        if (rv != APR_SUCCESS) {
+            *err = "reading padding";
+            return rv;
+        }
+    }
+    if (!req) {
+        /* management record (rid 0) or stale, ignored */
+        return APR_SUCCESS;
+    }
+
+    if (type == AP_FCGI_STDOUT && !offset) {
+        apr_thread_mutex_lock(mpx_mutex);
+        req->out_end = 1;
+        apr_thread_cond_broadcast(mc->cond);
+        apr_thread_mutex_unlock(mpx_mutex);
+    }
+    else if (type == AP_FCGI_END_REQUEST) {
+        apr_thread_mutex_lock(mpx_mutex);
+        if ((protocol_status == FCGI_CANT_MPX_CONN
+             || protocol_status == FCGI_OVERLOADED)
+            && !req->out_received) {
+            req->rejected = 1;
+        }
+        if (protocol_status == FCGI_CANT_MPX_CONN) {
+            /* said otherwise, don't share anymore */
+            mc->backend->mpxs_conns = 0;
+            mc->dead = 1;
+        }
+        req->done = 1;
+        mc->reqs[rid - 1] = NULL;
+        apr_thread_cond_broadcast(mc->cond);
+        apr_thread_mutex_unlock(mpx_mutex);
+    }
+    return APR_SUCCESS;
+}
+
+/* The work of the driver, outside mpx_mutex. The records are only read
+ * if reading, *nread of them. */
+static apr_status_t mpx_process(fcgi_mpx_conn *mc, int reading, int *nread,
+                                const char **err)
+{
+    proxy_conn_rec *conn = mc->p_conn;
+    apr_status_t rv;
+    struct iovec vec;
+    apr_size_t len;
+    int i;
+
+    *nread = 0;
+    for (i = 0; i < mc->submitting->nelts; ++i) {
+        fcgi_mpx_req *req = APR_ARRAY_IDX(mc->submitting, i, fcgi_mpx_req *);
+
+        vec.iov_base = req->records;
+        vec.iov_len = req->records_len;
+        rv = send_data(conn, &vec, 1, &len);
+        if (rv != APR_SUCCESS) {
+            *err = "sending request";
+            return rv;
+        }
+        req->submitted = 1;
+    }
+    apr_array_clear(mc->submitting);
+
+    for (i = 0; i < mc->aborting->nelts; ++i) {
+        fcgi_mpx_req *req = APR_ARRAY_IDX(mc->aborting, i, fcgi_mpx_req *);
+
+        if (req->aborted || req->done) {
+            continue;
+        }
+        rv = mpx_send_abort(mc, req);
+        if (rv != APR_SUCCESS) {
+            *err = "sending abort";
+            return rv;
+        }
+        /* Done for us, whether the backend ends it or not; its ID is
+         * kept until then though */
+        apr_thread_mutex_lock(mpx_mutex);
+        if (mc->reqs[req->request_id - 1] == req) {
+            mc->reqs[req->request_id - 1] = &mpx_aborted;
+            ++mc->stale;
+        }
+        req->done = 1;
+        apr_thread_cond_broadcast(mc->cond);
+        apr_thread_mutex_unlock(mpx_mutex);
+    }
+    apr_array_clear(mc->aborting);
+
+    if (!reading) {
+        return APR_SUCCESS;
+    }
+    for (i = 0; i < FCGI_MPX_MAX_RECORDS; ++i) {
+        apr_int32_t n;
+
+        rv = apr_poll(&mc->pfd, 1, &n, i ? 0 : FCGI_MPX_POLL);
+        if (APR_STATUS_IS_TIMEUP(rv)) {
+            break;
+        }
+        if (rv != APR_SUCCESS) {
+            if (APR_STATUS_IS_EINTR(rv)) {
+                break;
+            }
+            *err = "polling";
+            return rv;
+        }
+        rv = mpx_read_record(mc, err);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        ++*nread;
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * Handle what the driver read for the request, on the request's thread,
+ * outside mpx_mutex. Returns the length handled, *mayflush being set if
+ * some of the body was passed to the output filters.
+ */
+static apr_size_t mpx_write(fcgi_mpx_req *req, fcgi_mpx_chunk *chunk,
+                            int *mayflush, apr_status_t *prv,
+                            const char **err)
+{
+    apr_size_t len = 0;
+
+    *prv = APR_SUCCESS;
+    while (chunk) {
+        fcgi_mpx_chunk *next = chunk->next;
+
+        len += chunk->len;
+        if (chunk->type == AP_FCGI_STDERR) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, req->r, APLOGNO(10652)
+                          "Got error '%.*s'", (int)chunk->len, chunk->data);
+        }
+        else if (*prv == APR_SUCCESS && !req->out_failed) {
+            *prv = response_stdout(&req->resp, chunk->data, chunk->len,
+                                   mayflush, err);
+        }
+        free(chunk);
+        chunk = next;
+    }
+    return len;
+}
+
+/* The driver reads again: the time the records were left unread, for a
+ * client to keep up, does not count against the timeouts; mpx_mutex held */
+static void mpx_unstall(fcgi_mpx_conn *mc, apr_time_t now)
+{
+    int i;
+
+    for (i = 0; i < mc->max_reqs; ++i) {
+        fcgi_mpx_req *req = mc->reqs[i];
+
+        if (req && req != &mpx_aborted) {
+            req->last_activity += now - ((req->last_activity > mc->stalled)
+                                         ? req->last_activity : mc->stalled);
+        }
+    }
+    mc->last_io += now - ((mc->last_io > mc->stalled) ? mc->last_io
+                                                      : mc->stalled);
+    mc->stalled = 0;
+}
+
+/*
+ * Have the request processed on the shared connection, either by the
+ * current driver or by becoming the driver, and write its response as it
+ * is read. In any case, only return when the request is done.
+ */
+static void mpx_run(fcgi_mpx_req *req)
+{
+    fcgi_mpx_conn *mc = req->mc, *dead;
+    proxy_worker *worker = mc->backend->worker;
+    apr_array_header_t *tmp;
+    const char *err = NULL;
+    apr_status_t rv;
+    int i, reading, nread;
+
+    apr_thread_mutex_lock(mpx_mutex);
+    req->last_activity = apr_time_now();
+    APR_ARRAY_PUSH(mc->pending, fcgi_mpx_req *) = req;
+
+    while (!req->done || req->out_first) {
+        if (req->out_first) {
+            fcgi_mpx_chunk *chunks = req->out_first;
+            int mayflush = 0;
+            apr_size_t len;
+
+            if (mc->driver == req) {
+                /* don't keep the others waiting while writing */
+                mc->driver = NULL;
+                apr_thread_cond_broadcast(mc->cond);
+            }
+            req->out_first = req->out_last = NULL;
+            apr_thread_mutex_unlock(mpx_mutex);
+
+            len = mpx_write(req, chunks, &mayflush, &rv, &err);
+
+            apr_thread_mutex_lock(mpx_mutex);
+            req->out_queued -= len;
+            apr_thread_cond_broadcast(mc->cond);
+            if (rv == APR_SUCCESS && mayflush && !req->out_first
+                && worker->s->flush_packets == flush_auto) {
+                /* as if polling the backend for more */
+                apr_thread_cond_timedwait(mc->cond, mpx_mutex,
+                                          worker->s->flush_wait);
+            }
+            if (rv == APR_SUCCESS && mayflush && !req->out_first
+                && worker->s->flush_packets != flush_off) {
+                apr_thread_mutex_unlock(mpx_mutex);
+                rv = response_flush(&req->resp, &err);
+                apr_thread_mutex_lock(mpx_mutex);
+            }
+            if (rv != APR_SUCCESS) {
+                if (req->rv == APR_SUCCESS) {
+                    req->rv = rv;
+                    req->err = err;
+                }
+                /* nothing more wanted for this one */
+                req->out_failed = 1;
+                if (!req->cancel && !req->done) {
+                    mpx_cancel(mc, req);
+                }
+            }
+            continue;
+        }
+        if (!req->cancel) {
+            if (req->r->connection->aborted) {
+                /* client gone, abort the request */
+                mpx_cancel(mc, req);
+            }
+            else if (req->timeout > 0 && !mc->stalled
+                     && apr_time_now() - req->last_activity > req->timeout) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, req->r,
+                              APLOGNO(10663) "FCGI: timeout on shared "
+                              "connection to %s", req->hostname);
+                req->timedout = 1;
+                if (req->rv == APR_SUCCESS) {
+                    req->rv = APR_TIMEUP;
+                    req->err = "timeout";
+                }
+                if (apr_time_now() - mc->last_io > req->timeout) {
+                    /* nothing from the backend either, no newcomers */
+                    mc->dead = 1;
+                }
+                mpx_cancel(mc, req);
+            }
+            if (req->cancel) {
+                /* not submitted yet, nothing to abort */
+                i = mc->pending->nelts;
+                mpx_forget(mc->pending, req);
+                if (i != mc->pending->nelts) {
+                    req->done = 1;
+                    continue;
+                }
+            }
+        }
+        if (mc->driver && mc->driver != req) {
+            apr_thread_cond_timedwait(mc->cond, mpx_mutex, FCGI_MPX_WAIT);
+            continue;
+        }
+
+        mc->driver = req;
+        tmp = mc->submitting;
+        mc->submitting = mc->pending;
+        mc->pending = tmp;
+        /* those done meanwhile may be gone already */
+        for (i = 0; i < mc->aborts->nelts; ++i) {
+            fcgi_mpx_req *other = APR_ARRAY_IDX(mc->aborts, i,
+                                                fcgi_mpx_req *);
+            if (!other->done) {
+                APR_ARRAY_PUSH(mc->aborting, fcgi_mpx_req *) = other;
+            }
+        }
+        apr_array_clear(mc->aborts);
+        /* don't read more while a client does not keep up */
+        reading = 1;
+        for (i = 0; i < mc->max_reqs; ++i) {
+            fcgi_mpx_req *other = mc->reqs[i];
+
+            if (other && other != &mpx_aborted
+                && other->out_queued >= FCGI_MPX_MAX_QUEUED) {
+                reading = 0;
+                break;
+            }
+        }
+        if (!reading) {
+            if (!mc->stalled) {
+                mc->stalled = apr_time_now();
+            }
+        }
+        else if (mc->stalled) {
+            mpx_unstall(mc, apr_time_now());
+        }
+        apr_thread_mutex_unlock(mpx_mutex);
+
+        rv = mpx_process(mc, reading, &nread, &err);
+
+        apr_thread_mutex_lock(mpx_mutex);
+        if (nread) {
+            mc->last_io = apr_time_now();
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, req->r, APLOGNO(10653)
+                          "FCGI: end of shared connection to %s (%s)",
+                          req->hostname, err);
+            mpx_fail(mc, rv, err);
+        }
+        else if (!reading && !req->done && !req->out_first) {
+            /* until some output is written */
+            apr_thread_cond_timedwait(mc->cond, mpx_mutex, FCGI_MPX_POLL);
+        }
+    }
+
+    dead = mpx_leave(req);
+    apr_thread_mutex_unlock(mpx_mutex);
+    if (dead) {
+        mpx_destroy(dead);
+    }
+}
+
+/*
+ * Process the request on a shared connection and write the response, or
+ * set *fallback for the request to go the usual way.
+ */
+static int mpx_do_request(request_rec *r, proxy_worker *worker,
+                          proxy_server_conf *conf, proxy_dir_conf *dconf,
+                          char *url, const char *proxyname,
+                          apr_port_t proxyport,
+                          apr_bucket_brigade *input_brigade, int *fallback)
+{
+    fcgi_req_config_t *rconf;
+    fcgi_mpx_req *req;
+    apr_pool_t *setaside_pool;
+    apr_status_t rv;
+    int status, retried = 0;
+
+    req = apr_pcalloc(r->pool, sizeof(*req));
+    req->r = r;
+    if (worker->s->timeout_set) {
+        req->timeout = worker->s->timeout;
+    }
+    else if (conf->timeout_set) {
+        req->timeout = conf->timeout;
+    }
+    else {
+        req->timeout = r->server->timeout;
+    }
+
+    status = mpx_attach(req, worker, conf, url, proxyname, proxyport,
+                        fallback);
+    if (status != OK || *fallback) {
+        return status;
+    }
+    req->hostname = apr_pstrdup(r->pool, req->mc->p_conn->hostname);
+
+    rconf = ap_get_module_config(r->request_config, &proxy_fcgi_module);
+    if (rconf == NULL) {
+        rconf = apr_pcalloc(r->pool, sizeof(fcgi_req_config_t));
+        ap_set_module_config(r->request_config, &proxy_fcgi_module, rconf);
+    }
+    if (!rconf->environment_set) {
+        rv = setup_environment(r);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(10654)
+                          "Failed setting up Environment for %s",
+                          req->hostname);
+            mpx_detach(req);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+        rconf->environment_set = 1;
+    }
+    encode_request(r, r->pool, req->request_id, 1, input_brigade,
+                   &req->records, &req->records_len);
+
+    apr_pool_create(&setaside_pool, r->pool);
+    apr_pool_tag(setaside_pool, "proxy_fcgi_do_request");
+    response_init(&req->resp, r, dconf, setaside_pool);
+
+    for (;;) {
+        mpx_run(req);
+        if (!req->rejected || retried++) {
+            break;
+        }
+
+        /* Not processed by the backend, once more on another connection,
+         * the environment is set up already */
+        req->submitted = req->cancel = req->aborted = 0;
+        req->rejected = req->timedout = req->done = 0;
+        req->out_received = 0;
+        req->out_end = req->out_failed = 0;
+        apr_brigade_destroy(req->resp.ob);
+        response_init(&req->resp, r, dconf, setaside_pool);
+        status = mpx_attach(req, worker, conf, url, proxyname, proxyport,
+                            fallback);
+        if (*fallback) {
+            /* the backend does not multiplex after all, the usual way
+             * then (without setting up the environment again) */
+            apr_brigade_destroy(req->resp.ob);
+            return status;
+        }
+        if (status != OK) {
+            req->rejected = 1;
+            break;
+        }
+        mpx_set_request_id(req);
+    }
+
+    if (req->out_end && !req->out_failed && req->rv == APR_SUCCESS) {
+        req->rv = response_stdout_end(&req->resp, &req->err);
+    }
+    response_finish(&req->resp);
+
+    if (req->rejected) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(10655)
+                      "Request not processed by %s", req->hostname);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    if (req->rv != APR_SUCCESS) {
+        /* If the client aborted the connection during retrieval or
+         * (partially) sending the response, this is not a backend problem */
+        if (r->connection->aborted) {
+            ap_log_rerror(APLOG_MARK, APLOG_TRACE1, req->rv, r,
+                          "The client aborted the connection.");
+            return OK;
+        }
+
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, req->rv, r, APLOGNO(10656)
+                      "Error dispatching request to %s: %s%s%s",
+                      req->hostname,
+                      req->err ? "(" : "",
+                      req->err ? req->err : "",
+                      req->err ? ")" : "");
+        if (req->timedout) {
+            apr_table_setn(r->notes, "proxy_timedout", "1");
+        }
+        if (req->resp.has_responded) {
+            return AP_FILTER_ERROR;
+        }
+        if (APR_STATUS_IS_TIMEUP(req->rv)) {
+            return HTTP_GATEWAY_TIME_OUT;
+        }
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    return OK;
+}
+#endif /* APR_HAS_THREADS */
+
+/*
+ * This handles fcgi:(dest) URLs
+ */
+static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
+                              proxy_server_conf *conf,
+                              char *url, const char *proxyname,
+                              apr_port_t proxyport)
+{
+    int status;
+    char server_portstr[32];
+    conn_rec *origin = NULL;
+    proxy_conn_rec *backend = NULL;
+    apr_bucket_brigade *input_brigade;
+    apr_off_t input_bytes = 0;
+    apr_uri_t *uri;
+    char *locurl = url;
+
+    proxy_dir_conf *dconf = ap_get_module_config(r->per_dir_config,
+                                                 &proxy_module);
+
+    apr_pool_t *p = r->pool;
+
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01076)
+                  "url: %s proxyname: %s proxyport: %d",
+                  url, proxyname, proxyport);
+
+    if (ap_cstr_casecmpn(url, "fcgi:", 5) != 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01077) "declining URL %s", url);
+        return DECLINED;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01078) "serving URL %s", url);
+
+    /* Create space for state information */
+    status = ap_proxy_acquire_connection(FCGI_SCHEME, &backend, worker,
+                                         r->server);
+    if (status != OK) {
+        if (backend) {
+            backend->close = 1;
+            ap_proxy_release_connection(FCGI_SCHEME, backend, r->server);
+        }
+        return status;
+    }
+
+    backend->is_ssl = 0;
+
+    /* Step One: Determine Who To Connect To */
+    uri = apr_palloc(p, sizeof(*uri));
     status = ap_proxy_determine_connection(p, r, conf, worker, backend,
-                                           uri, &url, proxyname, proxyport,
+                                           uri, &locurl, proxyname, proxyport,
                                            server_portstr,
                                            sizeof(server_portstr));
     if (status != OK) {
@@ -1257,6 +2567,42 @@ static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
         }
     }
 
+#if APR_HAS_THREADS
+    if (mpx_usable(worker, proxyname, input_brigade)) {
+        int fallback = 0;
+
+        /* The shared connections are acquired on their own */
+        ap_proxy_release_connection(FCGI_SCHEME, backend, r->server);
+        backend = NULL;
+
+        status = mpx_do_request(r, worker, conf, dconf, url, proxyname,
+                                proxyport, input_brigade, &fallback);
+        if (!fallback) {
+            return status;
+        }
+
+        /* Not multiplexed, go the usual way */
+        status = ap_proxy_acquire_connection(FCGI_SCHEME, &backend, worker,
+                                             r->server);
+        if (status != OK) {
+            if (backend) {
+                backend->close = 1;
+                ap_proxy_release_connection(FCGI_SCHEME, backend, r->server);
+            }
+            return status;
+        }
+        backend->is_ssl = 0;
+        locurl = url;
+        status = ap_proxy_determine_connection(p, r, conf, worker, backend,
+                                               uri, &locurl, proxyname,
+                                               proxyport, server_portstr,
+                                               sizeof(server_portstr));
+        if (status != OK) {
+            goto cleanup;
+        }
+    }
+#endif
+
     /* This scheme handler does not reuse connections by default, to
      * avoid tying up a fastcgi that isn't expecting to work on
      * parallel requests.  But if the user went out of their way to
@@ -1280,7 +2626,7 @@ static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
     }
 
     /* Step Three: Process the Request */
-    status = fcgi_do_request(p, r, backend, origin, dconf, uri, url,
+    status = fcgi_do_request(p, r, backend, origin, dconf, uri, locurl,
                              server_portstr, input_brigade);
 
 cleanup:
@@ -1382,10 +2728,77 @@ static const char *cmd_setenv(cmd_parms *cmd, void *in_dconf,
 
     return NULL;
 }
+
+static const char *cmd_multiplex(cmd_parms *cmd, void *dummy, int flag)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+    fcgi_multiplex = flag;
+    return NULL;
+}
+
+static int proxy_fcgi_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                 apr_pool_t *ptemp)
+{
+    fcgi_multiplex = 0;
+    return OK;
+}
+
+static void proxy_fcgi_child_init(apr_pool_t *pchild, server_rec *s)
+{
+#if APR_HAS_THREADS
+    apr_allocator_t *allocator;
+    apr_thread_mutex_t *mutex;
+    apr_status_t rv;
+    int threaded = 0;
+
+    mpx_backends = NULL;
+    if (!fcgi_multiplex) {
+        return;
+    }
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS
+        || threaded == AP_MPMQ_NOT_SUPPORTED) {
+        /* one request at a time, nothing to share */
+        return;
+    }
+
+    /* Connections are opened and closed by any thread */
+    rv = apr_allocator_create(&allocator);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, pchild);
+        if (rv == APR_SUCCESS) {
+            apr_allocator_mutex_set(allocator, mutex);
+            apr_allocator_max_free_set(allocator, ap_max_mem_free);
+            rv = apr_pool_create_ex(&mpx_pool, pchild, NULL, allocator);
+        }
+        if (rv == APR_SUCCESS) {
+            apr_allocator_owner_set(allocator, mpx_pool);
+            apr_pool_tag(mpx_pool, "proxy_fcgi_mpx");
+            rv = apr_thread_mutex_create(&mpx_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                         mpx_pool);
+        }
+        else {
+            apr_allocator_destroy(allocator);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10657)
+                     "FCGI: could not set up shared connections, "
+                     "ProxyFCGIMultiplex disabled");
+        return;
+    }
+    mpx_backends = apr_hash_make(mpx_pool);
+#endif
+}
+
 static void register_hooks(apr_pool_t *p)
 {
     proxy_hook_scheme_handler(proxy_fcgi_handler, NULL, NULL, APR_HOOK_FIRST);
     proxy_hook_canon_handler(proxy_fcgi_canon, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_pre_config(proxy_fcgi_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(proxy_fcgi_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 static const command_rec command_table[] = {
@@ -1393,6 +2806,9 @@ static const command_rec command_table[] = {
                   "Specify the type of FastCGI server: 'Generic', 'FPM'"),
     AP_INIT_TAKE23("ProxyFCGISetEnvIf", cmd_setenv, NULL, OR_FILEINFO,
                   "expr-condition env-name expr-value"),
+    AP_INIT_FLAG("ProxyFCGIMultiplex", cmd_multiplex, NULL, RSRC_CONF,
+                 "on to share the connections with the FastCGI backends "
+                 "which multiplex requests (FCGI_MPXS_CONNS), off by default"),
     { NULL }
 };
 
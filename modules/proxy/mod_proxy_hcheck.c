@@ -14,19 +14,35 @@
  * limitations under the License.
  */
 #include "mod_proxy.h"
+#include "proxy_util.h"
 #include "mod_watchdog.h"
 #include "ap_slotmem.h"
 #include "ap_expr.h"
 #if APR_HAS_THREADS
 #include "apr_thread_pool.h"
 #endif
+#include "apr_poll.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
 #include "http_ssl.h"
 
+#if APR_HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
 module AP_MODULE_DECLARE_DATA proxy_hcheck_module;
 
 #define HCHECK_WATHCHDOG_NAME ("_proxy_hcheck_")
 #define HC_THREADPOOL_SIZE (16)
 
+/* Asynchronous checks: in flight at most, and size of the response kept */
+#define HC_ASYNC_MAX_CHECKS (1024)
+#define HC_ASYNC_MAX_RESPONSE (64 * 1024)
+
+/* Latency of the last check of each worker, in shared memory */
+#define HC_LATENCY_SLOTS (1024)
+#define HC_LATENCY_PROBES (16)
+
 /* Why? So we can easily set/clear HC_USE_THREADS during dev testing */
 #if APR_HAS_THREADS
 #ifndef HC_USE_THREADS
@@ -66,6 +82,10 @@ typedef struct {
     const char *req;    /* pre-formatted HTTP/AJP request */
     proxy_worker *w;    /* Pointer to the actual worker */
     const char *protocol; /* HTTP 1.0 or 1.1? */
+    apr_interval_time_t jitter; /* added to the interval of the next check */
+    apr_pool_t *cpool;  /* of the kept alive connection (async checks) */
+    apr_socket_t *sock; /* kept alive connection (async checks) */
+    apr_sockaddr_t *addr; /* if the worker's address is reusable */
 } wctx_t;
 
 typedef struct {
@@ -77,6 +97,36 @@ typedef struct {
     apr_time_t *now;
 } baton_t;
 
+/* An asynchronous check in flight */
+typedef struct hc_async_t hc_async_t;
+struct hc_async_t {
+    baton_t *baton;
+    wctx_t *wctx;
+    apr_pollfd_t pfd;
+    enum {
+        HC_ASYNC_CONNECT,
+        HC_ASYNC_WRITE,
+        HC_ASYNC_READ
+    } state;
+    unsigned int reused:1;      /* on a kept alive connection */
+    unsigned int keepalive:1;   /* connection reusable after the check */
+    const char *out;            /* request left to send */
+    apr_size_t outlen;
+    char *buf;                  /* response read so far */
+    apr_size_t len;
+    apr_sockaddr_t *addr;       /* resolved before the check is started */
+    apr_status_t status;        /* of the resolution */
+    apr_time_t start;
+    apr_time_t deadline;
+    hc_async_t *prev, *next;
+};
+
+typedef struct {
+    proxy_worker_slot key;
+    apr_uint32_t latency;   /* usecs */
+    apr_uint32_t checks;
+} hc_latency_slot;
+
 static APR_OPTIONAL_FN_TYPE(ajp_handle_cping_cpong) *ajp_handle_cping_cpong = NULL;
 
 static void *hc_create_config(apr_pool_t *p, server_rec *s)
@@ -96,6 +146,19 @@ static ap_watchdog_t *watchdog;
 static apr_thread_pool_t *hctp;
 static int tpsize;
 #endif
+static int hc_async;
+static apr_pollset_t *hc_pollset;
+static sctx_t *hc_pollset_ctx;
+static hc_async_t *hc_inflight;
+static apr_uint32_t hc_ninflight;   /* started, or handed over to start */
+#if HC_USE_THREADS
+static apr_thread_t *hc_poller;     /* runs the pollset */
+static apr_thread_mutex_t *hc_async_mutex;
+static hc_async_t *hc_starting;     /* handed over to the poller */
+static apr_uint32_t hc_poller_stop;
+#endif
+static apr_shm_t *hc_latency_shm;
+static hc_latency_slot *hc_latency_table;
 
 /*
  * This serves double duty by not only validating (and creating)
@@ -336,6 +399,16 @@ static const char *set_hc_tpsize (cmd_parms *cmd, void *dummy, const char *arg)
 }
 #endif
 
+static const char *set_hc_async(cmd_parms *cmd, void *dummy, int flag)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err)
+        return err;
+
+    hc_async = flag;
+    return NULL;
+}
+
 /*
  * Create a dummy request rec, simply so we can use ap_expr.
  * Use our short-lived pool for bucket_alloc so that we can simply move
@@ -724,19 +797,9 @@ static int hc_send(request_rec *r, const char *out, apr_bucket_brigade *bb)
     return (rv) ? !OK : OK;
 }
 
-static int hc_read_headers(request_rec *r)
+/* The status line of the response, see ap_proxy_http_process_response() */
+static int hc_parse_status_line(request_rec *r, char *buffer)
 {
-    char buffer[HUGE_STRING_LEN];
-    int len;
-    const char *ct;
-
-    len = ap_getline(buffer, sizeof(buffer), r, 1);
-    if (len <= 0) {
-        return !OK;
-    }
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, APLOGNO(03254)
-                 "%.*s", len, buffer);
-    /* for the below, see ap_proxy_http_process_response() */
     if (apr_date_checkmask(buffer, "HTTP/#.# ###*")) {
         int major;
         char keepchar;
@@ -744,7 +807,7 @@ static int hc_read_headers(request_rec *r)
         const char *proxy_status_line = NULL;
 
         major = buffer[5] - '0';
-        if ((major != 1) || (len >= sizeof(buffer)-1)) {
+        if (major != 1) {
             return !OK;
         }
 
@@ -760,25 +823,51 @@ static int hc_read_headers(request_rec *r)
         proxy_status_line = apr_pstrdup(r->pool, &buffer[9]);
         r->status = proxy_status;
         r->status_line = proxy_status_line;
-    } else {
+        return OK;
+    }
+    return !OK;
+}
+
+static int hc_parse_header_line(request_rec *r, char *buffer)
+{
+    char *value, *end;
+
+    if (!(value = strchr(buffer, ':'))) {
+        return !OK;
+    }
+    *value = '\0';
+    ++value;
+    while (apr_isspace(*value))
+        ++value;            /* Skip to start of value   */
+    for (end = &value[strlen(value)-1]; end > value && apr_isspace(*end); --end)
+        *end = '\0';
+    apr_table_add(r->headers_out, buffer, value);
+    return OK;
+}
+
+static int hc_read_headers(request_rec *r)
+{
+    char buffer[HUGE_STRING_LEN];
+    int len;
+    const char *ct;
+
+    len = ap_getline(buffer, sizeof(buffer), r, 1);
+    if (len <= 0) {
+        return !OK;
+    }
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, APLOGNO(03254)
+                 "%.*s", len, buffer);
+    if ((len >= sizeof(buffer)-1) || hc_parse_status_line(r, buffer) != OK) {
         return !OK;
     }
 
     /* OK, 1st line is OK... scarf in the headers */
     while ((len = ap_getline(buffer, sizeof(buffer), r, 1)) > 0) {
-        char *value, *end;
         ap_log_error(APLOG_MARK, APLOG_TRACE7, 0, r->server, "%.*s",
                      len, buffer);
-        if (!(value = strchr(buffer, ':'))) {
+        if (hc_parse_header_line(r, buffer) != OK) {
             return !OK;
         }
-        *value = '\0';
-        ++value;
-        while (apr_isspace(*value))
-            ++value;            /* Skip to start of value   */
-        for (end = &value[strlen(value)-1]; end > value && apr_isspace(*end); --end)
-            *end = '\0';
-        apr_table_add(r->headers_out, buffer, value);
     }
 
     /* Set the Content-Type for the request if set */
@@ -829,11 +918,49 @@ static int hc_read_body(request_rec *r, apr_bucket_brigade *bb)
     return (rv == APR_SUCCESS ? OK : !OK);
 }
 
+/*
+ * If we have Conditions, then apply those to the response,
+ * otherwise any status code 2xx or 3xx is considered "passing"
+ */
+static int hc_eval_response(baton_t *baton, request_rec *r)
+{
+    int status = OK;
+    sctx_t *ctx = baton->ctx;
+    proxy_worker *hc = baton->hc;
+    proxy_worker *worker = baton->worker;
+    hc_condition_t *cond;
+
+    if (*worker->s->hcexpr &&
+            (cond = (hc_condition_t *)apr_table_get(ctx->conditions, worker->s->hcexpr)) != NULL) {
+        const char *err;
+        int ok = ap_expr_exec(r, cond->pexpr, &err);
+        if (ok > 0) {
+            ap_log_error(APLOG_MARK, APLOG_TRACE2, 0, ctx->s,
+                         "Condition %s for %s (%s): passed", worker->s->hcexpr,
+                         hc->s->name, worker->s->name);
+        } else if (ok < 0 || err) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, ctx->s, APLOGNO(03301)
+                         "Error on checking condition %s for %s (%s): %s", worker->s->hcexpr,
+                         hc->s->name, worker->s->name, err);
+            status = !OK;
+        } else {
+            ap_log_error(APLOG_MARK, APLOG_TRACE2, 0, ctx->s,
+                         "Condition %s for %s (%s) : failed", worker->s->hcexpr,
+                         hc->s->name, worker->s->name);
+            status = !OK;
+        }
+    } else if (r->status < 200 || r->status > 399) {
+        ap_log_error(APLOG_MARK, APLOG_TRACE2, 0, ctx->s,
+                     "Response status %i for %s (%s): failed", r->status,
+                     hc->s->name, worker->s->name);
+        status = !OK;
+    }
+    return status;
+}
+
 /*
  * Send the HTTP OPTIONS, HEAD or GET request to the backend
- * server associated w/ worker. If we have Conditions,
- * then apply those to the resulting response, otherwise
- * any status code 2xx or 3xx is considered "passing"
+ * server associated w/ worker, and evaluate the response.
  */
 static apr_status_t hc_check_http(baton_t *baton, apr_thread_t *thread)
 {
@@ -841,11 +968,9 @@ static apr_status_t hc_check_http(baton_t *baton, apr_thread_t *thread)
     proxy_conn_rec *backend = NULL;
     sctx_t *ctx = baton->ctx;
     proxy_worker *hc = baton->hc;
-    proxy_worker *worker = baton->worker;
     apr_pool_t *ptemp = baton->ptemp;
     request_rec *r;
     wctx_t *wctx;
-    hc_condition_t *cond;
     apr_bucket_brigade *bb;
 
     wctx = (wctx_t *)hc->context;
@@ -887,58 +1012,48 @@ static apr_status_t hc_check_http(baton_t *baton, apr_thread_t *thread)
         r->trailers_out = apr_table_copy(r->pool, r->trailers_in);
     }
 
-    if (*worker->s->hcexpr &&
-            (cond = (hc_condition_t *)apr_table_get(ctx->conditions, worker->s->hcexpr)) != NULL) {
-        const char *err;
-        int ok = ap_expr_exec(r, cond->pexpr, &err);
-        if (ok > 0) {
-            ap_log_error(APLOG_MARK, APLOG_TRACE2, 0, ctx->s,
-                         "Condition %s for %s (%s): passed", worker->s->hcexpr,
-                         hc->s->name, worker->s->name);
-        } else if (ok < 0 || err) {
-            ap_log_error(APLOG_MARK, APLOG_INFO, 0, ctx->s, APLOGNO(03301)
-                         "Error on checking condition %s for %s (%s): %s", worker->s->hcexpr,
-                         hc->s->name, worker->s->name, err);
-            status = !OK;
-        } else {
-            ap_log_error(APLOG_MARK, APLOG_TRACE2, 0, ctx->s,
-                         "Condition %s for %s (%s) : failed", worker->s->hcexpr,
-                         hc->s->name, worker->s->name);
-            status = !OK;
-        }
-    } else if (r->status < 200 || r->status > 399) {
-        ap_log_error(APLOG_MARK, APLOG_TRACE2, 0, ctx->s,
-                     "Response status %i for %s (%s): failed", r->status,
-                     hc->s->name, worker->s->name);
-        status = !OK;
-    }
+    status = hc_eval_response(baton, r);
     return backend_cleanup("HCOH", backend, ctx->s, status);
 }
 
-static void * APR_THREAD_FUNC hc_check(apr_thread_t *thread, void *b)
+/* The worker's slot, claimed if needed, or NULL if the table is full */
+static hc_latency_slot *hc_latency_get(proxy_worker *worker)
 {
-    baton_t *baton = (baton_t *)b;
-    server_rec *s = baton->ctx->s;
-    proxy_worker *worker = baton->worker;
-    proxy_worker *hc = baton->hc;
-    apr_time_t now;
-    apr_status_t rv;
+    return ap_proxy_worker_slot_get(worker, hc_latency_table,
+                                    sizeof(hc_latency_slot),
+                                    HC_LATENCY_SLOTS, HC_LATENCY_PROBES);
+}
 
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(03256)
-                 "%sHealth checking %s", (thread ? "Threaded " : ""),
-                 worker->s->name);
+/* Latency of the last health check of the worker, or -1 if none yet */
+static apr_interval_time_t hc_get_latency(proxy_worker *worker)
+{
+    hc_latency_slot *slot = hc_latency_get(worker);
 
-    if (hc->s->method == TCP) {
-        rv = hc_check_tcp(baton);
-    }
-    else if (hc->s->method == CPING) {
-        rv = hc_check_cping(baton, thread);
-    }
-    else {
-        rv = hc_check_http(baton, thread);
+    if (!slot || !apr_atomic_read32(&slot->checks)) {
+        return -1;
     }
+    return apr_atomic_read32(&slot->latency);
+}
+
+static apr_interval_time_t hc_get_jitter(sctx_t *ctx, proxy_worker *worker)
+{
+    proxy_worker *hc = apr_hash_get(ctx->hcworkers, &worker, sizeof worker);
+    return hc ? ((wctx_t *)hc->context)->jitter : 0;
+}
+
+/*
+ * Update the state of the worker according to the result of its check,
+ * ended at now, and schedule the next one.
+ */
+static void hc_check_done(baton_t *baton, apr_status_t rv, apr_time_t start,
+                          apr_time_t now, const char *how)
+{
+    server_rec *s = baton->ctx->s;
+    proxy_worker *worker = baton->worker;
+    proxy_worker *hc = baton->hc;
+    wctx_t *wctx = hc->context;
+    hc_latency_slot *slot;
 
-    now = apr_time_now();
     if (rv == APR_ENOTIMPL) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(03257)
                          "Somehow tried to use unimplemented hcheck method: %d",
@@ -953,7 +1068,7 @@ static void * APR_THREAD_FUNC hc_check(apr_thread_t *thread, void *b)
                 ap_proxy_set_wstatus(PROXY_WORKER_IN_ERROR_FLAG, 0, worker);
                 worker->s->pcount = 0;
                 ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(03302)
-                             "%sHealth check ENABLING %s", (thread ? "Threaded " : ""),
+                             "%sHealth check ENABLING %s", how,
                              worker->s->name);
 
             }
@@ -967,20 +1082,727 @@ static void * APR_THREAD_FUNC hc_check(apr_thread_t *thread, void *b)
                 ap_proxy_set_wstatus(PROXY_WORKER_HC_FAIL_FLAG, 1, worker);
                 worker->s->fcount = 0;
                 ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(03303)
-                             "%sHealth check DISABLING %s", (thread ? "Threaded " : ""),
+                             "%sHealth check DISABLING %s", how,
                              worker->s->name);
             }
         }
     }
+    if ((slot = hc_latency_get(worker))) {
+        apr_interval_time_t latency = now - start;
+        apr_atomic_set32(&slot->latency,
+                         latency < 0 ? 0 : latency > APR_UINT32_MAX
+                                            ? APR_UINT32_MAX
+                                            : (apr_uint32_t)latency);
+        apr_atomic_inc32(&slot->checks);
+    }
+
+    /* Spread the checks over up to 10% of the interval, so that the
+     * workers configured (or started) at the same time don't get checked
+     * all at once forever */
+    wctx->jitter = apr_time_from_msec(ap_random_pick(0,
+                        (apr_uint32_t)apr_time_as_msec(worker->s->interval / 10)));
+
     if (baton->now) {
         *baton->now = now;
     }
     apr_pool_destroy(baton->ptemp);
     worker->s->updated = now;
+}
+
+static void * APR_THREAD_FUNC hc_check(apr_thread_t *thread, void *b)
+{
+    baton_t *baton = (baton_t *)b;
+    server_rec *s = baton->ctx->s;
+    proxy_worker *worker = baton->worker;
+    proxy_worker *hc = baton->hc;
+    apr_time_t start = apr_time_now();
+    apr_status_t rv;
 
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(03256)
+                 "%sHealth checking %s", (thread ? "Threaded " : ""),
+                 worker->s->name);
+
+    if (hc->s->method == TCP) {
+        rv = hc_check_tcp(baton);
+    }
+    else if (hc->s->method == CPING) {
+        rv = hc_check_cping(baton, thread);
+    }
+    else {
+        rv = hc_check_http(baton, thread);
+    }
+
+    hc_check_done(baton, rv, start, apr_time_now(),
+                  (thread ? "Threaded " : ""));
     return NULL;
 }
 
+/*
+ * Asynchronous checks: the TCP and (clear) HTTP checks of all the workers
+ * run on a single pollset, rather than taking a thread (or the watchdog)
+ * for the duration of each check. The watchdog resolves the address of
+ * the backend and hands the check over to the poller thread, which runs
+ * the pollset for as long as there are checks in flight (or, without
+ * threads, the watchdog runs it between its steps). The HTTP connections
+ * are kept alive between the checks when the backend allows it. The other
+ * checks (SSL, CPING, Unix sockets) still use the threadpool.
+ */
+static int hc_async_capable(baton_t *baton)
+{
+    proxy_worker *hc = baton->hc;
+    wctx_t *wctx = hc->context;
+
+    if (!hc_pollset || *baton->worker->s->uds_path
+            || strcmp(hc->s->scheme, "https") == 0
+            || strcmp(hc->s->scheme, "wss") == 0) {
+        return 0;
+    }
+    if (hc->s->method == TCP) {
+        return 1;
+    }
+    return hc->s->method != CPING && wctx->req && wctx->method;
+}
+
+static apr_interval_time_t hc_async_timeout(proxy_worker *hc, server_rec *s,
+                                            int connect)
+{
+    if (connect && hc->s->conn_timeout_set) {
+        return hc->s->conn_timeout;
+    }
+    if (hc->s->timeout_set) {
+        return hc->s->timeout;
+    }
+    return s->timeout;
+}
+
+static void hc_async_close(wctx_t *wctx)
+{
+    if (wctx->cpool) {
+        apr_pool_destroy(wctx->cpool);
+        wctx->cpool = NULL;
+        wctx->sock = NULL;
+    }
+}
+
+static apr_status_t hc_async_watch(hc_async_t *chk, apr_int16_t reqevents)
+{
+    if (chk->pfd.desc.s) {
+        apr_pollset_remove(hc_pollset, &chk->pfd);
+    }
+    chk->pfd.p = chk->baton->ptemp;
+    chk->pfd.desc_type = APR_POLL_SOCKET;
+    chk->pfd.desc.s = chk->wctx->sock;
+    chk->pfd.reqevents = reqevents;
+    chk->pfd.client_data = chk;
+    return apr_pollset_add(hc_pollset, &chk->pfd);
+}
+
+static void hc_async_unwatch(hc_async_t *chk)
+{
+    if (chk->pfd.desc.s) {
+        apr_pollset_remove(hc_pollset, &chk->pfd);
+        chk->pfd.desc.s = NULL;
+    }
+}
+
+static void hc_async_done(hc_async_t *chk, apr_status_t rv, apr_time_t now)
+{
+    baton_t *baton = chk->baton;
+
+    hc_async_unwatch(chk);
+    if (rv != APR_SUCCESS || !chk->keepalive) {
+        hc_async_close(chk->wctx);
+    }
+    if (chk->prev) {
+        chk->prev->next = chk->next;
+    }
+    else {
+        hc_inflight = chk->next;
+    }
+    if (chk->next) {
+        chk->next->prev = chk->prev;
+    }
+    apr_atomic_dec32(&hc_ninflight);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, baton->ctx->s, APLOGNO(10636)
+                 "Async health check %s status (%d) for %s",
+                 ap_proxy_show_hcmethod(baton->hc->s->method),
+                 rv == APR_SUCCESS ? OK : !OK, baton->worker->s->name);
+
+    /* Destroys chk */
+    hc_check_done(baton, rv, chk->start, now, "Async ");
+}
+
+/* Resolve the address of the backend, by the watchdog (blocking) */
+static apr_status_t hc_async_resolve(hc_async_t *chk)
+{
+    sctx_t *ctx = chk->baton->ctx;
+    proxy_worker *hc = chk->baton->hc;
+    wctx_t *wctx = chk->wctx;
+    apr_status_t rv;
+
+    if (wctx->addr) {
+        chk->addr = wctx->addr;
+        return APR_SUCCESS;
+    }
+    rv = apr_sockaddr_info_get(&chk->addr, hc->s->hostname_ex, APR_UNSPEC,
+                               hc->s->port, 0,
+                               hc->s->is_address_reusable
+                                   ? ctx->p : chk->baton->ptemp);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, ctx->s, APLOGNO(10637)
+                     "DNS lookup failure for: %s:%hu",
+                     hc->s->hostname_ex, hc->s->port);
+        chk->addr = NULL;
+        return rv;
+    }
+    if (hc->s->is_address_reusable) {
+        wctx->addr = chk->addr;
+    }
+    return APR_SUCCESS;
+}
+
+/* Open a new (non-blocking) connection to the backend */
+static apr_status_t hc_async_connect(hc_async_t *chk, apr_time_t now)
+{
+    sctx_t *ctx = chk->baton->ctx;
+    proxy_worker *hc = chk->baton->hc;
+    wctx_t *wctx = chk->wctx;
+    apr_sockaddr_t *addr = chk->addr;
+    apr_status_t rv = APR_SUCCESS;
+
+    hc_async_close(wctx);
+    chk->reused = 0;
+    chk->state = HC_ASYNC_CONNECT;
+    chk->deadline = now + hc_async_timeout(hc, ctx->s, 1);
+
+    apr_pool_create(&wctx->cpool, ctx->p);
+    apr_pool_tag(wctx->cpool, "hc_conn");
+    rv = apr_socket_create(&wctx->sock, addr->family, SOCK_STREAM,
+                           APR_PROTO_TCP, wctx->cpool);
+    if (rv == APR_SUCCESS) {
+        apr_socket_opt_set(wctx->sock, APR_TCP_NODELAY, 1);
+        rv = apr_socket_timeout_set(wctx->sock, 0);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_socket_connect(wctx->sock, addr);
+        if (APR_STATUS_IS_EINPROGRESS(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    if (rv == APR_SUCCESS) {
+        /* Writable once connected */
+        rv = hc_async_watch(chk, APR_POLLOUT);
+    }
+    if (rv != APR_SUCCESS) {
+        hc_async_unwatch(chk);
+        hc_async_close(wctx);
+    }
+    return rv;
+}
+
+/* Outcome of the non-blocking connect() */
+static apr_status_t hc_async_connected(apr_socket_t *sock)
+{
+    apr_os_sock_t fd;
+    apr_socklen_t len;
+    int err = 0;
+
+    len = sizeof(err);
+    if (apr_os_sock_get(&fd, sock) != APR_SUCCESS
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) < 0) {
+        return APR_EGENERAL;
+    }
+    return err ? APR_FROM_OS_ERROR(err) : APR_SUCCESS;
+}
+
+/*
+ * The backend may have closed the kept alive connection in the meantime,
+ * retry once on a new one before failing.
+ */
+static void hc_async_fail(hc_async_t *chk, apr_status_t rv, apr_time_t now)
+{
+    if (chk->reused && !chk->len) {
+        hc_async_unwatch(chk);
+        chk->out = chk->wctx->req;
+        chk->outlen = strlen(chk->out);
+        if (hc_async_connect(chk, now) == APR_SUCCESS) {
+            return;
+        }
+    }
+    hc_async_done(chk, rv, now);
+}
+
+/*
+ * Check the chunked body in buf (len bytes), and decode it into out
+ * unless NULL. Returns APR_INCOMPLETE if the last chunk or the trailers
+ * are missing, otherwise the length of the body and of the input used.
+ */
+static apr_status_t hc_async_dechunk(const char *buf, apr_size_t len,
+                                     char *out, apr_size_t *bodylen,
+                                     apr_size_t *used)
+{
+    apr_size_t pos = 0, n = 0;
+
+    for (;;) {
+        const char *eol = memchr(buf + pos, '\n', len - pos);
+        char *end;
+        apr_off_t size;
+
+        if (!eol) {
+            return APR_INCOMPLETE;
+        }
+        /* strtol() stops at the '\n' at most */
+        if (apr_strtoff(&size, buf + pos, &end, 16) != APR_SUCCESS
+                || end == buf + pos || size < 0) {
+            return APR_EGENERAL;
+        }
+        pos = eol - buf + 1;
+        if (size == 0) {
+            /* The trailers, up to an empty line */
+            for (;;) {
+                eol = memchr(buf + pos, '\n', len - pos);
+                if (!eol) {
+                    return APR_INCOMPLETE;
+                }
+                if (eol == buf + pos || (eol == buf + pos + 1
+                                         && buf[pos] == '\r')) {
+                    *bodylen = n;
+                    *used = eol - buf + 1;
+                    return APR_SUCCESS;
+                }
+                pos = eol - buf + 1;
+            }
+        }
+        if ((apr_uint64_t)size > len - pos) {
+            return APR_INCOMPLETE;
+        }
+        if (out) {
+            memmove(out + n, buf + pos, (apr_size_t)size);
+        }
+        n += (apr_size_t)size;
+        pos += (apr_size_t)size;
+        eol = memchr(buf + pos, '\n', len - pos);
+        if (!eol) {
+            return APR_INCOMPLETE;
+        }
+        if (eol - (buf + pos) > 1) {
+            return APR_EGENERAL;
+        }
+        pos = eol - buf + 1;
+    }
+}
+
+/*
+ * Parse the response read so far, and evaluate it once complete (or once
+ * the connection is closed). Returns APR_INCOMPLETE if more is needed.
+ */
+static apr_status_t hc_async_response(hc_async_t *chk, int eof)
+{
+    baton_t *baton = chk->baton;
+    wctx_t *wctx = chk->wctx;
+    int full = (chk->len >= HC_ASYNC_MAX_RESPONSE);
+    apr_size_t hdrlen, bodylen = 0, used = 0;
+    char *hdrs, *line, *eol, *body;
+    const char *val;
+    request_rec *r;
+    conn_rec *c;
+    int first = 1;
+
+    /* The end of the headers */
+    for (eol = chk->buf; ; eol++) {
+        eol = memchr(eol, '\n', chk->len - (eol - chk->buf));
+        if (!eol) {
+            return (eof || full) ? APR_EGENERAL : APR_INCOMPLETE;
+        }
+        if ((eol + 1 < chk->buf + chk->len && eol[1] == '\n')
+                || (eol + 2 < chk->buf + chk->len && eol[1] == '\r'
+                    && eol[2] == '\n')) {
+            hdrlen = (eol - chk->buf) + (eol[1] == '\n' ? 2 : 3);
+            break;
+        }
+    }
+
+    r = create_request_rec(baton->ptemp, baton->ctx->s, baton->balancer,
+                           wctx->method, wctx->protocol);
+    c = apr_pcalloc(r->pool, sizeof(conn_rec));
+    c->pool = r->pool;
+    c->base_server = r->server;
+    c->conn_config = ap_create_conn_config(r->pool);
+    c->notes = apr_table_make(r->pool, 1);
+    apr_socket_addr_get(&c->local_addr, APR_LOCAL, wctx->sock);
+    apr_socket_addr_get(&c->client_addr, APR_REMOTE, wctx->sock);
+    apr_sockaddr_ip_get(&c->local_ip, c->local_addr);
+    apr_sockaddr_ip_get(&c->client_ip, c->client_addr);
+    set_request_connection(r, c);
+
+    hdrs = apr_pstrmemdup(r->pool, chk->buf, hdrlen);
+    for (line = hdrs; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+        *eol = '\0';
+        if (eol > line && eol[-1] == '\r') {
+            eol[-1] = '\0';
+        }
+        if (!*line) {
+            break;
+        }
+        ap_log_error(APLOG_MARK, APLOG_TRACE7, 0, r->server, "%s", line);
+        if (first) {
+            /* hc_parse_status_line() may write past the end */
+            char *status = apr_pstrcat(r->pool, line, " ", NULL);
+            status[strlen(line)] = '\0';
+            if (hc_parse_status_line(r, status) != OK) {
+                return APR_EGENERAL;
+            }
+            /* Kept alive by default if both are HTTP/1.1 */
+            chk->keepalive = (line[7] == '1'
+                              && r->proto_num >= HTTP_VERSION(1, 1));
+            first = 0;
+        }
+        else if (hc_parse_header_line(r, line) != OK) {
+            return APR_EGENERAL;
+        }
+    }
+    if ((val = apr_table_get(r->headers_out, "Connection"))
+            && ap_find_token(r->pool, val, "close")) {
+        chk->keepalive = 0;
+    }
+    if ((val = apr_table_get(r->headers_out, "Content-Type")) != NULL) {
+        ap_set_content_type(r, val);
+    }
+
+    body = chk->buf + hdrlen;
+    if (r->header_only || r->status < 200
+            || r->status == HTTP_NO_CONTENT
+            || r->status == HTTP_NOT_MODIFIED) {
+        used = 0;
+    }
+    else if ((val = apr_table_get(r->headers_out, "Transfer-Encoding"))) {
+        apr_status_t rv;
+
+        if (!ap_find_last_token(r->pool, val, "chunked")) {
+            return APR_EGENERAL;
+        }
+        rv = hc_async_dechunk(body, chk->len - hdrlen, NULL, &bodylen, &used);
+        if (rv == APR_INCOMPLETE && !eof && !full) {
+            return APR_INCOMPLETE;
+        }
+        if (rv != APR_SUCCESS) {
+            return APR_EGENERAL;
+        }
+        /* Decodes in place, the output is never longer than the input */
+        hc_async_dechunk(body, chk->len - hdrlen, body, &bodylen, &used);
+    }
+    else if ((val = apr_table_get(r->headers_out, "Content-Length"))) {
+        apr_off_t cl;
+
+        if (!ap_parse_strict_length(&cl, val)) {
+            return APR_EGENERAL;
+        }
+        if ((apr_uint64_t)cl > chk->len - hdrlen) {
+            if (!eof && !full) {
+                return APR_INCOMPLETE;
+            }
+            if (eof) {
+                return APR_EGENERAL;
+            }
+            /* Too large, evaluate the beginning */
+            chk->keepalive = 0;
+            cl = chk->len - hdrlen;
+        }
+        bodylen = used = (apr_size_t)cl;
+    }
+    else {
+        /* Up to the end of the connection */
+        if (!eof && !full) {
+            return APR_INCOMPLETE;
+        }
+        chk->keepalive = 0;
+        bodylen = used = chk->len - hdrlen;
+    }
+    if (hdrlen + used != chk->len) {
+        /* Unexpected data */
+        chk->keepalive = 0;
+    }
+    if (eof) {
+        chk->keepalive = 0;
+    }
+
+    if (bodylen) {
+        APR_BRIGADE_INSERT_TAIL(r->kept_body,
+                                apr_bucket_pool_create(body, bodylen, r->pool,
+                                                       c->bucket_alloc));
+    }
+    return hc_eval_response(baton, r) == OK ? APR_SUCCESS : APR_EGENERAL;
+}
+
+/* Process the events of the check, which happened at now */
+static void hc_async_io(hc_async_t *chk, apr_int16_t rtnevents,
+                        apr_time_t now)
+{
+    proxy_worker *hc = chk->baton->hc;
+    apr_socket_t *sock = chk->wctx->sock;
+    apr_status_t rv;
+
+    switch (chk->state) {
+    case HC_ASYNC_CONNECT:
+        if ((rv = hc_async_connected(sock)) != APR_SUCCESS) {
+            hc_async_done(chk, rv, now);
+            return;
+        }
+        if (hc->s->method == TCP) {
+            hc_async_done(chk, APR_SUCCESS, now);
+            return;
+        }
+        chk->state = HC_ASYNC_WRITE;
+        chk->deadline = now + hc_async_timeout(hc, chk->baton->ctx->s, 0);
+        /* fallthrough */
+
+    case HC_ASYNC_WRITE:
+        while (chk->outlen) {
+            apr_size_t n = chk->outlen;
+            rv = apr_socket_send(sock, chk->out, &n);
+            chk->out += n;
+            chk->outlen -= n;
+            if (APR_STATUS_IS_EAGAIN(rv)) {
+                return;
+            }
+            if (rv != APR_SUCCESS) {
+                hc_async_fail(chk, rv, now);
+                return;
+            }
+        }
+        chk->state = HC_ASYNC_READ;
+        if ((rv = hc_async_watch(chk, APR_POLLIN)) != APR_SUCCESS) {
+            hc_async_done(chk, rv, now);
+        }
+        return;
+
+    case HC_ASYNC_READ:
+        for (;;) {
+            apr_size_t n = HC_ASYNC_MAX_RESPONSE - chk->len;
+            int eof = 0;
+
+            rv = APR_SUCCESS;
+            if (n) {
+                rv = apr_socket_recv(sock, chk->buf + chk->len, &n);
+                chk->len += n;
+                if (APR_STATUS_IS_EAGAIN(rv)) {
+                    rv = hc_async_response(chk, 0);
+                    if (rv != APR_INCOMPLETE) {
+                        hc_async_done(chk, rv, now);
+                    }
+                    return;
+                }
+                if (APR_STATUS_IS_EOF(rv)) {
+                    eof = 1;
+                }
+                else if (rv != APR_SUCCESS) {
+                    hc_async_fail(chk, rv, now);
+                    return;
+                }
+            }
+            if (eof && !chk->len) {
+                hc_async_fail(chk, APR_EOF, now);
+                return;
+            }
+            if (eof || chk->len >= HC_ASYNC_MAX_RESPONSE) {
+                hc_async_done(chk, hc_async_response(chk, eof), now);
+                return;
+            }
+        }
+    }
+}
+
+/* Start the check handed over, by the poller */
+static void hc_async_start(hc_async_t *chk)
+{
+    baton_t *baton = chk->baton;
+    proxy_worker *hc = baton->hc;
+    apr_time_t now = apr_time_now();
+    apr_status_t rv = chk->status;
+
+    chk->prev = NULL;
+    chk->next = hc_inflight;
+    if (hc_inflight) {
+        hc_inflight->prev = chk;
+    }
+    hc_inflight = chk;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, baton->ctx->s, APLOGNO(10638)
+                 "Async health checking %s", baton->worker->s->name);
+
+    if (rv != APR_SUCCESS) {
+        /* the address could not be resolved */
+        hc_async_done(chk, rv, now);
+        return;
+    }
+    if (hc->s->method == TCP) {
+        /* A new connection each time, that's the check */
+        rv = hc_async_connect(chk, now);
+    }
+    else {
+        chk->out = chk->wctx->req;
+        chk->outlen = strlen(chk->out);
+        chk->buf = apr_palloc(baton->ptemp, HC_ASYNC_MAX_RESPONSE);
+        if (chk->wctx->sock) {
+            chk->reused = 1;
+            chk->state = HC_ASYNC_WRITE;
+            chk->deadline = now + hc_async_timeout(hc, baton->ctx->s, 0);
+            rv = hc_async_watch(chk, APR_POLLOUT);
+        }
+        else {
+            rv = hc_async_connect(chk, now);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        hc_async_done(chk, rv, now);
+    }
+}
+
+/* Hand the check over to the poller, by the watchdog */
+static void hc_async_submit(baton_t *baton)
+{
+    hc_async_t *chk;
+
+    chk = apr_pcalloc(baton->ptemp, sizeof(hc_async_t));
+    chk->baton = baton;
+    chk->wctx = baton->hc->context;
+    chk->start = apr_time_now();
+    /* Not in the poller, it would hold up the checks in flight */
+    chk->status = hc_async_resolve(chk);
+    apr_atomic_inc32(&hc_ninflight);
+#if HC_USE_THREADS
+    apr_thread_mutex_lock(hc_async_mutex);
+    chk->next = hc_starting;
+    hc_starting = chk;
+    apr_thread_mutex_unlock(hc_async_mutex);
+    apr_pollset_wakeup(hc_pollset);
+#else
+    hc_async_start(chk);
+#endif
+}
+
+/*
+ * Wait for events for up to timeout, process them and expire the checks
+ * which timed out. The latency of the checks is measured up to the time
+ * their events are returned.
+ */
+static void hc_async_poll(apr_interval_time_t timeout)
+{
+    const apr_pollfd_t *descs;
+    apr_int32_t i, num = 0;
+    hc_async_t *chk, *next;
+    apr_status_t rv;
+    apr_time_t now;
+
+    rv = apr_pollset_poll(hc_pollset, timeout, &num, &descs);
+    now = apr_time_now();
+    if (rv == APR_SUCCESS) {
+        for (i = 0; i < num; i++) {
+            hc_async_io(descs[i].client_data, descs[i].rtnevents, now);
+        }
+    }
+
+    for (chk = hc_inflight; chk; chk = next) {
+        next = chk->next;
+        if (now > chk->deadline) {
+            hc_async_done(chk, APR_TIMEUP, now);
+        }
+    }
+}
+
+/* Time until the first deadline of the checks in flight, -1 if none */
+static apr_interval_time_t hc_async_wait(void)
+{
+    apr_time_t first = 0;
+    apr_interval_time_t wait;
+    hc_async_t *chk;
+
+    for (chk = hc_inflight; chk; chk = chk->next) {
+        if (!first || chk->deadline < first) {
+            first = chk->deadline;
+        }
+    }
+    if (!first) {
+        return -1;
+    }
+    /* expired once past the deadline */
+    wait = first - apr_time_now() + 1;
+    return wait > 0 ? wait : 0;
+}
+
+#if HC_USE_THREADS
+/* Run the pollset until stopped, woken up for the checks handed over */
+static void * APR_THREAD_FUNC hc_async_poller(apr_thread_t *thread, void *data)
+{
+    while (!apr_atomic_read32(&hc_poller_stop)) {
+        hc_async_t *chk;
+
+        apr_thread_mutex_lock(hc_async_mutex);
+        chk = hc_starting;
+        hc_starting = NULL;
+        apr_thread_mutex_unlock(hc_async_mutex);
+        while (chk) {
+            hc_async_t *next = chk->next;
+            hc_async_start(chk);
+            chk = next;
+        }
+        hc_async_poll(hc_async_wait());
+    }
+    return NULL;
+}
+#else
+/* Run the pollset until the next watchdog step, or the checks are done */
+static void hc_async_run(apr_interval_time_t timeout)
+{
+    apr_time_t until = apr_time_now() + timeout;
+
+    while (hc_inflight) {
+        apr_interval_time_t wait = hc_async_wait();
+        apr_interval_time_t left = until - apr_time_now();
+
+        if (left <= 0) {
+            break;
+        }
+        hc_async_poll((wait < 0 || wait > left) ? left : wait);
+    }
+}
+#endif
+
+/* Abort the checks in flight and close the kept alive connections, once
+ * nothing runs the pollset anymore */
+static void hc_async_stop(sctx_t *ctx)
+{
+    apr_hash_index_t *hi;
+
+#if HC_USE_THREADS
+    /* and those never started */
+    while (hc_starting) {
+        hc_async_t *chk = hc_starting;
+
+        hc_starting = chk->next;
+        chk->next = hc_inflight;
+        hc_inflight = chk;
+    }
+#endif
+    while (hc_inflight) {
+        hc_async_t *chk = hc_inflight;
+        baton_t *baton = chk->baton;
+
+        hc_async_unwatch(chk);
+        hc_async_close(chk->wctx);
+        hc_inflight = chk->next;
+        apr_atomic_dec32(&hc_ninflight);
+        baton->worker->s->updated = apr_time_now();
+        apr_pool_destroy(baton->ptemp);
+    }
+    hc_inflight = NULL;
+    for (hi = apr_hash_first(NULL, ctx->hcworkers); hi; hi = apr_hash_next(hi)) {
+        proxy_worker *hc = apr_hash_this_val(hi);
+        hc_async_close(hc->context);
+    }
+}
+
 static apr_status_t hc_watchdog_callback(int state, void *data,
                                          apr_pool_t *pool)
 {
@@ -1016,6 +1838,39 @@ static apr_status_t hc_watchdog_callback(int state, void *data,
                 hctp = NULL;
             }
 #endif
+            if (hc_async && hc_pollset == NULL) {
+                apr_status_t rv2;
+#if HC_USE_THREADS
+                rv2 = apr_pollset_create(&hc_pollset, HC_ASYNC_MAX_CHECKS,
+                                         ctx->p, APR_POLLSET_WAKEABLE);
+                if (rv2 == APR_SUCCESS) {
+                    rv2 = apr_thread_mutex_create(&hc_async_mutex,
+                                                  APR_THREAD_MUTEX_DEFAULT,
+                                                  ctx->p);
+                }
+                if (rv2 == APR_SUCCESS) {
+                    apr_atomic_set32(&hc_poller_stop, 0);
+                    rv2 = ap_thread_create(&hc_poller, NULL, hc_async_poller,
+                                           NULL, ctx->p);
+                }
+#else
+                rv2 = apr_pollset_create(&hc_pollset, HC_ASYNC_MAX_CHECKS,
+                                         ctx->p, 0);
+#endif
+                if (rv2 != APR_SUCCESS) {
+                    ap_log_error(APLOG_MARK, APLOG_INFO, rv2, s, APLOGNO(10639)
+                                 "can't run the pollset, health checks "
+                                 "won't be asynchronous");
+                    /* we can continue on without the pollset */
+                    if (hc_pollset) {
+                        apr_pollset_destroy(hc_pollset);
+                    }
+                    hc_pollset = NULL;
+                }
+                else {
+                    hc_pollset_ctx = ctx;
+                }
+            }
             break;
 
         case AP_WATCHDOG_STATE_RUNNING:
@@ -1039,7 +1894,11 @@ static apr_status_t hc_watchdog_callback(int state, void *data,
                         if (!PROXY_WORKER_IS(worker, PROXY_WORKER_STOPPED) &&
                             (worker->s->method != NONE) &&
                             (worker->s->updated != 0) &&
-                            (now > worker->s->updated + worker->s->interval)) {
+                            (now > worker->s->updated + worker->s->interval
+                                   + hc_get_jitter(ctx, worker)) &&
+                            /* Otherwise wait for some checks to complete */
+                            (apr_atomic_read32(&hc_ninflight)
+                                < HC_ASYNC_MAX_CHECKS)) {
                             baton_t *baton;
                             apr_pool_t *ptemp;
 
@@ -1061,6 +1920,10 @@ static apr_status_t hc_watchdog_callback(int state, void *data,
                                 return rv;
                             }
                             worker->s->updated = 0;
+                            if (hc_async_capable(baton)) {
+                                hc_async_submit(baton);
+                            }
+                            else
 #if HC_USE_THREADS
                             if (hctp) {
                                 apr_thread_pool_push(hctp, hc_check, (void *)baton,
@@ -1077,6 +1940,11 @@ static apr_status_t hc_watchdog_callback(int state, void *data,
                         workers++;
                     }
                 }
+#if !HC_USE_THREADS
+                if (hc_pollset) {
+                    hc_async_run(AP_WD_TM_SLICE);
+                }
+#endif
             }
             break;
 
@@ -1093,7 +1961,21 @@ static apr_status_t hc_watchdog_callback(int state, void *data,
                 }
                 hctp = NULL;
             }
+            if (hc_poller) {
+                apr_status_t rv2;
+
+                apr_atomic_set32(&hc_poller_stop, 1);
+                apr_pollset_wakeup(hc_pollset);
+                apr_thread_join(&rv2, hc_poller);
+                hc_poller = NULL;
+            }
 #endif
+            hc_async_stop(ctx);
+            if (hc_pollset && hc_pollset_ctx == ctx) {
+                apr_pollset_destroy(hc_pollset);
+                hc_pollset = NULL;
+                hc_pollset_ctx = NULL;
+            }
             break;
     }
     return rv;
@@ -1105,6 +1987,18 @@ static int hc_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
     hctp = NULL;
     tpsize = HC_THREADPOOL_SIZE;
 #endif
+    hc_async = 1;
+    hc_pollset = NULL;
+    hc_pollset_ctx = NULL;
+    hc_inflight = NULL;
+    hc_ninflight = 0;
+#if HC_USE_THREADS
+    hc_poller = NULL;
+    hc_async_mutex = NULL;
+    hc_starting = NULL;
+#endif
+    hc_latency_shm = NULL;
+    hc_latency_table = NULL;
 
     ajp_handle_cping_cpong = APR_RETRIEVE_OPTIONAL_FN(ajp_handle_cping_cpong);
     if (ajp_handle_cping_cpong) {
@@ -1147,6 +2041,20 @@ static int hc_post_config(apr_pool_t *p, apr_pool_t *plog,
                      HCHECK_WATHCHDOG_NAME);
         return !OK;
     }
+    rv = apr_shm_create(&hc_latency_shm,
+                        HC_LATENCY_SLOTS * sizeof(hc_latency_slot), NULL, p);
+    if (rv != APR_SUCCESS) {
+        /* Only the watchdog will know */
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10640)
+                     "couldn't create shared memory, health check latencies "
+                     "won't be available to the balancer-manager");
+        hc_latency_table = apr_pcalloc(p, HC_LATENCY_SLOTS
+                                          * sizeof(hc_latency_slot));
+    }
+    else {
+        hc_latency_table = apr_shm_baseaddr_get(hc_latency_shm);
+        memset(hc_latency_table, 0, HC_LATENCY_SLOTS * sizeof(hc_latency_slot));
+    }
     while (s) {
         sctx_t *ctx = ap_get_module_config(s->module_config,
                                            &proxy_hcheck_module);
@@ -1334,6 +2242,8 @@ static const command_rec command_table[] = {
     AP_INIT_TAKE1("ProxyHCTPsize", set_hc_tpsize, NULL, RSRC_CONF,
                      "Set size of health check thread pool"),
 #endif
+    AP_INIT_FLAG("ProxyHCAsync", set_hc_async, NULL, RSRC_CONF,
+                 "Run the TCP and HTTP health checks asynchronously"),
     { NULL }
 };
 
@@ -1345,6 +2255,7 @@ static void hc_register_hooks(apr_pool_t *p)
     APR_REGISTER_OPTIONAL_FN(hc_show_exprs);
     APR_REGISTER_OPTIONAL_FN(hc_select_exprs);
     APR_REGISTER_OPTIONAL_FN(hc_valid_expr);
+    APR_REGISTER_OPTIONAL_FN(hc_get_latency);
     ap_hook_pre_config(hc_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(hc_post_config, aszPre, aszSucc, APR_HOOK_LAST);
     ap_hook_expr_lookup(hc_expr_lookup, NULL, NULL, APR_HOOK_MIDDLE);
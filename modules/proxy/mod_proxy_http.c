@@ -24,6 +24,7 @@ module AP_MODULE_DECLARE_DATA proxy_http_module;
 
 static int (*ap_proxy_clear_connection_fn)(request_rec *r, apr_table_t *headers) =
         NULL;
+static int (*ap_proxy_suspended_done_fn)(request_rec *r, int status) = NULL;
 
 static apr_status_t ap_proxygetline(apr_bucket_brigade *bb, char *s, int n,
                                     request_rec *r, int flags, int *read);
@@ -274,10 +275,22 @@ static void add_cl(apr_pool_t *p,
 
 
 #define MAX_MEM_SPOOL 16384
+/* Largest read of the request body when streaming it */
+#define MAX_READ_BODY (1024 * 1024)
+/* Largest ProxyRequestBodyBuffer, held in memory by each request */
+#define MAX_BODY_BUFFER (1024 * 1024)
+
+typedef struct {
+    /* Request body bytes read before connecting the backend, and kept in
+     * memory when spooled; 0 to start streaming at once */
+    apr_off_t body_buffer;
+    unsigned int body_buffer_set:1;
+} proxy_http_dir_conf;
 
 typedef enum {
     PROXY_HTTP_REQ_HAVE_HEADER = 0,
 
+    PROXY_HTTP_WAITING_RESPONSE,
     PROXY_HTTP_TUNNELING
 } proxy_http_state;
 
@@ -306,6 +319,7 @@ typedef struct {
 
     char *old_cl_val, *old_te_val;
     apr_off_t cl_val;
+    apr_off_t body_buffer;
 
     proxy_http_state state;
     rb_methods rb_method;
@@ -314,6 +328,7 @@ typedef struct {
     proxy_tunnel_rec *tunnel;
 
     apr_pool_t *async_pool;
+    apr_array_header_t *pfds;
     apr_interval_time_t idle_timeout;
 
     unsigned int can_go_async           :1,
@@ -322,27 +337,53 @@ typedef struct {
                  force10                :1;
 } proxy_http_req_t;
 
-static void proxy_http_async_finish(proxy_http_req_t *req)
+static void proxy_http_async_finish(proxy_http_req_t *req, int status)
 { 
-    conn_rec *c = req->r->connection;
+    request_rec *r = req->r;
+    conn_rec *c = r->connection;
+    int tunneling = (req->state == PROXY_HTTP_TUNNELING);
 
     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, req->r,
                   "proxy %s: finish async", req->proto);
 
-    /* Report bytes exchanged by the backend */
-    req->backend->worker->s->read +=
-        ap_proxy_tunnel_conn_bytes_in(req->tunnel->origin);
-    req->backend->worker->s->transferred +=
-        ap_proxy_tunnel_conn_bytes_out(req->tunnel->origin);
+    if (req->backend) {
+        if (tunneling) {
+            /* Report bytes exchanged by the backend */
+            req->backend->worker->s->read +=
+                ap_proxy_tunnel_conn_bytes_in(req->tunnel->origin);
+            req->backend->worker->s->transferred +=
+                ap_proxy_tunnel_conn_bytes_out(req->tunnel->origin);
+        }
+        else if (status != OK) {
+            req->backend->close = 1;
+        }
+
+        proxy_run_detach_backend(req->r, req->backend);
+        ap_proxy_release_connection(req->proto, req->backend,
+                                    req->r->server);
+    }
 
-    proxy_run_detach_backend(req->r, req->backend);
-    ap_proxy_release_connection(req->proto, req->backend, req->r->server);
+    /* As proxy_handler() would have done on return */
+    if (tunneling) {
+        status = OK;
+    }
+    if (ap_proxy_suspended_done_fn) {
+        status = ap_proxy_suspended_done_fn(r, status);
+    }
 
-    ap_finalize_request_protocol(req->r);
-    ap_process_request_after_handler(req->r);
-    /* don't touch req or req->r from here */
+    /* As ap_process_async_request() would have done for the handler, the
+     * error is not a recursive one for the response status set already.
+     */
+    if (status != OK && status != DONE) {
+        r->status = HTTP_OK;
+    }
+    ap_die(status, r);
+    ap_process_request_after_handler(r);
+    /* don't touch req or r from here */
 
-    c->cs->state = CONN_STATE_LINGER;
+    if (tunneling) {
+        c->cs->state = CONN_STATE_LINGER;
+    }
     ap_mpm_resume_suspended(c);
 }
 
@@ -357,9 +398,20 @@ static void proxy_http_async_cancel_cb(void *baton)
     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, req->r,
                   "proxy %s: cancel async", req->proto);
 
-    req->r->connection->keepalive = AP_CONN_CLOSE;
     req->backend->close = 1;
-    proxy_http_async_finish(req);
+    if (req->state == PROXY_HTTP_WAITING_RESPONSE) {
+        /* Same as a read timeout on the status line */
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, req->r, APLOGNO(10618)
+                      "timeout waiting for the response of remote "
+                      "server %s:%d", req->backend->hostname,
+                      req->backend->port);
+        apr_table_setn(req->r->notes, "proxy_timedout", "1");
+        proxy_http_async_finish(req, HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
+
+    req->r->connection->keepalive = AP_CONN_CLOSE;
+    proxy_http_async_finish(req, OK);
 }
 
 /* Invoked by the event loop when data is ready on either end. 
@@ -377,6 +429,21 @@ static void proxy_http_async_cb(void *baton)
     }
 
     switch (req->state) {
+    case PROXY_HTTP_WAITING_RESPONSE:
+#if APR_HAS_THREADS
+        /* Wait for the handler which suspended the request to be done */
+        apr_thread_mutex_lock(req->r->invoke_mtx);
+        apr_thread_mutex_unlock(req->r->invoke_mtx);
+#endif
+        /* The response is coming (or the backend is gone), forward it */
+        status = ap_proxy_http_process_response(req);
+        if (status == SUSPENDED) {
+            /* Upgraded, the tunnel is running asynchronously already */
+            return;
+        }
+        proxy_http_async_finish(req, status);
+        return;
+
     case PROXY_HTTP_TUNNELING:
         /* Pump both ends until they'd block and then start over again */
         status = ap_proxy_tunnel_run(req->tunnel);
@@ -416,10 +483,63 @@ static void proxy_http_async_cb(void *baton)
         proxy_http_async_cancel_cb(req);
     }
     else {
-        proxy_http_async_finish(req);
+        proxy_http_async_finish(req, OK);
     }
 }
 
+/* Once the request is sent, wait ProxyAsyncDelay for the backend to start
+ * responding, or leave the response to the MPM by returning SUSPENDED.
+ * The errors of a suspended request are not failed over by proxy_handler()
+ * to another balancer member, they are answered when resumed.
+ */
+static int proxy_http_async_wait(proxy_http_req_t *req)
+{
+    proxy_http_state state;
+    apr_pollfd_t *pfd;
+    apr_int32_t nfds;
+    apr_status_t rv;
+
+    if (!req->pfds) {
+        req->pfds = apr_array_make(req->p, 1, sizeof(apr_pollfd_t));
+        pfd = apr_array_push(req->pfds);
+        memset(pfd, 0, sizeof(*pfd));
+        pfd->p = req->p;
+        pfd->desc_type = APR_POLL_SOCKET;
+        pfd->reqevents = APR_POLLIN;
+    }
+    pfd = &APR_ARRAY_IDX(req->pfds, 0, apr_pollfd_t);
+    pfd->desc.s = req->backend->sock;
+
+    rv = apr_poll(pfd, 1, &nfds, req->dconf->async_delay);
+    if (!APR_STATUS_IS_TIMEUP(rv)) {
+        /* Readable, or failed: process the response synchronously */
+        return OK;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, req->r,
+                  "proxy %s: waiting for the response asynchronously",
+                  req->proto);
+
+    if (!req->async_pool) {
+        apr_pool_create(&req->async_pool, req->p);
+    }
+    state = req->state;
+    req->state = PROXY_HTTP_WAITING_RESPONSE;
+    rv = ap_mpm_register_poll_callback_timeout(req->async_pool, req->pfds,
+                                               proxy_http_async_cb,
+                                               proxy_http_async_cancel_cb,
+                                               req, req->idle_timeout);
+    if (rv != APR_SUCCESS) {
+        /* Not to be resumed, process the response synchronously */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, req->r, APLOGNO(10675)
+                      "proxy %s: can't wait for the response "
+                      "asynchronously", req->proto);
+        req->state = state;
+        return OK;
+    }
+    return SUSPENDED;
+}
+
 static int stream_reqbody(proxy_http_req_t *req)
 {
     request_rec *r = req->r;
@@ -433,13 +553,25 @@ static int stream_reqbody(proxy_http_req_t *req)
     apr_bucket_brigade *input_brigade = req->input_brigade;
     rb_methods rb_method = req->rb_method;
     apr_off_t bytes, bytes_streamed = 0;
+    apr_off_t read_len;
     apr_bucket *e;
 
+    /* Large buffers make for large reads (and writes) of large bodies,
+     * still each read is passed to the backend before the next one so
+     * the client is not read faster than the backend takes it.
+     */
+    read_len = req->body_buffer;
+    if (read_len < HUGE_STRING_LEN) {
+        read_len = HUGE_STRING_LEN;
+    }
+    else if (read_len > MAX_READ_BODY) {
+        read_len = MAX_READ_BODY;
+    }
+
     do {
         if (APR_BRIGADE_EMPTY(input_brigade)
                 && APR_BRIGADE_EMPTY(header_brigade)) {
-            rv = ap_proxy_read_input(r, p_conn, input_brigade,
-                                     HUGE_STRING_LEN);
+            rv = ap_proxy_read_input(r, p_conn, input_brigade, read_len);
             if (rv != OK) {
                 return rv;
             }
@@ -625,7 +757,7 @@ static int ap_proxy_http_prefetch(proxy_http_req_t *req,
     rv = ap_proxy_prefetch_input(r, req->backend, input_brigade,
                                  req->prefetch_nonblocking ? APR_NONBLOCK_READ
                                                            : APR_BLOCK_READ,
-                                 &bytes_read, MAX_MEM_SPOOL);
+                                 &bytes_read, req->body_buffer);
     if (rv != OK) {
         return rv;
     }
@@ -644,8 +776,9 @@ static int ap_proxy_http_prefetch(proxy_http_req_t *req,
      *   "proxy-sendcl" which prevents T-E => RB_STREAM_CHUNKED.
      *
      * Otherwise we need to determine and set a content-length, so spool the
-     * entire request body to memory or temporary file (above MAX_MEM_SPOOL),
-     * such that we finally know its length => RB_SPOOL_CL.
+     * entire request body to memory or temporary file (above the
+     * ProxyRequestBodyBuffer size), such that we finally know its length
+     * => RB_SPOOL_CL.
      */
     if (!APR_BRIGADE_EMPTY(input_brigade)
         && APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(input_brigade))) {
@@ -698,7 +831,7 @@ static int ap_proxy_http_prefetch(proxy_http_req_t *req,
          * which could expire and be closed in the meantime.
          */
         rv = ap_proxy_spool_input(r, p_conn, input_brigade,
-                                  &bytes, MAX_MEM_SPOOL);
+                                  &bytes, req->body_buffer);
         if (rv != OK) {
             return rv;
         }
@@ -1242,6 +1375,13 @@ int ap_proxy_http_process_response(proxy_http_req_t *req)
             proxy_status = atoi(&buffer[9]);
             apr_table_setn(r->notes, "proxy-status",
                            apr_pstrdup(r->pool, &buffer[9]));
+            /* When the response (headers) arrived, for the balancers to
+             * measure the latency of the backend; interim responses are
+             * overwritten by the final one.
+             */
+            apr_table_setn(r->notes, "proxy-response-time",
+                           apr_psprintf(r->pool, "%" APR_TIME_T_FMT,
+                                        apr_time_now()));
 
             if (keepchar != '\0') {
                 buffer[12] = keepchar;
@@ -1938,6 +2078,7 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
     int is_ssl = 0;
     conn_rec *c = r->connection;
     proxy_dir_conf *dconf;
+    proxy_http_dir_conf *hconf;
     int retry = 0;
     char *locurl = url;
     int toclose = 0;
@@ -1974,6 +2115,7 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
     backend->is_ssl = is_ssl;
 
     dconf = ap_get_module_config(r->per_dir_config, &proxy_module);
+    hconf = ap_get_module_config(r->per_dir_config, &proxy_http_module);
     ap_mpm_query(AP_MPMQ_CAN_POLL, &mpm_can_poll);
 
     req = apr_pcalloc(p, sizeof(*req));
@@ -1985,11 +2127,14 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
     req->backend = backend;
     req->proto = scheme;
     req->bucket_alloc = c->bucket_alloc;
+    /* Subrequests and HTTP/2 secondary connections can't be resumed */
     req->can_go_async = (mpm_can_poll &&
+                         !r->main && !c->master &&
                          dconf->async_delay_set &&
                          dconf->async_delay >= 0);
     req->state = PROXY_HTTP_REQ_HAVE_HEADER;
     req->rb_method = RB_INIT;
+    req->body_buffer = hconf->body_buffer;
 
     if (apr_table_get(r->subprocess_env, "force-proxy-request-1.0")) {
         req->force10 = 1;
@@ -2049,6 +2194,7 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
     if (input_brigade
              || req->can_go_async
              || req->do_100_continue
+             || !req->body_buffer
              || apr_table_get(r->subprocess_env,
                               "proxy-prefetch-nonblocking")) {
         req->prefetch_nonblocking = 1;
@@ -2166,7 +2312,14 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
             break;
         }
 
-        /* Step Five: Receive the Response... Fall thru to cleanup */
+        /* Step Five: Receive the Response... Fall thru to cleanup
+         * If the MPM can, don't hold this thread while the backend is
+         * computing the response (nor while the 100-continue is pending).
+         */
+        if (req->can_go_async && !req->do_100_continue
+                && proxy_http_async_wait(req) == SUSPENDED) {
+            return SUSPENDED;
+        }
         status = ap_proxy_http_process_response(req);
         if (status == SUSPENDED) {
             return SUSPENDED;
@@ -2201,6 +2354,8 @@ static int proxy_http_post_config(apr_pool_t *pconf, apr_pool_t *plog,
 
     ap_proxy_clear_connection_fn =
             APR_RETRIEVE_OPTIONAL_FN(ap_proxy_clear_connection);
+    ap_proxy_suspended_done_fn =
+            APR_RETRIEVE_OPTIONAL_FN(ap_proxy_suspended_done);
     if (!ap_proxy_clear_connection_fn) {
         ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(02477)
                      "mod_proxy must be loaded for mod_proxy_http");
@@ -2210,6 +2365,53 @@ static int proxy_http_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     return OK;
 }
 
+static void *create_proxy_http_dir_config(apr_pool_t *p, char *dummy)
+{
+    proxy_http_dir_conf *new = apr_pcalloc(p, sizeof(proxy_http_dir_conf));
+
+    new->body_buffer = MAX_MEM_SPOOL;
+    return new;
+}
+
+static void *merge_proxy_http_dir_config(apr_pool_t *p, void *basev,
+                                         void *addv)
+{
+    proxy_http_dir_conf *new = apr_pcalloc(p, sizeof(proxy_http_dir_conf));
+    proxy_http_dir_conf *base = basev;
+    proxy_http_dir_conf *add = addv;
+
+    new->body_buffer = (add->body_buffer_set == 0) ? base->body_buffer
+                                                   : add->body_buffer;
+    new->body_buffer_set = add->body_buffer_set || base->body_buffer_set;
+    return new;
+}
+
+static const char *set_body_buffer(cmd_parms *cmd, void *dconf,
+                                   const char *arg)
+{
+    proxy_http_dir_conf *conf = dconf;
+    char *end;
+
+    if (apr_strtoff(&conf->body_buffer, arg, &end, 10) != APR_SUCCESS
+            || *end || conf->body_buffer < 0
+            || conf->body_buffer > MAX_BODY_BUFFER) {
+        return apr_psprintf(cmd->pool, "ProxyRequestBodyBuffer must be a "
+                            "size in bytes up to %d, or 0 to stream the "
+                            "request body at once", MAX_BODY_BUFFER);
+    }
+    conf->body_buffer_set = 1;
+    return NULL;
+}
+
+static const command_rec proxy_http_cmds[] =
+{
+    AP_INIT_TAKE1("ProxyRequestBodyBuffer", set_body_buffer, NULL,
+                  RSRC_CONF|ACCESS_CONF,
+                  "Request body bytes read before connecting the backend, "
+                  "and kept in memory when it must be spooled"),
+    {NULL}
+};
+
 static void ap_proxy_http_register_hook(apr_pool_t *p)
 {
     ap_hook_post_config(proxy_http_post_config, NULL, NULL, APR_HOOK_MIDDLE);
@@ -2220,11 +2422,11 @@ static void ap_proxy_http_register_hook(apr_pool_t *p)
 
 AP_DECLARE_MODULE(proxy_http) = {
     STANDARD20_MODULE_STUFF,
-    NULL,              /* create per-directory config structure */
-    NULL,              /* merge per-directory config structures */
+    create_proxy_http_dir_config, /* create per-directory config structure */
+    merge_proxy_http_dir_config,  /* merge per-directory config structures */
     NULL,              /* create per-server config structure */
     NULL,              /* merge per-server config structures */
-    NULL,              /* command apr_table_t */
+    proxy_http_cmds,   /* command apr_table_t */
     ap_proxy_http_register_hook/* register hooks */
 };
 
@@ -37,6 +37,7 @@ typedef struct ws_baton_t {
 } ws_baton_t;
 
 static int can_fallback_to_proxy_http;
+static int (*ap_proxy_suspended_done_fn)(request_rec *r, int status) = NULL;
 
 static void proxy_wstunnel_callback(void *b);
 
@@ -62,6 +63,9 @@ static void proxy_wstunnel_finish(ws_baton_t *baton)
 { 
     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, baton->r, "proxy_wstunnel_finish");
     ap_proxy_release_connection(baton->scheme, baton->backend, baton->r->server);
+    if (ap_proxy_suspended_done_fn) {
+        ap_proxy_suspended_done_fn(baton->r, OK);
+    }
     ap_finalize_request_protocol(baton->r);
     ap_lingering_close(baton->r->connection);
     ap_mpm_resume_suspended(baton->r->connection);
@@ -513,6 +517,8 @@ static int proxy_wstunnel_post_config(apr_pool_t *pconf, apr_pool_t *plog,
 {
     can_fallback_to_proxy_http =
         (ap_find_linked_module("mod_proxy_http.c") != NULL);
+    ap_proxy_suspended_done_fn =
+        APR_RETRIEVE_OPTIONAL_FN(ap_proxy_suspended_done);
 
     return OK;
 }
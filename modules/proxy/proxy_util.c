@@ -37,6 +37,16 @@
 
 #if APR_HAVE_SYS_UN_H
 #include <sys/un.h>
+#include <sys/socket.h>
+#if defined(SCM_RIGHTS)
+#define PROXY_HAVE_BROKER 1
+#include <fcntl.h>
+#include <poll.h>
+#include "apr_signal.h"
+#include "apr_shm.h"
+#include "ap_listen.h"
+#include "unixd.h"
+#endif
 #endif
 #if (APR_MAJOR_VERSION < 2)
 #include "apr_support.h"        /* for apr_wait_for_io_or_timeout() */
@@ -1527,6 +1537,693 @@ static void conn_cleanup(proxy_conn_rec *conn)
     }
 }
 
+/*
+ * The idle connections of the children can be shared through a broker
+ * process (ProxySharedConnections) started by the parent. A child hands the
+ * socket of an idle connection over to the broker (SCM_RIGHTS on a unix
+ * socket) rather than closing it, when the connection is evicted from the
+ * reslist of the worker or when the child exits with its single connection
+ * (non-threaded MPMs), and a child which has no connected socket for a
+ * worker asks the broker before connecting. The broker keeps the
+ * broker_max most recent sockets of each worker and closes them once idle
+ * for broker_idle.
+ *
+ * The broker counts the sockets it keeps in a shared table, indexed by the
+ * hash of the workers' names (colliding workers adding up), so that the
+ * children ask it only when it may have one. The parent restarts the broker
+ * if it dies, the children reconnecting to it once per PROXY_BROKER_RETRY.
+ *
+ * TLS connections are never shared since their state lives in the child.
+ */
+#if PROXY_HAVE_BROKER
+#define PROXY_BROKER_SOCKET "proxy-broker"
+#define PROXY_BROKER_PUT    'P'
+#define PROXY_BROKER_GET    'G'
+#define PROXY_BROKER_FD     'F'
+#define PROXY_BROKER_NONE   'N'
+#define PROXY_BROKER_TRIES  3
+#define PROXY_BROKER_SLOTS  1024
+#define PROXY_BROKER_RETRY  apr_time_from_sec(5)
+/* Exit status of a broker which could not start, not to be restarted */
+#define PROXY_BROKER_STARTUP_ERROR 254
+
+typedef struct {
+    proxy_hashes hash;      /* of the worker's name */
+    char op;
+} proxy_broker_msg;
+
+typedef struct {
+    proxy_hashes hash;
+    int fd;
+    apr_time_t idle_since;
+} proxy_broker_conn;
+
+typedef union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+} proxy_broker_cmsg;
+
+static int broker_max = 0;
+static apr_interval_time_t broker_idle = 0;
+static const char *broker_sockname = NULL;
+static apr_uint32_t *broker_stock = NULL; /* PROXY_BROKER_SLOTS */
+
+#define BROKER_SLOT(hash) (((hash).def ^ (hash).fnv) % PROXY_BROKER_SLOTS)
+
+/* In the parent, to restart the broker */
+static apr_pool_t *broker_pconf = NULL;
+static server_rec *broker_server = NULL;
+
+/* In the children */
+static int broker_sd = -1;
+static apr_time_t broker_retry = 0;
+static apr_pool_t *broker_pool = NULL;
+static apr_array_header_t *broker_workers = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *broker_mutex = NULL;
+#endif
+
+/* In the broker, ordered from the least recently idle */
+static proxy_broker_conn *broker_conns = NULL;
+static int broker_nconns = 0, broker_nalloc = 0;
+
+/* Whether a socket is still connected with nothing pending to read, which
+ * would belong to a previous user of the connection */
+static int broker_sock_idle(apr_socket_t *sock)
+{
+    apr_pollfd_t pfd;
+    apr_status_t rv;
+    apr_int32_t nfds;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.reqevents = APR_POLLIN;
+    pfd.desc_type = APR_POLL_SOCKET;
+    pfd.desc.s = sock;
+    do {
+        rv = apr_poll(&pfd, 1, &nfds, 0);
+    } while (APR_STATUS_IS_EINTR(rv));
+
+    return (APR_STATUS_IS_TIMEUP(rv) || APR_STATUS_IS_EAGAIN(rv)
+            || (rv == APR_SUCCESS && nfds == 0));
+}
+
+static apr_status_t broker_close(void *thefd)
+{
+    int fd = (int)((long)thefd);
+
+    return close(fd);
+}
+
+static apr_status_t broker_send(int sd, const proxy_broker_msg *msg, int fd)
+{
+    proxy_broker_cmsg cmsgu;
+    struct msghdr mh;
+    struct iovec iov;
+    ssize_t rc;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = (void *)msg;
+    iov.iov_len = sizeof(*msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        struct cmsghdr *cmsg;
+
+        memset(&cmsgu, 0, sizeof(cmsgu));
+        mh.msg_control = cmsgu.buf;
+        mh.msg_controllen = sizeof(cmsgu.buf);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do {
+        rc = sendmsg(sd, &mh, 0);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        return errno;
+    }
+    return (rc == sizeof(*msg)) ? APR_SUCCESS : APR_EGENERAL;
+}
+
+static apr_status_t broker_recv(int sd, proxy_broker_msg *msg, int *fd)
+{
+    proxy_broker_cmsg cmsgu;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    int flags = MSG_WAITALL;
+    ssize_t rc;
+
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = msg;
+    iov.iov_len = sizeof(*msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsgu.buf;
+    mh.msg_controllen = sizeof(cmsgu.buf);
+
+    *fd = -1;
+    do {
+        rc = recvmsg(sd, &mh, flags);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        return errno;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (rc != sizeof(*msg)) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        return rc ? APR_EGENERAL : APR_EOF;
+    }
+    return APR_SUCCESS;
+}
+
+#define BROKER_SAME_HASH(a, b) ((a).def == (b).def && (a).fnv == (b).fnv)
+
+static void broker_remove(int i)
+{
+    apr_atomic_dec32(&broker_stock[BROKER_SLOT(broker_conns[i].hash)]);
+    broker_nconns--;
+    memmove(&broker_conns[i], &broker_conns[i + 1],
+            (broker_nconns - i) * sizeof(*broker_conns));
+}
+
+static void broker_store(const proxy_hashes *hash, int fd)
+{
+    int i, n = 0, oldest = -1;
+
+    for (i = 0; i < broker_nconns; i++) {
+        if (BROKER_SAME_HASH(broker_conns[i].hash, *hash)) {
+            if (oldest < 0) {
+                oldest = i;
+            }
+            n++;
+        }
+    }
+    if (n >= broker_max) {
+        close(broker_conns[oldest].fd);
+        broker_remove(oldest);
+    }
+    if (broker_nconns == broker_nalloc) {
+        broker_nalloc = broker_nalloc ? broker_nalloc * 2 : 16;
+        broker_conns = ap_realloc(broker_conns,
+                                  broker_nalloc * sizeof(*broker_conns));
+    }
+    broker_conns[broker_nconns].hash = *hash;
+    broker_conns[broker_nconns].fd = fd;
+    broker_conns[broker_nconns].idle_since = apr_time_now();
+    broker_nconns++;
+    apr_atomic_inc32(&broker_stock[BROKER_SLOT(*hash)]);
+}
+
+static int broker_take(const proxy_hashes *hash)
+{
+    int i, fd;
+
+    /* The most recent first, the warmest */
+    for (i = broker_nconns - 1; i >= 0; i--) {
+        if (BROKER_SAME_HASH(broker_conns[i].hash, *hash)) {
+            fd = broker_conns[i].fd;
+            broker_remove(i);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static int broker_main(apr_pool_t *p, server_rec *s, int ld)
+{
+    struct pollfd *pfds;
+    int npfds = 1, maxpfds = 16;
+    int rc;
+
+    /* The handlers inherited from the parent would keep us alive when it
+     * kills us on restart (APR_KILL_AFTER_TIMEOUT), go back to the defaults.
+     */
+    apr_signal(SIGTERM, SIG_DFL);
+    apr_signal(SIGHUP, SIG_DFL);
+    apr_signal(AP_SIG_GRACEFUL, SIG_DFL);
+
+    /* Close our copy of the listening sockets */
+    ap_close_listeners();
+
+    /* if running as root, switch to configured user/group */
+    if (ap_run_drop_privileges(p, ap_server_conf) != 0) {
+        return PROXY_BROKER_STARTUP_ERROR;
+    }
+
+    pfds = ap_malloc(maxpfds * sizeof(*pfds));
+    pfds[0].fd = ld;
+    pfds[0].events = POLLIN;
+
+    for (;;) {
+        apr_time_t now;
+        int i;
+
+        rc = poll(pfds, npfds, 1000);
+        if (rc < 0 && errno != EINTR) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, errno, s, APLOGNO(10619)
+                         "proxy connections broker: poll() failed");
+            return 1;
+        }
+
+        /* Close the connections idle for too long */
+        now = apr_time_now();
+        for (i = 0; i < broker_nconns
+                    && now - broker_conns[i].idle_since > broker_idle; i++) {
+            apr_atomic_dec32(&broker_stock[BROKER_SLOT(broker_conns[i].hash)]);
+            close(broker_conns[i].fd);
+        }
+        if (i) {
+            broker_nconns -= i;
+            memmove(broker_conns, &broker_conns[i],
+                    broker_nconns * sizeof(*broker_conns));
+        }
+        if (rc <= 0) {
+            continue;
+        }
+
+        /* Backward so that a gone child can be replaced by the last one */
+        for (i = npfds - 1; i > 0; i--) {
+            proxy_broker_msg msg;
+            int fd;
+
+            if (!pfds[i].revents) {
+                continue;
+            }
+            if (broker_recv(pfds[i].fd, &msg, &fd) != APR_SUCCESS) {
+                close(pfds[i].fd);
+                pfds[i] = pfds[--npfds];
+                continue;
+            }
+            if (msg.op == PROXY_BROKER_PUT && fd >= 0) {
+                broker_store(&msg.hash, fd);
+            }
+            else if (msg.op == PROXY_BROKER_GET) {
+                fd = broker_take(&msg.hash);
+                msg.op = (fd >= 0) ? PROXY_BROKER_FD : PROXY_BROKER_NONE;
+                broker_send(pfds[i].fd, &msg, fd);
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            else if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int sd = accept(ld, NULL, NULL);
+            if (sd >= 0) {
+                if (npfds == maxpfds) {
+                    maxpfds *= 2;
+                    pfds = ap_realloc(pfds, maxpfds * sizeof(*pfds));
+                }
+                pfds[npfds].fd = sd;
+                pfds[npfds].events = POLLIN;
+                pfds[npfds].revents = 0;
+                npfds++;
+            }
+        }
+    }
+    /* not reached */
+}
+
+/* Connect to the broker, from a child */
+static apr_status_t broker_connect(void)
+{
+    struct sockaddr_un sa;
+    struct timeval tv;
+    apr_status_t rv;
+    int sd;
+
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return errno;
+    }
+    apr_pool_cleanup_register(broker_pool, (void *)((long)sd), broker_close,
+                              apr_pool_cleanup_null);
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, broker_sockname);
+    if (connect(sd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        rv = errno;
+        apr_pool_cleanup_run(broker_pool, (void *)((long)sd), broker_close);
+        return rv;
+    }
+    fcntl(sd, F_SETFD, FD_CLOEXEC);
+
+    /* Never wait for the broker for long */
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    broker_sd = sd;
+    return APR_SUCCESS;
+}
+
+/* Send a message to the broker and get its answer for PROXY_BROKER_GET,
+ * reconnecting to it if it was lost long enough ago */
+static apr_status_t broker_exchange(proxy_broker_msg *msg, int *fd)
+{
+    apr_status_t rv = APR_ENOSOCKET;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(broker_mutex);
+#endif
+    if (broker_sd < 0 && apr_time_now() >= broker_retry
+            && broker_connect() != APR_SUCCESS) {
+        broker_retry = apr_time_now() + PROXY_BROKER_RETRY;
+    }
+    if (broker_sd >= 0) {
+        rv = broker_send(broker_sd, msg, *fd);
+        if (rv == APR_SUCCESS && msg->op == PROXY_BROKER_GET) {
+            rv = broker_recv(broker_sd, msg, fd);
+        }
+        if (rv != APR_SUCCESS) {
+            /* Gone (restarted) or out of sync, reconnect later */
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, ap_server_conf,
+                         APLOGNO(10620) "lost the proxy connections broker, "
+                         "reconnecting in %" APR_TIME_T_FMT " seconds",
+                         apr_time_sec(PROXY_BROKER_RETRY));
+            apr_pool_cleanup_run(broker_pool, (void *)((long)broker_sd),
+                                 broker_close);
+            broker_sd = -1;
+            broker_retry = apr_time_now() + PROXY_BROKER_RETRY;
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(broker_mutex);
+#endif
+
+    return rv;
+}
+
+/* Hand the socket of an idle connection over to the broker, the caller
+ * is about to close it anyway */
+static void broker_put(proxy_conn_rec *conn)
+{
+    proxy_broker_msg msg;
+    apr_os_sock_t fd;
+
+    if (!broker_pool || !conn->sock || conn->is_ssl
+            || !ap_proxy_connection_reusable(conn)
+            || !conn->worker->s->is_address_reusable
+            || !broker_sock_idle(conn->sock)
+            || apr_os_sock_get(&fd, conn->sock) != APR_SUCCESS) {
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.hash = conn->worker->s->hash;
+    msg.op = PROXY_BROKER_PUT;
+    if (broker_exchange(&msg, &fd) == APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_TRACE2, 0, ap_server_conf,
+                     "handed backend connection to %s over to the broker",
+                     ap_proxy_worker_get_name(conn->worker));
+    }
+}
+
+/* Get a connected socket for conn's worker from the broker, if any */
+static apr_socket_t *broker_get(proxy_conn_rec *conn)
+{
+    proxy_worker *worker = conn->worker;
+    int tries;
+
+    if (!broker_pool || conn->is_ssl || conn->forward
+            || !worker->s->is_address_reusable || worker->s->disablereuse) {
+        return NULL;
+    }
+
+    for (tries = 0; tries < PROXY_BROKER_TRIES; tries++) {
+        apr_os_sock_info_t info;
+        proxy_broker_msg msg;
+        apr_socket_t *sock;
+        int fd = -1;
+
+        /* Nothing to ask if the broker has none */
+        if (!apr_atomic_read32(&broker_stock[BROKER_SLOT(worker->s->hash)])) {
+            break;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.hash = worker->s->hash;
+        msg.op = PROXY_BROKER_GET;
+        if (broker_exchange(&msg, &fd) != APR_SUCCESS
+                || msg.op != PROXY_BROKER_FD || fd < 0) {
+            break;
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.os_sock = &fd;
+        info.family = conn->uds_path ? AF_UNIX
+                      : conn->addr ? conn->addr->family : APR_INET;
+        info.type = SOCK_STREAM;
+        info.protocol = conn->uds_path ? 0 : worker->s->sock_proto;
+        if (apr_os_sock_make(&sock, &info, conn->scpool) != APR_SUCCESS) {
+            close(fd);
+            break;
+        }
+        if (broker_sock_idle(sock)) {
+            return sock;
+        }
+        apr_socket_close(sock);
+    }
+
+    return NULL;
+}
+
+/* Hand the single connections over when the child exits */
+static apr_status_t broker_child_exit(void *unused)
+{
+    int i;
+
+    for (i = 0; i < broker_workers->nelts; i++) {
+        proxy_worker *worker = APR_ARRAY_IDX(broker_workers, i,
+                                             proxy_worker *);
+        if (worker->cp && worker->cp->conn) {
+            broker_put(worker->cp->conn);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static int broker_start(apr_pool_t *p, server_rec *s);
+
+#if APR_HAS_OTHER_CHILD
+/* Restart the broker should it die, like mod_cgid its daemon */
+static void broker_maint(int reason, void *data, apr_wait_t status)
+{
+    int mpm_state;
+
+    switch (reason) {
+    case APR_OC_REASON_DEATH:
+        apr_proc_other_child_unregister(data);
+        if (ap_mpm_query(AP_MPMQ_MPM_STATE, &mpm_state) != APR_SUCCESS
+                || mpm_state == AP_MPMQ_STOPPING) {
+            break;
+        }
+        if (status == PROXY_BROKER_STARTUP_ERROR) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, 0, broker_server,
+                         APLOGNO(10681) "proxy connections broker failed "
+                         "to initialize, backend connections not shared");
+            break;
+        }
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, broker_server, APLOGNO(10682)
+                     "proxy connections broker died, restarting");
+        broker_start(broker_pconf, broker_server);
+        break;
+    case APR_OC_REASON_LOST:
+        apr_proc_other_child_unregister(data);
+        broker_start(broker_pconf, broker_server);
+        break;
+    case APR_OC_REASON_RESTART:
+        /* server is stopping or restarting */
+        apr_proc_other_child_unregister(data);
+        break;
+    }
+}
+#endif
+
+/* Remove the socket when the broker goes with the configuration */
+static apr_status_t broker_unlink(void *sockname)
+{
+    if (unlink(sockname) < 0 && errno != ENOENT) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, ap_server_conf,
+                     APLOGNO(10683) "Couldn't unlink unix domain socket %s",
+                     (const char *)sockname);
+    }
+    return APR_SUCCESS;
+}
+
+static int broker_start(apr_pool_t *p, server_rec *s)
+{
+    struct sockaddr_un sa;
+    apr_proc_t *proc;
+    mode_t omask;
+    int ld, rc;
+
+    if (strlen(broker_sockname) > sizeof(sa.sun_path) - 1) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(10621)
+                     "The length of the proxy broker socket path %s exceeds "
+                     "maximum", broker_sockname);
+        return APR_EINVAL;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, broker_sockname);
+
+    if ((ld = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        rc = errno;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, APLOGNO(10622)
+                     "Couldn't create unix domain socket");
+        return rc;
+    }
+    if (unlink(broker_sockname) < 0 && errno != ENOENT) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, errno, s, APLOGNO(10623)
+                     "Couldn't unlink unix domain socket %s",
+                     broker_sockname);
+    }
+    omask = umask(0077); /* so that only Apache can use socket */
+    rc = bind(ld, (struct sockaddr *)&sa, sizeof(sa));
+    umask(omask);
+    if (rc < 0 || listen(ld, DEFAULT_LISTENBACKLOG) < 0
+            || (!geteuid() && chown(broker_sockname,
+                                    ap_unixd_config.user_id, -1) < 0)) {
+        rc = errno;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, APLOGNO(10624)
+                     "Couldn't set up unix domain socket %s",
+                     broker_sockname);
+        close(ld);
+        return rc;
+    }
+
+    /* A new broker has no sockets yet */
+    memset(broker_stock, 0, PROXY_BROKER_SLOTS * sizeof(*broker_stock));
+
+    proc = apr_pcalloc(p, sizeof(*proc));
+    if ((proc->pid = fork()) < 0) {
+        rc = errno;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, APLOGNO(10625)
+                     "Couldn't spawn the proxy connections broker");
+        close(ld);
+        return rc;
+    }
+    if (proc->pid == 0) {
+        exit(broker_main(p, s, ld));
+    }
+    close(ld);
+    apr_pool_note_subprocess(p, proc, APR_KILL_AFTER_TIMEOUT);
+#if APR_HAS_OTHER_CHILD
+    apr_proc_other_child_register(proc, broker_maint, proc, NULL, p);
+#endif
+
+    return APR_SUCCESS;
+}
+
+#else /* PROXY_HAVE_BROKER */
+#define broker_put(conn)
+#define broker_get(conn) NULL
+#endif /* PROXY_HAVE_BROKER */
+
+const char *proxy_broker_set(int max, apr_interval_time_t idle)
+{
+#if PROXY_HAVE_BROKER
+    broker_max = max;
+    broker_idle = idle;
+    return NULL;
+#else
+    return "ProxySharedConnections is not supported on this platform";
+#endif
+}
+
+void proxy_broker_pre_config(apr_pool_t *pconf)
+{
+#if PROXY_HAVE_BROKER
+    broker_max = 0;
+    broker_sockname = NULL;
+#endif
+}
+
+int proxy_broker_post_config(apr_pool_t *pconf, server_rec *s)
+{
+#if PROXY_HAVE_BROKER
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    if (!broker_max
+            || ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+
+    /* Anonymous, the broker and the children inherit it */
+    rv = apr_shm_create(&shm, PROXY_BROKER_SLOTS * sizeof(*broker_stock),
+                        NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(10684)
+                     "could not allocate the shared memory of the proxy "
+                     "connections broker");
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    broker_stock = apr_shm_baseaddr_get(shm);
+
+    broker_sockname = ap_runtime_dir_relative(pconf,
+                          ap_append_pid(pconf, PROXY_BROKER_SOCKET, "."));
+    if (!broker_sockname || broker_start(pconf, s) != APR_SUCCESS) {
+        broker_sockname = NULL;
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+    apr_pool_cleanup_register(pconf, broker_sockname, broker_unlink,
+                              apr_pool_cleanup_null);
+    broker_pconf = pconf;
+    broker_server = s;
+#endif
+    return OK;
+}
+
+void proxy_broker_child_init(apr_pool_t *p, server_rec *s)
+{
+#if PROXY_HAVE_BROKER
+    apr_status_t rv;
+
+    if (!broker_sockname) {
+        return;
+    }
+
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&broker_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10626)
+                     "couldn't connect to the proxy connections broker %s, "
+                     "backend connections not shared", broker_sockname);
+        return;
+    }
+#endif
+    broker_workers = apr_array_make(p, 8, sizeof(proxy_worker *));
+    apr_pool_pre_cleanup_register(p, NULL, broker_child_exit);
+    broker_pool = p;
+
+    rv = broker_connect();
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10680)
+                     "couldn't connect to the proxy connections broker %s, "
+                     "retrying later", broker_sockname);
+        broker_retry = apr_time_now() + PROXY_BROKER_RETRY;
+    }
+#endif
+}
+
 static apr_status_t conn_pool_cleanup(void *theworker)
 {
     /* Signal that the child is exiting */
@@ -1638,6 +2335,250 @@ static proxy_conn_rec *connection_make(apr_pool_t *p, proxy_worker *worker)
     return conn;
 }
 
+/*
+ * The idle connections released by a thread are kept in a small cache of
+ * this thread, one per worker, and reused by its next requests without
+ * contending on the reslist of the worker. They are returned to the
+ * reslist when they have been idle for PROXY_THREAD_CONN_IDLE, when their
+ * slot is needed for another worker, and when the child exits.
+ *
+ * The caches of all the threads are linked in a registry of the child, so
+ * that the idle connections of a thread no longer serving requests are
+ * reaped by the others, once per PROXY_THREAD_CONN_IDLE. A slot is taken
+ * by its thread or the reaper with an atomic compare-and-swap. When a
+ * thread created by ap_thread_create() exits, its connections are
+ * returned and its cache is left to the next thread registering.
+ *
+ * Since the connections in the cache are not in the reslist, it's only
+ * used when the reslist of the worker can hold one connection per thread
+ * (the default), otherwise the other threads might wait for them.
+ */
+#if APR_HAS_THREADS && defined(AP_THREAD_LOCAL)
+#define PROXY_THREAD_CONNS 4
+#define PROXY_THREAD_CONN_IDLE apr_time_from_sec(1)
+
+typedef struct {
+    proxy_conn_rec *volatile conn;
+    apr_time_t idle_since;
+} proxy_thread_conn;
+
+typedef struct proxy_thread_conns {
+    struct proxy_thread_conns *next;
+    int unused;                 /* its thread exited */
+    proxy_thread_conn slots[PROXY_THREAD_CONNS];
+} proxy_thread_conns;
+
+static AP_THREAD_LOCAL proxy_thread_conns *thread_conns = NULL;
+static proxy_thread_conns *thread_conns_all = NULL;
+static apr_thread_mutex_t *thread_conns_mutex = NULL;
+static apr_pool_t *thread_conns_pool = NULL;
+static volatile apr_uint32_t thread_conns_reaped = 0;
+static int thread_conns_threads = 0;
+static int thread_conns_closed = 0;
+
+static APR_INLINE int thread_conns_usable(proxy_worker *worker)
+{
+    return (thread_conns_threads > 1
+            && thread_conns_mutex && !thread_conns_closed
+            && worker->s->hmax >= thread_conns_threads
+            && worker->cp->res);
+}
+
+/* Take the connection of a slot, unless someone else did */
+static APR_INLINE proxy_conn_rec *thread_conn_take(proxy_thread_conn *tc)
+{
+    proxy_conn_rec *conn = tc->conn;
+
+    if (conn && apr_atomic_casptr((void *)&tc->conn, NULL, conn) != conn) {
+        conn = NULL;
+    }
+    return conn;
+}
+
+/* Return the connections of all the threads idle for too long (or all of
+ * them if force) to their reslist.
+ */
+static void thread_conns_reap(apr_time_t now, int force)
+{
+    apr_uint32_t sec = (apr_uint32_t)apr_time_sec(now);
+    apr_uint32_t reaped = apr_atomic_read32(&thread_conns_reaped);
+    proxy_thread_conns *tcs;
+    int i;
+
+    /* once per PROXY_THREAD_CONN_IDLE, by a single thread */
+    if (!force && (sec - reaped < apr_time_sec(PROXY_THREAD_CONN_IDLE)
+                   || apr_atomic_cas32(&thread_conns_reaped, sec,
+                                       reaped) != reaped)) {
+        return;
+    }
+
+    apr_thread_mutex_lock(thread_conns_mutex);
+    for (tcs = thread_conns_all; tcs; tcs = tcs->next) {
+        for (i = 0; i < PROXY_THREAD_CONNS; i++) {
+            proxy_thread_conn *tc = &tcs->slots[i];
+            proxy_conn_rec *conn;
+
+            if (tc->conn && (force
+                             || now - tc->idle_since > PROXY_THREAD_CONN_IDLE)
+                    && (conn = thread_conn_take(tc)) != NULL) {
+                apr_reslist_release(conn->worker->cp->res, conn);
+            }
+        }
+    }
+    apr_thread_mutex_unlock(thread_conns_mutex);
+}
+
+/* The thread exits, return its connections and leave its cache */
+static apr_status_t thread_conns_exit(void *data)
+{
+    proxy_thread_conns *tcs = data;
+    proxy_conn_rec *conn;
+    int i;
+
+    /* the child exiting reaped them all already */
+    if (thread_conns_closed) {
+        return APR_SUCCESS;
+    }
+
+    apr_thread_mutex_lock(thread_conns_mutex);
+    for (i = 0; i < PROXY_THREAD_CONNS; i++) {
+        if ((conn = thread_conn_take(&tcs->slots[i])) != NULL) {
+            apr_reslist_release(conn->worker->cp->res, conn);
+        }
+    }
+    tcs->unused = 1;
+    apr_thread_mutex_unlock(thread_conns_mutex);
+
+    thread_conns = NULL;
+    return APR_SUCCESS;
+}
+
+/* The cache of this thread, registered on first use, reusing the one of
+ * an exited thread if any */
+static proxy_thread_conns *thread_conns_self(void)
+{
+    if (!thread_conns) {
+        apr_thread_t *thd = ap_thread_current();
+        proxy_thread_conns *tcs;
+
+        apr_thread_mutex_lock(thread_conns_mutex);
+        for (tcs = thread_conns_all; tcs && !tcs->unused; tcs = tcs->next)
+            ;
+        if (tcs) {
+            tcs->unused = 0;
+        }
+        else {
+            tcs = apr_pcalloc(thread_conns_pool, sizeof(*tcs));
+            tcs->next = thread_conns_all;
+            thread_conns_all = tcs;
+        }
+        apr_thread_mutex_unlock(thread_conns_mutex);
+
+        /* otherwise the thread's exit can't be known, its cache is
+         * reaped only */
+        if (thd) {
+            apr_pool_cleanup_register(apr_thread_pool_get(thd), tcs,
+                                      thread_conns_exit,
+                                      apr_pool_cleanup_null);
+        }
+        thread_conns = tcs;
+    }
+    return thread_conns;
+}
+
+static proxy_conn_rec *thread_conns_get(proxy_worker *worker)
+{
+    proxy_thread_conns *tcs;
+    proxy_conn_rec *conn = NULL;
+    int i;
+
+    if (!thread_conns_usable(worker)) {
+        return NULL;
+    }
+
+    tcs = thread_conns_self();
+    for (i = 0; i < PROXY_THREAD_CONNS; i++) {
+        proxy_thread_conn *tc = &tcs->slots[i];
+
+        if (tc->conn && tc->conn->worker == worker
+                && (conn = thread_conn_take(tc)) != NULL) {
+            break;
+        }
+    }
+    thread_conns_reap(apr_time_now(), 0);
+
+    return conn;
+}
+
+static int thread_conns_put(proxy_conn_rec *conn)
+{
+    proxy_thread_conns *tcs;
+    proxy_thread_conn *slot = NULL;
+    proxy_conn_rec *old;
+    apr_time_t now;
+    int i;
+
+    /* Only the warm connections are worth it */
+    if (!conn->sock || !thread_conns_usable(conn->worker)) {
+        return 0;
+    }
+
+    /* Same worker, free or oldest slot, in this order */
+    tcs = thread_conns_self();
+    for (i = 0; i < PROXY_THREAD_CONNS; i++) {
+        proxy_thread_conn *tc = &tcs->slots[i];
+
+        if (tc->conn && tc->conn->worker == conn->worker) {
+            slot = tc;
+            break;
+        }
+        if (!slot || (slot->conn && (!tc->conn
+                                     || tc->idle_since < slot->idle_since))) {
+            slot = tc;
+        }
+    }
+    if ((old = thread_conn_take(slot)) != NULL) {
+        apr_reslist_release(old->worker->cp->res, old);
+    }
+
+    /* Only this thread fills its slots */
+    now = apr_time_now();
+    slot->idle_since = now;
+    apr_atomic_casptr((void *)&slot->conn, conn, NULL);
+
+    thread_conns_reap(now, 0);
+    return 1;
+}
+
+static apr_status_t thread_conns_cleanup(void *dummy)
+{
+    if (thread_conns_mutex) {
+        thread_conns_closed = 1;
+        thread_conns_reap(apr_time_now(), 1);
+    }
+    return APR_SUCCESS;
+}
+
+void proxy_thread_conns_child_init(apr_pool_t *p, server_rec *s)
+{
+    thread_conns_pool = p;
+    if (apr_thread_mutex_create(&thread_conns_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                p) != APR_SUCCESS) {
+        thread_conns_mutex = NULL;
+        return;
+    }
+    /* before the pools of the connections go */
+    apr_pool_pre_cleanup_register(p, NULL, thread_conns_cleanup);
+}
+#else
+#define thread_conns_get(worker) NULL
+#define thread_conns_put(conn) 0
+
+void proxy_thread_conns_child_init(apr_pool_t *p, server_rec *s)
+{
+}
+#endif
+
 static void connection_cleanup(void *theconn)
 {
     proxy_conn_rec *conn = (proxy_conn_rec *)theconn;
@@ -1680,7 +2621,9 @@ static void connection_cleanup(void *theconn)
 
     if (worker->s->hmax && worker->cp->res) {
         conn->inreslist = 1;
-        apr_reslist_release(worker->cp->res, (void *)conn);
+        if (!thread_conns_put(conn)) {
+            apr_reslist_release(worker->cp->res, (void *)conn);
+        }
     }
     else {
         worker->cp->conn = conn;
@@ -1748,10 +2691,13 @@ static apr_status_t connection_destructor(void *resource, void *params,
                                           apr_pool_t *pool)
 {
     proxy_worker *worker = params;
+    proxy_conn_rec *conn = resource;
+
+    /* Evicted connections may still be of use to the other children */
+    broker_put(conn);
 
     /* Destroy the pool only if not called from reslist_destroy */
     if (worker->cp) {
-        proxy_conn_rec *conn = resource;
         apr_pool_destroy(conn->pool);
     }
 
@@ -2240,12 +3186,35 @@ PROXY_DECLARE(apr_status_t) ap_proxy_share_worker(proxy_worker *worker, proxy_wo
     return APR_SUCCESS;
 }
 
-PROXY_DECLARE(apr_status_t) ap_proxy_initialize_worker(proxy_worker *worker, server_rec *s, apr_pool_t *p)
+/* The number of threads which may need a connection at the same time */
+static int proxy_max_threads(server_rec *s)
 {
     APR_OPTIONAL_FN_TYPE(http2_get_num_workers) *get_h2_num_workers;
-    apr_status_t rv = APR_SUCCESS;
     int max_threads, minw, maxw;
 
+    /*
+     * When mod_http2 is loaded we might have more threads since it has
+     * its own pool of processing threads.
+     */
+    ap_mpm_query(AP_MPMQ_MAX_THREADS, &max_threads);
+    get_h2_num_workers = APR_RETRIEVE_OPTIONAL_FN(http2_get_num_workers);
+    if (get_h2_num_workers) {
+        get_h2_num_workers(s, &minw, &maxw);
+        /* So now the max is:
+         *   max_threads-1 threads for HTTP/1 each requiring one connection
+         *   + one thread for HTTP/2 requiring maxw connections
+         */
+        max_threads = max_threads - 1 + maxw;
+    }
+
+    return max_threads;
+}
+
+PROXY_DECLARE(apr_status_t) ap_proxy_initialize_worker(proxy_worker *worker, server_rec *s, apr_pool_t *p)
+{
+    apr_status_t rv = APR_SUCCESS;
+    int max_threads;
+
     if (worker->s->status & PROXY_WORKER_INITIALIZED) {
         /* The worker is already initialized */
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00924)
@@ -2279,20 +3248,7 @@ PROXY_DECLARE(apr_status_t) ap_proxy_initialize_worker(proxy_worker *worker, ser
             worker->s->disablereuse = 1;
         }
 
-        /*
-         * When mod_http2 is loaded we might have more threads since it has
-         * its own pool of processing threads.
-         */
-        ap_mpm_query(AP_MPMQ_MAX_THREADS, &max_threads);
-        get_h2_num_workers = APR_RETRIEVE_OPTIONAL_FN(http2_get_num_workers);
-        if (get_h2_num_workers) {
-            get_h2_num_workers(s, &minw, &maxw);
-            /* So now the max is:
-             *   max_threads-1 threads for HTTP/1 each requiring one connection
-             *   + one thread for HTTP/2 requiring maxw connections
-             */
-            max_threads = max_threads - 1 + maxw;
-        }
+        max_threads = proxy_max_threads(s);
         if (max_threads > 1) {
             /* Default hmax is max_threads to scale with the load and never
              * wait for an idle connection to proceed.
@@ -2364,6 +3320,9 @@ PROXY_DECLARE(apr_status_t) ap_proxy_initialize_worker(proxy_worker *worker, ser
                 if (rv == APR_SUCCESS && worker->s->acquire_set) {
                     apr_reslist_timeout_set(worker->cp->res, worker->s->acquire);
                 }
+#if APR_HAS_THREADS && defined(AP_THREAD_LOCAL)
+                thread_conns_threads = proxy_max_threads(s);
+#endif
 
             }
             else {
@@ -2371,6 +3330,11 @@ PROXY_DECLARE(apr_status_t) ap_proxy_initialize_worker(proxy_worker *worker, ser
 
                 rv = connection_constructor(&conn, worker, worker->cp->pool);
                 worker->cp->conn = conn;
+#if PROXY_HAVE_BROKER
+                if (rv == APR_SUCCESS && broker_workers) {
+                    APR_ARRAY_PUSH(broker_workers, proxy_worker *) = worker;
+                }
+#endif
 
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(00931)
                      "initialized single connection worker in child %" APR_PID_T_FMT " for (%s:%d)",
@@ -2793,7 +3757,12 @@ PROXY_DECLARE(int) ap_proxy_acquire_connection(const char *proxy_function,
     }
 
     if (worker->s->hmax && worker->cp->res) {
-        rv = apr_reslist_acquire(worker->cp->res, (void **)conn);
+        if ((*conn = thread_conns_get(worker)) != NULL) {
+            rv = APR_SUCCESS;
+        }
+        else {
+            rv = apr_reslist_acquire(worker->cp->res, (void **)conn);
+        }
     }
     else {
         /* create the new connection if the previous was destroyed */
@@ -3818,6 +4787,39 @@ PROXY_DECLARE(int) ap_proxy_connect_backend(const char *proxy_function,
     }
     backend_addr = conn->addr;
 
+    /* An idle connection handed over by another child, if any */
+    if (rv != APR_SUCCESS && (newsock = broker_get(conn)) != NULL) {
+        apr_sockaddr_t *peer, *addr;
+
+        if (worker->s->timeout_set) {
+            apr_socket_timeout_set(newsock, worker->s->timeout);
+        }
+        else if (conf->timeout_set) {
+            apr_socket_timeout_set(newsock, conf->timeout);
+        }
+        else {
+            apr_socket_timeout_set(newsock, s->timeout);
+        }
+
+        /* The address the other child connected, among those resolved */
+        if (!conn->uds_path && apr_socket_addr_get(&peer, APR_REMOTE,
+                                                   newsock) == APR_SUCCESS) {
+            for (addr = backend_addr; addr; addr = addr->next) {
+                if (addr->port == peer->port
+                        && apr_sockaddr_equal(addr, peer)) {
+                    conn->addr = addr;
+                    break;
+                }
+            }
+        }
+        conn->sock = newsock;
+        conn->connection = NULL;
+        rv = APR_SUCCESS;
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10627)
+                     "%s: reusing backend connection from another child "
+                     "(%s:%hu)", proxy_function, conn->hostname, conn->port);
+    }
+
     while (rv != APR_SUCCESS && (backend_addr || conn->uds_path)) {
 #if APR_HAVE_SYS_UN_H
         if (conn->uds_path)
@@ -5692,6 +6694,51 @@ PROXY_DECLARE(void) ap_proxy_set_busy_count(proxy_worker *worker, apr_size_t to)
 #endif
 }
 
+/*
+ * Both parts of the key are claimed with a CAS from zero, so that among the
+ * workers sharing the slot's def the first to publish its fnv owns it and
+ * the others go on probing, without seeing a slot whose fnv is not set yet.
+ */
+PROXY_DECLARE(void *) ap_proxy_worker_slot_get(proxy_worker *worker,
+                                               void *table, apr_size_t size,
+                                               unsigned int nslots,
+                                               int probes)
+{
+    apr_uint32_t def = worker->s->hash.def ? worker->s->hash.def : 1;
+    apr_uint32_t fnv = worker->s->hash.fnv ? worker->s->hash.fnv : 1;
+    int i;
+
+    if (!table || !nslots) {
+        return NULL;
+    }
+    for (i = 0; i < probes; i++) {
+        proxy_worker_slot *slot = (proxy_worker_slot *)
+            ((char *)table + (apr_size_t)((def + i) % nslots) * size);
+        apr_uint32_t cur = apr_atomic_read32(&slot->def);
+
+        if (!cur) {
+            cur = apr_atomic_cas32(&slot->def, def, 0);
+            if (!cur) {
+                cur = def;
+            }
+        }
+        if (cur != def) {
+            continue;
+        }
+        cur = apr_atomic_read32(&slot->fnv);
+        if (!cur) {
+            cur = apr_atomic_cas32(&slot->fnv, fnv, 0);
+            if (!cur) {
+                return slot;
+            }
+        }
+        if (cur == fnv) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
 static void add_pollset(apr_pollset_t *pollset, apr_pollfd_t *pfd,
                         apr_int16_t events)
 {
@@ -40,6 +40,28 @@ extern PROXY_DECLARE_DATA const apr_strmatch_pattern *ap_proxy_strmatch_domain;
  */
 void proxy_util_register_hooks(apr_pool_t *p);
 
+/**
+ * Configure the sharing of idle backend connections between the children.
+ * @param max   The maximum number of idle connections kept per worker
+ * @param idle  The time after which an idle connection is closed
+ * @return NULL or an error message if not supported
+ */
+const char *proxy_broker_set(int max, apr_interval_time_t idle);
+
+/**
+ * Start (post_config) and connect to (child_init) the broker of the
+ * shared backend connections, if configured.
+ */
+void proxy_broker_pre_config(apr_pool_t *pconf);
+int proxy_broker_post_config(apr_pool_t *pconf, server_rec *s);
+void proxy_broker_child_init(apr_pool_t *p, server_rec *s);
+
+/**
+ * Create the registry of the per-thread caches of idle connections, and
+ * return them to their reslist when the child exits (child_init).
+ */
+void proxy_thread_conns_child_init(apr_pool_t *p, server_rec *s);
+
 /*
  * Get the busy counter from the shared worker memory
  *
@@ -75,6 +97,30 @@ PROXY_DECLARE(apr_status_t) ap_proxy_decrement_busy_count(void *worker_);
  */
 PROXY_DECLARE(void) ap_proxy_increment_busy_count(proxy_worker *worker);
 
+/*
+ * The key of a worker's slot in a table shared by the children, indexed by
+ * the hash of the worker's name; the slot types start with it.
+ */
+typedef struct {
+    apr_uint32_t def;       /* of the worker's hash, never zero once used */
+    apr_uint32_t fnv;       /* of the worker's hash, never zero once used */
+} proxy_worker_slot;
+
+/*
+ * Get the worker's slot in a shared table, claimed if needed
+ *
+ * @param worker Pointer to the worker structure.
+ * @param table  the table of slots (zeroed initially), or NULL
+ * @param size   the size of a slot, which starts with a proxy_worker_slot
+ * @param nslots the number of slots in the table
+ * @param probes the number of slots tried from the one of the worker's hash
+ * @return       the slot, or NULL if none is available
+ */
+PROXY_DECLARE(void *) ap_proxy_worker_slot_get(proxy_worker *worker,
+                                               void *table, apr_size_t size,
+                                               unsigned int nslots,
+                                               int probes);
+
 
 /*
  * interpolate an env str in a configuration string
@@ -68,6 +68,49 @@ AP_DECLARE_DATA apr_array_header_t *ap_server_config_defines = NULL;
 
 AP_DECLARE_DATA ap_directive_t *ap_conftree = NULL;
 
+/*
+ * ConfigSnapshot: the directive tree of the main configuration file (with
+ * all the Include(s) and macros expanded) is saved in a binary file, along
+ * with what it depends on, and reused as long as none of the source files
+ * changed. The EXEC_ON_READ directives which are not part of the tree (e.g.
+ * LoadModule or Define) are saved too, to be replayed before the tree is
+ * restored.
+ */
+typedef struct {
+    const char *path;
+    apr_time_t mtime;
+    apr_off_t size;
+    apr_ino_t inode;
+} snapshot_source;
+
+typedef struct {
+    const char *pattern;
+    int optional;
+    /* The files matched by the pattern, in order (const char *) */
+    apr_array_header_t *files;
+} snapshot_include;
+
+typedef struct {
+    const char *directive;
+    const char *args;
+    const char *filename;
+    unsigned line_num;
+} snapshot_exec;
+
+typedef struct {
+    apr_pool_t *pool;
+    apr_array_header_t *sources;    /* snapshot_source */
+    apr_array_header_t *includes;   /* snapshot_include * */
+    apr_array_header_t *execs;      /* snapshot_exec */
+} config_snapshot;
+
+/* Set by ConfigSnapshot, for the current (re)start only */
+static const char *config_snapshot_file = NULL;
+/* Whether the -C directives are being processed */
+static int config_snapshot_allowed = 0;
+/* Non-NULL while the main configuration file is read and recorded */
+static config_snapshot *snapshot_rec = NULL;
+
 APR_HOOK_STRUCT(
            APR_HOOK_LINK(header_parser)
            APR_HOOK_LINK(pre_config)
@@ -1171,6 +1214,20 @@ static const char *ap_build_config_sub(apr_pool_t *p, apr_pool_t *temp_pool,
             parms->err_directive = newdir;
             retval = execute_now(cmd_name, args, parms, p, temp_pool,
                                  &sub_tree, *curr_parent);
+
+            /* Sections, Include and alike only produce the sub_tree, the
+             * server-wide ones (LoadModule, Define...) have side effects
+             * which must be replayed when the snapshot is used.
+             */
+            if (snapshot_rec && !retval
+                && !(cmd->req_override & (OR_ALL | ACCESS_CONF))) {
+                snapshot_exec *e = apr_array_push(snapshot_rec->execs);
+                e->directive = newdir->directive;
+                e->args = newdir->args;
+                e->filename = newdir->filename;
+                e->line_num = newdir->line_num;
+            }
+
             if (*current) {
                 (*current)->next = sub_tree;
             }
@@ -1874,6 +1931,26 @@ AP_DECLARE(const char *) ap_process_resource_config(server_rec *s,
         dump_config_name(fname, p);
     }
 
+    if (snapshot_rec) {
+        snapshot_source *src = apr_array_push(snapshot_rec->sources);
+        apr_finfo_t finfo;
+
+        src->path = apr_pstrdup(snapshot_rec->pool, fname);
+        rv = apr_stat(&finfo, fname, APR_FINFO_MTIME | APR_FINFO_SIZE
+                                     | APR_FINFO_INODE, ptemp);
+        if (rv == APR_SUCCESS || rv == APR_INCOMPLETE) {
+            src->mtime = finfo.mtime;
+            src->size = finfo.size;
+            src->inode = finfo.inode;
+        }
+        else {
+            /* never matches, hence no snapshot */
+            src->mtime = -1;
+            src->size = -1;
+            src->inode = 0;
+        }
+    }
+
     parms.config_file = cfp;
     error = ap_build_config(&parms, p, ptemp, conftree);
     ap_cfg_closefile(cfp);
@@ -1896,14 +1973,44 @@ AP_DECLARE(const char *) ap_process_resource_config(server_rec *s,
 typedef struct {
     server_rec *s;
     ap_directive_t **conftree;
+    snapshot_include *inc;
 } configs;
 
 static const char *process_resource_config_cb(ap_dir_match_t *w, const char *fname)
 {
     configs *cfgs = w->ctx;
+    if (cfgs->inc) {
+        APR_ARRAY_PUSH(cfgs->inc->files, const char *) =
+            apr_pstrdup(snapshot_rec->pool, fname);
+    }
     return ap_process_resource_config(cfgs->s, fname, cfgs->conftree, w->p, w->ptemp);
 }
 
+static const char *process_fnmatch(ap_dir_match_t *w, const char *fname)
+{
+    if (!apr_fnmatch_test(fname)) {
+        return ap_dir_nofnmatch(w, fname);
+    }
+    else {
+        apr_status_t status;
+        const char *rootpath, *filepath = fname;
+
+        /* locate the start of the directories proper */
+        status = apr_filepath_root(&rootpath, &filepath, APR_FILEPATH_TRUENAME, w->ptemp);
+
+        /* we allow APR_SUCCESS and APR_EINCOMPLETE */
+        if (APR_ERELATIVE == status) {
+            return apr_pstrcat(w->p, "Include must have an absolute path, ", fname, NULL);
+        }
+        else if (APR_EBADPATH == status) {
+            return apr_pstrcat(w->p, "Include has a bad path, ", fname, NULL);
+        }
+
+        /* walk the filepath */
+        return ap_dir_fnmatch(w, rootpath, filepath);
+    }
+}
+
 AP_DECLARE(const char *) ap_process_fnmatch_configs(server_rec *s,
                                                     const char *fname,
                                                     ap_directive_t **conftree,
@@ -1916,6 +2023,7 @@ AP_DECLARE(const char *) ap_process_fnmatch_configs(server_rec *s,
 
     cfgs.s = s;
     cfgs.conftree = conftree;
+    cfgs.inc = NULL;
 
     w.prefix = "Include/IncludeOptional: ";
     w.p = p;
@@ -1935,27 +2043,649 @@ AP_DECLARE(const char *) ap_process_fnmatch_configs(server_rec *s,
             return NULL;
     }
 
-    if (!apr_fnmatch_test(fname)) {
-        return ap_dir_nofnmatch(&w, fname);
+    if (snapshot_rec) {
+        /* The files matched by the pattern are checked again when the
+         * snapshot is loaded, so that added/removed files are noticed.
+         */
+        cfgs.inc = apr_pcalloc(snapshot_rec->pool, sizeof(snapshot_include));
+        cfgs.inc->pattern = apr_pstrdup(snapshot_rec->pool, fname);
+        cfgs.inc->optional = optional;
+        cfgs.inc->files = apr_array_make(snapshot_rec->pool, 1,
+                                         sizeof(const char *));
+        APR_ARRAY_PUSH(snapshot_rec->includes, snapshot_include *) = cfgs.inc;
+    }
+
+    return process_fnmatch(&w, fname);
+}
+
+/*
+ * ConfigSnapshot file, in the native byte order of the host:
+ *   - magic, bom and the key (see snapshot_key()),
+ *   - the source files, as path, mtime, size and inode,
+ *   - the Include(s), as pattern, optional and the files matched,
+ *   - the EXEC_ON_READ directives to replay, as directive, args, filename
+ *     and line number,
+ *   - the filenames referenced by the nodes,
+ *   - the tree, each level being the number of nodes followed by each node
+ *     as directive, args, filename index, line number and its children.
+ * Counts are 32bit, strings are a 32bit length followed by the bytes (or
+ * SNAPSHOT_NONE for a NULL string).
+ */
+#define SNAPSHOT_MAGIC      "APCFSNP1"
+#define SNAPSHOT_MAGIC_LEN  8
+#define SNAPSHOT_BOM        0x01020304
+#define SNAPSHOT_NONE       0xFFFFFFFF
+#define SNAPSHOT_MAX_DEPTH  256
+
+typedef struct {
+    apr_file_t *f;
+    apr_status_t rv;
+} snapshot_writer;
+
+typedef struct {
+    const char *pos;
+    const char *end;
+    int bad;
+} snapshot_reader;
+
+static void snapshot_put(snapshot_writer *w, const void *buf, apr_size_t len)
+{
+    if (w->rv == APR_SUCCESS) {
+        w->rv = apr_file_write_full(w->f, buf, len, NULL);
+    }
+}
+
+static void snapshot_put_u32(snapshot_writer *w, apr_uint32_t v)
+{
+    snapshot_put(w, &v, sizeof(v));
+}
+
+static void snapshot_put_u64(snapshot_writer *w, apr_uint64_t v)
+{
+    snapshot_put(w, &v, sizeof(v));
+}
+
+static void snapshot_put_str(snapshot_writer *w, const char *str)
+{
+    if (str) {
+        apr_size_t len = strlen(str);
+        snapshot_put_u32(w, (apr_uint32_t)len);
+        snapshot_put(w, str, len);
     }
     else {
-        apr_status_t status;
-        const char *rootpath, *filepath = fname;
+        snapshot_put_u32(w, SNAPSHOT_NONE);
+    }
+}
 
-        /* locate the start of the directories proper */
-        status = apr_filepath_root(&rootpath, &filepath, APR_FILEPATH_TRUENAME, ptemp);
+static const char *snapshot_get(snapshot_reader *r, apr_size_t len)
+{
+    const char *data = r->pos;
 
-        /* we allow APR_SUCCESS and APR_EINCOMPLETE */
-        if (APR_ERELATIVE == status) {
-            return apr_pstrcat(p, "Include must have an absolute path, ", fname, NULL);
+    if (r->bad || (apr_size_t)(r->end - r->pos) < len) {
+        r->bad = 1;
+        return NULL;
+    }
+    r->pos += len;
+    return data;
+}
+
+static apr_uint32_t snapshot_get_u32(snapshot_reader *r)
+{
+    apr_uint32_t v = 0;
+    const char *data = snapshot_get(r, sizeof(v));
+    if (data) {
+        memcpy(&v, data, sizeof(v));
+    }
+    return v;
+}
+
+static apr_uint64_t snapshot_get_u64(snapshot_reader *r)
+{
+    apr_uint64_t v = 0;
+    const char *data = snapshot_get(r, sizeof(v));
+    if (data) {
+        memcpy(&v, data, sizeof(v));
+    }
+    return v;
+}
+
+static const char *snapshot_get_str(snapshot_reader *r, apr_pool_t *p)
+{
+    apr_uint32_t len = snapshot_get_u32(r);
+    const char *data;
+
+    if (r->bad || len == SNAPSHOT_NONE) {
+        return NULL;
+    }
+    data = snapshot_get(r, len);
+    return data ? apr_pstrmemdup(p, data, len) : NULL;
+}
+
+/*
+ * What the reading of the main configuration file depends on, besides the
+ * files themselves.
+ */
+static const char *snapshot_key(apr_pool_t *p, const char *confname)
+{
+    const char *key;
+    int i;
+
+    key = apr_psprintf(p, "%s (%s) %d.%d" APR_EOL_STR "%s" APR_EOL_STR
+                       "%s" APR_EOL_STR,
+                       AP_SERVER_BASEVERSION, ap_get_server_built(),
+                       MODULE_MAGIC_NUMBER_MAJOR, MODULE_MAGIC_NUMBER_MINOR,
+                       ap_server_root, confname);
+    for (i = 0; i < ap_server_config_defines->nelts; ++i) {
+        key = apr_pstrcat(p, key, "-D ",
+                          APR_ARRAY_IDX(ap_server_config_defines, i,
+                                        const char *),
+                          APR_EOL_STR, NULL);
+    }
+    for (i = 0; i < ap_server_pre_read_config->nelts; ++i) {
+        key = apr_pstrcat(p, key, "-C ",
+                          APR_ARRAY_IDX(ap_server_pre_read_config, i,
+                                        const char *),
+                          APR_EOL_STR, NULL);
+    }
+
+    return key;
+}
+
+static int snapshot_source_changed(const char *path, apr_time_t mtime,
+                                   apr_off_t size, apr_ino_t inode,
+                                   apr_pool_t *ptemp)
+{
+    apr_finfo_t finfo;
+    apr_status_t rv;
+
+    rv = apr_stat(&finfo, path, APR_FINFO_MTIME | APR_FINFO_SIZE
+                                | APR_FINFO_INODE, ptemp);
+    if (rv != APR_SUCCESS && rv != APR_INCOMPLETE) {
+        return 1;
+    }
+    return (finfo.mtime != mtime || finfo.size != size
+            || ((finfo.valid & APR_FINFO_INODE) && finfo.inode != inode));
+}
+
+static const char *snapshot_collect_cb(ap_dir_match_t *w, const char *fname)
+{
+    APR_ARRAY_PUSH((apr_array_header_t *)w->ctx, const char *) = fname;
+    return NULL;
+}
+
+static int snapshot_include_changed(snapshot_include *inc, apr_pool_t *ptemp)
+{
+    apr_array_header_t *files = apr_array_make(ptemp, inc->files->nelts,
+                                               sizeof(const char *));
+    ap_dir_match_t w;
+    int i;
+
+    w.prefix = NULL;
+    w.p = ptemp;
+    w.ptemp = ptemp;
+    w.flags = (inc->optional ? AP_DIR_FLAG_OPTIONAL : AP_DIR_FLAG_NONE)
+              | AP_DIR_FLAG_RECURSIVE;
+    w.cb = snapshot_collect_cb;
+    w.ctx = files;
+    w.depth = 0;
+
+    if (process_fnmatch(&w, inc->pattern) != NULL
+        || files->nelts != inc->files->nelts) {
+        return 1;
+    }
+    for (i = 0; i < files->nelts; ++i) {
+        if (strcmp(APR_ARRAY_IDX(files, i, const char *),
+                   APR_ARRAY_IDX(inc->files, i, const char *))) {
+            return 1;
         }
-        else if (APR_EBADPATH == status) {
-            return apr_pstrcat(p, "Include has a bad path, ", fname, NULL);
+    }
+
+    return 0;
+}
+
+static int snapshot_scan_tree(ap_directive_t *node, apr_hash_t *names,
+                              apr_array_header_t *filenames)
+{
+    for (; node; node = node->next) {
+        if (node->data) {
+            /* Opaque data attached while reading (e.g. mod_lua's inline
+             * sections) can't be saved.
+             */
+            return 0;
+        }
+        if (node->filename
+            && !apr_hash_get(names, node->filename, APR_HASH_KEY_STRING)) {
+            apr_uint32_t *idx = apr_palloc(filenames->pool, sizeof(*idx));
+            *idx = (apr_uint32_t)filenames->nelts;
+            APR_ARRAY_PUSH(filenames, const char *) = node->filename;
+            apr_hash_set(names, node->filename, APR_HASH_KEY_STRING, idx);
         }
+        if (!snapshot_scan_tree(node->first_child, names, filenames)) {
+            return 0;
+        }
+    }
 
-        /* walk the filepath */
-        return ap_dir_fnmatch(&w, rootpath, filepath);
+    return 1;
+}
+
+static void snapshot_put_tree(snapshot_writer *w, ap_directive_t *first,
+                              apr_hash_t *names)
+{
+    ap_directive_t *node;
+    apr_uint32_t count = 0;
+
+    for (node = first; node; node = node->next) {
+        ++count;
+    }
+    snapshot_put_u32(w, count);
+
+    for (node = first; node; node = node->next) {
+        apr_uint32_t *idx = NULL;
+        if (node->filename) {
+            idx = apr_hash_get(names, node->filename, APR_HASH_KEY_STRING);
+        }
+        snapshot_put_str(w, node->directive);
+        snapshot_put_str(w, node->args);
+        snapshot_put_u32(w, idx ? *idx : SNAPSHOT_NONE);
+        snapshot_put_u32(w, (apr_uint32_t)node->line_num);
+        snapshot_put_tree(w, node->first_child, names);
+    }
+}
+
+static ap_directive_t *snapshot_get_tree(snapshot_reader *r, apr_pool_t *p,
+                                         const char **filenames,
+                                         apr_uint32_t nfilenames,
+                                         ap_directive_t *parent, int depth)
+{
+    ap_directive_t *first = NULL, *last = NULL;
+    apr_uint32_t count = snapshot_get_u32(r);
+
+    if (depth > SNAPSHOT_MAX_DEPTH) {
+        r->bad = 1;
+        return NULL;
+    }
+
+    while (count-- && !r->bad) {
+        ap_directive_t *node = apr_pcalloc(p, sizeof(ap_directive_t));
+        apr_uint32_t idx;
+
+        node->directive = snapshot_get_str(r, p);
+        node->args = snapshot_get_str(r, p);
+        idx = snapshot_get_u32(r);
+        node->filename = (idx < nfilenames) ? filenames[idx] : NULL;
+        node->line_num = (int)snapshot_get_u32(r);
+        node->parent = parent;
+        node->first_child = snapshot_get_tree(r, p, filenames, nfilenames,
+                                              node, depth + 1);
+        if (!node->directive) {
+            r->bad = 1;
+        }
+
+        if (last) {
+            last->next = node;
+        }
+        else {
+            first = node;
+        }
+        last = node;
     }
+
+    return first;
+}
+
+/*
+ * Use the snapshot in place of reading confname if it is up to date.
+ * Returns zero if the configuration file has to be read, otherwise *error
+ * is set should replaying the directives fail.
+ */
+static int config_snapshot_load(server_rec *s, const char *confname,
+                                const char *snapkey,
+                                ap_directive_t **conftree,
+                                apr_pool_t *p, apr_pool_t *ptemp,
+                                const char **error)
+{
+    const char *fname = config_snapshot_file, *key, *magic, *changed = NULL;
+    const char **filenames;
+    apr_array_header_t *includes, *execs;
+    ap_directive_t *tree;
+    snapshot_reader r;
+    apr_finfo_t finfo;
+    apr_file_t *f;
+    apr_status_t rv;
+    apr_uint32_t n, i, j;
+    char *buf = NULL;
+    cmd_parms parms;
+
+    *error = NULL;
+
+    rv = apr_file_open(&f, fname, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                       APR_OS_DEFAULT, ptemp);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f);
+        if (rv == APR_SUCCESS) {
+            buf = apr_palloc(ptemp, (apr_size_t)finfo.size);
+            rv = apr_file_read_full(f, buf, (apr_size_t)finfo.size, NULL);
+        }
+        apr_file_close(f);
+    }
+    if (rv != APR_SUCCESS) {
+        if (!APR_STATUS_IS_ENOENT(rv)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, NULL, APLOGNO(10666)
+                         "Could not read configuration snapshot %s", fname);
+        }
+        return 0;
+    }
+
+    r.pos = buf;
+    r.end = buf + finfo.size;
+    r.bad = 0;
+
+    magic = snapshot_get(&r, SNAPSHOT_MAGIC_LEN);
+    if (!magic || memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN)
+        || snapshot_get_u32(&r) != SNAPSHOT_BOM) {
+        r.bad = 1;
+        goto bad;
+    }
+
+    key = snapshot_get_str(&r, ptemp);
+    if (!key || strcmp(key, snapkey)) {
+        changed = "the server or its command line";
+        goto stale;
+    }
+
+    /* The source files */
+    n = snapshot_get_u32(&r);
+    for (i = 0; i < n && !r.bad; ++i) {
+        const char *path = snapshot_get_str(&r, ptemp);
+        apr_time_t mtime = (apr_time_t)snapshot_get_u64(&r);
+        apr_off_t size = (apr_off_t)snapshot_get_u64(&r);
+        apr_ino_t inode = (apr_ino_t)snapshot_get_u64(&r);
+
+        if (!r.bad && (!path || snapshot_source_changed(path, mtime, size,
+                                                        inode, ptemp))) {
+            changed = path ? path : "a source file";
+            goto stale;
+        }
+    }
+
+    /* The Include(s), whose matched files may have changed */
+    n = snapshot_get_u32(&r);
+    includes = apr_array_make(ptemp, 1, sizeof(snapshot_include));
+    for (i = 0; i < n && !r.bad; ++i) {
+        snapshot_include *inc = apr_array_push(includes);
+        apr_uint32_t nfiles;
+
+        inc->pattern = snapshot_get_str(&r, ptemp);
+        inc->optional = (int)snapshot_get_u32(&r);
+        nfiles = snapshot_get_u32(&r);
+        inc->files = apr_array_make(ptemp, 1, sizeof(const char *));
+        for (j = 0; j < nfiles && !r.bad; ++j) {
+            APR_ARRAY_PUSH(inc->files, const char *) =
+                snapshot_get_str(&r, ptemp);
+        }
+        if (!inc->pattern) {
+            r.bad = 1;
+        }
+    }
+    for (i = 0; !r.bad && i < (apr_uint32_t)includes->nelts; ++i) {
+        snapshot_include *inc = &APR_ARRAY_IDX(includes, i, snapshot_include);
+        if (snapshot_include_changed(inc, ptemp)) {
+            changed = inc->pattern;
+            goto stale;
+        }
+    }
+
+    /* The directives to replay */
+    n = snapshot_get_u32(&r);
+    execs = apr_array_make(ptemp, 1, sizeof(snapshot_exec));
+    for (i = 0; i < n && !r.bad; ++i) {
+        snapshot_exec *e = apr_array_push(execs);
+
+        e->directive = snapshot_get_str(&r, ptemp);
+        e->args = snapshot_get_str(&r, p);
+        e->filename = snapshot_get_str(&r, p);
+        e->line_num = snapshot_get_u32(&r);
+        if (!e->directive || !e->args) {
+            r.bad = 1;
+        }
+    }
+
+    /* The tree */
+    n = snapshot_get_u32(&r);
+    if (n > (apr_uint32_t)(r.end - r.pos)) {
+        r.bad = 1;
+        goto bad;
+    }
+    filenames = apr_pcalloc(ptemp, (n + 1) * sizeof(const char *));
+    for (i = 0; i < n && !r.bad; ++i) {
+        filenames[i] = snapshot_get_str(&r, p);
+    }
+    tree = snapshot_get_tree(&r, p, filenames, n, NULL, 0);
+    if (r.bad || r.pos != r.end) {
+        r.bad = 1;
+        goto bad;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, NULL, APLOGNO(10667)
+                 "Using configuration snapshot %s for %s", fname, confname);
+
+    /* From now on there is no going back */
+    parms = default_parms;
+    parms.pool = p;
+    parms.temp_pool = ptemp;
+    parms.server = s;
+    parms.override = (RSRC_CONF | OR_ALL) & ~(OR_AUTHCFG | OR_LIMIT);
+    parms.override_opts = OPT_ALL | OPT_SYM_OWNER | OPT_MULTI;
+
+    for (i = 0; i < (apr_uint32_t)execs->nelts; ++i) {
+        snapshot_exec *e = &APR_ARRAY_IDX(execs, i, snapshot_exec);
+        ap_configfile_t *cfp = apr_pcalloc(ptemp, sizeof(*cfp));
+        ap_directive_t *dir = apr_pcalloc(ptemp, sizeof(*dir));
+        ap_directive_t *sub_tree = NULL;
+        const char *errmsg;
+
+        cfp->name = e->filename;
+        cfp->line_number = e->line_num;
+        dir->directive = e->directive;
+        dir->args = e->args;
+        dir->filename = e->filename;
+        dir->line_num = e->line_num;
+
+        parms.config_file = cfp;
+        parms.err_directive = dir;
+        errmsg = execute_now((char *)e->directive, e->args, &parms, p, ptemp,
+                             &sub_tree, NULL);
+        if (errmsg) {
+            *error = apr_psprintf(p, "Syntax error on line %d of %s: %s",
+                                  dir->line_num, dir->filename, errmsg);
+            return 1;
+        }
+    }
+
+    if (tree) {
+        if (*conftree) {
+            ap_directive_t *last = *conftree;
+            while (last->next) {
+                last = last->next;
+            }
+            last->next = tree;
+        }
+        else {
+            *conftree = tree;
+        }
+    }
+
+    return 1;
+
+bad:
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, APLOGNO(10668)
+                 "Configuration snapshot %s is invalid, ignored", fname);
+    return 0;
+
+stale:
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, NULL, APLOGNO(10669)
+                 "Configuration snapshot %s is out of date (%s changed), "
+                 "reading %s", fname, changed, confname);
+    return 0;
+}
+
+/*
+ * Save what was recorded while reading confname, tree being the resulting
+ * (top level) directives.
+ */
+static void config_snapshot_save(config_snapshot *rec, const char *confname,
+                                 const char *snapkey, ap_directive_t *tree,
+                                 apr_pool_t *ptemp)
+{
+    const char *fname = config_snapshot_file;
+    apr_array_header_t *filenames;
+    apr_hash_t *names;
+    snapshot_writer w;
+    char *tmpname;
+    apr_status_t rv;
+    int i, j;
+
+    names = apr_hash_make(ptemp);
+    filenames = apr_array_make(ptemp, 16, sizeof(const char *));
+    if (!snapshot_scan_tree(tree, names, filenames)) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, NULL, APLOGNO(10670)
+                     "Configuration snapshot %s not saved, %s contains "
+                     "module data which can't be saved", fname, confname);
+        return;
+    }
+
+    /* apr_file_mktemp() creates the file readable by its owner only, which
+     * suits a copy of the configuration.
+     */
+    tmpname = apr_pstrcat(ptemp, fname, ".XXXXXX", NULL);
+    rv = apr_file_mktemp(&w.f, tmpname, APR_FOPEN_CREATE | APR_FOPEN_WRITE
+                                        | APR_FOPEN_EXCL | APR_FOPEN_BUFFERED
+                                        | APR_FOPEN_BINARY, ptemp);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, NULL, APLOGNO(10671)
+                     "Could not save configuration snapshot %s", fname);
+        return;
+    }
+    w.rv = APR_SUCCESS;
+
+    snapshot_put(&w, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    snapshot_put_u32(&w, SNAPSHOT_BOM);
+    snapshot_put_str(&w, snapkey);
+
+    snapshot_put_u32(&w, (apr_uint32_t)rec->sources->nelts);
+    for (i = 0; i < rec->sources->nelts; ++i) {
+        snapshot_source *src = &APR_ARRAY_IDX(rec->sources, i,
+                                              snapshot_source);
+        snapshot_put_str(&w, src->path);
+        snapshot_put_u64(&w, (apr_uint64_t)src->mtime);
+        snapshot_put_u64(&w, (apr_uint64_t)src->size);
+        snapshot_put_u64(&w, (apr_uint64_t)src->inode);
+    }
+
+    snapshot_put_u32(&w, (apr_uint32_t)rec->includes->nelts);
+    for (i = 0; i < rec->includes->nelts; ++i) {
+        snapshot_include *inc = APR_ARRAY_IDX(rec->includes, i,
+                                              snapshot_include *);
+        snapshot_put_str(&w, inc->pattern);
+        snapshot_put_u32(&w, (apr_uint32_t)inc->optional);
+        snapshot_put_u32(&w, (apr_uint32_t)inc->files->nelts);
+        for (j = 0; j < inc->files->nelts; ++j) {
+            snapshot_put_str(&w, APR_ARRAY_IDX(inc->files, j, const char *));
+        }
+    }
+
+    snapshot_put_u32(&w, (apr_uint32_t)rec->execs->nelts);
+    for (i = 0; i < rec->execs->nelts; ++i) {
+        snapshot_exec *e = &APR_ARRAY_IDX(rec->execs, i, snapshot_exec);
+        snapshot_put_str(&w, e->directive);
+        snapshot_put_str(&w, e->args);
+        snapshot_put_str(&w, e->filename);
+        snapshot_put_u32(&w, e->line_num);
+    }
+
+    snapshot_put_u32(&w, (apr_uint32_t)filenames->nelts);
+    for (i = 0; i < filenames->nelts; ++i) {
+        snapshot_put_str(&w, APR_ARRAY_IDX(filenames, i, const char *));
+    }
+    snapshot_put_tree(&w, tree, names);
+
+    rv = w.rv;
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_close(w.f);
+    }
+    else {
+        apr_file_close(w.f);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_rename(tmpname, fname, ptemp);
+    }
+    if (rv != APR_SUCCESS) {
+        apr_file_remove(tmpname, ptemp);
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, NULL, APLOGNO(10672)
+                     "Could not save configuration snapshot %s", fname);
+    }
+}
+
+/*
+ * Read confname, from the snapshot if it is up to date, otherwise from the
+ * files and save the snapshot for next time.
+ */
+static const char *process_config_snapshot(server_rec *s,
+                                           const char *confname,
+                                           ap_directive_t **conftree,
+                                           apr_pool_t *p, apr_pool_t *ptemp)
+{
+    config_snapshot *rec;
+    ap_directive_t *last = *conftree;
+    const char *error, *snapkey;
+
+    /* Before reading the files, whose Define(s) add to the defines */
+    snapkey = snapshot_key(ptemp, confname);
+
+    /* DUMP_INCLUDES wants to see the files being read */
+    if (!ap_exists_config_define("DUMP_INCLUDES")
+        && config_snapshot_load(s, confname, snapkey, conftree, p, ptemp,
+                                &error)) {
+        return error;
+    }
+
+    while (last && last->next) {
+        last = last->next;
+    }
+
+    rec = apr_pcalloc(ptemp, sizeof(config_snapshot));
+    rec->pool = ptemp;
+    rec->sources = apr_array_make(ptemp, 16, sizeof(snapshot_source));
+    rec->includes = apr_array_make(ptemp, 16, sizeof(snapshot_include *));
+    rec->execs = apr_array_make(ptemp, 16, sizeof(snapshot_exec));
+
+    snapshot_rec = rec;
+    error = ap_process_resource_config(s, confname, conftree, p, ptemp);
+    snapshot_rec = NULL;
+
+    if (!error) {
+        config_snapshot_save(rec, confname, snapkey,
+                             last ? last->next : *conftree, ptemp);
+    }
+
+    return error;
+}
+
+const char *ap_set_config_snapshot(cmd_parms *cmd, void *dummy,
+                                   const char *arg)
+{
+    if (!config_snapshot_allowed) {
+        return apr_pstrcat(cmd->pool, cmd->cmd->name, " can only be given "
+                           "on the command line with -C", NULL);
+    }
+
+    config_snapshot_file = ap_server_root_relative(cmd->pool, arg);
+    if (!config_snapshot_file) {
+        return apr_pstrcat(cmd->pool, "Invalid ", cmd->cmd->name, " path ",
+                           arg, NULL);
+    }
+
+    return NULL;
 }
 
 AP_DECLARE(int) ap_process_config_tree(server_rec *s,
@@ -2325,8 +3055,11 @@ AP_DECLARE(server_rec*) ap_read_config(process_rec *process, apr_pool_t *ptemp,
     }
 
     /* All server-wide config files now have the SAME syntax... */
+    config_snapshot_file = NULL;
+    config_snapshot_allowed = 1;
     error = process_command_config(s, ap_server_pre_read_config, conftree,
                                    p, ptemp);
+    config_snapshot_allowed = 0;
     if (error) {
         ap_log_error(APLOG_MARK, APLOG_STARTUP|APLOG_CRIT, 0, NULL, "%s: %s",
                      ap_server_argv0, error);
@@ -2345,7 +3078,12 @@ AP_DECLARE(server_rec*) ap_read_config(process_rec *process, apr_pool_t *ptemp,
         return NULL;
     }
 
-    error = ap_process_resource_config(s, confname, conftree, p, ptemp);
+    if (config_snapshot_file) {
+        error = process_config_snapshot(s, confname, conftree, p, ptemp);
+    }
+    else {
+        error = ap_process_resource_config(s, confname, conftree, p, ptemp);
+    }
     if (error) {
         ap_log_error(APLOG_MARK, APLOG_STARTUP|APLOG_CRIT, 0, NULL,
                      "%s: %s", ap_server_argv0, error);
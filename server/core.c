@@ -4830,6 +4830,10 @@ AP_INIT_TAKE1("DefaultRuntimeDir", set_runtime_dir, NULL, RSRC_CONF | EXEC_ON_RE
   "Common directory for run-time files (shared memory, locks, etc.)"),
 AP_INIT_TAKE1("DefaultStateDir", set_state_dir, NULL, RSRC_CONF | EXEC_ON_READ,
   "Common directory for persistent state (databases, long-lived caches, etc.)"),
+AP_INIT_TAKE1("ConfigSnapshot", ap_set_config_snapshot, NULL,
+  RSRC_CONF | EXEC_ON_READ,
+  "File where the parsed main configuration file is saved and reused from "
+  "while the source files are unchanged (command line only)"),
 AP_INIT_TAKE12("ErrorLog", set_errorlog,
   (void *)APR_OFFSETOF(server_rec, error_fname), RSRC_CONF,
   "The filename of the error log"),
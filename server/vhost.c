@@ -22,6 +22,7 @@
 
 #include "apr.h"
 #include "apr_strings.h"
+#include "apr_hash.h"
 #include "apr_lib.h"
 #include "apr_version.h"
 
@@ -54,13 +55,43 @@
  * lists of name-vhosts.
  */
 typedef struct name_chain name_chain;
+typedef struct name_index name_index;
 struct name_chain {
     name_chain *next;
     server_addr_rec *sar;       /* the record causing it to be in
                                  * this chain (needed for port comparisons) */
     server_rec *server;         /* the server to use on a match */
+    int order;                  /* position in the chain */
+    name_index *index;          /* the names index of the chain, if any
+                                 * (set on the first record only) */
 };
 
+/* Index of the names of the servers in a (long) name_chain, so that the
+ * server matching a request's Host is found with a few hash lookups
+ * rather than by comparing the Host against all the names in the chain.
+ *
+ * Each hash maps a lowercased name to the array of name_chain records
+ * having it, in chain order. Since the linear lookup returns the first
+ * match in the chain, the match with the lowest order wins.
+ */
+struct name_index {
+    apr_hash_t *names;          /* ServerName and exact ServerAlias */
+    apr_hash_t *suffixes;       /* ".example.com" for "*.example.com" */
+    apr_hash_t *virthosts;      /* names from the <VirtualHost> line */
+    apr_array_header_t *wild_names; /* other wildcard ServerAlias, in
+                                     * chain order (wild_name) */
+};
+
+typedef struct {
+    const char *pattern;
+    name_chain *nc;
+} wild_name;
+
+/* Minimum number of records in a name_chain for it to be indexed. */
+#ifndef NAME_INDEX_MIN_CHAIN
+#define NAME_INDEX_MIN_CHAIN 16
+#endif
+
 /* meta-list of ip addresses.  Each server_rec can be in possibly multiple
  * hash chains since it can have multiple ips.
  */
@@ -383,6 +414,8 @@ static name_chain *new_name_chain(apr_pool_t *p,
     new->server = s;
     new->sar = sar;
     new->next = NULL;
+    new->order = 0;
+    new->index = NULL;
     return new;
 }
 
@@ -561,6 +594,89 @@ static void add_name_vhost_config(apr_pool_t *p, server_rec *main_s,
    }
 }
 
+static void add_to_name_index(apr_pool_t *p, apr_hash_t *hash,
+                              const char *name, name_chain *nc)
+{
+    apr_array_header_t *arr;
+    char *key;
+
+    if (!name || !*name) {
+        return;
+    }
+
+    key = apr_pstrdup(p, name);
+    ap_str_tolower(key);
+
+    arr = apr_hash_get(hash, key, APR_HASH_KEY_STRING);
+    if (!arr) {
+        arr = apr_array_make(p, 1, sizeof(name_chain *));
+        apr_hash_set(hash, key, APR_HASH_KEY_STRING, arr);
+    }
+    else if (APR_ARRAY_IDX(arr, arr->nelts - 1, name_chain *) == nc) {
+        /* e.g. ServerAlias same as ServerName */
+        return;
+    }
+    APR_ARRAY_PUSH(arr, name_chain *) = nc;
+}
+
+static void build_name_index(apr_pool_t *p, name_chain *names)
+{
+    name_index *idx;
+    name_chain *nc;
+    int order = 0;
+    int i;
+
+    for (nc = names; nc; nc = nc->next) {
+        nc->order = order++;
+    }
+    if (order < NAME_INDEX_MIN_CHAIN) {
+        return;
+    }
+
+    idx = apr_palloc(p, sizeof(*idx));
+    idx->names = apr_hash_make(p);
+    idx->suffixes = apr_hash_make(p);
+    idx->virthosts = apr_hash_make(p);
+    idx->wild_names = apr_array_make(p, 0, sizeof(wild_name));
+
+    for (nc = names; nc; nc = nc->next) {
+        server_rec *s = nc->server;
+        char **name;
+
+        add_to_name_index(p, idx->virthosts, nc->sar->virthost, nc);
+        add_to_name_index(p, idx->names, s->server_hostname, nc);
+
+        if (s->names) {
+            name = (char **)s->names->elts;
+            for (i = 0; i < s->names->nelts; ++i) {
+                add_to_name_index(p, idx->names, name[i], nc);
+            }
+        }
+        if (s->wild_names) {
+            name = (char **)s->wild_names->elts;
+            for (i = 0; i < s->wild_names->nelts; ++i) {
+                if (!name[i]) {
+                    continue;
+                }
+                /* "*.example.com" matches any name ending with the
+                 * ".example.com" suffix, anything else is kept aside.
+                 */
+                if (name[i][0] == '*' && name[i][1] == '.'
+                    && !strpbrk(name[i] + 1, "*?")) {
+                    add_to_name_index(p, idx->suffixes, name[i] + 1, nc);
+                }
+                else {
+                    wild_name *w = apr_array_push(idx->wild_names);
+                    w->pattern = name[i];
+                    w->nc = nc;
+                }
+            }
+        }
+    }
+
+    names->index = idx;
+}
+
 /* compile the tables and such we need to do the run-time vhost lookups */
 AP_DECLARE(void) ap_fini_vhost_config(apr_pool_t *p, server_rec *main_s)
 {
@@ -677,6 +793,18 @@ AP_DECLARE(void) ap_fini_vhost_config(apr_pool_t *p, server_rec *main_s)
         }
     }
 
+    /* index the names of the name-vhosts chains */
+    for (i = 0; i <= IPHASH_TABLE_SIZE; ++i) {
+        ipaddr_chain *ic;
+
+        ic = (i < IPHASH_TABLE_SIZE) ? iphash_table[i] : default_list;
+        for (; ic; ic = ic->next) {
+            if (ic->names) {
+                build_name_index(p, ic->names);
+            }
+        }
+    }
+
 #ifdef IPHASH_STATISTICS
     dump_iphash_statistics(main_s);
 #endif
@@ -977,6 +1105,84 @@ AP_DECLARE(int) ap_matches_request_vhost(request_rec *r, const char *host,
 }
 
 
+static APR_INLINE int name_chain_port_matches(name_chain *nc,
+                                               apr_port_t port)
+{
+    return nc->sar->host_port == 0 || port == nc->sar->host_port;
+}
+
+/*
+ * Returns the first record of the chain having the given name and a
+ * matching port, if it comes before best, or best otherwise.
+ */
+static name_chain *find_in_name_index(apr_hash_t *hash, const char *name,
+                                      apr_port_t port, name_chain *best)
+{
+    apr_array_header_t *arr;
+    int i;
+
+    arr = apr_hash_get(hash, name, APR_HASH_KEY_STRING);
+    if (arr) {
+        for (i = 0; i < arr->nelts; ++i) {
+            name_chain *nc = APR_ARRAY_IDX(arr, i, name_chain *);
+
+            if (best && nc->order >= best->order) {
+                break;
+            }
+            if (name_chain_port_matches(nc, port)) {
+                return nc;
+            }
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Indexed equivalent of the name_chain walk in update_server_from_aliases.
+ */
+static server_rec *lookup_name_index(request_rec *r, name_index *idx,
+                                     const char *host, apr_port_t port)
+{
+    name_chain *best;
+    const char *c;
+    int i;
+
+    for (c = host; *c; ++c) {
+        if (apr_isupper(*c)) {
+            char *lhost = apr_pstrdup(r->pool, host);
+            ap_str_tolower(lhost);
+            host = lhost;
+            break;
+        }
+    }
+
+    /* ServerName and ServerAlias */
+    best = find_in_name_index(idx->names, host, port, NULL);
+    for (c = strchr(host, '.'); c; c = strchr(c + 1, '.')) {
+        best = find_in_name_index(idx->suffixes, c, port, best);
+    }
+    for (i = 0; i < idx->wild_names->nelts; ++i) {
+        wild_name *w = &APR_ARRAY_IDX(idx->wild_names, i, wild_name);
+
+        if (best && w->nc->order >= best->order) {
+            break;
+        }
+        if (name_chain_port_matches(w->nc, port)
+            && !ap_strcasecmp_match(host, w->pattern)) {
+            best = w->nc;
+            break;
+        }
+    }
+
+    /* Fallback: the virthost from the sar */
+    if (!best) {
+        best = find_in_name_index(idx->virthosts, host, port, NULL);
+    }
+
+    return best ? best->server : NULL;
+}
+
 /*
  * Updates r->server from ServerName/ServerAlias. Per the interaction
  * of ip and name-based vhosts, it only looks in the best match from the
@@ -1010,6 +1216,15 @@ static int update_server_from_aliases(request_rec *r)
 
     port = r->connection->local_addr->port;
 
+    src = r->connection->vhost_lookup_data;
+    if (src && src->index) {
+        s = lookup_name_index(r, src->index, host, port);
+        if (s) {
+            goto found;
+        }
+        return HTTP_BAD_REQUEST;
+    }
+
     /* Recall that the name_chain is a list of server_addr_recs, some of
      * whose ports may not match.  Also each server may appear more than
      * once in the chain -- specifically, it will appear once for each
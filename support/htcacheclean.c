@@ -29,6 +29,7 @@
 #include "apr_file_info.h"
 #include "apr_pools.h"
 #include "apr_hash.h"
+#include "apr_tables.h"
 #include "apr_thread_proc.h"
 #include "apr_signal.h"
 #include "apr_getopt.h"
@@ -71,6 +72,9 @@
 
 #define DIRINFO (APR_FINFO_MTIME|APR_FINFO_SIZE|APR_FINFO_TYPE|APR_FINFO_LINK)
 
+#define JOURNAL_CHUNK  (16 * MBYTE) /* journal bytes read per run at most */
+#define JOURNAL_ROTATE (4 * MBYTE)  /* rotate the journal past this offset */
+
 typedef struct _direntry {
     APR_RING_ENTRY(_direntry) link;
     int type;         /* type of file/fileset: TEMP, HEADER, DATA, HEADERDATA */
@@ -92,6 +96,24 @@ typedef struct _entry {
     char *basename;           /* fileset base name */
 } ENTRY;
 
+typedef struct _jentry {
+    apr_time_t atime;         /* time of the last store or access */
+    apr_time_t expire;        /* cache entry expiration time */
+    apr_off_t size;           /* headers and body files size */
+    char *basename;           /* fileset base name */
+} JENTRY;
+
+/* the index of the cache maintained from the journal, with -j */
+typedef struct {
+    apr_pool_t *parent;       /* pool living as long as the process */
+    apr_pool_t *pool;         /* pool of the index, recycled when compacted */
+    apr_hash_t *entries;      /* JENTRY by basename */
+    apr_off_t offset;         /* read offset in the journal */
+    apr_ino_t inode;          /* of the journal, 0 if unknown */
+    apr_off_t removed;        /* entries removed since the last compaction */
+    int rotated;              /* the journal was renamed to the old one */
+} JOURNAL;
+
 
 static int delcount;    /* file deletion count for nice mode */
 static int interrupted; /* flag: true if SIGINT or SIGTERM occurred */
@@ -1084,6 +1106,348 @@ static void purge(char *path, apr_pool_t *pool, apr_off_t max,
     }
 }
 
+/*
+ * add or replace an entry in the journal index
+ */
+static void journal_set(JOURNAL *j, const char *basename, apr_off_t size,
+        apr_time_t atime, apr_time_t expire)
+{
+    JENTRY *je = apr_hash_get(j->entries, basename, APR_HASH_KEY_STRING);
+
+    if (!je) {
+        je = apr_palloc(j->pool, sizeof(JENTRY));
+        je->basename = apr_pstrdup(j->pool, basename);
+        apr_hash_set(j->entries, je->basename, APR_HASH_KEY_STRING, je);
+    }
+    je->size = size;
+    je->atime = atime;
+    je->expire = expire;
+}
+
+static void journal_unset(JOURNAL *j, const char *basename)
+{
+    if (apr_hash_get(j->entries, basename, APR_HASH_KEY_STRING)) {
+        apr_hash_set(j->entries, basename, APR_HASH_KEY_STRING, NULL);
+        j->removed++;
+    }
+}
+
+/*
+ * apply the complete lines of a journal buffer to the index, returning
+ * the number of bytes consumed
+ */
+static apr_size_t journal_apply(JOURNAL *j, char *buf, apr_size_t len)
+{
+    char *line = buf, *eol, *last;
+    char *op, *stime, *ssize, *sexpire, *name;
+    JENTRY *je;
+
+    while ((eol = memchr(line, '\n', len - (line - buf)))) {
+        *eol = '\0';
+
+        op = apr_strtok(line, " ", &last);
+        stime = apr_strtok(NULL, " ", &last);
+        ssize = apr_strtok(NULL, " ", &last);
+        sexpire = apr_strtok(NULL, " ", &last);
+        name = apr_strtok(NULL, "", &last);
+        line = eol + 1;
+
+        /* ignore anything malformed, the journal is advisory */
+        if (!op || !stime || !ssize || !sexpire || !name || op[1]) {
+            continue;
+        }
+
+        switch (*op) {
+        case 'S':
+            journal_set(j, name, apr_atoi64(ssize),
+                    apr_time_from_sec(apr_atoi64(stime)),
+                    apr_atoi64(sexpire) > 0 ?
+                    apr_time_from_sec(apr_atoi64(sexpire)) : APR_DATE_BAD);
+            break;
+        case 'A':
+            je = apr_hash_get(j->entries, name, APR_HASH_KEY_STRING);
+            if (je) {
+                je->atime = apr_time_from_sec(apr_atoi64(stime));
+            }
+            break;
+        case 'R':
+            journal_unset(j, name);
+            break;
+        }
+    }
+
+    return line - buf;
+}
+
+/*
+ * read the journal from the given offset, at most JOURNAL_CHUNK bytes,
+ * and apply it to the index. Returns APR_EOF once the end of the journal
+ * is reached, APR_SUCCESS if there is more to read.
+ */
+static apr_status_t journal_read(JOURNAL *j, const char *file,
+        apr_pool_t *pool)
+{
+    apr_file_t *fd;
+    apr_finfo_t finfo;
+    apr_status_t status;
+    apr_size_t len, used;
+    apr_off_t offset, left;
+    char *buf;
+
+    status = apr_file_open(&fd, file, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                           APR_OS_DEFAULT, pool);
+    if (status != APR_SUCCESS) {
+        return APR_STATUS_IS_ENOENT(status) ? APR_EOF : status;
+    }
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_INODE, fd);
+    if (status != APR_SUCCESS && status != APR_INCOMPLETE) {
+        apr_file_close(fd);
+        return status;
+    }
+    if (!(finfo.valid & APR_FINFO_INODE)) {
+        finfo.inode = 0;
+    }
+    if (finfo.size < j->offset || (j->inode && finfo.inode != j->inode)) {
+        /* the journal was truncated or replaced behind our back, like
+         * httpd does when it grows too large
+         */
+        apr_file_close(fd);
+        return APR_EGENERAL;
+    }
+    j->inode = finfo.inode;
+
+    left = finfo.size - j->offset;
+    if (left > JOURNAL_CHUNK) {
+        left = JOURNAL_CHUNK;
+    }
+    if (!left) {
+        apr_file_close(fd);
+        return APR_EOF;
+    }
+
+    offset = j->offset;
+    status = apr_file_seek(fd, APR_SET, &offset);
+    if (status == APR_SUCCESS) {
+        len = (apr_size_t)left;
+        buf = apr_palloc(pool, len);
+        status = apr_file_read_full(fd, buf, len, &len);
+        if (status == APR_SUCCESS || APR_STATUS_IS_EOF(status)) {
+            /* a partial last line is read again on the next run */
+            used = journal_apply(j, buf, len);
+            j->offset += used;
+            status = (j->offset + (apr_off_t)(len - used) >= finfo.size) ?
+                     APR_EOF : APR_SUCCESS;
+        }
+    }
+    apr_file_close(fd);
+
+    return status;
+}
+
+/*
+ * build the journal index from a full scan of the cache
+ */
+static int journal_bootstrap(JOURNAL *j, char *path, apr_pool_t *pool)
+{
+    apr_finfo_t finfo;
+    apr_off_t nodes = 0;
+    apr_status_t status;
+    ENTRY *e;
+
+    if (j->pool) {
+        apr_pool_destroy(j->pool);
+    }
+    apr_pool_create(&j->pool, j->parent);
+    /* set once the scan succeeded, for the next update to retry it */
+    j->entries = NULL;
+    j->removed = 0;
+    j->rotated = 0;
+
+    /* anything journaled during the scan is applied after it */
+    j->offset = 0;
+    j->inode = 0;
+    status = apr_stat(&finfo, apr_pstrcat(pool, path, "/", CACHE_JOURNAL_FILE,
+                                          NULL),
+                      APR_FINFO_SIZE | APR_FINFO_INODE, pool);
+    if (status == APR_SUCCESS || status == APR_INCOMPLETE) {
+        j->offset = finfo.size;
+        if (finfo.valid & APR_FINFO_INODE) {
+            j->inode = finfo.inode;
+        }
+    }
+    apr_file_remove(apr_pstrcat(pool, path, "/", CACHE_JOURNAL_OLD, NULL),
+                    pool);
+
+    if (process_dir(path, pool, &nodes)) {
+        return 1;
+    }
+
+    j->entries = apr_hash_make(j->pool);
+    for (e = APR_RING_FIRST(&root.link);
+         e != APR_RING_SENTINEL(&root.link, _entry, link);
+         e = APR_RING_NEXT(e, link)) {
+        journal_set(j, e->basename, e->hsize + e->dsize,
+                    e->dtime > e->htime ? e->dtime : e->htime, e->expire);
+    }
+
+    return 0;
+}
+
+/*
+ * bring the journal index up to date
+ */
+static int journal_update(JOURNAL *j, char *path, apr_pool_t *pool)
+{
+    char *file = apr_pstrcat(pool, path, "/", CACHE_JOURNAL_FILE, NULL);
+    char *old = apr_pstrcat(pool, path, "/", CACHE_JOURNAL_OLD, NULL);
+    apr_status_t status;
+
+    if (!j->entries) {
+        if (journal_bootstrap(j, path, pool)) {
+            return 1;
+        }
+    }
+
+    /* the tail of the rotated journal, which httpd children may have
+     * appended to after we last read it
+     */
+    if (j->rotated) {
+        do {
+            status = journal_read(j, old, pool);
+        } while (status == APR_SUCCESS && !interrupted);
+        if (status != APR_EOF) {
+            return journal_bootstrap(j, path, pool);
+        }
+        apr_file_remove(old, pool);
+        j->offset = 0;
+        j->inode = 0;
+        j->rotated = 0;
+    }
+
+    status = journal_read(j, file, pool);
+    if (status == APR_EGENERAL) {
+        return journal_bootstrap(j, path, pool);
+    }
+    if (status == APR_EOF && j->offset >= JOURNAL_ROTATE && !dryrun) {
+        if (apr_file_rename(file, old, pool) == APR_SUCCESS) {
+            j->rotated = 1;
+        }
+    }
+
+    return interrupted != 0;
+}
+
+static int journal_compare(const void *a, const void *b)
+{
+    const JENTRY *ja = *(const JENTRY * const *)a;
+    const JENTRY *jb = *(const JENTRY * const *)b;
+
+    return (ja->atime > jb->atime) - (ja->atime < jb->atime);
+}
+
+/*
+ * purge cache entries, least recently used first, using the journal
+ * index; the number of inodes is estimated from the number of entries
+ */
+static void journal_purge(JOURNAL *j, char *path, apr_pool_t *pool,
+        apr_off_t max, apr_off_t inodes, apr_off_t round)
+{
+    apr_array_header_t *arr;
+    apr_hash_index_t *hi;
+    JENTRY *je, **list;
+    struct stats s;
+    int i, pass;
+
+    s.sum = 0;
+    s.entries = 0;
+    s.dfuture = 0;
+    s.dexpired = 0;
+    s.dfresh = 0;
+    s.max = max;
+    s.inodes = inodes;
+
+    arr = apr_array_make(pool, apr_hash_count(j->entries), sizeof(JENTRY *));
+    for (hi = apr_hash_first(pool, j->entries); hi; hi = apr_hash_next(hi)) {
+        void *hvalue;
+
+        apr_hash_this(hi, NULL, NULL, &hvalue);
+        je = hvalue;
+        APR_ARRAY_PUSH(arr, JENTRY *) = je;
+        s.sum += round_up((apr_size_t)je->size, round);
+        s.entries++;
+    }
+    s.nodes = s.ntotal = s.entries * 2;
+    s.total = s.sum;
+    s.etotal = s.entries;
+
+    list = (JENTRY **)arr->elts;
+    qsort(list, arr->nelts, sizeof(JENTRY *), journal_compare);
+
+    /* entries from the future first, then the expired ones, then the
+     * least recently used ones
+     */
+    for (pass = 0; pass < 3 && !interrupted; pass++) {
+        for (i = 0; i < arr->nelts && !interrupted; i++) {
+            je = list[i];
+            if (!je) {
+                continue;
+            }
+            if ((!s.max || s.sum <= s.max)
+                    && (!s.inodes || s.nodes <= s.inodes)) {
+                break;
+            }
+            if (pass == 0 && je->atime <= now) {
+                continue;
+            }
+            if (pass == 1 && (je->expire == APR_DATE_BAD
+                              || je->expire >= now)) {
+                continue;
+            }
+            delete_entry(path, je->basename, &s.nodes, pool);
+            s.sum -= round_up((apr_size_t)je->size, round);
+            s.entries--;
+            if (pass == 0) {
+                s.dfuture++;
+            }
+            else if (pass == 1) {
+                s.dexpired++;
+            }
+            else {
+                s.dfresh++;
+            }
+            journal_unset(j, je->basename);
+            list[i] = NULL;
+        }
+    }
+
+    /* recycle the memory of the removed entries once they dominate */
+    if (!interrupted && j->removed > (apr_off_t)apr_hash_count(j->entries)) {
+        apr_pool_t *p;
+        apr_hash_t *entries;
+
+        apr_pool_create(&p, j->parent);
+        entries = apr_hash_make(p);
+        for (hi = apr_hash_first(pool, j->entries); hi;
+             hi = apr_hash_next(hi)) {
+            JENTRY *copy;
+            void *hvalue;
+
+            apr_hash_this(hi, NULL, NULL, &hvalue);
+            copy = apr_pmemdup(p, hvalue, sizeof(JENTRY));
+            copy->basename = apr_pstrdup(p, copy->basename);
+            apr_hash_set(entries, copy->basename, APR_HASH_KEY_STRING, copy);
+        }
+        apr_pool_destroy(j->pool);
+        j->pool = p;
+        j->entries = entries;
+        j->removed = 0;
+    }
+
+    if (!interrupted) {
+        printstats(path, &s);
+    }
+}
+
 static apr_status_t remove_directory(apr_pool_t *pool, const char *dir)
 {
     apr_status_t rv;
@@ -1283,7 +1647,8 @@ static void usage(const char *error)
     apr_file_printf(errfile,
     "%s -- program for cleaning the disk cache."                             NL
     "Usage: %s [-Dvtrn] -pPATH [-lLIMIT] [-LLIMIT] [-PPIDFILE]"              NL
-    "       %s [-nti] -dINTERVAL -pPATH [-lLIMIT] [-LLIMIT] [-PPIDFILE]"     NL
+    "       %s [-nt] [-i|-j] -dINTERVAL -pPATH [-lLIMIT] [-LLIMIT]"          NL
+    "          [-PPIDFILE]"                                                  NL
     "       %s [-Dvt] -pPATH URL ..."                                        NL
                                                                              NL
     "Options:"                                                               NL
@@ -1328,6 +1693,11 @@ static void usage(const char *error)
     "       the disk cache. This option is only possible together with the"  NL
     "       -d option."                                                      NL
                                                                              NL
+    "  -j   Clean incrementally from the journal kept by mod_cache_disk"     NL
+    "       (CacheJournal on), after a single full scan at startup. This"    NL
+    "       option is only possible together with the -d option, and is"     NL
+    "       mutually exclusive with the -i option."                          NL
+                                                                             NL
     "  -a   List the URLs currently stored in the cache. Variants of the"    NL
     "       same URL will be listed once for each variant."                  NL
                                                                              NL
@@ -1393,6 +1763,8 @@ int main(int argc, const char * const argv[])
     apr_finfo_t info;
     apr_file_t *pidfile;
     int retries, isdaemon, limit_found, inodes_found, intelligent, dowork;
+    int journaled;
+    JOURNAL journal;
     char opt;
     const char *arg;
     char *proxypath, *path, *pidfilename;
@@ -1411,6 +1783,8 @@ int main(int argc, const char * const argv[])
     benice = 0;
     deldirs = 0;
     intelligent = 0;
+    journaled = 0;
+    memset(&journal, 0, sizeof(journal));
     previous = 0; /* avoid compiler warning */
     proxypath = NULL;
     pidfilename = NULL;
@@ -1428,6 +1802,7 @@ int main(int argc, const char * const argv[])
         return 1;
     }
     apr_pool_abort_set(oom, pool);
+    journal.parent = pool;
     apr_file_open_stderr(&errfile, pool);
     apr_file_open_stdout(&outfile, pool);
     apr_signal(SIGINT, setterm);
@@ -1436,7 +1811,7 @@ int main(int argc, const char * const argv[])
     apr_getopt_init(&o, pool, argc, argv);
 
     while (1) {
-        status = apr_getopt(o, "iDnvrtd:l:L:p:P:R:aA", &opt, &arg);
+        status = apr_getopt(o, "iDjnvrtd:l:L:p:P:R:aA", &opt, &arg);
         if (status == APR_EOF) {
             break;
         }
@@ -1461,6 +1836,13 @@ int main(int argc, const char * const argv[])
                 dryrun = 1;
                 break;
 
+            case 'j':
+                if (journaled) {
+                    usage_repeated_arg(pool, opt);
+                }
+                journaled = 1;
+                break;
+
             case 'n':
                 if (benice) {
                     usage_repeated_arg(pool, opt);
@@ -1677,6 +2059,14 @@ int main(int argc, const char * const argv[])
          usage("Option -i cannot be used without -d");
     }
 
+    if (!isdaemon && journaled) {
+         usage("Option -j cannot be used without -d");
+    }
+
+    if (journaled && intelligent) {
+         usage("Option -j cannot be used with -i");
+    }
+
     if (!listurls && max <= 0 && inodes <= 0) {
          usage("At least one of option -l or -L must be greater than zero");
     }
@@ -1766,7 +2156,12 @@ int main(int argc, const char * const argv[])
             break;
         }
 
-        if (dowork && !interrupted) {
+        if (journaled && !interrupted) {
+            if (!journal_update(&journal, path, instance) && !interrupted) {
+                journal_purge(&journal, path, instance, max, inodes, round);
+            }
+        }
+        else if (dowork && !interrupted) {
             apr_off_t nodes = 0;
             if (!process_dir(path, instance, &nodes) && !interrupted) {
                 purge(path, instance, max, inodes, nodes, round);
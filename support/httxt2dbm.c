@@ -16,7 +16,7 @@
 
 /*
  * httxt2dbm.c: simple program for converting RewriteMap text files to DBM
- * Rewrite databases for the Apache HTTP server
+ * (or memory mapped idx:) Rewrite databases for the Apache HTTP server
  *
  */
 
@@ -27,9 +27,12 @@
 #include "apr_file_info.h"
 #include "apr_pools.h"
 #include "apr_getopt.h"
+#include "apr_tables.h"
 #include "apu.h"
 #include "apr_dbm.h"
 
+#include "../modules/mappers/rewrite_idx_common.h"
+
 #if APR_HAVE_STDLIB_H
 #include <stdlib.h> /* for atexit() */
 #endif
@@ -80,7 +83,7 @@ static void usage(void)
 #endif
 
     apr_file_printf(errfile,
-    "%s -- Program to Create DBM Files for use by RewriteMap" NL
+    "%s -- Program to Create DBM or IDX Files for use by RewriteMap" NL
     "Usage: %s [-v] [-f format] -i SOURCE_TXT -o OUTPUT_DBM" NL
     NL
     "Options: " NL
@@ -96,6 +99,7 @@ static void usage(void)
     "           DB   for berkeley DB files (%s)" NL
     "           NDBM for NDBM files (%s)" NL
     "           default for the default DBM type" NL
+    "           IDX  for memory mapped index files (RewriteMap idx:)" NL
     NL,
     shortname,
     shortname,
@@ -106,6 +110,51 @@ static void usage(void)
 }
 
 
+/* Splits a line of the text map into its key and value, returns zero for
+ * comments and lines without a value.
+ */
+static int parse_line(char *line, char **key, apr_size_t *keylen,
+                      char **value, apr_size_t *vallen)
+{
+    char *c;
+
+    if (*line == '#' || apr_isspace(*line)) {
+        return 0;
+    }
+
+    c = line;
+
+    while (*c && !apr_isspace(*c)) {
+        ++c;
+    }
+
+    if (!*c) {
+        /* no value. solid line of data. */
+        return 0;
+    }
+
+    *key = line;
+    *keylen = c - line;
+
+    while (apr_isspace(*c)) {
+        ++c;
+    }
+
+    if (!*c) {
+        return 0;
+    }
+
+    *value = c;
+
+    while (*c && !apr_isspace(*c)) {
+        ++c;
+    }
+
+    *vallen = c - *value;
+
+    return 1;
+}
+
 static apr_status_t to_dbm(apr_dbm_t *dbm, apr_file_t *fp, apr_pool_t *pool)
 {
     apr_status_t rv = APR_SUCCESS;
@@ -117,57 +166,175 @@ static apr_status_t to_dbm(apr_dbm_t *dbm, apr_file_t *fp, apr_pool_t *pool)
     apr_pool_create(&p, pool);
 
     while (apr_file_gets(line, sizeof(line), fp) == APR_SUCCESS) {
-        char *c, *value;
+        char *key, *value;
+        apr_size_t keylen, vallen;
 
-        if (*line == '#' || apr_isspace(*line)) {
+        if (!parse_line(line, &key, &keylen, &value, &vallen)) {
             continue;
         }
 
-        c = line;
+        dbmkey.dptr = apr_pstrmemdup(p, key, keylen);
+        dbmkey.dsize = keylen;
 
-        while (*c && !apr_isspace(*c)) {
-            ++c;
-        }
+        dbmval.dptr = apr_pstrmemdup(p, value, vallen);
+        dbmval.dsize = vallen;
 
-        if (!*c) {
-            /* no value. solid line of data. */
-            continue;
+        if (verbose) {
+            apr_file_printf(errfile, "    '%s' -> '%s'" NL,
+                            dbmkey.dptr, dbmval.dptr);
         }
 
-        dbmkey.dptr = apr_pstrmemdup(p, line,  c - line);
-        dbmkey.dsize = (c - line);
+        rv = apr_dbm_store(dbm, dbmkey, dbmval);
 
-        while (apr_isspace(*c)) {
-            ++c;
-        }
+        apr_pool_clear(p);
 
-        if (!*c) {
-            apr_pool_clear(p);
-            continue;
+        if (rv != APR_SUCCESS) {
+            break;
         }
+    }
+
+    return rv;
+}
+
+typedef struct {
+    const char *key;
+    const char *value;
+    rewrite_idx_slot_t slot;
+} idx_entry_t;
+
+/* Builds the whole hash table in memory, then writes it to a temporary
+ * file which finally replaces the output file, so that the running servers
+ * never see a partially written file.
+ */
+static apr_status_t to_idx(const char *fname, apr_file_t *fp,
+                           apr_pool_t *pool)
+{
+    apr_status_t rv;
+    char line[REWRITE_MAX_TXT_MAP_LINE + 1]; /* +1 for \0 */
+    apr_array_header_t *entries;
+    idx_entry_t *first, *entry;
+    rewrite_idx_header_t header;
+    rewrite_idx_slot_t *slots;
+    apr_uint64_t offset;
+    apr_uint32_t nslots, mask, i;
+    apr_file_t *out;
+    char *tmpname;
+    int n;
+
+    entries = apr_array_make(pool, 1024, sizeof(idx_entry_t));
 
-        value = c;
+    while (apr_file_gets(line, sizeof(line), fp) == APR_SUCCESS) {
+        char *key, *value;
+        apr_size_t keylen, vallen;
 
-        while (*c && !apr_isspace(*c)) {
-            ++c;
+        if (!parse_line(line, &key, &keylen, &value, &vallen)) {
+            continue;
+        }
+        if (entries->nelts >= 0x40000000) {
+            return APR_ENOSPC;
         }
 
-        dbmval.dptr = apr_pstrmemdup(p, value,  c - value);
-        dbmval.dsize = (c - value);
+        entry = apr_array_push(entries);
+        entry->key = apr_pstrmemdup(pool, key, keylen);
+        entry->value = apr_pstrmemdup(pool, value, vallen);
+        entry->slot.hash = rewrite_idx_hash(key, keylen);
+        entry->slot.keylen = (apr_uint32_t)keylen;
+        entry->slot.vallen = (apr_uint32_t)vallen;
+        entry->slot.reserved = 0;
 
         if (verbose) {
             apr_file_printf(errfile, "    '%s' -> '%s'" NL,
-                            dbmkey.dptr, dbmval.dptr);
+                            entry->key, entry->value);
         }
+    }
 
-        rv = apr_dbm_store(dbm, dbmkey, dbmval);
+    /* keep the load factor below 1/2 */
+    for (nslots = 16; nslots < 2 * (apr_uint32_t)entries->nelts; nslots <<= 1)
+        ;
+    mask = nslots - 1;
+    slots = apr_pcalloc(pool, nslots * sizeof(rewrite_idx_slot_t));
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REWRITE_IDX_MAGIC, REWRITE_IDX_MAGIC_LEN);
+    header.bom = REWRITE_IDX_BOM;
+    header.nslots = nslots;
+
+    /* Like for txt: maps, the first occurrence of a key wins, duplicates
+     * are marked with a zero keylen and not written.
+     */
+    offset = sizeof(header) + (apr_uint64_t)nslots * sizeof(*slots);
+    first = entry = (idx_entry_t *)entries->elts;
+    for (n = 0; n < entries->nelts; ++n, ++entry) {
+        for (i = entry->slot.hash & mask; slots[i].keylen; i = (i + 1) & mask) {
+            if (slots[i].hash == entry->slot.hash
+                && slots[i].keylen == entry->slot.keylen
+                && !strcmp(first[slots[i].reserved].key, entry->key)) {
+                break;
+            }
+        }
+        if (slots[i].keylen) {
+            if (verbose) {
+                apr_file_printf(errfile, "    '%s' duplicated, ignored" NL,
+                                entry->key);
+            }
+            entry->slot.keylen = 0;
+            continue;
+        }
+        entry->slot.offset = offset;
+        offset += entry->slot.keylen + entry->slot.vallen + 2;
+        slots[i] = entry->slot;
+        /* remember the entry while building, reset before writing */
+        slots[i].reserved = (apr_uint32_t)n;
+        header.nentries++;
+    }
+    for (i = 0; i < nslots; ++i) {
+        slots[i].reserved = 0;
+    }
 
-        apr_pool_clear(p);
+    tmpname = apr_pstrcat(pool, fname, ".XXXXXX", NULL);
+    rv = apr_file_mktemp(&out, tmpname, APR_FOPEN_CREATE | APR_FOPEN_WRITE
+                                        | APR_FOPEN_EXCL | APR_FOPEN_BUFFERED,
+                         pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
 
-        if (rv != APR_SUCCESS) {
-            break;
+    rv = apr_file_write_full(out, &header, sizeof(header), NULL);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(out, slots, nslots * sizeof(*slots), NULL);
+    }
+    entry = (idx_entry_t *)entries->elts;
+    for (n = 0; rv == APR_SUCCESS && n < entries->nelts; ++n, ++entry) {
+        if (!entry->slot.keylen) {
+            continue;
+        }
+        rv = apr_file_write_full(out, entry->key, entry->slot.keylen + 1,
+                                 NULL);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_write_full(out, entry->value,
+                                     entry->slot.vallen + 1, NULL);
+        }
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_close(out);
+    }
+    else {
+        apr_file_close(out);
+    }
+    if (rv == APR_SUCCESS) {
+        /* apr_file_mktemp() creates the file readable by its owner only */
+        rv = apr_file_perms_set(tmpname, APR_FPROT_UREAD | APR_FPROT_UWRITE
+                                         | APR_FPROT_GREAD | APR_FPROT_WREAD);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            rv = APR_SUCCESS;
         }
     }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_rename(tmpname, fname, pool);
+    }
+    if (rv != APR_SUCCESS) {
+        apr_file_remove(tmpname, pool);
+    }
 
     return rv;
 }
@@ -294,6 +461,27 @@ int main(int argc, const char *const argv[])
         apr_file_printf(errfile, "Input File: %s" NL, input);
     }
 
+    if (!strcmp(format, "IDX")) {
+        if (verbose) {
+            apr_file_printf(errfile, "IDX File: %s" NL, output);
+        }
+
+        rv = to_idx(output, infile, pool);
+
+        if (rv != APR_SUCCESS) {
+            apr_file_printf(errfile,
+                            "Error: Converting to IDX: (%d) %pm" NL NL,
+                             rv, &rv);
+            return 1;
+        }
+
+        if (verbose) {
+            apr_file_printf(errfile, "Conversion Complete." NL);
+        }
+
+        return 0;
+    }
+
     rv = apr_dbm_open_ex(&outdbm, format, output, APR_DBM_RWCREATE,
                     APR_OS_DEFAULT, pool);
 
@@ -0,0 +1,80 @@
+import os
+
+import pytest
+
+from pyhttpd.conf import HttpdConf
+
+
+class TestConfigSnapshot:
+
+    @pytest.fixture(autouse=True, scope='class')
+    def _class_scope(self, env):
+        conf = HttpdConf(env)
+        # Defines read from the files must not change what the snapshot
+        # is checked against
+        conf.add([
+            "Define SNAPSHOT_TEST_DIR htdocs/test1",
+        ])
+        conf.start_vhost(domains=[f"test1.{env.http_tld}"], port=env.http_port,
+                         doc_root="${SNAPSHOT_TEST_DIR}")
+        conf.end_vhost()
+        conf.install()
+
+    @pytest.fixture(autouse=True)
+    def _function_scope(self, env):
+        if os.path.exists(self.snapshot(env)):
+            os.remove(self.snapshot(env))
+        yield
+        env.apache_stop()
+
+    def snapshot(self, env):
+        return os.path.join(env.server_dir, 'logs/httpd.conf.snapshot')
+
+    def httpd(self, env, args):
+        return env.run([os.path.join(env.bin_dir, 'httpd'),
+                        '-d', env.server_dir,
+                        '-f', os.path.join(env.server_dir, 'conf/httpd.conf'),
+                        '-C', f"ConfigSnapshot {self.snapshot(env)}",
+                        '-e', 'debug'] + args)
+
+    def check(self, env, args=[]):
+        r = self.httpd(env, args + ['-t'])
+        assert r.exit_code == 0, f"{r}"
+        return r.stderr.decode()
+
+    # saved when read, used next time
+    def test_core_003_01(self, env):
+        out = self.check(env)
+        assert os.path.isfile(self.snapshot(env))
+        assert 'AH10667' not in out, out
+        out = self.check(env)
+        assert 'AH10667' in out, out
+
+    # not used once an included file changed, saved again
+    def test_core_003_02(self, env):
+        self.check(env)
+        test_conf = os.path.join(env.server_conf_dir, 'test.conf')
+        st = os.stat(test_conf)
+        os.utime(test_conf, (st.st_atime, st.st_mtime + 1))
+        out = self.check(env)
+        assert 'AH10669' in out, out
+        assert 'AH10667' not in out, out
+        out = self.check(env)
+        assert 'AH10667' in out, out
+
+    # not used with other -D arguments
+    def test_core_003_03(self, env):
+        self.check(env)
+        out = self.check(env, ['-D', 'SNAPSHOT_OTHER'])
+        assert 'AH10669' in out, out
+        assert 'AH10667' not in out, out
+
+    # the server started from the snapshot serves as configured
+    def test_core_003_04(self, env):
+        self.check(env)
+        r = self.httpd(env, ['-k', 'start'])
+        assert r.exit_code == 0, f"{r}"
+        assert env.is_live()
+        r = env.curl_get(f"http://test1.{env.http_tld}:{env.http_port}/001.html", 5)
+        assert r.response["status"] == 200
+        assert 'AH10668' not in open(env.httpd_error_log.path).read()
@@ -0,0 +1,57 @@
+import os
+
+import pytest
+
+from pyhttpd.conf import HttpdConf
+
+
+class TestRewritePrefix:
+
+    @pytest.fixture(autouse=True, scope='class')
+    def _class_scope(self, env):
+        docs = os.path.join(env.server_docs_dir, "rewrite")
+        os.makedirs(os.path.join(docs, "dir"), exist_ok=True)
+        with open(os.path.join(docs, "dir", "index.html"), 'w') as fd:
+            fd.write("index\n")
+        conf = HttpdConf(env)
+        conf.start_vhost(domains=[f"test1.{env.http_tld}"],
+                         port=env.https_port, doc_root="htdocs/rewrite")
+        conf.add([
+            "DirectoryIndex index.html",
+            "RewriteEngine on",
+            # a skip landing on a chain
+            "RewriteRule ^/s/ - [S=1]",
+            "RewriteRule ^/s/a - [C]",
+            "RewriteRule ^/s/b - [C]",
+            "RewriteRule ^/ - [F]",
+            # a chain ending with a rule ignored on subrequests
+            "RewriteRule ^/p/a - [C]",
+            "RewriteRule ^/p/b - [NS,C]",
+            "RewriteRule index\\.html$ - [F]",
+        ])
+        conf.end_vhost()
+        conf.install()
+        assert env.apache_restart() == 0
+
+    def get(self, env, path):
+        r = env.curl_get(env.mkurl("https", "test1", path))
+        assert r.exit_code == 0, f"{r}"
+        return r
+
+    # the rules whose prefix doesn't match are skipped like those which
+    # don't match, along with the rest of their chain
+    @pytest.mark.parametrize(["path", "status"], [
+        ["/s/b", 403],
+        ["/s/c", 404],
+        ["/t", 404],
+        ["/p/a/index.html", 404],
+        ["/dir/index.html", 200],
+    ])
+    def test_core_004_01(self, env, path, status):
+        assert self.get(env, path).response["status"] == status
+
+    # the subrequest looking up the index skips the whole chain too
+    def test_core_004_02(self, env):
+        r = self.get(env, "/dir/")
+        assert r.response["status"] == 200
+        assert r.response["body"] == b'index\n'
@@ -0,0 +1,111 @@
+import os
+import time
+from shutil import copyfile
+from threading import Thread
+
+import pytest
+
+from .env import H2Conf, H2TestEnv
+
+
+@pytest.mark.skipif(condition=H2TestEnv.is_unsupported, reason="mod_http2 not supported here")
+class TestH2ProxyMultiplex:
+
+    @pytest.fixture(autouse=True, scope='class')
+    def _class_scope(self, env):
+        copyfile(os.path.join(env.gen_dir, "data-1m"),
+                 os.path.join(env.server_docs_dir, "cgi", "data-1m"))
+        conf = H2Conf(env, extras={
+            f'cgi.{env.http_tld}': [
+                "ProxyTimeout 2",
+                f"ProxyPass /h2c/ h2c://127.0.0.1:{env.http_port}/",
+            ]
+        })
+        conf.add([
+            "ProxyH2Multiplex on",
+            "LogLevel proxy_http2:debug",
+        ])
+        conf.add_vhost_cgi()
+        conf.install()
+        assert env.apache_restart() == 0
+
+    def get(self, env, path, results, options=None):
+        url = env.mkurl("https", "cgi", path)
+        results.append(env.curl_get(url, 5, options=options))
+
+    def concurrent(self, env, paths, options=None):
+        results = []
+        threads = [Thread(target=self.get, args=(env, path, results, options))
+                   for path in paths]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        return results
+
+    def count_log(self, env, logno):
+        with open(env.httpd_error_log.path) as fd:
+            return sum(1 for line in fd if logno in line)
+
+    # concurrent requests share the sessions to the backend
+    def test_h2_602_01(self, env):
+        count = 10
+        sessions = self.count_log(env, 'AH10644')
+        results = self.concurrent(env, ["/h2c/hello.py"] * count)
+        assert len(results) == count
+        for r in results:
+            assert r.exit_code == 0, r
+            assert r.response["status"] == 200
+            assert r.response["json"]["protocol"] == "HTTP/2.0"
+        assert self.count_log(env, 'AH10644') - sessions < count
+
+    # a slow response does not hold up the others of the session
+    def test_h2_602_02(self, env):
+        results = []
+        slow = Thread(target=self.get,
+                      args=(env, "/h2c/h2test/delay?1", results))
+        slow.start()
+        time.sleep(0.2)
+        start = time.monotonic()
+        for r in self.concurrent(env, ["/h2c/hello.py"] * 5):
+            assert r.response["status"] == 200
+        assert time.monotonic() - start < 2
+        slow.join()
+        assert results[0].response["status"] == 200
+
+    # a client reading slowly does not hold up the others of the session
+    def test_h2_602_03(self, env):
+        results = []
+        slow = Thread(target=self.get,
+                      args=(env, "/h2c/data-1m", results,
+                            ['--limit-rate', '300k']))
+        slow.start()
+        time.sleep(0.5)
+        start = time.monotonic()
+        for r in self.concurrent(env, ["/h2c/hello.py"] * 5):
+            assert r.response["status"] == 200
+        assert time.monotonic() - start < 2
+        slow.join()
+        assert results[0].exit_code == 0, results[0]
+        assert results[0].response["status"] == 200
+        assert len(results[0].outraw) == 1000 * 1000
+
+    # the timeout applies to each request, not to the shared session
+    def test_h2_602_04(self, env):
+        results = self.concurrent(env, ["/h2c/h2test/error?delay=4",
+                                        "/h2c/hello.py"])
+        statuses = sorted(r.response["status"] for r in results)
+        assert statuses == [200, 504]
+        assert self.count_log(env, 'AH10662') > 0
+
+    # interim responses and the response head are made by the request's
+    # own thread, not by the driver of the session
+    def test_h2_602_05(self, env):
+        url = env.mkurl("https", "cgi", "/h2c/echo.py")
+        r = env.curl_post_data(url, 'XYZ',
+                               options=["-H", "expect: 100-continue"])
+        assert r.exit_code == 0, r
+        assert r.response["status"] == 200
+        assert "previous" in r.response
+        assert r.response["previous"]["status"] == 100
+        assert r.response["body"] == b'XYZ'
@@ -16,7 +16,7 @@ class ProxyTestSetup(HttpdTestSetup):
     def __init__(self, env: 'HttpdTestEnv'):
         super().__init__(env=env)
         self.add_source_dir(os.path.dirname(inspect.getfile(ProxyTestSetup)))
-        self.add_modules(["proxy", "proxy_http", "proxy_balancer", "lbmethod_byrequests"])
+        self.add_modules(["proxy", "proxy_http", "proxy_fcgi", "proxy_balancer", "lbmethod_byrequests"])
 
 
 class ProxyTestEnv(HttpdTestEnv):
@@ -29,7 +29,7 @@ class ProxyTestEnv(HttpdTestEnv):
         self._d_forward = f"forward.{self.http_tld}"
         self._d_mixed = f"mixed.{self.http_tld}"
 
-        self.add_httpd_log_modules(["proxy", "proxy_http", "proxy_balancer", "lbmethod_byrequests", "ssl"])
+        self.add_httpd_log_modules(["proxy", "proxy_http", "proxy_fcgi", "proxy_balancer", "lbmethod_byrequests", "ssl"])
         self.add_cert_specs([
             CertificateSpec(domains=[
                 self._d_forward, self._d_reverse, self._d_mixed
@@ -0,0 +1,101 @@
+import os
+import shutil
+import time
+
+import pytest
+
+from pyhttpd.conf import HttpdConf
+
+
+class TestProxyCacheTags:
+
+    @pytest.fixture(autouse=True, scope='class')
+    def _class_scope(self, env):
+        # a caching reverse proxy on https: to the http: vhost, which tags
+        # its documents with Surrogate-Key
+        cache_root = f"{env.server_dir}/cache-tags"
+        if os.path.isdir(cache_root):
+            shutil.rmtree(cache_root)
+        conf = HttpdConf(env)
+        conf.add("ProxyPreserveHost on")
+        conf.start_vhost(domains=[env.d_reverse], port=env.https_port)
+        conf.add([
+            f"CacheRoot {cache_root}",
+            "CacheEnable disk /",
+            "CacheHeader on",
+            "CacheTagHeader Surrogate-Key",
+            "ProxyPass /cache-purge !",
+            f"ProxyPass / http://127.0.0.1:{env.http_port}/",
+            "<Location /cache-purge>",
+            "  SetHandler cache-tag-purge",
+            "</Location>",
+        ])
+        conf.end_vhost()
+        conf.start_vhost(domains=[env.d_reverse], port=env.http_port,
+                         doc_root='htdocs/test1')
+        conf.add([
+            "Header set Cache-Control max-age=300",
+            "<Location /001.html>",
+            "  Header set Surrogate-Key \"tag-a all\"",
+            "</Location>",
+            "<Location /002.jpg>",
+            "  Header set Surrogate-Key \"tag-b, all\"",
+            "</Location>",
+        ])
+        conf.end_vhost()
+        conf.install()
+        assert env.apache_restart() == 0
+
+    def get(self, env, path):
+        r = env.curl_get(f"https://{env.d_reverse}:{env.https_port}{path}", 5)
+        assert r.exit_code == 0, f"{r}"
+        assert r.response["status"] == 200
+        return r.response["header"].get("x-cache", "")
+
+    def cached(self, env, path):
+        self.get(env, path)
+        assert self.get(env, path).startswith("HIT"), path
+
+    def purge(self, env, tags):
+        r = env.curl_get(f"https://{env.d_reverse}:{env.https_port}/cache-purge", 5,
+                         options=['-X', 'PURGE', '-H', f"Surrogate-Key: {tags}"])
+        assert r.exit_code == 0, f"{r}"
+        assert r.response["status"] == 200
+        # purges and requests are compared by the second
+        time.sleep(1.1)
+
+    # purging a tag only misses the entities having it
+    def test_proxy_03_001(self, env):
+        self.cached(env, "/001.html")
+        self.cached(env, "/002.jpg")
+        self.purge(env, "tag-a")
+        assert self.get(env, "/001.html").startswith("MISS")
+        assert self.get(env, "/001.html").startswith("HIT")
+        assert self.get(env, "/002.jpg").startswith("HIT")
+
+    # a tag shared by the entities purges them all
+    def test_proxy_03_002(self, env):
+        self.cached(env, "/001.html")
+        self.cached(env, "/002.jpg")
+        self.purge(env, "all")
+        assert self.get(env, "/001.html").startswith("MISS")
+        assert self.get(env, "/002.jpg").startswith("MISS")
+
+    # the purges are kept across a graceful restart, and across a stop of
+    # the server for the entities kept on disk
+    def test_proxy_03_003(self, env):
+        self.cached(env, "/001.html")
+        self.cached(env, "/002.jpg")
+        self.purge(env, "tag-a")
+        assert env.apache_reload() == 0
+        assert self.get(env, "/001.html").startswith("MISS")
+        self.purge(env, "tag-b")
+        assert env.apache_stop() == 0
+        assert os.path.isfile(os.path.join(env.server_logs_dir, "mod_cache-tags"))
+        assert env.apache_restart() == 0
+        assert self.get(env, "/002.jpg").startswith("MISS")
+        assert self.get(env, "/002.jpg").startswith("HIT")
+
+    def test_proxy_03_004(self, env):
+        r = env.curl_get(f"https://{env.d_reverse}:{env.https_port}/cache-purge", 5)
+        assert r.response["status"] == 405
@@ -0,0 +1,108 @@
+import os
+import shutil
+import time
+
+import pytest
+
+from pyhttpd.conf import HttpdConf
+
+
+class TestProxyCacheVary:
+
+    @pytest.fixture(autouse=True, scope='class')
+    def _class_scope(self, env):
+        # a caching reverse proxy on https: to the http: vhost, whose
+        # documents vary on Accept-Encoding, or on Accept-Language while
+        # the flag file exists
+        cache_root = f"{env.server_dir}/cache-vary"
+        if os.path.isdir(cache_root):
+            shutil.rmtree(cache_root)
+        TestProxyCacheVary.FLAG = f"{env.gen_dir}/proxy_04.vary-lang"
+        if os.path.exists(self.FLAG):
+            os.remove(self.FLAG)
+        conf = HttpdConf(env)
+        conf.add("ProxyPreserveHost on")
+        conf.start_vhost(domains=[env.d_reverse], port=env.https_port)
+        conf.add([
+            f"CacheRoot {cache_root}",
+            "CacheEnable disk /",
+            "CacheHeader on",
+            "CacheVaryBuckets Accept-Encoding br gzip",
+            "CacheVaryIndex 60",
+            f"ProxyPass / http://127.0.0.1:{env.http_port}/",
+        ])
+        conf.end_vhost()
+        conf.start_vhost(domains=[env.d_reverse], port=env.http_port,
+                         doc_root='htdocs/test1')
+        conf.add([
+            "Header set Cache-Control max-age=300",
+            # no validators, an expired entity is fetched again
+            "<Location /002.jpg>",
+            "  Header set Cache-Control max-age=2",
+            "  Header unset ETag",
+            "  Header unset Last-Modified",
+            "</Location>",
+            f"<If \"-f '{self.FLAG}'\">",
+            "  Header set Vary Accept-Language",
+            "</If>",
+            "<Else>",
+            "  Header set Vary Accept-Encoding",
+            "</Else>",
+        ])
+        conf.end_vhost()
+        conf.install()
+        assert env.apache_restart() == 0
+
+    def get(self, env, path, header):
+        r = env.curl_get(f"https://{env.d_reverse}:{env.https_port}{path}", 5,
+                         options=['-H', header])
+        assert r.exit_code == 0, f"{r}"
+        assert r.response["status"] == 200
+        return r.response["header"].get("x-cache", "")
+
+    # the values of Accept-Encoding are looked up by their bucket
+    def test_proxy_04_001(self, env):
+        self.get(env, "/001.html", "Accept-Encoding: gzip, deflate")
+        assert self.get(env, "/001.html",
+                        "Accept-Encoding: gzip").startswith("HIT")
+        assert self.get(env, "/001.html",
+                        "Accept-Encoding: deflate, gzip;q=0.5").startswith("HIT")
+        assert not self.get(env, "/001.html",
+                            "Accept-Encoding: br, gzip").startswith("HIT")
+        assert self.get(env, "/001.html",
+                        "Accept-Encoding: br").startswith("HIT")
+        # no bucket, the value as is
+        assert not self.get(env, "/001.html",
+                            "Accept-Encoding: identity").startswith("HIT")
+        assert not self.get(env, "/001.html",
+                            "Accept-Encoding: gzip;q=0").startswith("HIT")
+
+    # the vary index follows the header file of the URL when the varying
+    # headers change
+    def test_proxy_04_002(self, env):
+        self.get(env, "/002.jpg", "Accept-Language: de")
+        assert self.get(env, "/002.jpg",
+                        "Accept-Language: de").startswith("HIT")
+        time.sleep(2.5)
+        with open(self.FLAG, 'w') as fd:
+            fd.write("on\n")
+        try:
+            assert not self.get(env, "/002.jpg",
+                                "Accept-Language: de").startswith("HIT")
+            assert self.get(env, "/002.jpg",
+                            "Accept-Language: de").startswith("HIT")
+            assert not self.get(env, "/002.jpg",
+                                "Accept-Language: fr").startswith("HIT")
+            assert self.get(env, "/002.jpg",
+                            "Accept-Language: fr").startswith("HIT")
+        finally:
+            os.remove(self.FLAG)
+
+    # the index does not serve what was removed from the disk
+    def test_proxy_04_003(self, env):
+        self.get(env, "/001.html", "Accept-Encoding: gzip")
+        assert self.get(env, "/001.html",
+                        "Accept-Encoding: gzip").startswith("HIT")
+        shutil.rmtree(f"{env.server_dir}/cache-vary")
+        assert not self.get(env, "/001.html",
+                            "Accept-Encoding: gzip").startswith("HIT")
@@ -0,0 +1,130 @@
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from threading import Thread
+
+import pytest
+
+from pyhttpd.conf import HttpdConf
+
+
+class OutlierHandler(BaseHTTPRequestHandler):
+
+    protocol_version = 'HTTP/1.1'
+
+    def do_GET(self):
+        status, headers_delay, body_delay = 200, 0, 0
+        if self.path.endswith('/fail'):
+            status = 500
+        elif self.path.endswith('/slow-headers'):
+            headers_delay = 1
+        elif self.path.endswith('/slow-body'):
+            body_delay = 1
+        body = self.server.name.encode()
+        time.sleep(headers_delay)
+        self.send_response(status)
+        self.send_header('Content-Type', 'text/plain')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.flush()
+        time.sleep(body_delay)
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+class OutlierBackend:
+
+    def __init__(self, name):
+        self._httpd = ThreadingHTTPServer(('127.0.0.1', 0), OutlierHandler)
+        self._httpd.name = name
+        self._httpd.daemon_threads = True
+        self.port = self._httpd.server_address[1]
+
+    def start(self):
+        Thread(target=self._httpd.serve_forever, daemon=True).start()
+
+    def stop(self):
+        self._httpd.shutdown()
+        self._httpd.server_close()
+
+
+class TestProxyBalancerOutlier:
+
+    @pytest.fixture(autouse=True, scope='class')
+    def _class_scope(self, env):
+        # a healthy backend "a", and "b" whose responses depend on the path,
+        # reached with a sticky route not to fail over to "a"
+        backends = [OutlierBackend('a'), OutlierBackend('b')]
+        for backend in backends:
+            backend.start()
+        conf = HttpdConf(env)
+        conf.add([
+            "<Proxy balancer://outlier>",
+            f"  BalancerMember http://127.0.0.1:{backends[0].port} route=a",
+            f"  BalancerMember http://127.0.0.1:{backends[1].port} route=b retry=30",
+            "  ProxySet stickysession=ROUTEID nofailover=On",
+            "</Proxy>",
+            "BalancerOutlierFailures 3",
+            "BalancerOutlierLatency 500ms",
+        ])
+        conf.start_vhost(domains=[env.d_reverse], port=env.https_port)
+        conf.add([
+            "ProxyPass /sync balancer://outlier",
+            "ProxyPass /async balancer://outlier",
+            "<Location /async>",
+            "  ProxyAsyncDelay 100ms",
+            "</Location>",
+        ])
+        conf.end_vhost()
+        conf.install()
+        yield
+        for backend in backends:
+            backend.stop()
+
+    @pytest.fixture(autouse=True)
+    def _function_scope(self, env):
+        # afresh, without ejections
+        assert env.apache_restart() == 0
+
+    def get(self, env, path):
+        r = env.curl_get(f"https://{env.d_reverse}:{env.https_port}{path}", 5,
+                         options=['-H', 'Cookie: ROUTEID=.b'])
+        assert r.exit_code == 0, f"{r}"
+        return r.response["status"]
+
+    def ejected(self, env):
+        return self.get(env, "/sync/ok") == 503
+
+    def test_proxy_05_001(self, env):
+        for _ in range(3):
+            assert self.get(env, "/sync/fail") == 500
+        assert self.ejected(env)
+
+    # the latency is measured up to the response headers, a slow body is
+    # no failure
+    def test_proxy_05_002(self, env):
+        for _ in range(3):
+            assert self.get(env, "/sync/slow-body") == 200
+        assert not self.ejected(env)
+
+    def test_proxy_05_003(self, env):
+        for _ in range(3):
+            assert self.get(env, "/sync/slow-headers") == 200
+        assert self.ejected(env)
+
+    # the requests waiting asynchronously for the response are evaluated
+    # when they finish
+    def test_proxy_05_004(self, env):
+        if env.mpm_module != 'mpm_event':
+            pytest.skip('asynchronous responses need mpm_event')
+        for _ in range(3):
+            assert self.get(env, "/async/slow-headers") == 200
+        assert self.ejected(env)
+
+    def test_proxy_05_005(self, env):
+        if env.mpm_module != 'mpm_event':
+            pytest.skip('asynchronous responses need mpm_event')
+        for _ in range(3):
+            assert self.get(env, "/async/slow-body") == 200
+        assert not self.ejected(env)
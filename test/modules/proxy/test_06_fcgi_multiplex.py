@@ -0,0 +1,223 @@
+import json
+import socket
+import struct
+import time
+from threading import Lock, Thread
+from urllib.parse import parse_qs
+
+import pytest
+
+from pyhttpd.conf import HttpdConf
+
+FCGI_BEGIN_REQUEST = 1
+FCGI_END_REQUEST = 3
+FCGI_PARAMS = 4
+FCGI_STDIN = 5
+FCGI_STDOUT = 6
+FCGI_GET_VALUES = 9
+FCGI_GET_VALUES_RESULT = 10
+FCGI_UNKNOWN_TYPE = 11
+
+
+def fcgi_record(rtype, rid, content=b''):
+    return struct.pack('!BBHHBx', 1, rtype, rid, len(content), 0) + content
+
+
+def fcgi_pair(name, value):
+    return bytes([len(name), len(value)]) + name + value
+
+
+def fcgi_pairs(data):
+    pairs = {}
+    pos = 0
+    while pos < len(data):
+        lens = []
+        for _ in range(2):
+            if data[pos] & 0x80:
+                lens.append(struct.unpack('!I', data[pos:pos+4])[0] & 0x7fffffff)
+                pos += 4
+            else:
+                lens.append(data[pos])
+                pos += 1
+        name = data[pos:pos+lens[0]].decode()
+        pos += lens[0]
+        pairs[name] = data[pos:pos+lens[1]].decode()
+        pos += lens[1]
+    return pairs
+
+
+class FCGIFaker:
+    """A FastCGI application answering with the connection and the request
+       ID it got, after the 'delay' of the query. When multiplexing, the
+       requests of a connection are answered concurrently, otherwise one
+       after the other. Aborts are ignored, the responses come anyway."""
+
+    def __init__(self, multiplex):
+        self.multiplex = multiplex
+        self.connections = 0
+        self._lock = Lock()
+        self._sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self._sock.bind(('127.0.0.1', 0))
+        self._sock.listen(32)
+        self.port = self._sock.getsockname()[1]
+
+    def start(self):
+        Thread(target=self._accept, daemon=True).start()
+
+    def stop(self):
+        self._sock.close()
+
+    def _accept(self):
+        while True:
+            try:
+                conn, _ = self._sock.accept()
+            except OSError:
+                return
+            Thread(target=self._serve, args=(conn,), daemon=True).start()
+
+    def _recv(self, conn, n):
+        data = b''
+        while len(data) < n:
+            chunk = conn.recv(n - len(data))
+            if not chunk:
+                return None
+            data += chunk
+        return data
+
+    def _serve(self, conn):
+        with self._lock:
+            self.connections += 1
+            cid = self.connections
+        wlock = Lock()
+        params = {}
+        try:
+            while True:
+                header = self._recv(conn, 8)
+                if header is None:
+                    break
+                _, rtype, rid, clen, plen = struct.unpack('!BBHHBx', header)
+                content = self._recv(conn, clen + plen) if clen + plen else b''
+                if content is None:
+                    break
+                content = content[:clen]
+                if rtype == FCGI_GET_VALUES:
+                    if self.multiplex:
+                        values = fcgi_pair(b'FCGI_MPXS_CONNS', b'1') \
+                                 + fcgi_pair(b'FCGI_MAX_REQS', b'10')
+                        record = fcgi_record(FCGI_GET_VALUES_RESULT, 0, values)
+                    else:
+                        record = fcgi_record(FCGI_UNKNOWN_TYPE, 0,
+                                             bytes([rtype]) + bytes(7))
+                    with wlock:
+                        conn.sendall(record)
+                elif rtype == FCGI_BEGIN_REQUEST:
+                    params[rid] = b''
+                elif rtype == FCGI_PARAMS:
+                    params[rid] += content
+                elif rtype == FCGI_STDIN and clen == 0 and rid in params:
+                    args = (conn, wlock, cid, rid, fcgi_pairs(params.pop(rid)))
+                    if self.multiplex:
+                        Thread(target=self._respond, args=args,
+                               daemon=True).start()
+                    else:
+                        self._respond(*args)
+        except OSError:
+            pass
+        finally:
+            conn.close()
+
+    def _respond(self, conn, wlock, cid, rid, env):
+        query = parse_qs(env.get('QUERY_STRING', ''))
+        time.sleep(float(query.get('delay', ['0'])[0]))
+        body = json.dumps({'connection': cid, 'request_id': rid})
+        stdout = f"Content-Type: application/json\r\n\r\n{body}".encode()
+        with wlock:
+            try:
+                conn.sendall(fcgi_record(FCGI_STDOUT, rid, stdout)
+                             + fcgi_record(FCGI_STDOUT, rid)
+                             + fcgi_record(FCGI_END_REQUEST, rid,
+                                           struct.pack('!IB3x', 0, 0)))
+            except OSError:
+                pass
+
+
+class TestProxyFCGIMultiplex:
+
+    @pytest.fixture(autouse=True, scope='class')
+    def _class_scope(self, env):
+        if env.mpm_module == 'mpm_prefork':
+            pytest.skip('shared connections need a threaded MPM')
+        backends = {
+            'mpx': FCGIFaker(multiplex=True),
+            'nompx': FCGIFaker(multiplex=False),
+            'timeout': FCGIFaker(multiplex=True),
+        }
+        for backend in backends.values():
+            backend.start()
+        TestProxyFCGIMultiplex.BACKENDS = backends
+        conf = HttpdConf(env)
+        conf.add("ProxyFCGIMultiplex on")
+        conf.start_vhost(domains=[env.d_reverse], port=env.https_port)
+        conf.add([
+            f"ProxyPass /mpx/ fcgi://127.0.0.1:{backends['mpx'].port}/ "
+            "enablereuse=on",
+            f"ProxyPass /nompx/ fcgi://127.0.0.1:{backends['nompx'].port}/ "
+            "enablereuse=on",
+            f"ProxyPass /timeout/ fcgi://127.0.0.1:{backends['timeout'].port}/ "
+            "enablereuse=on timeout=1",
+        ])
+        conf.end_vhost()
+        conf.install()
+        assert env.apache_restart() == 0
+        yield
+        for backend in backends.values():
+            backend.stop()
+
+    def get(self, env, path, results):
+        r = env.curl_get(f"https://{env.d_reverse}:{env.https_port}{path}", 5)
+        results.append(r)
+
+    def concurrent(self, env, paths):
+        results = []
+        threads = [Thread(target=self.get, args=(env, path, results))
+                   for path in paths]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        return results
+
+    # concurrent requests share the connections, with their own request ID
+    def test_proxy_06_001(self, env):
+        # the first requests of a child ask the backend whether it
+        # multiplexes, and go the usual way meanwhile
+        self.concurrent(env, ["/mpx/test?delay=0.2"] * 10)
+        start = time.monotonic()
+        results = self.concurrent(env, ["/mpx/test?delay=1"] * 10)
+        assert time.monotonic() - start < 5
+        for r in results:
+            assert r.exit_code == 0, f"{r}"
+            assert r.response["status"] == 200
+        assert max(r.json["request_id"] for r in results) > 1
+
+    # a backend not multiplexing gets one request per connection
+    def test_proxy_06_002(self, env):
+        results = self.concurrent(env, ["/nompx/test?delay=0.5"] * 5)
+        for r in results:
+            assert r.exit_code == 0, f"{r}"
+            assert r.response["status"] == 200
+            assert r.json["request_id"] == 1
+
+    # the timeout applies to each request, the others of the connection
+    # and those coming later go on
+    def test_proxy_06_003(self, env):
+        results = self.concurrent(env, ["/timeout/test?delay=3",
+                                        "/timeout/test?delay=0.2"])
+        statuses = sorted(r.response["status"] for r in results)
+        assert statuses == [200, 504]
+        # the response of the aborted request arrives meanwhile
+        time.sleep(3)
+        results = self.concurrent(env, ["/timeout/test?delay=0.2"] * 3)
+        for r in results:
+            assert r.exit_code == 0, f"{r}"
+            assert r.response["status"] == 200
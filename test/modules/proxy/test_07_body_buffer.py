@@ -0,0 +1,101 @@
+import json
+import os
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from threading import Thread
+
+import pytest
+
+from pyhttpd.conf import HttpdConf
+
+
+class FramingHandler(BaseHTTPRequestHandler):
+    """Answers with how the request body was framed, and its length."""
+
+    protocol_version = 'HTTP/1.1'
+
+    def do_POST(self):
+        length = self.headers.get('Content-Length')
+        chunked = self.headers.get('Transfer-Encoding') == 'chunked'
+        received = 0
+        if chunked:
+            while True:
+                size = int(self.rfile.readline().split(b';')[0], 16)
+                if not size:
+                    while self.rfile.readline() not in (b'\r\n', b''):
+                        pass
+                    break
+                received += len(self.rfile.read(size))
+                self.rfile.readline()
+        elif length is not None:
+            received = len(self.rfile.read(int(length)))
+        body = json.dumps({'content-length': length, 'chunked': chunked,
+                           'received': received}).encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+class TestProxyBodyBuffer:
+
+    @pytest.fixture(autouse=True, scope='class')
+    def _class_scope(self, env):
+        httpd = ThreadingHTTPServer(('127.0.0.1', 0), FramingHandler)
+        httpd.daemon_threads = True
+        Thread(target=httpd.serve_forever, daemon=True).start()
+        TestProxyBodyBuffer.PORT = httpd.server_address[1]
+        TestProxyBodyBuffer.BODY = os.path.join(env.gen_dir, 'body-64k')
+        with open(self.BODY, 'w') as fd:
+            fd.write('x' * 65536)
+        yield
+        httpd.shutdown()
+        httpd.server_close()
+
+    def configure(self, env, buffer=None):
+        conf = HttpdConf(env)
+        conf.start_vhost(domains=[env.d_reverse], port=env.https_port)
+        conf.add(f"ProxyPass / http://127.0.0.1:{self.PORT}/")
+        if buffer is not None:
+            conf.add(f"ProxyRequestBodyBuffer {buffer}")
+        conf.end_vhost()
+        conf.install()
+
+    def post(self, env):
+        # a chunked request body, whose length is not known in advance
+        r = env.curl_post_data(f"https://{env.d_reverse}:{env.https_port}/",
+                               f"@{self.BODY}",
+                               options=['-H', 'Transfer-Encoding: chunked'])
+        assert r.exit_code == 0, f"{r}"
+        assert r.response["status"] == 200
+        assert r.json["received"] == 65536
+        return r.json
+
+    # a body larger than the buffer is streamed chunked
+    def test_proxy_07_001(self, env):
+        self.configure(env)
+        assert env.apache_restart() == 0
+        assert self.post(env)["chunked"]
+
+    # a body fitting in the buffer is sent with its length
+    def test_proxy_07_002(self, env):
+        self.configure(env, 131072)
+        assert env.apache_restart() == 0
+        framing = self.post(env)
+        assert not framing["chunked"]
+        assert framing["content-length"] == "65536"
+
+    def test_proxy_07_003(self, env):
+        self.configure(env, 0)
+        assert env.apache_restart() == 0
+        assert self.post(env)["chunked"]
+
+    # the buffer is held in memory by each request, it is capped
+    def test_proxy_07_004(self, env):
+        self.configure(env, 2 * 1024 * 1024)
+        assert env.apache_fail() == 0
+        self.configure(env)
+        assert env.apache_restart() == 0